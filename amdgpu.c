@@ -10,10 +10,13 @@
 #include <drm_fourcc.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -38,6 +41,25 @@
 /* Height alignement for Encoder/Decoder buffers */
 #define CHROME_HEIGHT_ALIGN 16
 
+#define SDMA_MAX_SIZE_PER_CMD 0x3fff00
+#define SDMA_CMD_SIZE (7 * sizeof(uint32_t)) /* 7 dwords, see sdma_copy_locked(). */
+
+/* Staging buffer sizes are powers of two from 64 KiB to 4 GiB. */
+#define STAGING_MIN_ORDER 16
+#define STAGING_NUM_CLASSES 17
+/* Idle staging buffers beyond this are freed, but their GPU VA range is kept for reuse. */
+#define STAGING_MAX_IDLE_BYTES (64 * 1024 * 1024)
+
+/* A GTT buffer that stays mapped for both the CPU and the SDMA engine while pooled. */
+struct amdgpu_staging_bo {
+	/* 0 if only the VA range is being kept. */
+	uint32_t handle;
+	uint32_t order;
+	uint64_t va;
+	void *addr;
+	struct amdgpu_staging_bo *next;
+};
+
 struct amdgpu_priv {
 	struct dri_driver dri;
 	int drm_version;
@@ -49,11 +71,34 @@ struct amdgpu_priv {
 	uint64_t sdma_cmdbuf_addr;
 	uint64_t sdma_cmdbuf_size;
 	uint32_t *sdma_cmdbuf_map;
+
+	/* Guards the command buffer, the VA range after it and the staging pool. */
+	pthread_mutex_t sdma_lock;
+
+	struct amdgpu_staging_bo *staging_idle[STAGING_NUM_CLASSES];
+	uint64_t staging_idle_bytes;
+	/* Staging VA ranges are handed out downwards from the top of the VA space. */
+	uint64_t staging_va_floor;
+	uint64_t staging_va_next;
+};
+
+/* A span of bytes at the same offset in a bo and its staging buffer. */
+struct sdma_range {
+	uint64_t offset;
+	uint64_t size;
 };
 
 struct amdgpu_linear_vma_priv {
-	uint32_t handle;
+	struct amdgpu_staging_bo *staging;
 	uint32_t map_flags;
+	/*
+	 * Rows, in units of the first plane, that have been read back into |staging| and that
+	 * have been mapped for writing. Both are empty when y0 == y1.
+	 */
+	uint32_t valid_y0;
+	uint32_t valid_y1;
+	uint32_t dirty_y0;
+	uint32_t dirty_y1;
 };
 
 const static uint32_t render_target_formats[] = {
@@ -143,6 +188,14 @@ static int sdma_init(struct amdgpu_priv *priv, int fd)
 		goto fail_va;
 	}
 
+	/* Leave room after the command buffer for mapping the largest bo sdma can copy. */
+	priv->staging_va_floor =
+	    ALIGN(priv->sdma_cmdbuf_addr + priv->sdma_cmdbuf_size +
+		      priv->sdma_cmdbuf_size / SDMA_CMD_SIZE * SDMA_MAX_SIZE_PER_CMD,
+		  priv->dev_info.virtual_address_alignment);
+	priv->staging_va_next = priv->dev_info.virtual_address_max &
+				~((uint64_t)priv->dev_info.virtual_address_alignment - 1);
+
 	return 0;
 fail_va:
 	va_args.operation = AMDGPU_VA_OP_UNMAP;
@@ -159,6 +212,8 @@ fail_ctx:
 	return ret;
 }
 
+static void staging_destroy_bo(int fd, struct amdgpu_staging_bo *staging);
+
 static void sdma_finish(struct amdgpu_priv *priv, int fd)
 {
 	union drm_amdgpu_ctx ctx_args = { { 0 } };
@@ -168,6 +223,15 @@ static void sdma_finish(struct amdgpu_priv *priv, int fd)
 	if (!priv->sdma_cmdbuf_map)
 		return;
 
+	for (size_t i = 0; i < STAGING_NUM_CLASSES; i++) {
+		while (priv->staging_idle[i]) {
+			struct amdgpu_staging_bo *staging = priv->staging_idle[i];
+			priv->staging_idle[i] = staging->next;
+			staging_destroy_bo(fd, staging);
+			free(staging);
+		}
+	}
+
 	va_args.handle = priv->sdma_cmdbuf_bo;
 	va_args.operation = AMDGPU_VA_OP_UNMAP;
 	va_args.flags = 0;
@@ -184,68 +248,114 @@ static void sdma_finish(struct amdgpu_priv *priv, int fd)
 	drmCommandWriteRead(fd, DRM_AMDGPU_CTX, &ctx_args, sizeof(ctx_args));
 }
 
-static int sdma_copy(struct amdgpu_priv *priv, int fd, uint32_t src_handle, uint32_t dst_handle,
-		     uint64_t size)
+static void sdma_unmap_va(int fd, uint32_t handle, uint64_t va, uint64_t size)
 {
-	const uint64_t max_size_per_cmd = 0x3fff00;
-	const uint32_t cmd_size = 7 * sizeof(uint32_t); /* 7 dwords, see loop below. */
-	const uint64_t max_commands = priv->sdma_cmdbuf_size / cmd_size;
-	uint64_t src_addr = priv->sdma_cmdbuf_addr + priv->sdma_cmdbuf_size;
-	uint64_t dst_addr = src_addr + size;
+	struct drm_amdgpu_gem_va va_args = { 0 };
+
+	va_args.handle = handle;
+	va_args.operation = AMDGPU_VA_OP_UNMAP;
+	va_args.flags = AMDGPU_VM_DELAY_UPDATE;
+	va_args.va_address = va;
+	va_args.map_size = size;
+	drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+}
+
+static int sdma_wait_locked(struct amdgpu_priv *priv, int fd, uint64_t seq)
+{
+	union drm_amdgpu_wait_cs wait_cs = { { 0 } };
+	int ret;
+
+	wait_cs.in.handle = seq;
+	wait_cs.in.ip_type = AMDGPU_HW_IP_DMA;
+	wait_cs.in.ctx_id = priv->sdma_ctx;
+	wait_cs.in.timeout = INT64_MAX;
+
+	ret = drmCommandWriteRead(fd, DRM_AMDGPU_WAIT_CS, &wait_cs, sizeof(wait_cs));
+	if (ret) {
+		drv_loge("Could not wait for CS to finish\n");
+	} else if (wait_cs.out.status) {
+		drv_loge("Infinite wait timed out, likely GPU hang.\n");
+		ret = -ENODEV;
+	}
+
+	return ret;
+}
+
+/*
+ * Copies |ranges| between the bo |handle| of |size| bytes and |staging|, in the direction given
+ * by |to_staging|, and waits for the copy. Every caller needs the result before it returns, so
+ * there is nothing for an asynchronous copy to overlap with.
+ */
+static int sdma_copy_locked(struct amdgpu_priv *priv, int fd, uint32_t handle, uint64_t size,
+			    struct amdgpu_staging_bo *staging, bool to_staging,
+			    const struct sdma_range *ranges, uint32_t num_ranges)
+{
+	const uint64_t max_commands = priv->sdma_cmdbuf_size / SDMA_CMD_SIZE;
+	uint64_t bo_addr = priv->sdma_cmdbuf_addr + priv->sdma_cmdbuf_size;
+	uint64_t src_addr = to_staging ? bo_addr : staging->va;
+	uint64_t dst_addr = to_staging ? staging->va : bo_addr;
 	struct drm_amdgpu_gem_va va_args = { 0 };
 	unsigned cmd = 0;
-	uint64_t remaining_size = size;
-	uint64_t cur_src_addr = src_addr;
-	uint64_t cur_dst_addr = dst_addr;
+	uint64_t num_commands = 0;
 	struct drm_amdgpu_cs_chunk_ib ib = { 0 };
 	struct drm_amdgpu_cs_chunk chunks[2] = { { 0 } };
 	uint64_t chunk_ptrs[2];
 	union drm_amdgpu_cs cs = { { 0 } };
 	struct drm_amdgpu_bo_list_in bo_list = { 0 };
 	struct drm_amdgpu_bo_list_entry bo_list_entries[3] = { { 0 } };
-	union drm_amdgpu_wait_cs wait_cs = { { 0 } };
 	int ret = 0;
 
-	if (size > UINT64_MAX - max_size_per_cmd ||
-	    DIV_ROUND_UP(size, max_size_per_cmd) > max_commands)
+	if (size > (1ull << staging->order))
+		return -ENOMEM;
+
+	for (uint32_t i = 0; i < num_ranges; i++) {
+		if (ranges[i].offset > size || ranges[i].size > size - ranges[i].offset)
+			return -EINVAL;
+		num_commands += DIV_ROUND_UP(ranges[i].size, SDMA_MAX_SIZE_PER_CMD);
+	}
+
+	if (num_commands > max_commands)
 		return -ENOMEM;
 
-	/* Map both buffers into the GPU address space so we can access them from the GPU. */
-	va_args.handle = src_handle;
+	if (!num_commands)
+		return 0;
+
+	/* The staging buffer is always mapped; map the bo for the duration of the copy. */
+	va_args.handle = handle;
 	va_args.operation = AMDGPU_VA_OP_MAP;
 	va_args.flags = AMDGPU_VM_PAGE_READABLE | AMDGPU_VM_DELAY_UPDATE;
-	va_args.va_address = src_addr;
+	if (!to_staging)
+		va_args.flags |= AMDGPU_VM_PAGE_WRITEABLE;
+	va_args.va_address = bo_addr;
 	va_args.map_size = size;
 
 	ret = drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
 	if (ret)
 		return ret;
 
-	va_args.handle = dst_handle;
-	va_args.flags = AMDGPU_VM_PAGE_READABLE | AMDGPU_VM_PAGE_WRITEABLE | AMDGPU_VM_DELAY_UPDATE;
-	va_args.va_address = dst_addr;
-
-	ret = drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
-	if (ret)
-		goto unmap_src;
-
-	while (remaining_size) {
-		uint64_t cur_size = remaining_size;
-		if (cur_size > max_size_per_cmd)
-			cur_size = max_size_per_cmd;
-
-		priv->sdma_cmdbuf_map[cmd++] = 0x01; /* linear copy */
-		priv->sdma_cmdbuf_map[cmd++] =
-		    priv->dev_info.family >= AMDGPU_FAMILY_AI ? (cur_size - 1) : cur_size;
-		priv->sdma_cmdbuf_map[cmd++] = 0;
-		priv->sdma_cmdbuf_map[cmd++] = cur_src_addr;
-		priv->sdma_cmdbuf_map[cmd++] = cur_src_addr >> 32;
-		priv->sdma_cmdbuf_map[cmd++] = cur_dst_addr;
-		priv->sdma_cmdbuf_map[cmd++] = cur_dst_addr >> 32;
-
-		remaining_size -= cur_size;
-		cur_src_addr += cur_size;
-		cur_dst_addr += cur_size;
+	for (uint32_t i = 0; i < num_ranges; i++) {
+		uint64_t remaining_size = ranges[i].size;
+		uint64_t cur_src_addr = src_addr + ranges[i].offset;
+		uint64_t cur_dst_addr = dst_addr + ranges[i].offset;
+
+		while (remaining_size) {
+			uint64_t cur_size = remaining_size;
+			if (cur_size > SDMA_MAX_SIZE_PER_CMD)
+				cur_size = SDMA_MAX_SIZE_PER_CMD;
+
+			priv->sdma_cmdbuf_map[cmd++] = 0x01; /* linear copy */
+			priv->sdma_cmdbuf_map[cmd++] =
+			    priv->dev_info.family >= AMDGPU_FAMILY_AI ? (cur_size - 1) : cur_size;
+			priv->sdma_cmdbuf_map[cmd++] = 0;
+			priv->sdma_cmdbuf_map[cmd++] = cur_src_addr;
+			priv->sdma_cmdbuf_map[cmd++] = cur_src_addr >> 32;
+			priv->sdma_cmdbuf_map[cmd++] = cur_dst_addr;
+			priv->sdma_cmdbuf_map[cmd++] = cur_dst_addr >> 32;
+
+			remaining_size -= cur_size;
+			cur_src_addr += cur_size;
+			cur_dst_addr += cur_size;
+		}
 	}
 
 	ib.va_start = priv->sdma_cmdbuf_addr;
@@ -258,9 +368,9 @@ static int sdma_copy(struct amdgpu_priv *priv, int fd, uint32_t src_handle, uint
 
 	bo_list_entries[0].bo_handle = priv->sdma_cmdbuf_bo;
 	bo_list_entries[0].bo_priority = 8; /* Middle of range, like RADV. */
-	bo_list_entries[1].bo_handle = src_handle;
+	bo_list_entries[1].bo_handle = handle;
 	bo_list_entries[1].bo_priority = 8;
-	bo_list_entries[2].bo_handle = dst_handle;
+	bo_list_entries[2].bo_handle = staging->handle;
 	bo_list_entries[2].bo_priority = 8;
 
 	bo_list.bo_number = 3;
@@ -279,41 +389,202 @@ static int sdma_copy(struct amdgpu_priv *priv, int fd, uint32_t src_handle, uint
 	cs.in.chunks = (uintptr_t)chunk_ptrs;
 
 	ret = drmCommandWriteRead(fd, DRM_AMDGPU_CS, &cs, sizeof(cs));
-	if (ret) {
+	if (ret)
 		drv_loge("SDMA copy command buffer submission failed %d\n", ret);
-		goto unmap_dst;
+	else
+		ret = sdma_wait_locked(priv, fd, cs.out.handle);
+
+	sdma_unmap_va(fd, handle, bo_addr, size);
+	return ret;
+}
+
+static int sdma_copy(struct amdgpu_priv *priv, int fd, uint32_t handle, uint64_t size,
+		     struct amdgpu_staging_bo *staging, bool to_staging,
+		     const struct sdma_range *ranges, uint32_t num_ranges)
+{
+	int ret;
+
+	pthread_mutex_lock(&priv->sdma_lock);
+	ret = sdma_copy_locked(priv, fd, handle, size, staging, to_staging, ranges, num_ranges);
+	pthread_mutex_unlock(&priv->sdma_lock);
+
+	return ret;
+}
+
+/*
+ * Fills |ranges| with the bytes of every plane of |bo| that hold rows [y0, y1) of the first
+ * plane, and returns how many ranges were filled.
+ */
+static uint32_t amdgpu_rows_to_ranges(struct bo *bo, uint32_t y0, uint32_t y1,
+				      struct sdma_range ranges[DRV_MAX_PLANES])
+{
+	uint32_t num_ranges = 0;
+
+	for (size_t plane = 0; plane < bo->meta.num_planes && y0 < y1; plane++) {
+		uint32_t subsample = drv_vertical_subsampling_from_format(bo->meta.format, plane);
+		uint64_t stride = bo->meta.strides[plane];
+		uint64_t start = y0 / subsample * stride;
+		uint64_t end = DIV_ROUND_UP(y1, subsample) * stride;
+
+		if (end > bo->meta.sizes[plane])
+			end = bo->meta.sizes[plane];
+		if (start >= end)
+			continue;
+
+		ranges[num_ranges].offset = bo->meta.offsets[plane] + start;
+		ranges[num_ranges].size = end - start;
+		num_ranges++;
 	}
 
-	wait_cs.in.handle = cs.out.handle;
-	wait_cs.in.ip_type = AMDGPU_HW_IP_DMA;
-	wait_cs.in.ctx_id = priv->sdma_ctx;
-	wait_cs.in.timeout = INT64_MAX;
+	return num_ranges;
+}
 
-	ret = drmCommandWriteRead(fd, DRM_AMDGPU_WAIT_CS, &wait_cs, sizeof(wait_cs));
-	if (ret) {
-		drv_loge("Could not wait for CS to finish\n");
-	} else if (wait_cs.out.status) {
-		drv_loge("Infinite wait timed out, likely GPU hang.\n");
-		ret = -ENODEV;
+static int staging_create_bo(struct amdgpu_priv *priv, int fd, struct amdgpu_staging_bo *staging)
+{
+	union drm_amdgpu_gem_create gem_create = { { 0 } };
+	struct drm_amdgpu_gem_va va_args = { 0 };
+	union drm_amdgpu_gem_mmap gem_map = { { 0 } };
+	struct drm_gem_close gem_close = { 0 };
+	uint64_t size = 1ull << staging->order;
+	int ret;
+
+	gem_create.in.bo_size = size;
+	gem_create.in.alignment = 4096;
+	gem_create.in.domains = AMDGPU_GEM_DOMAIN_GTT;
+
+	ret = drmCommandWriteRead(fd, DRM_AMDGPU_GEM_CREATE, &gem_create, sizeof(gem_create));
+	if (ret < 0) {
+		drv_loge("GEM create failed\n");
+		return ret;
 	}
 
-unmap_dst:
-	va_args.handle = dst_handle;
-	va_args.operation = AMDGPU_VA_OP_UNMAP;
-	va_args.flags = AMDGPU_VM_DELAY_UPDATE;
-	va_args.va_address = dst_addr;
-	drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+	va_args.handle = gem_create.out.handle;
+	va_args.operation = AMDGPU_VA_OP_MAP;
+	va_args.flags = AMDGPU_VM_PAGE_READABLE | AMDGPU_VM_PAGE_WRITEABLE;
+	va_args.va_address = staging->va;
+	va_args.map_size = size;
 
-unmap_src:
-	va_args.handle = src_handle;
-	va_args.operation = AMDGPU_VA_OP_UNMAP;
-	va_args.flags = AMDGPU_VM_DELAY_UPDATE;
-	va_args.va_address = src_addr;
-	drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+	ret = drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+	if (ret)
+		goto fail_bo;
+
+	gem_map.in.handle = gem_create.out.handle;
+	ret = drmIoctl(fd, DRM_IOCTL_AMDGPU_GEM_MMAP, &gem_map);
+	if (ret)
+		goto fail_va;
+
+	staging->addr =
+	    mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, gem_map.out.addr_ptr);
+	if (staging->addr == MAP_FAILED) {
+		staging->addr = NULL;
+		ret = -ENOMEM;
+		goto fail_va;
+	}
+
+	staging->handle = gem_create.out.handle;
+	return 0;
 
+fail_va:
+	sdma_unmap_va(fd, gem_create.out.handle, staging->va, size);
+fail_bo:
+	gem_close.handle = gem_create.out.handle;
+	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
 	return ret;
 }
 
+static void staging_destroy_bo(int fd, struct amdgpu_staging_bo *staging)
+{
+	struct drm_gem_close gem_close = { 0 };
+	uint64_t size = 1ull << staging->order;
+
+	if (!staging->handle)
+		return;
+
+	munmap(staging->addr, size);
+	sdma_unmap_va(fd, staging->handle, staging->va, size);
+	gem_close.handle = staging->handle;
+	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+
+	staging->handle = 0;
+	staging->addr = NULL;
+}
+
+/* Returns a staging buffer of at least |size| bytes, reusing an idle one when possible. */
+static struct amdgpu_staging_bo *staging_get(struct amdgpu_priv *priv, int fd, uint64_t size)
+{
+	struct amdgpu_staging_bo **link, *staging = NULL;
+	uint32_t order = STAGING_MIN_ORDER;
+
+	while ((1ull << order) < size)
+		order++;
+
+	if (order >= STAGING_MIN_ORDER + STAGING_NUM_CLASSES)
+		return NULL;
+
+	pthread_mutex_lock(&priv->sdma_lock);
+
+	/* Prefer an idle buffer that still has its memory, then any spare VA range. */
+	for (link = &priv->staging_idle[order - STAGING_MIN_ORDER]; *link; link = &(*link)->next) {
+		if ((*link)->handle)
+			break;
+	}
+
+	if (!*link)
+		link = &priv->staging_idle[order - STAGING_MIN_ORDER];
+
+	if (*link) {
+		staging = *link;
+		*link = staging->next;
+		if (staging->handle)
+			priv->staging_idle_bytes -= 1ull << order;
+	} else if (priv->staging_va_next - priv->staging_va_floor >= (1ull << order)) {
+		uint64_t va = (priv->staging_va_next - (1ull << order)) &
+			      ~((uint64_t)priv->dev_info.virtual_address_alignment - 1);
+
+		staging = calloc(1, sizeof(*staging));
+		if (staging && va >= priv->staging_va_floor) {
+			staging->order = order;
+			staging->va = va;
+			priv->staging_va_next = va;
+		} else {
+			free(staging);
+			staging = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&priv->sdma_lock);
+
+	if (!staging || staging->handle)
+		return staging;
+
+	if (staging_create_bo(priv, fd, staging)) {
+		pthread_mutex_lock(&priv->sdma_lock);
+		staging->next = priv->staging_idle[order - STAGING_MIN_ORDER];
+		priv->staging_idle[order - STAGING_MIN_ORDER] = staging;
+		pthread_mutex_unlock(&priv->sdma_lock);
+		return NULL;
+	}
+
+	return staging;
+}
+
+static void staging_put(struct amdgpu_priv *priv, int fd, struct amdgpu_staging_bo *staging)
+{
+	uint64_t size = 1ull << staging->order;
+
+	pthread_mutex_lock(&priv->sdma_lock);
+
+	if (priv->staging_idle_bytes + size > STAGING_MAX_IDLE_BYTES)
+		staging_destroy_bo(fd, staging);
+	else
+		priv->staging_idle_bytes += size;
+
+	staging->next = priv->staging_idle[staging->order - STAGING_MIN_ORDER];
+	priv->staging_idle[staging->order - STAGING_MIN_ORDER] = staging;
+
+	pthread_mutex_unlock(&priv->sdma_lock);
+}
+
 static bool is_modifier_scanout_capable(struct amdgpu_priv *priv, uint32_t format,
 					uint64_t modifier)
 {
@@ -347,11 +618,182 @@ static bool is_modifier_scanout_capable(struct amdgpu_priv *priv, uint32_t forma
 	return true;
 }
 
+/*
+ * The DRI modifier combinations only depend on the GPU and the Mesa build, but enumerating them
+ * goes through the DRI screen for every format. With MINIGBM_AMDGPU_COMBO_CACHE naming a file,
+ * the first process records them there for the ones after it.
+ */
+#define AMDGPU_COMBO_CACHE_MAGIC 0x63636d61 /* "amcc" */
+#define AMDGPU_COMBO_CACHE_VERSION 1
+#define AMDGPU_COMBO_CACHE_MAX_ENTRIES 256
+
+struct amdgpu_combo_cache_entry {
+	uint32_t format;
+	uint32_t scanout;
+	uint64_t modifier;
+};
+
+struct amdgpu_combo_cache {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t family;
+	uint32_t chip_external_rev;
+	uint32_t device_id;
+	uint32_t drm_version;
+	uint64_t dri_ino;
+	uint64_t dri_size;
+	int64_t dri_mtime;
+	/* Bit f is set if DRI reported modifiers for render_target_formats[f]. */
+	uint32_t queried_formats;
+	uint32_t num_entries;
+	struct amdgpu_combo_cache_entry entries[AMDGPU_COMBO_CACHE_MAX_ENTRIES];
+};
+
+static int amdgpu_combo_cache_key(struct amdgpu_priv *priv, struct amdgpu_combo_cache *cache)
+{
+	struct stat st;
+
+	if (stat(DRI_PATH, &st))
+		return -errno;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->magic = AMDGPU_COMBO_CACHE_MAGIC;
+	cache->version = AMDGPU_COMBO_CACHE_VERSION;
+	cache->family = priv->dev_info.family;
+	cache->chip_external_rev = priv->dev_info.external_rev;
+	cache->device_id = priv->dev_info.device_id;
+	cache->drm_version = priv->drm_version;
+	cache->dri_ino = st.st_ino;
+	cache->dri_size = st.st_size;
+	cache->dri_mtime = st.st_mtime;
+	return 0;
+}
+
+static bool amdgpu_combo_cache_load(struct amdgpu_priv *priv, struct amdgpu_combo_cache *cache)
+{
+	struct amdgpu_combo_cache key;
+	const char *cache_path = getenv("MINIGBM_AMDGPU_COMBO_CACHE");
+
+	if (!cache_path || amdgpu_combo_cache_key(priv, &key))
+		return false;
+
+	if (!drv_read_cache_file(cache_path, cache, sizeof(*cache)))
+		return false;
+
+	return !memcmp(cache, &key, offsetof(struct amdgpu_combo_cache, queried_formats)) &&
+	       cache->num_entries <= AMDGPU_COMBO_CACHE_MAX_ENTRIES;
+}
+
+static void amdgpu_combo_cache_store(struct amdgpu_priv *priv, struct amdgpu_combo_cache *cache)
+{
+	struct amdgpu_combo_cache key;
+	const char *cache_path = getenv("MINIGBM_AMDGPU_COMBO_CACHE");
+
+	if (!cache_path || amdgpu_combo_cache_key(priv, &key))
+		return;
+
+	memcpy(cache, &key, offsetof(struct amdgpu_combo_cache, queried_formats));
+	if (drv_write_cache_file(cache_path, cache, sizeof(*cache)))
+		drv_logi("Failed to write combination cache %s\n", cache_path);
+}
+
+static bool amdgpu_dri_modifier_usable(struct driver *drv, uint32_t format, uint64_t modifier)
+{
+	/* LINEAR will be handled using the LINEAR metadata. */
+	if (modifier == DRM_FORMAT_MOD_LINEAR)
+		return false;
+
+	/* The virtgpu minigbm can't handle auxiliary planes in the host. */
+	return dri_num_planes_from_modifier(drv, format, modifier) ==
+	       drv_num_planes_from_format(format);
+}
+
+/*
+ * Adds the DRI modifier combinations of |format| without going through the cache. Returns false
+ * if DRI reports no modifiers for it.
+ */
+static bool amdgpu_add_dri_modifiers(struct driver *drv, uint32_t format,
+				     struct format_metadata *metadata, uint64_t use_flags)
+{
+	uint64_t *modifiers;
+	int mod_cnt;
+
+	if (!dri_query_modifiers(drv, format, 0, NULL, &mod_cnt) || !mod_cnt)
+		return false;
+
+	modifiers = calloc(mod_cnt, sizeof(uint64_t));
+	if (!modifiers)
+		return false;
+
+	dri_query_modifiers(drv, format, mod_cnt, modifiers, &mod_cnt);
+	metadata->tiling = TILE_TYPE_DRI_MODIFIER;
+	for (int i = 0; i < mod_cnt; ++i) {
+		bool scanout = is_modifier_scanout_capable(drv->priv, format, modifiers[i]);
+
+		if (!amdgpu_dri_modifier_usable(drv, format, modifiers[i]))
+			continue;
+
+		metadata->modifier = modifiers[i];
+		drv_add_combination(drv, format, metadata,
+				    use_flags | (scanout ? BO_USE_SCANOUT : 0));
+	}
+
+	free(modifiers);
+	return true;
+}
+
+/*
+ * Asks DRI for the modifiers of every render target format. Unused entries are zeroed, since the
+ * whole cache is written out.
+ */
+static bool amdgpu_combo_cache_build(struct driver *drv, struct amdgpu_combo_cache *cache)
+{
+	memset(cache, 0, sizeof(*cache));
+
+	for (unsigned f = 0; f < ARRAY_SIZE(render_target_formats); ++f) {
+		uint32_t format = render_target_formats[f];
+		uint64_t *modifiers;
+		int mod_cnt;
+
+		if (!dri_query_modifiers(drv, format, 0, NULL, &mod_cnt) || !mod_cnt)
+			continue;
+
+		modifiers = calloc(mod_cnt, sizeof(uint64_t));
+		if (!modifiers)
+			return false;
+
+		dri_query_modifiers(drv, format, mod_cnt, modifiers, &mod_cnt);
+		cache->queried_formats |= 1u << f;
+		for (int i = 0; i < mod_cnt; ++i) {
+			struct amdgpu_combo_cache_entry *entry;
+
+			if (!amdgpu_dri_modifier_usable(drv, format, modifiers[i]))
+				continue;
+
+			if (cache->num_entries == AMDGPU_COMBO_CACHE_MAX_ENTRIES) {
+				free(modifiers);
+				return false;
+			}
+
+			entry = &cache->entries[cache->num_entries++];
+			entry->format = format;
+			entry->modifier = modifiers[i];
+			entry->scanout =
+			    is_modifier_scanout_capable(drv->priv, format, modifiers[i]);
+		}
+		free(modifiers);
+	}
+
+	return true;
+}
+
 static int amdgpu_init(struct driver *drv)
 {
 	struct amdgpu_priv *priv;
 	drmVersionPtr drm_version;
 	struct format_metadata metadata;
+	struct amdgpu_combo_cache cache;
+	bool cached = true;
 	uint64_t use_flags = BO_USE_RENDER_MASK;
 
 	priv = calloc(1, sizeof(struct amdgpu_priv));
@@ -380,6 +822,8 @@ static int amdgpu_init(struct driver *drv)
 		return -ENODEV;
 	}
 
+	pthread_mutex_init(&priv->sdma_lock, NULL);
+
 	/* Continue on failure, as we can still succesfully map things without SDMA. */
 	if (sdma_init(priv, drv_get_fd(drv)))
 		drv_loge("SDMA init failed\n");
@@ -451,31 +895,32 @@ static int amdgpu_init(struct driver *drv)
 
 	metadata.priority = 2;
 
+	/* A cache that can't hold every modifier would drop some, so enumerate them directly. */
+	if (!amdgpu_combo_cache_load(priv, &cache)) {
+		cached = amdgpu_combo_cache_build(drv, &cache);
+		if (cached)
+			amdgpu_combo_cache_store(priv, &cache);
+		else
+			drv_logi("DRI modifiers don't fit the combination cache, not using it\n");
+	}
+
 	for (unsigned f = 0; f < ARRAY_SIZE(render_target_formats); ++f) {
 		uint32_t format = render_target_formats[f];
-		int mod_cnt;
-		if (dri_query_modifiers(drv, format, 0, NULL, &mod_cnt) && mod_cnt) {
-			uint64_t *modifiers = calloc(mod_cnt, sizeof(uint64_t));
-			dri_query_modifiers(drv, format, mod_cnt, modifiers, &mod_cnt);
+		if (!cached && amdgpu_add_dri_modifiers(drv, format, &metadata, use_flags)) {
+			continue;
+		} else if (cached && (cache.queried_formats & (1u << f))) {
 			metadata.tiling = TILE_TYPE_DRI_MODIFIER;
-			for (int i = 0; i < mod_cnt; ++i) {
-				bool scanout =
-				    is_modifier_scanout_capable(drv->priv, format, modifiers[i]);
-
-				/* LINEAR will be handled using the LINEAR metadata. */
-				if (modifiers[i] == DRM_FORMAT_MOD_LINEAR)
-					continue;
+			for (uint32_t i = 0; i < cache.num_entries; ++i) {
+				struct amdgpu_combo_cache_entry *entry = &cache.entries[i];
 
-				/* The virtgpu minigbm can't handle auxiliary planes in the host. */
-				if (dri_num_planes_from_modifier(drv, format, modifiers[i]) !=
-				    drv_num_planes_from_format(format))
+				if (entry->format != format)
 					continue;
 
-				metadata.modifier = modifiers[i];
+				metadata.modifier = entry->modifier;
 				drv_add_combination(drv, format, &metadata,
-						    use_flags | (scanout ? BO_USE_SCANOUT : 0));
+						    use_flags |
+							(entry->scanout ? BO_USE_SCANOUT : 0));
 			}
-			free(modifiers);
 		} else {
 			bool scanout = false;
 			switch (format) {
@@ -502,7 +947,10 @@ static int amdgpu_init(struct driver *drv)
 
 static void amdgpu_close(struct driver *drv)
 {
-	sdma_finish(drv->priv, drv_get_fd(drv));
+	struct amdgpu_priv *priv = drv->priv;
+
+	sdma_finish(priv, drv_get_fd(drv));
+	pthread_mutex_destroy(&priv->sdma_lock);
 	dri_close(drv);
 	free(drv->priv);
 	drv->priv = NULL;
@@ -575,6 +1023,30 @@ static int amdgpu_create_bo_linear(struct bo *bo, uint32_t width, uint32_t heigh
 		bo->handles[plane].u32 = gem_create.out.handle;
 
 	bo->meta.format_modifier = DRM_FORMAT_MOD_LINEAR;
+	bo->heap = DRV_HEAP_GTT;
+
+	return 0;
+}
+
+/* The DRI driver picks the domains of the bos it creates; ask the kernel which it picked. */
+static int amdgpu_query_heap(struct bo *bo, int ret)
+{
+	struct drm_amdgpu_gem_create_in bo_info = { 0 };
+	struct drm_amdgpu_gem_op gem_op = { 0 };
+
+	if (ret)
+		return ret;
+
+	gem_op.handle = bo->handles[0].u32;
+	gem_op.op = AMDGPU_GEM_OP_GET_GEM_CREATE_INFO;
+	gem_op.value = (uintptr_t)&bo_info;
+
+	if (!drmCommandWriteRead(bo->drv->fd, DRM_AMDGPU_GEM_OP, &gem_op, sizeof(gem_op))) {
+		if (bo_info.domains & AMDGPU_GEM_DOMAIN_VRAM)
+			bo->heap = DRV_HEAP_VRAM;
+		else
+			bo->heap = DRV_HEAP_GTT;
+	}
 
 	return 0;
 }
@@ -585,7 +1057,7 @@ static int amdgpu_create_bo(struct bo *bo, uint32_t width, uint32_t height, uint
 	struct combination *combo;
 	struct amdgpu_priv *priv = bo->drv->priv;
 
-	combo = drv_get_combination(bo->drv, format, use_flags);
+	combo = drv_get_combination_with_policy(bo->drv, format, use_flags, width, height);
 	if (!combo)
 		return -EINVAL;
 
@@ -596,10 +1068,11 @@ static int amdgpu_create_bo(struct bo *bo, uint32_t width, uint32_t height, uint
 			width = ALIGN(width, 256 / bytes_per_pixel);
 		}
 
-		return dri_bo_create(bo, width, height, format, use_flags);
+		return amdgpu_query_heap(bo, dri_bo_create(bo, width, height, format, use_flags));
 	} else if (combo->metadata.tiling == TILE_TYPE_DRI_MODIFIER) {
-		return dri_bo_create_with_modifiers(bo, width, height, format,
-						    &combo->metadata.modifier, 1);
+		return amdgpu_query_heap(bo, dri_bo_create_with_modifiers(
+						 bo, width, height, format,
+						 &combo->metadata.modifier, 1));
 	}
 
 	return amdgpu_create_bo_linear(bo, width, height, format, use_flags);
@@ -610,15 +1083,37 @@ static int amdgpu_create_bo_with_modifiers(struct bo *bo, uint32_t width, uint32
 					   uint32_t count)
 {
 	bool only_use_linear = true;
+	uint64_t *allowed = NULL;
+	int ret;
+
+	/* Hide DCC modifiers from Mesa if the compression policy denies them to this buffer. */
+	if (!drv_compression_allowed(bo->drv, format, bo->meta.use_flags, width, height)) {
+		uint32_t num_allowed = 0;
+
+		allowed = calloc(count, sizeof(*allowed));
+		if (!allowed)
+			return -ENOMEM;
+
+		for (uint32_t i = 0; i < count; ++i)
+			if (!drv_modifier_is_compressed(modifiers[i]))
+				allowed[num_allowed++] = modifiers[i];
+
+		modifiers = allowed;
+		count = num_allowed;
+	}
 
 	for (uint32_t i = 0; i < count; ++i)
 		if (modifiers[i] != DRM_FORMAT_MOD_LINEAR)
 			only_use_linear = false;
 
 	if (only_use_linear)
-		return amdgpu_create_bo_linear(bo, width, height, format, BO_USE_SCANOUT);
+		ret = amdgpu_create_bo_linear(bo, width, height, format, BO_USE_SCANOUT);
+	else
+		ret = amdgpu_query_heap(
+		    bo, dri_bo_create_with_modifiers(bo, width, height, format, modifiers, count));
 
-	return dri_bo_create_with_modifiers(bo, width, height, format, modifiers, count);
+	free(allowed);
+	return ret;
 }
 
 static int amdgpu_import_bo(struct bo *bo, struct drv_import_fd_data *data)
@@ -686,96 +1181,222 @@ static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, size_t plane, uint32_
 	if (((bo_info.domains & AMDGPU_GEM_DOMAIN_VRAM) ||
 	     (bo_info.domain_flags & AMDGPU_GEM_CREATE_CPU_GTT_USWC)) &&
 	    drv_priv->sdma_cmdbuf_map) {
-		union drm_amdgpu_gem_create gem_create = { { 0 } };
-
 		priv = calloc(1, sizeof(struct amdgpu_linear_vma_priv));
 		if (!priv)
 			return MAP_FAILED;
 
-		gem_create.in.bo_size = bo_info.bo_size;
-		gem_create.in.alignment = 4096;
-		gem_create.in.domains = AMDGPU_GEM_DOMAIN_GTT;
-
-		ret = drmCommandWriteRead(bo->drv->fd, DRM_AMDGPU_GEM_CREATE, &gem_create,
-					  sizeof(gem_create));
-		if (ret < 0) {
-			drv_loge("GEM create failed\n");
+		priv->staging = staging_get(drv_priv, bo->drv->fd, bo_info.bo_size);
+		if (!priv->staging) {
 			free(priv);
 			return MAP_FAILED;
 		}
 
+		/*
+		 * Nothing is read back yet: amdgpu_bo_invalidate(), which follows every map, reads
+		 * back what each mapping's rectangle needs.
+		 */
 		priv->map_flags = map_flags;
-		handle = priv->handle = gem_create.out.handle;
 
-		ret = sdma_copy(bo->drv->priv, bo->drv->fd, bo->handles[0].u32, priv->handle,
-				bo_info.bo_size);
-		if (ret) {
-			drv_loge("SDMA copy for read failed\n");
-			goto fail;
-		}
+		vma->priv = priv;
+		return priv->staging->addr;
 	}
 
 	gem_map.in.handle = handle;
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_AMDGPU_GEM_MMAP, &gem_map);
 	if (ret) {
-		drv_loge("DRM_IOCTL_AMDGPU_GEM_MMAP failed\n");
-		goto fail;
+		drv_loge_ratelimited("DRM_IOCTL_AMDGPU_GEM_MMAP failed\n");
+		return MAP_FAILED;
 	}
 
-	addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.out.addr_ptr);
+	addr = drv_bo_mmap(bo, bo->meta.total_size, drv_get_prot(map_flags), bo->drv->fd,
+			   gem_map.out.addr_ptr);
 	if (addr == MAP_FAILED)
-		goto fail;
+		return MAP_FAILED;
 
-	vma->priv = priv;
 	return addr;
-
-fail:
-	if (priv) {
-		struct drm_gem_close gem_close = { 0 };
-		gem_close.handle = priv->handle;
-		drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
-		free(priv);
-	}
-	return MAP_FAILED;
 }
 
 static int amdgpu_unmap_bo(struct bo *bo, struct vma *vma)
 {
 	if (bo->priv) {
 		return dri_bo_unmap(bo, vma);
+	} else if (vma->priv) {
+		struct amdgpu_linear_vma_priv *priv = vma->priv;
+		struct amdgpu_priv *drv_priv = bo->drv->priv;
+		int r = 0;
+
+		struct sdma_range ranges[DRV_MAX_PLANES];
+		uint32_t num_ranges;
+
+		/* Only rows a writable mapping covered can have changed. */
+		num_ranges = amdgpu_rows_to_ranges(bo, priv->dirty_y0, priv->dirty_y1, ranges);
+		if (num_ranges)
+			r = sdma_copy(drv_priv, bo->drv->fd, bo->handles[0].u32, vma->length,
+				      priv->staging, false, ranges, num_ranges);
+
+		staging_put(drv_priv, bo->drv->fd, priv->staging);
+		free(priv);
+		vma->priv = NULL;
+		return r;
 	} else {
-		int r = munmap(vma->addr, vma->length);
-		if (r)
-			return r;
-
-		if (vma->priv) {
-			struct amdgpu_linear_vma_priv *priv = vma->priv;
-			struct drm_gem_close gem_close = { 0 };
-
-			if (BO_MAP_WRITE & priv->map_flags) {
-				r = sdma_copy(bo->drv->priv, bo->drv->fd, priv->handle,
-					      bo->handles[0].u32, vma->length);
-				if (r)
-					return r;
-			}
+		return munmap(vma->addr, vma->length);
+	}
+}
+
+/*
+ * Reads back the rows of |mapping| that its staging buffer doesn't hold yet, and records the rows
+ * of writable mappings for amdgpu_unmap_bo() to write back.
+ *
+ * The valid rows are kept contiguous and every written row lies inside them, so nothing written
+ * back can come from a pooled staging buffer's previous contents.
+ */
+static int amdgpu_staging_prepare(struct bo *bo, struct mapping *mapping)
+{
+	struct amdgpu_linear_vma_priv *priv = mapping->vma->priv;
+	uint32_t y0 = mapping->rect.y;
+	uint32_t y1 = mapping->rect.y + mapping->rect.height;
+	uint32_t valid_y0 = priv->valid_y0;
+	uint32_t valid_y1 = priv->valid_y1;
+	uint32_t read_y0 = y0;
+	uint32_t read_y1 = y1;
+	struct sdma_range ranges[2 * DRV_MAX_PLANES];
+	uint32_t num_ranges = 0;
+	int ret;
 
-			gem_close.handle = priv->handle;
-			r = drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	/*
+	 * A write-only mapping never reads the old contents of the rows it fully covers, but rows it
+	 * only partially covers are written back whole, so those still need the pixels on either
+	 * side of the rectangle.
+	 */
+	bool overwrites_rows = !(priv->map_flags & BO_MAP_READ) && mapping->rect.x == 0 &&
+			       mapping->rect.width == bo->meta.width;
+
+	if (valid_y0 >= valid_y1) {
+		if (!overwrites_rows)
+			num_ranges = amdgpu_rows_to_ranges(bo, y0, y1, ranges);
+		priv->valid_y0 = y0;
+		priv->valid_y1 = y1;
+	} else {
+		/* Overwritten rows count as valid, but any gap between them and the rest doesn't. */
+		if (overwrites_rows) {
+			read_y0 = y1 < valid_y0 ? y1 : valid_y0;
+			read_y1 = MAX(y0, valid_y1);
 		}
+		if (read_y0 < valid_y0)
+			num_ranges += amdgpu_rows_to_ranges(bo, read_y0, valid_y0, ranges);
+		if (read_y1 > valid_y1)
+			num_ranges += amdgpu_rows_to_ranges(bo, valid_y1, read_y1,
+							    ranges + num_ranges);
+		priv->valid_y0 = y0 < valid_y0 ? y0 : valid_y0;
+		priv->valid_y1 = MAX(y1, valid_y1);
+	}
 
-		return 0;
+	if (num_ranges) {
+		ret = sdma_copy(bo->drv->priv, bo->drv->fd, bo->handles[0].u32,
+				mapping->vma->length, priv->staging, true, ranges, num_ranges);
+		if (ret) {
+			drv_loge("SDMA copy for read failed\n");
+			/* Rows valid before still hold what earlier mappings wrote. */
+			priv->valid_y0 = valid_y0;
+			priv->valid_y1 = valid_y1;
+			return ret;
+		}
 	}
+
+	if (priv->map_flags & BO_MAP_WRITE) {
+		if (priv->dirty_y0 >= priv->dirty_y1 || y0 < priv->dirty_y0)
+			priv->dirty_y0 = y0;
+		priv->dirty_y1 = MAX(priv->dirty_y1, y1);
+	}
+
+	return 0;
+}
+
+static int amdgpu_bo_get_size(struct bo *bo, uint64_t *out_size)
+{
+	struct drm_amdgpu_gem_create_in bo_info = { 0 };
+	struct drm_amdgpu_gem_op gem_op = { 0 };
+	int ret;
+
+	gem_op.handle = bo->handles[0].u32;
+	gem_op.op = AMDGPU_GEM_OP_GET_GEM_CREATE_INFO;
+	gem_op.value = (uintptr_t)&bo_info;
+
+	ret = drmCommandWriteRead(bo->drv->fd, DRM_AMDGPU_GEM_OP, &gem_op, sizeof(gem_op));
+	if (ret)
+		return ret;
+
+	*out_size = bo_info.bo_size;
+	return 0;
+}
+
+/*
+ * SDMA only does linear copies here, so the bos must share one layout and the rectangle must
+ * span whole rows; the rows then sit at the same offsets in both. The copy bounces through a
+ * staging buffer, as only one bo at a time can be mapped for the engine.
+ */
+static int amdgpu_bo_copy(struct bo *dst, struct bo *src, const struct rectangle *rect)
+{
+	struct amdgpu_priv *priv = src->drv->priv;
+	struct amdgpu_staging_bo *staging;
+	struct sdma_range ranges[DRV_MAX_PLANES];
+	uint64_t src_size, dst_size;
+	uint32_t num_ranges;
+	int ret;
+
+	if (src->priv || dst->priv || !priv->sdma_cmdbuf_map)
+		return -ENOTSUP;
+
+	if (rect->x != 0 || rect->width != src->meta.width || src->meta.width != dst->meta.width ||
+	    src->meta.num_planes != dst->meta.num_planes ||
+	    memcmp(src->meta.strides, dst->meta.strides, sizeof(src->meta.strides)) ||
+	    memcmp(src->meta.offsets, dst->meta.offsets, sizeof(src->meta.offsets)) ||
+	    memcmp(src->meta.sizes, dst->meta.sizes, sizeof(src->meta.sizes)))
+		return -ENOTSUP;
+
+	if (amdgpu_bo_get_size(src, &src_size) || amdgpu_bo_get_size(dst, &dst_size))
+		return -ENOTSUP;
+
+	num_ranges = amdgpu_rows_to_ranges(src, rect->y, rect->y + rect->height, ranges);
+	if (!num_ranges)
+		return 0;
+
+	staging = staging_get(priv, src->drv->fd, MAX(src_size, dst_size));
+	if (!staging)
+		return -ENOTSUP;
+
+	ret = sdma_copy(priv, src->drv->fd, src->handles[0].u32, src_size, staging, true, ranges,
+			num_ranges);
+	if (!ret)
+		ret = sdma_copy(priv, dst->drv->fd, dst->handles[0].u32, dst_size, staging, false,
+				ranges, num_ranges);
+
+	staging_put(priv, src->drv->fd, staging);
+
+	/* Too many ranges for one command buffer; the CPU can still do it. */
+	if (ret == -ENOMEM)
+		return -ENOTSUP;
+	if (ret)
+		drv_loge("SDMA bo copy failed %d\n", ret);
+
+	return ret;
 }
 
 static int amdgpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
 	union drm_amdgpu_gem_wait_idle wait_idle = { { 0 } };
+	struct amdgpu_linear_vma_priv *priv = mapping->vma->priv;
 
 	if (bo->priv)
 		return 0;
 
+	if (priv) {
+		ret = amdgpu_staging_prepare(bo, mapping);
+		if (ret)
+			return ret;
+	}
+
 	wait_idle.in.handle = bo->handles[0].u32;
 	wait_idle.in.timeout = AMDGPU_TIMEOUT_INFINITE;
 
@@ -805,6 +1426,7 @@ const struct backend backend_amdgpu = {
 	.bo_map = amdgpu_map_bo,
 	.bo_unmap = amdgpu_unmap_bo,
 	.bo_invalidate = amdgpu_bo_invalidate,
+	.bo_copy = amdgpu_bo_copy,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
 	.num_planes_from_modifier = dri_num_planes_from_modifier,
 };
@@ -6,11 +6,26 @@
 
 #include "cros_gralloc_buffer.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <inttypes.h>
 #include <sys/mman.h>
 
 #include <cutils/native_handle.h>
 
+static std::atomic<bool> record_access_default{ false };
+
+/* Locks per second from which a buffer counts as accessed often. */
+constexpr double ACCESS_OFTEN_LOCKS_PER_SEC = 1.0;
+/* Too few locks to tell a pattern apart from startup noise. */
+constexpr uint64_t ACCESS_MIN_LOCKS = 8;
+
+static uint64_t access_now_ns(std::chrono::steady_clock::time_point time)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch())
+	    .count();
+}
+
 /*static*/
 std::unique_ptr<cros_gralloc_buffer>
 cros_gralloc_buffer::create(struct bo *acquire_bo,
@@ -32,6 +47,16 @@ cros_gralloc_buffer::create(struct bo *acquire_bo,
 		return {};
 	}
 
+	/*
+	 * Map the reserved region up front so that metadata accesses, which can happen every
+	 * frame, never need a syscall or the buffer lock. Failures are retried lazily.
+	 */
+	if (acquire_hnd->reserved_region_size > 0) {
+		void *addr;
+		uint64_t size;
+		buffer->get_reserved_region(&addr, &size);
+	}
+
 	return buffer;
 }
 
@@ -43,16 +68,22 @@ cros_gralloc_buffer::cros_gralloc_buffer(struct bo *acquire_bo,
 	assert(hnd_);
 	for (uint32_t plane = 0; plane < DRV_MAX_PLANES; plane++)
 		lock_data_[plane] = nullptr;
+
+	record_access_ = record_access_default.load(std::memory_order_relaxed);
 }
 
 cros_gralloc_buffer::~cros_gralloc_buffer()
 {
-	drv_bo_destroy(bo_);
-	if (reserved_region_addr_) {
-		munmap(reserved_region_addr_, hnd_->reserved_region_size);
+	/* Both are cleared if the buffer was detached. */
+	if (bo_)
+		drv_bo_destroy(bo_);
+	void *reserved_region_addr = reserved_region_addr_.load(std::memory_order_relaxed);
+	if (reserved_region_addr)
+		unmap_reserved_region(reserved_region_addr);
+	if (hnd_) {
+		native_handle_close(hnd_);
+		native_handle_delete(hnd_);
 	}
-	native_handle_close(hnd_);
-	native_handle_delete(hnd_);
 }
 
 uint32_t cros_gralloc_buffer::get_id() const
@@ -133,6 +164,8 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 
 	memset(addr, 0, DRV_MAX_PLANES * sizeof(*addr));
 
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	/*
 	 * Gralloc consumers don't support more than one kernel buffer per buffer object yet, so
 	 * just use the first kernel buffer.
@@ -170,12 +203,36 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 	for (uint32_t plane = 0; plane < hnd_->num_planes; plane++)
 		addr[plane] = static_cast<uint8_t *>(vaddr) + drv_bo_get_plane_offset(bo_, plane);
 
+	if (record_access_ && map_flags) {
+		auto now = std::chrono::steady_clock::now();
+		uint64_t width = rect->width, height = rect->height;
+
+		if (!width && !height && !rect->x && !rect->y) {
+			width = drv_bo_get_width(bo_);
+			height = drv_bo_get_height(bo_);
+		}
+
+		access_stats_.locks++;
+		if (map_flags & BO_MAP_READ)
+			access_stats_.read_locks++;
+		if (map_flags & BO_MAP_WRITE)
+			access_stats_.write_locks++;
+		access_stats_.locked_pixels += width * height;
+		if (!access_stats_.first_lock_ns)
+			access_stats_.first_lock_ns = access_now_ns(now);
+		access_stats_.last_lock_ns = access_now_ns(now);
+		if (!lockcount_)
+			lock_start_ = now;
+	}
+
 	lockcount_++;
 	return 0;
 }
 
-int32_t cros_gralloc_buffer::unlock()
+int32_t cros_gralloc_buffer::unlock(int32_t *release_fence)
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (lockcount_ <= 0) {
 		ALOGE("Buffer was not locked.");
 		return -EINVAL;
@@ -183,23 +240,121 @@ int32_t cros_gralloc_buffer::unlock()
 
 	if (!--lockcount_) {
 		if (lock_data_[0]) {
-			drv_bo_flush_or_unmap(bo_, lock_data_[0]);
+			drv_bo_flush_or_unmap(bo_, lock_data_[0], release_fence);
 			lock_data_[0] = nullptr;
 		}
+
+		/* The flush is part of what holding the lock costs. */
+		if (record_access_ && access_stats_.locks) {
+			uint64_t hold_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					       std::chrono::steady_clock::now() - lock_start_)
+					       .count();
+			access_stats_.hold_ns += hold_ns;
+			access_stats_.max_hold_ns = std::max(access_stats_.max_hold_ns, hold_ns);
+		}
 	}
 
 	return 0;
 }
 
+/*static*/
+void cros_gralloc_buffer::set_record_access(bool record)
+{
+	record_access_default.store(record, std::memory_order_relaxed);
+}
+
+bool cros_gralloc_buffer::get_access_stats(struct cros_gralloc_access_stats *out_stats) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (!record_access_)
+		return false;
+
+	*out_stats = access_stats_;
+	return true;
+}
+
+std::string cros_gralloc_buffer::get_access_advice() const
+{
+	struct cros_gralloc_access_stats stats;
+	uint64_t use_flags = drv_bo_get_use_flags(bo_);
+	std::string advice;
+	char buf[128];
+
+	if (!get_access_stats(&stats) || !stats.locks)
+		return advice;
+
+	auto add = [&](const char *text) {
+		if (!advice.empty())
+			advice += "; ";
+		advice += text;
+	};
+
+	/* A single lock says nothing about its rate. */
+	double span_s = (stats.last_lock_ns - stats.first_lock_ns) / 1e9;
+	bool often = stats.locks >= ACCESS_MIN_LOCKS && span_s > 0 &&
+		     stats.locks / span_s >= ACCESS_OFTEN_LOCKS_PER_SEC;
+
+	if (stats.read_locks && !(use_flags & (BO_USE_SW_READ_OFTEN | BO_USE_SW_READ_RARELY)))
+		add("read without SW_READ usage");
+	else if (often && stats.read_locks * 2 > stats.locks &&
+		 !(use_flags & BO_USE_SW_READ_OFTEN))
+		add("read often but SW_READ_OFTEN not set");
+	else if (stats.locks >= ACCESS_MIN_LOCKS && !stats.read_locks &&
+		 (use_flags & BO_USE_SW_READ_OFTEN))
+		add("SW_READ_OFTEN set but never read");
+
+	if (stats.write_locks && !(use_flags & (BO_USE_SW_WRITE_OFTEN | BO_USE_SW_WRITE_RARELY)))
+		add("written without SW_WRITE usage");
+	else if (often && stats.write_locks * 2 > stats.locks &&
+		 !(use_flags & BO_USE_SW_WRITE_OFTEN))
+		add("written often but SW_WRITE_OFTEN not set");
+	else if (stats.locks >= ACCESS_MIN_LOCKS && !stats.write_locks &&
+		 (use_flags & BO_USE_SW_WRITE_OFTEN))
+		add("SW_WRITE_OFTEN set but never written");
+
+	if (advice.empty())
+		return advice;
+
+	uint64_t pixels = static_cast<uint64_t>(drv_bo_get_width(bo_)) * drv_bo_get_height(bo_);
+	snprintf(buf, sizeof(buf),
+		 " (locks=%" PRIu64 " reads=%" PRIu64 " writes=%" PRIu64
+		 " area=%" PRIu64 "%% avg_hold_us=%" PRIu64 " max_hold_us=%" PRIu64 ")",
+		 stats.locks, stats.read_locks, stats.write_locks,
+		 pixels ? stats.locked_pixels * 100 / (stats.locks * pixels) : 0,
+		 stats.hold_ns / stats.locks / 1000, stats.max_hold_ns / 1000);
+	advice += buf;
+	return advice;
+}
+
 int32_t cros_gralloc_buffer::resource_info(uint32_t strides[DRV_MAX_PLANES],
 					   uint32_t offsets[DRV_MAX_PLANES],
 					   uint64_t *format_modifier)
 {
-	return drv_resource_info(bo_, strides, offsets, format_modifier);
+	std::lock_guard<std::mutex> lock(resource_info_mutex_);
+
+	/* Backends that ask the host keep the answer for the life of the resource. */
+	if (!resource_info_valid_) {
+		int32_t ret = drv_resource_info(bo_, resource_strides_, resource_offsets_,
+						&resource_format_modifier_);
+		if (ret)
+			return ret;
+
+		resource_info_valid_ = true;
+	}
+
+	for (uint32_t plane = 0; plane < DRV_MAX_PLANES; plane++) {
+		strides[plane] = resource_strides_[plane];
+		offsets[plane] = resource_offsets_[plane];
+	}
+	*format_modifier = resource_format_modifier_;
+	return 0;
 }
 
 int32_t cros_gralloc_buffer::invalidate()
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (lockcount_ <= 0) {
 		ALOGE("Buffer was not locked.");
 		return -EINVAL;
@@ -213,36 +368,151 @@ int32_t cros_gralloc_buffer::invalidate()
 
 int32_t cros_gralloc_buffer::flush()
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (lockcount_ <= 0) {
+		ALOGE("Buffer was not locked.");
+		return -EINVAL;
+	}
+
+	if (lock_data_[0])
+		return drv_bo_flush(bo_, lock_data_[0], nullptr);
+
+	return 0;
+}
+
+int32_t cros_gralloc_buffer::mark_dirty(const struct rectangle *rect)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (lockcount_ <= 0) {
 		ALOGE("Buffer was not locked.");
 		return -EINVAL;
 	}
 
 	if (lock_data_[0])
-		return drv_bo_flush(bo_, lock_data_[0]);
+		return drv_bo_mark_dirty(bo_, lock_data_[0], rect);
 
 	return 0;
 }
 
+int32_t cros_gralloc_buffer::copy_from(cros_gralloc_buffer *src, const struct rectangle *rect)
+{
+	if (src == this)
+		return -EINVAL;
+
+	std::lock(mutex_, src->mutex_);
+	std::lock_guard<std::mutex> lock(mutex_, std::adopt_lock);
+	std::lock_guard<std::mutex> src_lock(src->mutex_, std::adopt_lock);
+
+	return drv_bo_copy(bo_, src->bo_, rect);
+}
+
+/* Regions carved out of a shared slab needn't start on a page. */
+static uint64_t reserved_region_page_offset(const struct cros_gralloc_handle *hnd)
+{
+	return hnd->reserved_region_offset & (static_cast<uint64_t>(getpagesize()) - 1);
+}
+
+void cros_gralloc_buffer::unmap_reserved_region(void *addr) const
+{
+	uint64_t page_offset = reserved_region_page_offset(hnd_);
+
+	munmap(static_cast<uint8_t *>(addr) - page_offset,
+	       page_offset + hnd_->reserved_region_size);
+}
+
 int32_t cros_gralloc_buffer::get_reserved_region(void **addr, uint64_t *size) const
 {
+	/* Once mapped, the region stays mapped for the lifetime of the buffer. */
+	void *reserved_region_addr = reserved_region_addr_.load(std::memory_order_acquire);
+	if (reserved_region_addr) {
+		*addr = reserved_region_addr;
+		*size = hnd_->reserved_region_size;
+		return 0;
+	}
+
 	int32_t reserved_region_fd = hnd_->fds[hnd_->num_planes];
 	if (reserved_region_fd < 0) {
 		ALOGE("Buffer does not have reserved region.");
 		return -EINVAL;
 	}
 
-	if (!reserved_region_addr_) {
-		reserved_region_addr_ =
-		    mmap(nullptr, hnd_->reserved_region_size, PROT_WRITE | PROT_READ, MAP_SHARED,
-			 reserved_region_fd, 0);
-		if (reserved_region_addr_ == MAP_FAILED) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	reserved_region_addr = reserved_region_addr_.load(std::memory_order_relaxed);
+	if (!reserved_region_addr) {
+		uint64_t page_offset = reserved_region_page_offset(hnd_);
+
+		reserved_region_addr = mmap(nullptr, page_offset + hnd_->reserved_region_size,
+					    PROT_WRITE | PROT_READ, MAP_SHARED, reserved_region_fd,
+					    hnd_->reserved_region_offset - page_offset);
+		if (reserved_region_addr == MAP_FAILED) {
 			ALOGE("Failed to mmap reserved region: %s.", strerror(errno));
 			return -errno;
 		}
+
+		reserved_region_addr = static_cast<uint8_t *>(reserved_region_addr) + page_offset;
+		reserved_region_addr_.store(reserved_region_addr, std::memory_order_release);
 	}
 
-	*addr = reserved_region_addr_;
+	*addr = reserved_region_addr;
 	*size = hnd_->reserved_region_size;
 	return 0;
 }
+
+const std::vector<uint8_t> *cros_gralloc_buffer::get_cached_encoding(uint64_t key) const
+{
+	std::lock_guard<std::mutex> lock(encodings_mutex_);
+
+	auto it = encodings_.find(key);
+	return it != encodings_.end() ? &it->second : nullptr;
+}
+
+const std::vector<uint8_t> *cros_gralloc_buffer::cache_encoding(uint64_t key,
+								 std::vector<uint8_t> encoding) const
+{
+	std::lock_guard<std::mutex> lock(encodings_mutex_);
+
+	/* Map nodes are stable, and the first encoding cached for a key wins. */
+	return &encodings_.emplace(key, std::move(encoding)).first->second;
+}
+
+void cros_gralloc_buffer::set_recyclable(bool recyclable)
+{
+	recyclable_ = recyclable;
+}
+
+bool cros_gralloc_buffer::is_recyclable() const
+{
+	return recyclable_;
+}
+
+int32_t cros_gralloc_buffer::detach(struct bo **out_bo, struct cros_gralloc_handle **out_hnd)
+{
+	void *addr;
+	uint64_t size;
+
+	if (hnd_->reserved_region_size > 0) {
+		int32_t ret = get_reserved_region(&addr, &size);
+		if (ret)
+			return ret;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (lockcount_ > 0)
+		return -EBUSY;
+
+	/* Don't let metadata of the previous owner leak into the next allocation. */
+	void *reserved_region_addr = reserved_region_addr_.load(std::memory_order_relaxed);
+	if (reserved_region_addr) {
+		memset(reserved_region_addr, 0, hnd_->reserved_region_size);
+		unmap_reserved_region(reserved_region_addr);
+		reserved_region_addr_.store(nullptr, std::memory_order_relaxed);
+	}
+
+	*out_bo = bo_;
+	*out_hnd = hnd_;
+	bo_ = nullptr;
+	hnd_ = nullptr;
+	return 0;
+}
@@ -7,10 +7,30 @@
 #ifndef CROS_GRALLOC_BUFFER_H
 #define CROS_GRALLOC_BUFFER_H
 
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "cros_gralloc_helpers.h"
 
+/* CPU accesses made through lock() and unlock() since the buffer was created or imported. */
+struct cros_gralloc_access_stats {
+	uint64_t locks;
+	uint64_t read_locks;
+	uint64_t write_locks;
+	/* Summed over locks, in pixels. */
+	uint64_t locked_pixels;
+	/* From the first lock() to the matching last unlock(), summed over locks. */
+	uint64_t hold_ns;
+	uint64_t max_hold_ns;
+	uint64_t first_lock_ns;
+	uint64_t last_lock_ns;
+};
+
 class cros_gralloc_buffer
 {
       public:
@@ -32,25 +52,62 @@ class cros_gralloc_buffer
 	int32_t get_android_format() const;
 	uint64_t get_android_usage() const;
 
-	/* The new reference count is returned by both these functions. */
+	/*
+	 * The new reference count is returned by both these functions. These are serialized by
+	 * the driver, which only calls them with its handle table locked exclusively.
+	 */
 	int32_t increase_refcount();
 	int32_t decrease_refcount();
 
 	int32_t lock(const struct rectangle *rect, uint32_t map_flags,
 		     uint8_t *addr[DRV_MAX_PLANES]);
-	int32_t unlock();
+	/* |release_fence| is set to -1 or a fence the caller must wait on before using the data. */
+	int32_t unlock(int32_t *release_fence);
 	int32_t resource_info(uint32_t strides[DRV_MAX_PLANES], uint32_t offsets[DRV_MAX_PLANES],
 			      uint64_t *format_modifier);
 
 	int32_t invalidate();
 	int32_t flush();
+	int32_t mark_dirty(const struct rectangle *rect);
+	/* Copies |rect| of |src| into this buffer, see drv_bo_copy(). */
+	int32_t copy_from(cros_gralloc_buffer *src, const struct rectangle *rect);
 
 	int32_t get_reserved_region(void **reserved_region_addr,
 				    uint64_t *reserved_region_size) const;
 
+	/*
+	 * Cache of encoded, immutable buffer properties, keyed by ids chosen by the gralloc
+	 * frontend. Cached encodings are never replaced, so returned pointers stay valid for the
+	 * lifetime of the buffer.
+	 */
+	const std::vector<uint8_t> *get_cached_encoding(uint64_t key) const;
+	const std::vector<uint8_t> *cache_encoding(uint64_t key, std::vector<uint8_t> encoding) const;
+
+	/* Whether buffers created from now on record cros_gralloc_access_stats. Off by default. */
+	static void set_record_access(bool record);
+	/* Returns false if this buffer doesn't record its accesses. */
+	bool get_access_stats(struct cros_gralloc_access_stats *out_stats) const;
+	/*
+	 * Describes where the recorded accesses don't match the SW_READ and SW_WRITE usage the
+	 * buffer was allocated with, or returns an empty string.
+	 */
+	std::string get_access_advice() const;
+
+	/* Whether the driver may park this buffer's bo for reuse once it is released. */
+	void set_recyclable(bool recyclable);
+	bool is_recyclable() const;
+
+	/*
+	 * Hands ownership of the bo and handle to the caller, clearing the reserved region, so
+	 * they outlive this object. Fails if the buffer is still locked.
+	 */
+	int32_t detach(struct bo **out_bo, struct cros_gralloc_handle **out_hnd);
+
       private:
 	cros_gralloc_buffer(struct bo *acquire_bo, struct cros_gralloc_handle *acquire_handle);
 
+	void unmap_reserved_region(void *addr) const;
+
 	cros_gralloc_buffer(cros_gralloc_buffer const &);
 	cros_gralloc_buffer operator=(cros_gralloc_buffer const &);
 
@@ -60,12 +117,33 @@ class cros_gralloc_buffer
 	struct cros_gralloc_handle *hnd_;
 
 	int32_t refcount_ = 1;
+	bool recyclable_ = false;
+
+	/* Serializes CPU access state (lock count, mappings, reserved region) of this buffer. */
+	mutable std::mutex mutex_;
 	int32_t lockcount_ = 0;
 
 	struct mapping *lock_data_[DRV_MAX_PLANES];
 
-	/* Optional additional shared memory region attached to some gralloc buffers. */
-	mutable void *reserved_region_addr_ = nullptr;
+	/* Under |mutex_|, like the lock state they describe. */
+	bool record_access_ = false;
+	struct cros_gralloc_access_stats access_stats_ = {};
+	std::chrono::steady_clock::time_point lock_start_;
+
+	std::mutex resource_info_mutex_;
+	bool resource_info_valid_ = false;
+	uint32_t resource_strides_[DRV_MAX_PLANES] = {};
+	uint32_t resource_offsets_[DRV_MAX_PLANES] = {};
+	uint64_t resource_format_modifier_ = 0;
+
+	mutable std::mutex encodings_mutex_;
+	mutable std::unordered_map<uint64_t, std::vector<uint8_t>> encodings_;
+
+	/*
+	 * Optional additional shared memory region attached to some gralloc buffers. Mapped when
+	 * the buffer is created; only set once, so readers don't need |mutex_|.
+	 */
+	mutable std::atomic<void *> reserved_region_addr_{ nullptr };
 };
 
 #endif
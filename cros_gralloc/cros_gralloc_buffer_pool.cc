@@ -0,0 +1,184 @@
+/*
+ * Copyright 2022 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "cros_gralloc_buffer_pool.h"
+
+#include <algorithm>
+#include <cutils/native_handle.h>
+
+cros_gralloc_buffer_pool::~cros_gralloc_buffer_pool()
+{
+	trim(0);
+}
+
+void cros_gralloc_buffer_pool::configure(uint64_t max_bytes, std::chrono::milliseconds ttl)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		max_bytes_ = max_bytes;
+		ttl_ = ttl;
+	}
+
+	trim(max_bytes);
+}
+
+bool cros_gralloc_buffer_pool::enabled() const
+{
+	return max_bytes_ != 0;
+}
+
+void cros_gralloc_buffer_pool::destroy_entry(const struct entry &entry)
+{
+	native_handle_close(entry.hnd);
+	/*
+	 * Parked buffers have no user left (see the class comment), so the backend may keep their
+	 * memory for reuse too, e.g. virtgpu_cross_domain's blob recycling.
+	 */
+	drv_bo_set_exports_released(entry.bo);
+	drv_bo_destroy(entry.bo);
+	native_handle_delete(entry.hnd);
+}
+
+void cros_gralloc_buffer_pool::collect_locked(clock::time_point now, uint64_t target_bytes,
+					      std::deque<entry> &out)
+{
+	for (auto it = entries_.begin(); it != entries_.end();) {
+		auto &list = it->second;
+		while (!list.empty() && list.front().expiry <= now) {
+			stats_.num_bytes -= list.front().hnd->total_size;
+			stats_.num_buffers--;
+			stats_.evictions++;
+			out.push_back(list.front());
+			list.pop_front();
+		}
+
+		it = list.empty() ? entries_.erase(it) : std::next(it);
+	}
+
+	while (stats_.num_bytes > target_bytes && !entries_.empty()) {
+		auto oldest = entries_.begin();
+		for (auto it = entries_.begin(); it != entries_.end(); it++) {
+			if (it->second.front().expiry < oldest->second.front().expiry)
+				oldest = it;
+		}
+
+		auto &list = oldest->second;
+		stats_.num_bytes -= list.front().hnd->total_size;
+		stats_.num_buffers--;
+		stats_.evictions++;
+		out.push_back(list.front());
+		list.pop_front();
+		if (list.empty())
+			entries_.erase(oldest);
+	}
+}
+
+bool cros_gralloc_buffer_pool::put(const struct cros_gralloc_buffer_pool_key &key, struct bo *bo,
+				   struct cros_gralloc_handle *hnd)
+{
+	std::deque<entry> evicted;
+	const clock::time_point now = clock::now();
+	struct entry parked = { bo, hnd, now };
+	bool parked_ok = false;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (max_bytes_ && hnd->total_size <= max_bytes_) {
+			collect_locked(now, max_bytes_ - hnd->total_size, evicted);
+			parked.expiry = now + ttl_;
+			entries_[key].push_back(parked);
+			stats_.num_bytes += hnd->total_size;
+			stats_.num_buffers++;
+			parked_ok = true;
+		}
+	}
+
+	/* Destroying bos can take a while, so keep it out of the pool lock. */
+	for (const auto &entry : evicted)
+		destroy_entry(entry);
+
+	if (!parked_ok)
+		destroy_entry(parked);
+
+	return parked_ok;
+}
+
+bool cros_gralloc_buffer_pool::take(const struct cros_gralloc_buffer_pool_key &key,
+				    struct bo **out_bo, struct cros_gralloc_handle **out_hnd)
+{
+	std::deque<entry> expired;
+	bool hit = false;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!max_bytes_)
+			return false;
+
+		collect_locked(clock::now(), max_bytes_, expired);
+
+		auto it = entries_.find(key);
+		if (it != entries_.end()) {
+			/* Hand out the most recently parked buffer; it is the most likely to be hot. */
+			const struct entry &entry = it->second.back();
+			*out_bo = entry.bo;
+			*out_hnd = entry.hnd;
+			stats_.num_bytes -= entry.hnd->total_size;
+			stats_.num_buffers--;
+			it->second.pop_back();
+			if (it->second.empty())
+				entries_.erase(it);
+
+			stats_.hits++;
+			hit = true;
+		} else {
+			stats_.misses++;
+		}
+	}
+
+	for (const auto &entry : expired)
+		destroy_entry(entry);
+
+	return hit;
+}
+
+uint32_t cros_gralloc_buffer_pool::num_parked(const struct cros_gralloc_buffer_pool_key &key)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = entries_.find(key);
+	return it == entries_.end() ? 0 : static_cast<uint32_t>(it->second.size());
+}
+
+bool cros_gralloc_buffer_pool::next_expiry(clock::time_point *out_expiry)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (entries_.empty())
+		return false;
+
+	*out_expiry = clock::time_point::max();
+	for (const auto &it : entries_)
+		*out_expiry = std::min(*out_expiry, it.second.front().expiry);
+
+	return true;
+}
+
+void cros_gralloc_buffer_pool::trim(uint64_t target_bytes)
+{
+	std::deque<entry> evicted;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		collect_locked(clock::now(), target_bytes, evicted);
+	}
+
+	for (const auto &entry : evicted)
+		destroy_entry(entry);
+}
+
+struct cros_gralloc_buffer_pool_stats cros_gralloc_buffer_pool::get_stats()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return stats_;
+}
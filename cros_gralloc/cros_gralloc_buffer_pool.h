@@ -0,0 +1,135 @@
+/*
+ * Copyright 2022 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef CROS_GRALLOC_BUFFER_POOL_H
+#define CROS_GRALLOC_BUFFER_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+#include "cros_gralloc_helpers.h"
+
+/*
+ * Identifies interchangeable allocations: the device, the resolved format and use flags plus
+ * the sizes.
+ */
+struct cros_gralloc_buffer_pool_key {
+	const struct driver *drv;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t use_flags;
+	uint64_t reserved_region_size;
+
+	bool operator==(const cros_gralloc_buffer_pool_key &other) const
+	{
+		return drv == other.drv && width == other.width && height == other.height &&
+		       format == other.format && use_flags == other.use_flags &&
+		       reserved_region_size == other.reserved_region_size;
+	}
+};
+
+struct cros_gralloc_buffer_pool_key_hash {
+	size_t operator()(const cros_gralloc_buffer_pool_key &key) const
+	{
+		uint64_t hash = reinterpret_cast<uintptr_t>(key.drv);
+		hash = hash * 31 + key.format;
+		hash = hash * 31 + key.width;
+		hash = hash * 31 + key.height;
+		hash = hash * 31 + key.use_flags;
+		hash = hash * 31 + key.reserved_region_size;
+		return static_cast<size_t>(hash ^ (hash >> 32));
+	}
+};
+
+struct cros_gralloc_buffer_pool_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t num_buffers;
+	uint64_t num_bytes;
+};
+
+/*
+ * Parks the bo and handle of freed buffers for a short time so that an allocation with the same
+ * key can reuse them instead of creating, exporting and describing a new buffer.
+ *
+ * This is only safe when the process releasing a buffer is its last user, so the pool is off
+ * unless explicitly configured, and it must not be enabled in allocator services that hand
+ * buffers out to other processes. Recycled buffers are not cleared either: the next user sees
+ * the pixels the previous one left, which is only acceptable when both may see each other's
+ * contents anyway.
+ *
+ * Parked buffers are memory nobody uses, so besides expiring they are trimmed when allocation
+ * fails and on memory pressure (see cros_gralloc_driver::trim_memory()).
+ */
+class cros_gralloc_buffer_pool
+{
+      public:
+	cros_gralloc_buffer_pool() = default;
+	~cros_gralloc_buffer_pool();
+
+	/* A |max_bytes| of zero disables the pool. */
+	void configure(uint64_t max_bytes, std::chrono::milliseconds ttl);
+	bool enabled() const;
+
+	/*
+	 * Takes ownership of |bo| and |hnd|. Returns false (destroying both) if the pool is
+	 * disabled or the buffer doesn't fit in it.
+	 */
+	bool put(const struct cros_gralloc_buffer_pool_key &key, struct bo *bo,
+		 struct cros_gralloc_handle *hnd);
+
+	/* On a hit, ownership of the parked bo and handle moves to the caller. */
+	bool take(const struct cros_gralloc_buffer_pool_key &key, struct bo **out_bo,
+		  struct cros_gralloc_handle **out_hnd);
+
+	/* The number of buffers parked under |key|. */
+	uint32_t num_parked(const struct cros_gralloc_buffer_pool_key &key);
+
+	/*
+	 * Stores when the next parked buffer expires in |out_expiry|. Returns false if none is
+	 * parked. Expired buffers are only destroyed by the next put(), take() or trim().
+	 */
+	bool next_expiry(std::chrono::steady_clock::time_point *out_expiry);
+
+	/* Destroys parked buffers, oldest first, until at most |target_bytes| remain. */
+	void trim(uint64_t target_bytes);
+
+	struct cros_gralloc_buffer_pool_stats get_stats();
+
+      private:
+	using clock = std::chrono::steady_clock;
+
+	struct entry {
+		struct bo *bo;
+		struct cros_gralloc_handle *hnd;
+		clock::time_point expiry;
+	};
+
+	static void destroy_entry(const struct entry &entry);
+
+	/* Moves entries that are expired, or that must go to get under |target_bytes|, to |out|. */
+	void collect_locked(clock::time_point now, uint64_t target_bytes, std::deque<entry> &out);
+
+	cros_gralloc_buffer_pool(cros_gralloc_buffer_pool const &);
+	cros_gralloc_buffer_pool operator=(cros_gralloc_buffer_pool const &);
+
+	std::mutex mutex_;
+	/* Written under |mutex_|, but read without it by enabled(). */
+	std::atomic<uint64_t> max_bytes_{ 0 };
+	std::chrono::milliseconds ttl_{ 0 };
+	/* Entries of each key are ordered by expiry, oldest at the front. */
+	std::unordered_map<cros_gralloc_buffer_pool_key, std::deque<entry>,
+			   cros_gralloc_buffer_pool_key_hash>
+	    entries_;
+	struct cros_gralloc_buffer_pool_stats stats_ = {};
+};
+
+#endif
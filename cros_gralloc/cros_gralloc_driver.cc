@@ -6,10 +6,13 @@
 
 #include "cros_gralloc_driver.h"
 
+#include <cinttypes>
 #include <cstdlib>
 #include <cutils/properties.h>
 #include <fcntl.h>
 #include <hardware/gralloc.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <syscall.h>
 #include <xf86drm.h>
@@ -61,9 +64,9 @@ int memfd_create_reserved_region(const std::string &buffer_name, uint64_t reserv
 	return reserved_region_fd;
 }
 
-cros_gralloc_driver *cros_gralloc_driver::get_instance()
+cros_gralloc_driver *cros_gralloc_driver::get_instance(bool mapper_only)
 {
-	static cros_gralloc_driver s_instance;
+	static cros_gralloc_driver s_instance(mapper_only);
 
 	if (!s_instance.is_initialized()) {
 		ALOGE("Failed to initialize driver.");
@@ -74,7 +77,7 @@ cros_gralloc_driver *cros_gralloc_driver::get_instance()
 }
 
 #ifndef DRV_EXTERNAL
-static struct driver *init_try_node(int idx, char const *str)
+static struct driver *init_try_node(int idx, char const *str, bool mapper_only)
 {
 	int fd;
 	char *node;
@@ -89,14 +92,55 @@ static struct driver *init_try_node(int idx, char const *str)
 	if (fd < 0)
 		return NULL;
 
-	drv = drv_create(fd);
-	if (!drv)
+	drv = mapper_only ? drv_create_mapper_only(fd) : drv_create(fd);
+	if (drv)
+		drv_cache_node(fd, "gralloc");
+	else
 		close(fd);
 
 	return drv;
 }
 
-static struct driver *init_try_nodes()
+/*
+ * Creates a driver for the first render node, or else card node, whose kernel driver is called
+ * |name|. Unlike init_try_nodes(), the pick isn't remembered for the next boot.
+ */
+static struct driver *init_try_named_node(const char *name, bool mapper_only)
+{
+	char const *nodes_fmt[] = { "%s/renderD%d", "%s/card%d" };
+	uint32_t min_node[] = { DRM_RENDER_NODE_START, DRM_CARD_NODE_START };
+
+	for (uint32_t type = 0; type < ARRAY_SIZE(nodes_fmt); type++) {
+		for (uint32_t i = min_node[type]; i < min_node[type] + DRM_NUM_NODES; i++) {
+			char *node;
+			int fd;
+
+			if (asprintf(&node, nodes_fmt[type], DRM_DIR_NAME, i) < 0)
+				return nullptr;
+
+			fd = open(node, O_RDWR, 0);
+			free(node);
+			if (fd < 0)
+				continue;
+
+			drmVersionPtr version = drmGetVersion(fd);
+			bool match = version && !strcmp(version->name, name);
+			drmFreeVersion(version);
+
+			struct driver *drv = nullptr;
+			if (match)
+				drv = mapper_only ? drv_create_mapper_only(fd) : drv_create(fd);
+			if (drv)
+				return drv;
+
+			close(fd);
+		}
+	}
+
+	return nullptr;
+}
+
+static struct driver *init_try_nodes(bool mapper_only)
 {
 	/*
 	 * Create a driver from render nodes first, then try card
@@ -113,17 +157,35 @@ static struct driver *init_try_nodes()
 	uint32_t max_render_node = (min_render_node + num_nodes);
 	uint32_t min_card_node = DRM_CARD_NODE_START;
 	uint32_t max_card_node = (min_card_node + num_nodes);
+	int fd;
+	char name[PROP_VALUE_MAX];
+
+	// Try the configured render device, if any...
+	if (property_get("vendor.minigbm.render_device", name, "") > 0) {
+		drv = init_try_named_node(name, mapper_only);
+		if (drv)
+			return drv;
+	}
+
+	// Try the node picked earlier in this boot, if any...
+	fd = drv_open_cached_node("gralloc");
+	if (fd >= 0) {
+		drv = mapper_only ? drv_create_mapper_only(fd) : drv_create(fd);
+		if (drv)
+			return drv;
+		close(fd);
+	}
 
 	// Try render nodes...
 	for (uint32_t i = min_render_node; i < max_render_node; i++) {
-		drv = init_try_node(i, render_nodes_fmt);
+		drv = init_try_node(i, render_nodes_fmt, mapper_only);
 		if (drv)
 			return drv;
 	}
 
 	// Try card nodes... for vkms mostly.
 	for (uint32_t i = min_card_node; i < max_card_node; i++) {
-		drv = init_try_node(i, card_nodes_fmt);
+		drv = init_try_node(i, card_nodes_fmt, mapper_only);
 		if (drv)
 			return drv;
 	}
@@ -133,9 +195,14 @@ static struct driver *init_try_nodes()
 
 #else
 
-static struct driver *init_try_nodes()
+static struct driver *init_try_named_node(const char *, bool)
 {
-	return drv_create(-1);
+	return nullptr;
+}
+
+static struct driver *init_try_nodes(bool mapper_only)
+{
+	return mapper_only ? drv_create_mapper_only(-1) : drv_create(-1);
 }
 
 #endif
@@ -148,17 +215,161 @@ static void drv_destroy_and_close(struct driver *drv)
 		close(fd);
 }
 
-cros_gralloc_driver::cros_gralloc_driver() : drv_(init_try_nodes(), drv_destroy_and_close)
+cros_gralloc_driver::cros_gralloc_driver(bool mapper_only)
+    : drv_(init_try_nodes(mapper_only), drv_destroy_and_close),
+      scanout_drv_(nullptr, drv_destroy_and_close)
 {
 	char buf[PROP_VALUE_MAX];
 	property_get("ro.product.device", buf, "unknown");
 	mt8183_camera_quirk_ = !strncmp(buf, "kukui", strlen("kukui"));
+
+	/*
+	 * With a separate display device, scanout buffers are allocated there so that only buffers
+	 * the GPU renders to cross devices. Two devices with the same kernel driver can't be told
+	 * apart this way.
+	 */
+	if (drv_ && property_get("vendor.minigbm.scanout_device", buf, "") > 0 &&
+	    strcmp(buf, drv_get_name(drv_.get()))) {
+		scanout_drv_.reset(init_try_named_node(buf, mapper_only));
+		if (!scanout_drv_)
+			ALOGE("Scanout device %s not found, using %s.", buf,
+			      drv_get_name(drv_.get()));
+	}
+
+	if (drv_)
+		static_resource_info_ =
+		    drv_has_static_resource_info(drv_.get()) &&
+		    (!scanout_drv_ || drv_has_static_resource_info(scanout_drv_.get()));
+
+	/*
+	 * Recycling is opt-in; see cros_gralloc_buffer_pool for when it is safe to enable. Recycled
+	 * buffers keep the previous user's pixels, so the pool must only be enabled where every
+	 * allocation of this process may see every other's contents.
+	 */
+	uint64_t pool_kb = property_get_int64("vendor.minigbm.recycle_pool.max_kb", 0);
+	int64_t pool_ttl_ms = property_get_int64("vendor.minigbm.recycle_pool.ttl_ms", 500);
+	buffer_pool_.configure(pool_kb * 1024, std::chrono::milliseconds(pool_ttl_ms));
+
+	/* Buffers for preallocate() hints; they wait longer since their users are expected. */
+	uint64_t prealloc_kb = property_get_int64("vendor.minigbm.prealloc.max_kb", 0);
+	int64_t prealloc_ttl_ms = property_get_int64("vendor.minigbm.prealloc.ttl_ms", 10000);
+	prealloc_max_bytes_ = prealloc_kb * 1024;
+	preallocated_.configure(prealloc_max_bytes_, std::chrono::milliseconds(prealloc_ttl_ms));
+
+	/* Keeping released imports alive holds on to memory their producer freed, so opt-in too. */
+	int64_t import_ttl_ms = property_get_int64("vendor.minigbm.import_cache.ttl_ms", 0);
+	int64_t import_max = property_get_int64("vendor.minigbm.import_cache.max_buffers", 64);
+	import_cache_.configure(std::chrono::milliseconds(import_ttl_ms),
+				static_cast<uint32_t>(import_max));
+
+	/*
+	 * Any process holding one buffer of a slab can read and write the metadata of the others,
+	 * so only devices whose clients may see each other's metadata should opt in.
+	 */
+	int64_t slab_kb = property_get_int64("vendor.minigbm.reserved_region_slab_kb", 0);
+	reserved_slab_size_ = slab_kb > 0 ? static_cast<uint64_t>(slab_kb) * 1024 : 0;
+
+	if (drv_ && property_get_int64("vendor.minigbm.stats", 0)) {
+		drv_stats_enable(drv_.get());
+		if (scanout_drv_)
+			drv_stats_enable(scanout_drv_.get());
+	}
+
+	/* Costs a clock read per lock and unlock; for finding callers with the wrong SW usage. */
+	if (property_get_int64("vendor.minigbm.access_stats", 0))
+		cros_gralloc_buffer::set_record_access(true);
+
+	/* "on", or the use flags to use huge pages for; see drv_set_huge_page_policy(). */
+	if (drv_ && property_get("vendor.minigbm.huge_pages", buf, "") > 0) {
+		drv_set_huge_page_policy(drv_.get(), buf);
+		if (scanout_drv_)
+			drv_set_huge_page_policy(scanout_drv_.get(), buf);
+	}
+
+	/* A rule list, or the path of a file holding one; see drv_set_compression_policy(). */
+	if (drv_ && property_get("vendor.minigbm.compression_policy", buf, "") > 0) {
+		drv_set_compression_policy(drv_.get(), buf);
+		if (scanout_drv_)
+			drv_set_compression_policy(scanout_drv_.get(), buf);
+	}
+
+	/*
+	 * Trims whatever is kept for reuse when memory goes under pressure. The trigger is a PSI
+	 * one, "<some|full> <stall us> <window us>"; the default fires on 150ms of stall per 1s.
+	 */
+	if (drv_ && (buffer_pool_.enabled() || preallocated_.enabled() || import_ttl_ms > 0) &&
+	    property_get("vendor.minigbm.psi_trigger", buf, "some 150000 1000000") > 0 &&
+	    strcmp(buf, "off")) {
+		pressure_fd_ = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (pressure_fd_ >= 0 && write(pressure_fd_, buf, strlen(buf) + 1) < 0) {
+			ALOGI("PSI trigger \"%s\" rejected: %s", buf, strerror(errno));
+			close(pressure_fd_);
+			pressure_fd_ = -1;
+		}
+		if (pressure_fd_ >= 0)
+			pressure_stop_fd_ = eventfd(0, EFD_CLOEXEC);
+		if (pressure_stop_fd_ >= 0)
+			pressure_thread_ = std::thread(&cros_gralloc_driver::pressure_worker, this);
+		else if (pressure_fd_ >= 0)
+			close(pressure_fd_);
+	}
+}
+
+void cros_gralloc_driver::pressure_worker()
+{
+	struct pollfd fds[2] = {
+		{ .fd = pressure_fd_, .events = POLLPRI },
+		{ .fd = pressure_stop_fd_, .events = POLLIN },
+	};
+
+	while (true) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ALOGE("Failed to poll PSI: %s", strerror(errno));
+			return;
+		}
+
+		if (fds[1].revents)
+			return;
+
+		/* POLLERR means the monitor went away with the pressure file. */
+		if (fds[0].revents & POLLERR)
+			return;
+
+		if (fds[0].revents & POLLPRI)
+			trim_memory();
+	}
 }
 
 cros_gralloc_driver::~cros_gralloc_driver()
 {
+	if (pressure_thread_.joinable()) {
+		uint64_t one = 1;
+		if (write(pressure_stop_fd_, &one, sizeof(one)) != sizeof(one))
+			ALOGE("Failed to stop the PSI monitor: %s", strerror(errno));
+		pressure_thread_.join();
+	}
+	if (pressure_fd_ >= 0)
+		close(pressure_fd_);
+	if (pressure_stop_fd_ >= 0)
+		close(pressure_stop_fd_);
+
+	{
+		std::lock_guard<std::mutex> lock(prealloc_mutex_);
+		prealloc_stop_ = true;
+	}
+	prealloc_cond_.notify_all();
+	if (prealloc_thread_.joinable())
+		prealloc_thread_.join();
+
 	buffers_.clear();
 	handles_.clear();
+	buffer_pool_.trim(0);
+	preallocated_.trim(0);
+	import_cache_.clear();
+	if (reserved_slab_fd_ >= 0)
+		close(reserved_slab_fd_);
 }
 
 bool cros_gralloc_driver::is_initialized()
@@ -166,9 +377,51 @@ bool cros_gralloc_driver::is_initialized()
 	return drv_ != nullptr;
 }
 
+struct driver *cros_gralloc_driver::get_driver_for(uint64_t use_flags)
+{
+	if (scanout_drv_ && (use_flags & (BO_USE_SCANOUT | BO_USE_CURSOR)))
+		return scanout_drv_.get();
+
+	return drv_.get();
+}
+
+struct driver *cros_gralloc_driver::get_driver_for_import(cros_gralloc_handle_t hnd)
+{
+	struct driver *drv = get_driver_for(hnd->use_flags);
+
+	/*
+	 * The handle holds the resolved format and use flags, so the display device lacking them
+	 * means the allocation fell back to the render device.
+	 */
+	if (drv != drv_.get() && !drv_get_combination(drv, hnd->format, hnd->use_flags))
+		return drv_.get();
+
+	return drv;
+}
+
 bool cros_gralloc_driver::get_resolved_format_and_use_flags(
-    const struct cros_gralloc_buffer_descriptor *descriptor, uint32_t *out_format,
-    uint64_t *out_use_flags)
+    const struct cros_gralloc_buffer_descriptor *descriptor, struct driver **out_drv,
+    uint32_t *out_format, uint64_t *out_use_flags)
+{
+	struct driver *drv = get_driver_for(descriptor->use_flags);
+
+	/* Fall back to the render device for what the display device can't allocate. */
+	if (resolve_on_driver(drv, descriptor, out_format, out_use_flags)) {
+		*out_drv = drv;
+		return true;
+	}
+
+	if (drv == drv_.get() || !resolve_on_driver(drv_.get(), descriptor, out_format,
+						      out_use_flags))
+		return false;
+
+	*out_drv = drv_.get();
+	return true;
+}
+
+bool cros_gralloc_driver::resolve_on_driver(struct driver *drv,
+					   const struct cros_gralloc_buffer_descriptor *descriptor,
+					   uint32_t *out_format, uint64_t *out_use_flags)
 {
 	uint32_t resolved_format;
 	uint64_t resolved_use_flags;
@@ -181,10 +434,10 @@ bool cros_gralloc_driver::get_resolved_format_and_use_flags(
 		return true;
 	}
 
-	drv_resolve_format_and_use_flags(drv_.get(), descriptor->drm_format, descriptor->use_flags,
+	drv_resolve_format_and_use_flags(drv, descriptor->drm_format, descriptor->use_flags,
 					 &resolved_format, &resolved_use_flags);
 
-	combo = drv_get_combination(drv_.get(), resolved_format, resolved_use_flags);
+	combo = drv_get_combination(drv, resolved_format, resolved_use_flags);
 	if (!combo && (descriptor->droid_usage & GRALLOC_USAGE_HW_VIDEO_ENCODER) &&
 	    descriptor->droid_format != HAL_PIXEL_FORMAT_YCbCr_420_888) {
 		// Unmask BO_USE_HW_VIDEO_ENCODER for other formats. They are mostly
@@ -192,12 +445,12 @@ bool cros_gralloc_driver::get_resolved_format_and_use_flags(
 		// camera). YV12 is passed to the encoder component, but it is converted
 		// to YCbCr_420_888 before being passed to the hw encoder.
 		resolved_use_flags &= ~BO_USE_HW_VIDEO_ENCODER;
-		combo = drv_get_combination(drv_.get(), resolved_format, resolved_use_flags);
+		combo = drv_get_combination(drv, resolved_format, resolved_use_flags);
 	}
 	if (!combo && (descriptor->droid_usage & BUFFER_USAGE_FRONT_RENDERING_MASK)) {
 		resolved_use_flags &= ~BO_USE_FRONT_RENDERING;
 		resolved_use_flags |= BO_USE_LINEAR;
-		combo = drv_get_combination(drv_.get(), resolved_format, resolved_use_flags);
+		combo = drv_get_combination(drv, resolved_format, resolved_use_flags);
 	}
 	if (!combo)
 		return false;
@@ -207,26 +460,111 @@ bool cros_gralloc_driver::get_resolved_format_and_use_flags(
 	return true;
 }
 
-bool cros_gralloc_driver::is_supported(const struct cros_gralloc_buffer_descriptor *descriptor)
+bool cros_gralloc_driver::is_supported_uncached(
+    const struct cros_gralloc_buffer_descriptor *descriptor)
 {
+	struct driver *drv;
 	uint32_t resolved_format;
 	uint64_t resolved_use_flags;
-	uint32_t max_texture_size = drv_get_max_texture_2d_size(drv_.get());
-	if (!get_resolved_format_and_use_flags(descriptor, &resolved_format, &resolved_use_flags))
+	if (!get_resolved_format_and_use_flags(descriptor, &drv, &resolved_format,
+					       &resolved_use_flags))
 		return false;
 
+	uint32_t max_texture_size = drv_get_max_texture_2d_size(drv);
+
 	// Allow blob buffers to go beyond the limit.
 	if (descriptor->droid_format == HAL_PIXEL_FORMAT_BLOB)
 		return true;
 
-	return descriptor->width <= max_texture_size && descriptor->height <= max_texture_size;
+	if (descriptor->width > max_texture_size || descriptor->height > max_texture_size)
+		return false;
+
+	/*
+	 * A matching combination doesn't mean the backend can lay out this size; ask it, where it
+	 * can tell without allocating.
+	 */
+	int ret = drv_bo_query_layout(drv, descriptor->width, descriptor->height, resolved_format,
+				      resolved_use_flags);
+	return ret == 0 || ret == -ENOTSUP;
+}
+
+bool cros_gralloc_driver::is_supported(const struct cros_gralloc_buffer_descriptor *descriptor)
+{
+	const supported_key key = { descriptor->width,	      descriptor->height,
+				    descriptor->droid_format, descriptor->droid_usage,
+				    descriptor->drm_format,   descriptor->use_flags };
+	const size_t max_entries = 512;
+
+	{
+		std::lock_guard<std::mutex> lock(supported_mutex_);
+		auto it = supported_.find(key);
+		if (it != supported_.end())
+			return it->second;
+	}
+
+	bool supported = is_supported_uncached(descriptor);
+
+	std::lock_guard<std::mutex> lock(supported_mutex_);
+	if (supported_.size() < max_entries)
+		supported_.emplace(key, supported);
+
+	return supported;
+}
+
+/*
+ * Reserved regions are a few hundred bytes, so when enabled they are carved out of a shared
+ * memfd instead of each taking an fd and a page of their own. Every handle still carries its
+ * own dup of the slab fd. Space is never reused: other processes may still hold a region after
+ * this one released its handle. A slab's memory is freed once the last handle into it closes.
+ */
+int cros_gralloc_driver::alloc_reserved_region_from_slab(uint64_t reserved_region_size,
+							 uint64_t *out_offset)
+{
+	const uint64_t align = 64;
+	uint64_t size = ALIGN(reserved_region_size, align);
+
+	std::lock_guard<std::mutex> lock(reserved_slab_mutex_);
+	if (size > reserved_slab_size_ / 4)
+		return -EINVAL;
+
+	if (reserved_slab_fd_ < 0 || reserved_slab_used_ + size > reserved_slab_size_) {
+		int fd = memfd_create_wrapper("minigbm reserved regions", FD_CLOEXEC);
+		if (fd < 0)
+			return -errno;
+
+		if (ftruncate(fd, reserved_slab_size_)) {
+			ALOGE("Failed to set reserved region slab size: %s.", strerror(errno));
+			close(fd);
+			return -errno;
+		}
+
+		if (reserved_slab_fd_ >= 0)
+			close(reserved_slab_fd_);
+		reserved_slab_fd_ = fd;
+		reserved_slab_used_ = 0;
+	}
+
+	int fd = fcntl(reserved_slab_fd_, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	*out_offset = reserved_slab_used_;
+	reserved_slab_used_ += size;
+	return fd;
 }
 
 int cros_gralloc_driver::create_reserved_region(const std::string &buffer_name,
-						uint64_t reserved_region_size)
+						uint64_t reserved_region_size, uint64_t *out_offset)
 {
 	int ret;
 
+	*out_offset = 0;
+	if (reserved_slab_size_) {
+		ret = alloc_reserved_region_from_slab(reserved_region_size, out_offset);
+		if (ret >= 0)
+			return ret;
+	}
+
 #if ANDROID_API_LEVEL >= 31 && defined(HAS_DMABUF_SYSTEM_HEAP)
 	ret = allocator_.Alloc(kDmabufSystemHeapName, reserved_region_size);
 	if (ret >= 0)
@@ -241,26 +579,27 @@ int cros_gralloc_driver::create_reserved_region(const std::string &buffer_name,
 	return -1;
 }
 
-int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
-				      native_handle_t **out_handle)
+int32_t cros_gralloc_driver::create_bo_and_handle(
+    struct driver *drv, const struct cros_gralloc_buffer_descriptor *descriptor,
+    uint32_t resolved_format, uint64_t resolved_use_flags, struct bo **out_bo,
+    struct cros_gralloc_handle **out_hnd)
 {
 	int ret = 0;
 	size_t num_planes;
 	size_t num_fds;
 	size_t num_ints;
-	uint32_t resolved_format;
-	uint64_t resolved_use_flags;
 	struct bo *bo;
 	struct cros_gralloc_handle *hnd;
-	std::unique_ptr<cros_gralloc_buffer> buffer;
 
-	if (!get_resolved_format_and_use_flags(descriptor, &resolved_format, &resolved_use_flags)) {
-		ALOGE("Failed to resolve format and use_flags.");
-		return -EINVAL;
-	}
-
-	bo = drv_bo_create(drv_.get(), descriptor->width, descriptor->height, resolved_format,
+	bo = drv_bo_create(drv, descriptor->width, descriptor->height, resolved_format,
 			   resolved_use_flags);
+	if (!bo && (buffer_pool_.enabled() || preallocated_.enabled())) {
+		/* Parked buffers may be what is holding the memory, so give them back and retry. */
+		buffer_pool_.trim(0);
+		preallocated_.trim(0);
+		bo = drv_bo_create(drv, descriptor->width, descriptor->height, resolved_format,
+				   resolved_use_flags);
+	}
 	if (!bo) {
 		ALOGE("Failed to create bo.");
 		return -errno;
@@ -273,6 +612,7 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	 */
 	if (drv_num_buffers_per_bo(bo) != 1) {
 		ALOGE("Can only support one buffer per bo.");
+		ret = -EINVAL;
 		goto destroy_bo;
 	}
 
@@ -304,16 +644,16 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	}
 
 	hnd->reserved_region_size = descriptor->reserved_region_size;
+	hnd->reserved_region_offset = 0;
 	if (hnd->reserved_region_size > 0) {
-		ret = create_reserved_region(descriptor->name, hnd->reserved_region_size);
+		ret = create_reserved_region(descriptor->name, hnd->reserved_region_size,
+					     &hnd->reserved_region_offset);
 		if (ret < 0)
 			goto destroy_hnd;
 
 		hnd->fds[hnd->num_planes] = ret;
 	}
 
-	static std::atomic<uint32_t> next_buffer_id{ 1 };
-	hnd->id = next_buffer_id++;
 	hnd->width = drv_bo_get_width(bo);
 	hnd->height = drv_bo_get_height(bo);
 	hnd->format = drv_bo_get_format(bo);
@@ -322,29 +662,10 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	hnd->use_flags = drv_bo_get_use_flags(bo);
 	hnd->pixel_stride = drv_bo_get_pixel_stride(bo);
 	hnd->magic = cros_gralloc_magic;
-	hnd->droid_format = descriptor->droid_format;
-	hnd->usage = descriptor->droid_usage;
 	hnd->total_size = descriptor->reserved_region_size + drv_bo_get_total_size(bo);
 
-	buffer = cros_gralloc_buffer::create(bo, hnd);
-	if (!buffer) {
-		ALOGE("Failed to allocate: failed to create cros_gralloc_buffer.");
-		ret = -1;
-		goto destroy_hnd;
-	}
-
-	{
-		std::lock_guard<std::mutex> lock(mutex_);
-
-		struct cros_gralloc_imported_handle_info hnd_info = {
-			.buffer = buffer.get(),
-			.refcount = 1,
-		};
-		handles_.emplace(hnd, hnd_info);
-		buffers_.emplace(hnd->id, std::move(buffer));
-	}
-
-	*out_handle = hnd;
+	*out_bo = bo;
+	*out_hnd = hnd;
 	return 0;
 
 destroy_hnd:
@@ -356,9 +677,223 @@ destroy_bo:
 	return ret;
 }
 
+static void destroy_bo_and_handle(struct bo *bo, struct cros_gralloc_handle *hnd)
+{
+	native_handle_close(hnd);
+	native_handle_delete(hnd);
+	drv_bo_destroy(bo);
+}
+
+int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
+				      native_handle_t **out_handle)
+{
+	return allocate_batch(descriptor, 1, /*parallel=*/false, out_handle);
+}
+
+int32_t cros_gralloc_driver::allocate_batch(const struct cros_gralloc_buffer_descriptor *descriptor,
+					    uint32_t count, bool parallel,
+					    native_handle_t **out_handles)
+{
+	int32_t ret = 0;
+	struct driver *drv;
+	uint32_t resolved_format;
+	uint64_t resolved_use_flags;
+	std::vector<struct bo *> bos(count, nullptr);
+	std::vector<struct cros_gralloc_handle *> hnds(count, nullptr);
+	std::vector<std::shared_ptr<cros_gralloc_buffer>> buffers(count);
+	std::vector<uint32_t> to_create;
+
+	if (!get_resolved_format_and_use_flags(descriptor, &drv, &resolved_format,
+					       &resolved_use_flags)) {
+		ALOGE("Failed to resolve format and use_flags.");
+		return -EINVAL;
+	}
+
+	const struct cros_gralloc_buffer_pool_key key = {
+		.drv = drv,
+		.width = descriptor->width,
+		.height = descriptor->height,
+		.format = resolved_format,
+		.use_flags = resolved_use_flags,
+		.reserved_region_size = descriptor->reserved_region_size,
+	};
+	for (uint32_t i = 0; i < count; i++) {
+		if (!buffer_pool_.take(key, &bos[i], &hnds[i]) &&
+		    !preallocated_.take(key, &bos[i], &hnds[i]))
+			to_create.push_back(i);
+	}
+
+	auto create = [&](uint32_t i) {
+		return create_bo_and_handle(drv, descriptor, resolved_format, resolved_use_flags,
+					    &bos[i], &hnds[i]);
+	};
+
+	if (parallel && to_create.size() > 1) {
+		/* Backend allocations may block on the kernel or the host, so overlap them. */
+		std::vector<std::future<int32_t>> pending;
+		for (size_t j = 1; j < to_create.size(); j++)
+			pending.push_back(std::async(std::launch::async, create, to_create[j]));
+
+		ret = create(to_create[0]);
+		for (auto &result : pending) {
+			int32_t result_ret = result.get();
+			if (!ret)
+				ret = result_ret;
+		}
+	} else {
+		for (uint32_t i : to_create) {
+			ret = create(i);
+			if (ret)
+				break;
+		}
+	}
+
+	if (ret)
+		goto destroy;
+
+	static std::atomic<uint32_t> next_buffer_id{ 1 };
+	for (uint32_t i = 0; i < count; i++) {
+		hnds[i]->id = next_buffer_id++;
+		hnds[i]->droid_format = descriptor->droid_format;
+		hnds[i]->usage = descriptor->droid_usage;
+
+		buffers[i] = cros_gralloc_buffer::create(bos[i], hnds[i]);
+		if (!buffers[i]) {
+			ALOGE("Failed to allocate: failed to create cros_gralloc_buffer.");
+			ret = -1;
+			goto destroy;
+		}
+
+		buffers[i]->set_recyclable(buffer_pool_.enabled());
+	}
+
+	{
+		std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+
+		for (uint32_t i = 0; i < count; i++) {
+			struct cros_gralloc_imported_handle_info hnd_info = {
+				.buffer = buffers[i],
+				.refcount = 1,
+			};
+			handles_.emplace(hnds[i], hnd_info);
+			buffers_.emplace(hnds[i]->id, std::move(buffers[i]));
+		}
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+		out_handles[i] = hnds[i];
+
+	return 0;
+
+destroy:
+	for (uint32_t i = 0; i < count; i++) {
+		if (buffers[i]) {
+			/* The buffer owns the bo and a clone of the handle. */
+			buffers[i].reset();
+			native_handle_close(hnds[i]);
+			native_handle_delete(hnds[i]);
+		} else if (bos[i] && hnds[i]) {
+			destroy_bo_and_handle(bos[i], hnds[i]);
+		}
+	}
+
+	return ret;
+}
+
+int32_t cros_gralloc_driver::preallocate(const struct cros_gralloc_buffer_descriptor *descriptor,
+					 uint32_t count)
+{
+	if (!preallocated_.enabled())
+		return -ENOTSUP;
+
+	if (!count)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(prealloc_mutex_);
+	prealloc_queue_.push_back({ *descriptor, count });
+	if (!prealloc_thread_.joinable())
+		prealloc_thread_ = std::thread(&cros_gralloc_driver::preallocate_worker, this);
+
+	prealloc_cond_.notify_one();
+	return 0;
+}
+
+void cros_gralloc_driver::preallocate_worker()
+{
+	std::unique_lock<std::mutex> lock(prealloc_mutex_);
+	auto has_work = [&] { return prealloc_stop_ || !prealloc_queue_.empty(); };
+
+	for (;;) {
+		std::chrono::steady_clock::time_point expiry;
+
+		/* Also wake up to expire preallocations, in case nothing allocates any more. */
+		if (preallocated_.next_expiry(&expiry))
+			prealloc_cond_.wait_until(lock, expiry, has_work);
+		else
+			prealloc_cond_.wait(lock, has_work);
+		if (prealloc_stop_)
+			return;
+
+		if (prealloc_queue_.empty()) {
+			lock.unlock();
+			preallocated_.trim(prealloc_max_bytes_);
+			lock.lock();
+			continue;
+		}
+
+		struct preallocation request = std::move(prealloc_queue_.front());
+		prealloc_queue_.pop_front();
+		lock.unlock();
+
+		struct driver *drv;
+		uint32_t resolved_format;
+		uint64_t resolved_use_flags;
+		if (get_resolved_format_and_use_flags(&request.descriptor, &drv, &resolved_format,
+						      &resolved_use_flags)) {
+			const struct cros_gralloc_buffer_pool_key key = {
+				.drv = drv,
+				.width = request.descriptor.width,
+				.height = request.descriptor.height,
+				.format = resolved_format,
+				.use_flags = resolved_use_flags,
+				.reserved_region_size = request.descriptor.reserved_region_size,
+			};
+
+			/*
+			 * Repeated hints for the same buffer set only top it up. The count is
+			 * rechecked every time, since allocations may take from it meanwhile.
+			 */
+			for (uint32_t i = 0; i < request.count && !prealloc_stop_ &&
+					     preallocated_.num_parked(key) < request.count;
+			     i++) {
+				struct bo *bo;
+				struct cros_gralloc_handle *hnd;
+
+				if (create_bo_and_handle(drv, &request.descriptor,
+							 resolved_format, resolved_use_flags, &bo,
+							 &hnd)) {
+					ALOGE("Failed to preallocate buffer.");
+					break;
+				}
+
+				/* Once full, parking more would only push out the ones before. */
+				if (preallocated_.get_stats().num_bytes + hnd->total_size >
+				    prealloc_max_bytes_) {
+					destroy_bo_and_handle(bo, hnd);
+					break;
+				}
+
+				preallocated_.put(key, bo, hnd);
+			}
+		}
+
+		lock.lock();
+	}
+}
+
 int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	std::lock_guard<std::shared_timed_mutex> lock(mutex_);
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
@@ -382,7 +917,7 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 
 	uint32_t id = hnd->id;
 
-	cros_gralloc_buffer *buffer = nullptr;
+	std::shared_ptr<cros_gralloc_buffer> buffer;
 
 	auto buffer_it = buffers_.find(id);
 	if (buffer_it != buffers_.end()) {
@@ -390,8 +925,13 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 		// has already been imported into this process but the given handle has not
 		// yet been registered. Increase the buffer reference count (here) and start
 		// to track the handle (below).
-		buffer = buffer_it->second.get();
+		buffer = buffer_it->second;
+		buffer->increase_refcount();
+	} else if ((buffer = import_cache_.take(hnd))) {
+		// The underlying buffer was released recently and is still imported. Revive it
+		// with a fresh reference count and start to track the buffer again.
 		buffer->increase_refcount();
+		buffers_.emplace(id, buffer);
 	} else {
 		// The underlying buffer has not yet been imported into this process. Import
 		// and start to track the buffer (here) and start to track the handle (below).
@@ -406,18 +946,27 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 		memcpy(data.fds, hnd->fds, sizeof(data.fds));
 		memcpy(data.strides, hnd->strides, sizeof(data.strides));
 		memcpy(data.offsets, hnd->offsets, sizeof(data.offsets));
-
-		struct bo *bo = drv_bo_import(drv_.get(), &data);
+		memcpy(data.sizes, hnd->sizes, sizeof(data.sizes));
+
+		/*
+		 * Routed like the allocation was, so both sides of a buffer use one device. Handles
+		 * don't record that device, so if its layout is one the guessed device can't import,
+		 * try the other one.
+		 */
+		struct driver *drv = get_driver_for_import(hnd);
+		struct bo *bo = drv_bo_import(drv, &data);
+		if (!bo && scanout_drv_)
+			bo = drv_bo_import(drv == drv_.get() ? scanout_drv_.get() : drv_.get(),
+					   &data);
 		if (!bo)
 			return -EFAULT;
 
-		auto scoped_buffer = cros_gralloc_buffer::create(bo, hnd);
-		if (!scoped_buffer) {
+		buffer = cros_gralloc_buffer::create(bo, hnd);
+		if (!buffer) {
 			ALOGE("Failed to import: failed to create cros_gralloc_buffer.");
 			return -1;
 		}
-		buffer = scoped_buffer.get();
-		buffers_.emplace(id, std::move(scoped_buffer));
+		buffers_.emplace(id, buffer);
 	}
 
 	struct cros_gralloc_imported_handle_info hnd_info = {
@@ -430,59 +979,245 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 
 int32_t cros_gralloc_driver::release(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	std::shared_ptr<cros_gralloc_buffer> released;
+	cros_gralloc_handle_t hnd;
+
+	{
+		std::lock_guard<std::shared_timed_mutex> lock(mutex_);
+
+		hnd = cros_gralloc_convert_handle(handle);
+		if (!hnd) {
+			ALOGE("Invalid handle.");
+			return -EINVAL;
+		}
+
+		auto buffer = get_buffer_locked(hnd);
+		if (!buffer) {
+			ALOGE("Invalid reference (release() called on unregistered handle).");
+			return -EINVAL;
+		}
+
+		if (!--handles_[hnd].refcount)
+			handles_.erase(hnd);
+
+		if (buffer->decrease_refcount() == 0) {
+			buffers_.erase(buffer->get_id());
+			released = std::move(buffer);
+		}
+	}
+
+	/* Tear down (or park) the buffer without blocking lookups of unrelated buffers. */
+	if (released && !import_cache_.put(std::move(released), hnd))
+		recycle_buffer(std::move(released));
+
+	return 0;
+}
+
+void cros_gralloc_driver::recycle_buffer(std::shared_ptr<cros_gralloc_buffer> buffer)
+{
+	struct bo *bo;
+	struct cros_gralloc_handle *hnd;
+
+	/*
+	 * The buffer is no longer reachable through the tables, so it is only recycled if no
+	 * lock() or with_buffer() still holds a reference to it.
+	 */
+	if (!buffer->is_recyclable() || !buffer_pool_.enabled() || buffer.use_count() != 1)
+		return;
+
+	if (buffer->detach(&bo, &hnd))
+		return;
+
+	const struct cros_gralloc_buffer_pool_key key = {
+		.drv = drv_bo_get_driver(bo),
+		.width = hnd->width,
+		.height = hnd->height,
+		.format = hnd->format,
+		.use_flags = hnd->use_flags,
+		.reserved_region_size = hnd->reserved_region_size,
+	};
+	buffer_pool_.put(key, bo, hnd);
+}
+
+void cros_gralloc_driver::trim_buffer_pool(uint64_t target_bytes)
+{
+	buffer_pool_.trim(target_bytes);
+}
+
+void cros_gralloc_driver::trim_memory()
+{
+	buffer_pool_.trim(0);
+	preallocated_.trim(0);
+	import_cache_.clear();
+}
+
+struct cros_gralloc_buffer_pool_stats cros_gralloc_driver::get_buffer_pool_stats()
+{
+	return buffer_pool_.get_stats();
+}
+
+static void append_drv_stats(struct driver *drv, std::string &dump)
+{
+	size_t len = drv_stats_dump(drv, nullptr, 0);
+	std::string stats(len, '\0');
+
+	/* std::string keeps room for the terminator past size(). */
+	drv_stats_dump(drv, &stats[0], len + 1);
+	dump += stats;
+}
+
+std::string cros_gralloc_driver::dump_stats()
+{
+	std::string dump;
+	char line[256];
+
+	append_drv_stats(drv_.get(), dump);
+	if (scanout_drv_)
+		append_drv_stats(scanout_drv_.get(), dump);
+
+	if (buffer_pool_.enabled()) {
+		struct cros_gralloc_buffer_pool_stats stats = buffer_pool_.get_stats();
+		snprintf(line, sizeof(line),
+			 "recycle pool: hits=%" PRIu64 " misses=%" PRIu64 " evictions=%" PRIu64
+			 " buffers=%" PRIu64 " bytes=%" PRIu64 "\n",
+			 stats.hits, stats.misses, stats.evictions, stats.num_buffers,
+			 stats.num_bytes);
+		dump += line;
+	}
+
+	uint32_t num_mismatched = 0;
+	with_each_buffer([&](cros_gralloc_buffer *buffer) {
+		std::string advice = buffer->get_access_advice();
+		if (advice.empty())
+			return;
+
+		snprintf(line, sizeof(line), "buffer %u %ux%u usage=0x%" PRIx64 ": ",
+			 buffer->get_id(), buffer->get_width(), buffer->get_height(),
+			 buffer->get_android_usage());
+		dump += line;
+		dump += advice;
+		dump += "\n";
+		num_mismatched++;
+	});
+
+	if (num_mismatched) {
+		snprintf(line, sizeof(line),
+			 "%u buffers are locked differently than their usage declares\n",
+			 num_mismatched);
+		dump += line;
+	}
+
+	return dump;
+}
+
+void cros_gralloc_driver::log_stats()
+{
+	std::string dump = dump_stats();
+	size_t start = 0;
+
+	while (start < dump.size()) {
+		size_t end = dump.find('\n', start);
+		if (end == std::string::npos)
+			end = dump.size();
+
+		ALOGI("%s", dump.substr(start, end - start).c_str());
+		start = end + 1;
+	}
+}
 
+int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
+				  bool close_acquire_fence, const struct rectangle *rect,
+				  uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES])
+{
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
+		if (close_acquire_fence && acquire_fence >= 0)
+			close(acquire_fence);
 		return -EINVAL;
 	}
 
 	auto buffer = get_buffer(hnd);
 	if (!buffer) {
-		ALOGE("Invalid reference (release() called on unregistered handle).");
+		ALOGE("Invalid reference (lock() called on unregistered handle).");
+		if (close_acquire_fence && acquire_fence >= 0)
+			close(acquire_fence);
 		return -EINVAL;
 	}
 
-	if (!--handles_[hnd].refcount)
-		handles_.erase(hnd);
-
-	if (buffer->decrease_refcount() == 0) {
-		buffers_.erase(buffer->get_id());
-	}
+	/*
+	 * No driver lock is held while waiting on the fence: the buffer reference keeps the buffer
+	 * alive even if it is released meanwhile.
+	 */
+	int32_t ret = wait_acquire_fence(acquire_fence, close_acquire_fence);
+	if (ret)
+		return ret;
 
-	return 0;
+	return buffer->lock(rect, map_flags, addr);
 }
 
-int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
-				  bool close_acquire_fence, const struct rectangle *rect,
-				  uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES])
+int32_t cros_gralloc_driver::wait_acquire_fence(int32_t acquire_fence, bool close_acquire_fence)
 {
+	struct drv_stat_scope scope;
+
+	if (acquire_fence < 0)
+		return 0;
+
+	drv_stat_begin(drv_.get(), DRV_STAT_FENCE_WAIT, &scope);
 	int32_t ret = cros_gralloc_sync_wait(acquire_fence, close_acquire_fence);
-	if (ret)
-		return ret;
+	drv_stat_end(drv_.get(), DRV_STAT_FENCE_WAIT, &scope);
 
-	std::lock_guard<std::mutex> lock(mutex_);
+	return ret;
+}
 
+static std::future<int32_t> make_ready_future(int32_t ret)
+{
+	std::promise<int32_t> promise;
+	promise.set_value(ret);
+	return promise.get_future();
+}
+
+std::future<int32_t> cros_gralloc_driver::lock_async(buffer_handle_t handle,
+						     int32_t acquire_fence,
+						     bool close_acquire_fence,
+						     const struct rectangle *rect,
+						     uint32_t map_flags,
+						     uint8_t *addr[DRV_MAX_PLANES])
+{
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
-		return -EINVAL;
+		if (close_acquire_fence && acquire_fence >= 0)
+			close(acquire_fence);
+		return make_ready_future(-EINVAL);
 	}
 
 	auto buffer = get_buffer(hnd);
 	if (!buffer) {
-		ALOGE("Invalid reference (lock() called on unregistered handle).");
-		return -EINVAL;
+		ALOGE("Invalid reference (lock_async() called on unregistered handle).");
+		if (close_acquire_fence && acquire_fence >= 0)
+			close(acquire_fence);
+		return make_ready_future(-EINVAL);
 	}
 
-	return buffer->lock(rect, map_flags, addr);
+	struct rectangle region = *rect;
+	auto lock_buffer = [this, buffer, acquire_fence, close_acquire_fence, region, map_flags,
+			    addr]() {
+		int32_t ret = wait_acquire_fence(acquire_fence, close_acquire_fence);
+		if (ret)
+			return ret;
+
+		return buffer->lock(&region, map_flags, addr);
+	};
+
+	if (acquire_fence < 0)
+		return make_ready_future(lock_buffer());
+
+	return std::async(std::launch::async, lock_buffer);
 }
 
 int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fence)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -500,15 +1235,15 @@ int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fen
 	 *
 	 * "A value of -1 indicates that the caller may access the buffer immediately without
 	 * waiting on a fence."
+	 *
+	 * Backends that can't hand out a fence for the flush wait for it instead.
 	 */
 	*release_fence = -1;
-	return buffer->unlock();
+	return buffer->unlock(release_fence);
 }
 
 int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -526,8 +1261,6 @@ int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
 
 int32_t cros_gralloc_driver::flush(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -543,10 +1276,45 @@ int32_t cros_gralloc_driver::flush(buffer_handle_t handle)
 	return buffer->flush();
 }
 
-int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t *out_store)
+int32_t cros_gralloc_driver::mark_dirty(buffer_handle_t handle, const struct rectangle *rect)
+{
+	auto hnd = cros_gralloc_convert_handle(handle);
+	if (!hnd) {
+		ALOGE("Invalid handle.");
+		return -EINVAL;
+	}
+
+	auto buffer = get_buffer(hnd);
+	if (!buffer) {
+		ALOGE("Invalid reference (mark_dirty() called on unregistered handle).");
+		return -EINVAL;
+	}
+
+	return buffer->mark_dirty(rect);
+}
+
+int32_t cros_gralloc_driver::copy(buffer_handle_t dst, buffer_handle_t src,
+				  const struct rectangle *rect)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	auto dst_hnd = cros_gralloc_convert_handle(dst);
+	auto src_hnd = cros_gralloc_convert_handle(src);
+	if (!dst_hnd || !src_hnd) {
+		ALOGE("Invalid handle.");
+		return -EINVAL;
+	}
 
+	auto dst_buffer = get_buffer(dst_hnd);
+	auto src_buffer = get_buffer(src_hnd);
+	if (!dst_buffer || !src_buffer) {
+		ALOGE("Invalid reference (copy() called on unregistered handle).");
+		return -EINVAL;
+	}
+
+	return dst_buffer->copy_from(src_buffer.get(), rect);
+}
+
+int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t *out_store)
+{
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -567,14 +1335,22 @@ int32_t cros_gralloc_driver::resource_info(buffer_handle_t handle, uint32_t stri
 					   uint32_t offsets[DRV_MAX_PLANES],
 					   uint64_t *format_modifier)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
 		return -EINVAL;
 	}
 
+	/* The handle carries the whole layout; skip the lookup under |mutex_|. */
+	if (static_resource_info_) {
+		for (uint32_t plane = 0; plane < hnd->num_planes; plane++) {
+			strides[plane] = hnd->strides[plane];
+			offsets[plane] = hnd->offsets[plane];
+		}
+		*format_modifier = hnd->format_modifier;
+		return 0;
+	}
+
 	auto buffer = get_buffer(hnd);
 	if (!buffer) {
 		ALOGE("Invalid reference (resource_info() called on unregistered handle).");
@@ -588,8 +1364,6 @@ int32_t cros_gralloc_driver::get_reserved_region(buffer_handle_t handle,
 						 void **reserved_region_addr,
 						 uint64_t *reserved_region_size)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -607,20 +1381,34 @@ int32_t cros_gralloc_driver::get_reserved_region(buffer_handle_t handle,
 
 uint32_t cros_gralloc_driver::get_resolved_drm_format(uint32_t drm_format, uint64_t use_flags)
 {
+	struct driver *drv = get_driver_for(use_flags);
 	uint32_t resolved_format;
 	uint64_t resolved_use_flags;
 
-	drv_resolve_format_and_use_flags(drv_.get(), drm_format, use_flags, &resolved_format,
+	/* Allocations the display device can't serve fall back to the render device. */
+	drv_resolve_format_and_use_flags(drv, drm_format, use_flags, &resolved_format,
 					 &resolved_use_flags);
+	if (drv != drv_.get() && !drv_get_combination(drv, resolved_format, resolved_use_flags))
+		drv_resolve_format_and_use_flags(drv_.get(), drm_format, use_flags,
+						 &resolved_format, &resolved_use_flags);
 
 	return resolved_format;
 }
 
-cros_gralloc_buffer *cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
+std::shared_ptr<cros_gralloc_buffer> cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
+{
+	std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+
+	return get_buffer_locked(hnd);
+}
+
+std::shared_ptr<cros_gralloc_buffer>
+cros_gralloc_driver::get_buffer_locked(cros_gralloc_handle_t hnd)
 {
 	/* Assumes driver mutex is held. */
-	if (handles_.count(hnd))
-		return handles_[hnd].buffer;
+	auto hnd_it = handles_.find(hnd);
+	if (hnd_it != handles_.end())
+		return hnd_it->second.buffer;
 
 	return nullptr;
 }
@@ -628,22 +1416,28 @@ cros_gralloc_buffer *cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
 void cros_gralloc_driver::with_buffer(cros_gralloc_handle_t hnd,
 				      const std::function<void(cros_gralloc_buffer *)> &function)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto buffer = get_buffer(hnd);
 	if (!buffer) {
 		ALOGE("Invalid reference (with_buffer() called on unregistered handle).");
 		return;
 	}
 
-	function(buffer);
+	function(buffer.get());
 }
 
 void cros_gralloc_driver::with_each_buffer(
     const std::function<void(cros_gralloc_buffer *)> &function)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	std::vector<std::shared_ptr<cros_gralloc_buffer>> snapshot;
+
+	{
+		std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+
+		snapshot.reserve(buffers_.size());
+		for (const auto &pair : buffers_)
+			snapshot.push_back(pair.second);
+	}
 
-	for (const auto &pair : buffers_)
-		function(pair.second.get());
+	for (const auto &buffer : snapshot)
+		function(buffer.get());
 }
@@ -8,12 +8,21 @@
 #define CROS_GRALLOC_DRIVER_H
 
 #include "cros_gralloc_buffer.h"
+#include "cros_gralloc_buffer_pool.h"
+#include "cros_gralloc_import_cache.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <future>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #if ANDROID_API_LEVEL >= 31 && defined(HAS_DMABUF_SYSTEM_HEAP)
 #include <BufferAllocator/BufferAllocator.h>
@@ -22,10 +31,29 @@
 class cros_gralloc_driver
 {
       public:
-	static cros_gralloc_driver *get_instance();
+	/*
+	 * The first call creates the driver. Passing |mapper_only| lets the backend skip
+	 * allocation-side setup that only allocating processes benefit from.
+	 */
+	static cros_gralloc_driver *get_instance(bool mapper_only = false);
 	bool is_supported(const struct cros_gralloc_buffer_descriptor *descriptor);
 	int32_t allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
 			 native_handle_t **out_handle);
+	/*
+	 * Allocates |count| buffers for |descriptor| into |out_handles|, resolving the descriptor
+	 * once and registering every buffer under a single lock acquisition. With |parallel|, the
+	 * backend allocations run concurrently. Either all buffers are allocated or none are.
+	 */
+	int32_t allocate_batch(const struct cros_gralloc_buffer_descriptor *descriptor,
+			       uint32_t count, bool parallel, native_handle_t **out_handles);
+
+	/*
+	 * Hints that |count| buffers like |descriptor| are about to be allocated. A worker thread
+	 * creates the ones not already waiting, for allocate() to hand out without calling into
+	 * the backend. Returns -ENOTSUP unless vendor.minigbm.prealloc.max_kb is set.
+	 */
+	int32_t preallocate(const struct cros_gralloc_buffer_descriptor *descriptor,
+			    uint32_t count);
 
 	int32_t retain(buffer_handle_t handle);
 	int32_t release(buffer_handle_t handle);
@@ -33,10 +61,23 @@ class cros_gralloc_driver
 	int32_t lock(buffer_handle_t handle, int32_t acquire_fence, bool close_acquire_fence,
 		     const struct rectangle *rect, uint32_t map_flags,
 		     uint8_t *addr[DRV_MAX_PLANES]);
+	/*
+	 * Like lock(), but returns as soon as the handle is validated. Waiting on |acquire_fence|
+	 * and mapping happen on a worker thread; |addr| (and |acquire_fence|, unless ownership is
+	 * passed with |close_acquire_fence|) must stay valid until the returned future is ready.
+	 * Without a fence to wait on, the lock completes before this returns.
+	 */
+	std::future<int32_t> lock_async(buffer_handle_t handle, int32_t acquire_fence,
+					bool close_acquire_fence, const struct rectangle *rect,
+					uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES]);
 	int32_t unlock(buffer_handle_t handle, int32_t *release_fence);
 
 	int32_t invalidate(buffer_handle_t handle);
 	int32_t flush(buffer_handle_t handle);
+	/* Narrows what the next flush or unlock of a locked buffer writes back. */
+	int32_t mark_dirty(buffer_handle_t handle, const struct rectangle *rect);
+	/* Copies |rect| of |src| into |dst| without mapping either, where the backend can. */
+	int32_t copy(buffer_handle_t dst, buffer_handle_t src, const struct rectangle *rect);
 
 	int32_t get_backing_store(buffer_handle_t handle, uint64_t *out_store);
 	int32_t resource_info(buffer_handle_t handle, uint32_t strides[DRV_MAX_PLANES],
@@ -49,41 +90,167 @@ class cros_gralloc_driver
 
 	void with_buffer(cros_gralloc_handle_t hnd,
 			 const std::function<void(cros_gralloc_buffer *)> &function);
+	/*
+	 * Calls |function| on a snapshot of the registered buffers, outside of |mutex_|, so that
+	 * slow visitors (dumps) don't hold up imports and releases. A buffer released meanwhile
+	 * stays alive until the walk is done.
+	 */
 	void with_each_buffer(const std::function<void(cros_gralloc_buffer *)> &function);
 
+	/* Destroys recycled buffers until the pool holds at most |target_bytes|. */
+	void trim_buffer_pool(uint64_t target_bytes);
+	/*
+	 * Gives back everything kept around for reuse: recycled, preallocated and cached imported
+	 * buffers. Called on memory pressure, by callers handling onTrimMemory() through
+	 * GRALLOC_DRM_TRIM_MEMORY and by the PSI monitor vendor.minigbm.psi_trigger configures.
+	 */
+	void trim_memory();
+	struct cros_gralloc_buffer_pool_stats get_buffer_pool_stats();
+
+	/*
+	 * Logs the drv_stats_enable() counters, the recycle pool stats and, with
+	 * vendor.minigbm.access_stats set, buffers locked differently than their usage declares.
+	 */
+	void log_stats();
+	/* Returns what log_stats() logs, one line per entry, for the mapper's dumpBuffers(). */
+	std::string dump_stats();
+
       private:
-	cros_gralloc_driver();
+	explicit cros_gralloc_driver(bool mapper_only);
 	~cros_gralloc_driver();
 	bool is_initialized();
-	cros_gralloc_buffer *get_buffer(cros_gralloc_handle_t hnd);
+	int32_t wait_acquire_fence(int32_t acquire_fence, bool close_acquire_fence);
+	std::shared_ptr<cros_gralloc_buffer> get_buffer(cros_gralloc_handle_t hnd);
+	std::shared_ptr<cros_gralloc_buffer> get_buffer_locked(cros_gralloc_handle_t hnd);
+	/* The device allocations and imports with |use_flags| go to. */
+	struct driver *get_driver_for(uint64_t use_flags);
+	/* The device that most likely allocated |hnd|. */
+	struct driver *get_driver_for_import(cros_gralloc_handle_t hnd);
+	/* Also returns the device that can allocate |descriptor| in |out_drv|. */
 	bool
 	get_resolved_format_and_use_flags(const struct cros_gralloc_buffer_descriptor *descriptor,
-					  uint32_t *out_format, uint64_t *out_use_flags);
+					  struct driver **out_drv, uint32_t *out_format,
+					  uint64_t *out_use_flags);
+	bool resolve_on_driver(struct driver *drv,
+			       const struct cros_gralloc_buffer_descriptor *descriptor,
+			       uint32_t *out_format, uint64_t *out_use_flags);
 
-	int create_reserved_region(const std::string &buffer_name, uint64_t reserved_region_size);
+	int create_reserved_region(const std::string &buffer_name, uint64_t reserved_region_size,
+				   uint64_t *out_offset);
+	int alloc_reserved_region_from_slab(uint64_t reserved_region_size, uint64_t *out_offset);
+	int32_t create_bo_and_handle(struct driver *drv,
+				     const struct cros_gralloc_buffer_descriptor *descriptor,
+				     uint32_t resolved_format, uint64_t resolved_use_flags,
+				     struct bo **out_bo, struct cros_gralloc_handle **out_hnd);
+	void recycle_buffer(std::shared_ptr<cros_gralloc_buffer> buffer);
+	void preallocate_worker();
 
 #if ANDROID_API_LEVEL >= 31 && defined(HAS_DMABUF_SYSTEM_HEAP)
 	/* For allocating cros_gralloc_buffer reserved regions for metadata. */
 	BufferAllocator allocator_;
 #endif
 
+	/* The slab reserved regions are currently carved from; see create_reserved_region(). */
+	std::mutex reserved_slab_mutex_;
+	uint64_t reserved_slab_size_ = 0;
+	uint64_t reserved_slab_used_ = 0;
+	int reserved_slab_fd_ = -1;
+
+	/* The render device, and the display device if vendor.minigbm.scanout_device names one. */
 	std::unique_ptr<struct driver, void (*)(struct driver *)> drv_;
+	std::unique_ptr<struct driver, void (*)(struct driver *)> scanout_drv_;
 
 	struct cros_gralloc_imported_handle_info {
 		/*
 		 * The underlying buffer for referred to by this handle (as multiple handles can
 		 * refer to the same buffer).
 		 */
-		cros_gralloc_buffer *buffer = nullptr;
+		std::shared_ptr<cros_gralloc_buffer> buffer;
 
 		/* The handle's refcount as a handle can be imported multiple times.*/
 		int32_t refcount = 1;
 	};
 
-	std::mutex mutex_;
-	std::unordered_map<uint32_t, std::unique_ptr<cros_gralloc_buffer>> buffers_;
+	/*
+	 * Guards |buffers_| and |handles_| only. Lookups take it shared and hold a reference to
+	 * the buffer once it is dropped, so per-buffer operations (which serialize on the buffer's
+	 * own lock) never block on unrelated buffers.
+	 */
+	std::shared_timed_mutex mutex_;
+	std::unordered_map<uint32_t, std::shared_ptr<cros_gralloc_buffer>> buffers_;
 	std::unordered_map<cros_gralloc_handle_t, cros_gralloc_imported_handle_info> handles_;
+	/* The descriptor fields is_supported() depends on. */
+	struct supported_key {
+		uint32_t width;
+		uint32_t height;
+		int32_t droid_format;
+		int32_t droid_usage;
+		uint32_t drm_format;
+		uint64_t use_flags;
+
+		bool operator==(const supported_key &other) const
+		{
+			return width == other.width && height == other.height &&
+			       droid_format == other.droid_format &&
+			       droid_usage == other.droid_usage && drm_format == other.drm_format &&
+			       use_flags == other.use_flags;
+		}
+	};
+
+	struct supported_key_hash {
+		size_t operator()(const supported_key &key) const
+		{
+			uint64_t h = key.use_flags;
+			h = h * 31 + key.drm_format;
+			h = h * 31 + static_cast<uint32_t>(key.droid_format);
+			h = h * 31 + static_cast<uint32_t>(key.droid_usage);
+			h = h * 31 + key.width;
+			h = h * 31 + key.height;
+			return std::hash<uint64_t>()(h);
+		}
+	};
+
+	bool is_supported_uncached(const struct cros_gralloc_buffer_descriptor *descriptor);
+
+	/*
+	 * is_supported() results. Nothing they depend on changes while |drv_| lives, so entries
+	 * are never invalidated; once full, new descriptors just aren't remembered.
+	 */
+	std::mutex supported_mutex_;
+	std::unordered_map<supported_key, bool, supported_key_hash> supported_;
+
 	bool mt8183_camera_quirk_ = false;
+	/* drv_has_static_resource_info(): resource_info() is answered from the handle alone. */
+	bool static_resource_info_ = false;
+
+	struct preallocation {
+		struct cros_gralloc_buffer_descriptor descriptor;
+		uint32_t count;
+	};
+
+	/* Requests for preallocate_worker(), which is started by the first of them. */
+	std::mutex prealloc_mutex_;
+	std::condition_variable prealloc_cond_;
+	std::deque<struct preallocation> prealloc_queue_;
+	std::atomic<bool> prealloc_stop_{ false };
+	std::thread prealloc_thread_;
+	uint64_t prealloc_max_bytes_ = 0;
+
+	/* Waits for PSI memory pressure events and calls trim_memory() on each. */
+	void pressure_worker();
+	int pressure_fd_ = -1;
+	/* Written by the destructor to stop pressure_worker(). */
+	int pressure_stop_fd_ = -1;
+	std::thread pressure_thread_;
+
+	/* Declared after |drv_| so parked bos are destroyed before the driver. */
+	cros_gralloc_buffer_pool buffer_pool_;
+	/*
+	 * Buffers preallocate_worker() created. None were ever handed out, so unlike
+	 * |buffer_pool_| this is safe in allocator services.
+	 */
+	cros_gralloc_buffer_pool preallocated_;
+	cros_gralloc_import_cache import_cache_;
 };
 
 #endif
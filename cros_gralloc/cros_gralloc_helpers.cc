@@ -150,6 +150,9 @@ uint32_t cros_gralloc_convert_map_usage(uint64_t usage)
 		map_flags |= BO_MAP_READ;
 	if (usage & GRALLOC_USAGE_SW_WRITE_MASK)
 		map_flags |= BO_MAP_WRITE;
+	/* Frequent writers are usually streaming whole frames through the locked region. */
+	if ((usage & GRALLOC_USAGE_SW_WRITE_MASK) == GRALLOC_USAGE_SW_WRITE_OFTEN)
+		map_flags |= BO_MAP_PREFAULT;
 
 	return map_flags;
 }
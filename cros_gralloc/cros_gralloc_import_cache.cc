@@ -0,0 +1,129 @@
+/*
+ * Copyright 2022 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "cros_gralloc_import_cache.h"
+
+#include <sys/stat.h>
+
+cros_gralloc_import_cache::~cros_gralloc_import_cache()
+{
+	clear();
+}
+
+void cros_gralloc_import_cache::configure(std::chrono::milliseconds ttl, uint32_t max_buffers)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		ttl_ = ttl;
+		max_buffers_ = max_buffers;
+	}
+
+	if (ttl.count() <= 0 || !max_buffers)
+		clear();
+}
+
+void cros_gralloc_import_cache::collect_locked(clock::time_point now, std::vector<entry> &out)
+{
+	while (!entries_.empty() &&
+	       (entries_.front().expiry <= now || entries_.size() > max_buffers_)) {
+		index_.erase(entries_.front().id);
+		out.push_back(std::move(entries_.front()));
+		entries_.pop_front();
+	}
+}
+
+bool cros_gralloc_import_cache::put(std::shared_ptr<cros_gralloc_buffer> &&buffer,
+				    const struct cros_gralloc_handle *hnd)
+{
+	std::vector<entry> evicted;
+	const clock::time_point now = clock::now();
+	struct stat sb;
+
+	/* Buffers allocated by this process go to the recycle pool instead. */
+	if (buffer->is_recyclable() || buffer.use_count() != 1 || hnd->num_planes == 0)
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (ttl_.count() <= 0 || !max_buffers_)
+			return false;
+	}
+
+	if (fstat(hnd->fds[0], &sb))
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = index_.find(buffer->get_id());
+		if (it != index_.end()) {
+			/* An older buffer with the same id, from another allocator. */
+			evicted.push_back(std::move(*it->second));
+			entries_.erase(it->second);
+			index_.erase(it);
+		}
+
+		entries_.push_back({ buffer->get_id(), sb.st_dev, sb.st_ino, now + ttl_,
+				     std::move(buffer) });
+		index_[entries_.back().id] = std::prev(entries_.end());
+		collect_locked(now, evicted);
+	}
+
+	/* Destroying the bos can take a while, so keep it out of the cache lock. */
+	evicted.clear();
+	return true;
+}
+
+std::shared_ptr<cros_gralloc_buffer>
+cros_gralloc_import_cache::take(const struct cros_gralloc_handle *hnd)
+{
+	std::vector<entry> expired;
+	std::shared_ptr<cros_gralloc_buffer> buffer;
+	dev_t dev;
+	ino_t ino;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		collect_locked(clock::now(), expired);
+
+		auto it = index_.find(hnd->id);
+		if (it == index_.end())
+			return nullptr;
+
+		dev = it->second->dev;
+		ino = it->second->ino;
+	}
+
+	struct stat sb;
+	bool same = hnd->num_planes && !fstat(hnd->fds[0], &sb) && sb.st_dev == dev &&
+		    sb.st_ino == ino;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = index_.find(hnd->id);
+		if (it != index_.end()) {
+			if (same && it->second->dev == dev && it->second->ino == ino)
+				buffer = std::move(it->second->buffer);
+			else
+				expired.push_back(std::move(*it->second));
+
+			entries_.erase(it->second);
+			index_.erase(it);
+		}
+	}
+
+	return buffer;
+}
+
+void cros_gralloc_import_cache::clear()
+{
+	std::list<entry> cleared;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		cleared.swap(entries_);
+		index_.clear();
+	}
+}
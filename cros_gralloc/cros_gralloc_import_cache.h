@@ -0,0 +1,75 @@
+/*
+ * Copyright 2022 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef CROS_GRALLOC_IMPORT_CACHE_H
+#define CROS_GRALLOC_IMPORT_CACHE_H
+
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+#include "cros_gralloc_buffer.h"
+
+/*
+ * Keeps imported buffers alive for a grace period after their last release, so that importing
+ * the same buffer again (BufferQueue consumers and composers re-importing every frame) finds the
+ * existing bo instead of turning the fds back into GEM handles.
+ *
+ * Buffer ids are only unique within the allocator that assigned them, so a hit also requires
+ * the first fd of the new handle to refer to the same dma-buf as the cached one.
+ */
+class cros_gralloc_import_cache
+{
+      public:
+	cros_gralloc_import_cache() = default;
+	~cros_gralloc_import_cache();
+
+	/* A |ttl| of zero disables the cache. */
+	void configure(std::chrono::milliseconds ttl, uint32_t max_buffers);
+
+	/*
+	 * Takes the last reference to |buffer|, which |hnd| was just released from. Returns false,
+	 * leaving |buffer| untouched, if the cache didn't keep it.
+	 */
+	bool put(std::shared_ptr<cros_gralloc_buffer> &&buffer,
+		 const struct cros_gralloc_handle *hnd);
+
+	/* Returns the cached buffer that |hnd| refers to, if any, and removes it from the cache. */
+	std::shared_ptr<cros_gralloc_buffer> take(const struct cros_gralloc_handle *hnd);
+
+	/* Drops every cached buffer. */
+	void clear();
+
+      private:
+	using clock = std::chrono::steady_clock;
+
+	struct entry {
+		uint32_t id;
+		dev_t dev;
+		ino_t ino;
+		clock::time_point expiry;
+		std::shared_ptr<cros_gralloc_buffer> buffer;
+	};
+
+	/* Moves expired entries, and the oldest ones beyond |max_buffers_|, to |out|. */
+	void collect_locked(clock::time_point now, std::vector<entry> &out);
+
+	cros_gralloc_import_cache(cros_gralloc_import_cache const &);
+	cros_gralloc_import_cache operator=(cros_gralloc_import_cache const &);
+
+	std::mutex mutex_;
+	std::chrono::milliseconds ttl_{ 0 };
+	uint32_t max_buffers_ = 0;
+	/* Oldest first; |index_| maps buffer ids into it. */
+	std::list<entry> entries_;
+	std::unordered_map<uint32_t, std::list<entry>::iterator> index_;
+};
+
+#endif
@@ -29,6 +29,16 @@ struct cros_gralloc0_buffer_info {
 	uint32_t stride[4];
 };
 
+/* Filled by GRALLOC_DRM_GET_BUFFER_INFO_ALL. */
+struct cros_gralloc0_buffer_info_all {
+	struct cros_gralloc0_buffer_info info;
+	uint32_t width;
+	uint32_t height;
+	uint32_t pixel_stride;
+	int32_t droid_format;
+	int32_t usage;
+};
+
 /* This enumeration must match the one in <gralloc_drm.h>.
  * The functions supported by this gralloc's temporary private API are listed
  * below. Use of these functions is highly discouraged and should only be
@@ -43,6 +53,14 @@ enum {
 	GRALLOC_DRM_GET_BACKING_STORE,
 	GRALLOC_DRM_GET_BUFFER_INFO,
 	GRALLOC_DRM_GET_USAGE,
+	/* minigbm only: hints which region of a locked buffer was written. */
+	GRALLOC_DRM_MARK_DIRTY,
+	/* minigbm only: GET_BUFFER_INFO, GET_DIMENSIONS, GET_FORMAT and GET_STRIDE in one call. */
+	GRALLOC_DRM_GET_BUFFER_INFO_ALL,
+	/* minigbm only: hints that buffers of the given alloc() arguments are about to be needed. */
+	GRALLOC_DRM_PREALLOCATE,
+	/* minigbm only: gives back buffers kept for reuse, e.g. from onTrimMemory(). */
+	GRALLOC_DRM_TRIM_MEMORY,
 };
 
 /* This enumeration corresponds to the GRALLOC_DRM_GET_USAGE query op, which
@@ -211,6 +229,45 @@ static int gralloc0_unlock(struct gralloc_module_t const *module, buffer_handle_
 	return 0;
 }
 
+static int gralloc0_get_buffer_info(struct gralloc0_module *mod, buffer_handle_t handle,
+				   cros_gralloc_handle_t hnd,
+				   struct cros_gralloc0_buffer_info *info,
+				   uint32_t *out_pixel_stride)
+{
+	uint32_t strides[DRV_MAX_PLANES] = { 0, 0, 0, 0 };
+	uint32_t offsets[DRV_MAX_PLANES] = { 0, 0, 0, 0 };
+	uint64_t format_modifier = 0;
+	int32_t ret;
+
+	memset(info, 0, sizeof(*info));
+	info->drm_fourcc = drv_get_standard_fourcc(hnd->format);
+	info->num_fds = hnd->num_planes;
+	for (int i = 0; i < info->num_fds; i++)
+		info->fds[i] = hnd->fds[i];
+
+	ret = mod->driver->resource_info(handle, strides, offsets, &format_modifier);
+	if (ret)
+		return ret;
+
+	info->modifier = format_modifier ? format_modifier : hnd->format_modifier;
+	for (uint32_t i = 0; i < DRV_MAX_PLANES; i++) {
+		if (!strides[i])
+			break;
+
+		info->stride[i] = strides[i];
+		info->offset[i] = offsets[i];
+	}
+
+	if (strides[0] != hnd->strides[0]) {
+		uint32_t bytes_per_pixel = drv_bytes_per_pixel_from_format(hnd->format, 0);
+		*out_pixel_stride = DIV_ROUND_UP(strides[0], bytes_per_pixel);
+	} else {
+		*out_pixel_stride = hnd->pixel_stride;
+	}
+
+	return 0;
+}
+
 static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 {
 	va_list args;
@@ -219,15 +276,16 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 	buffer_handle_t handle;
 	cros_gralloc_handle_t hnd;
 	uint32_t *out_width, *out_height, *out_stride;
-	uint32_t strides[DRV_MAX_PLANES] = { 0, 0, 0, 0 };
-	uint32_t offsets[DRV_MAX_PLANES] = { 0, 0, 0, 0 };
-	uint64_t format_modifier = 0;
 	struct cros_gralloc0_buffer_info *info;
+	struct cros_gralloc0_buffer_info_all *info_all;
+	struct cros_gralloc0_buffer_info scratch;
+	uint32_t pixel_stride;
 	auto const_module = reinterpret_cast<const struct gralloc0_module *>(module);
 	auto mod = const_cast<struct gralloc0_module *>(const_module);
 	uint32_t req_usage;
 	uint32_t gralloc_usage = 0;
 	uint32_t *out_gralloc_usage;
+	struct rectangle rect;
 
 	if (!mod->initialized) {
 		if (gralloc0_init(mod, true))
@@ -242,6 +300,8 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 	case GRALLOC_DRM_GET_DIMENSIONS:
 	case GRALLOC_DRM_GET_BACKING_STORE:
 	case GRALLOC_DRM_GET_BUFFER_INFO:
+	case GRALLOC_DRM_MARK_DIRTY:
+	case GRALLOC_DRM_GET_BUFFER_INFO_ALL:
 		/* retrieve handles for ops with buffer_handle_t */
 		handle = va_arg(args, buffer_handle_t);
 		hnd = cros_gralloc_convert_handle(handle);
@@ -252,6 +312,8 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 		}
 		break;
 	case GRALLOC_DRM_GET_USAGE:
+	case GRALLOC_DRM_PREALLOCATE:
+	case GRALLOC_DRM_TRIM_MEMORY:
 		break;
 	default:
 		va_end(args);
@@ -262,17 +324,7 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 	switch (op) {
 	case GRALLOC_DRM_GET_STRIDE:
 		out_stride = va_arg(args, uint32_t *);
-		ret = mod->driver->resource_info(handle, strides, offsets, &format_modifier);
-		if (ret)
-			break;
-
-		if (strides[0] != hnd->strides[0]) {
-			uint32_t bytes_per_pixel = drv_bytes_per_pixel_from_format(hnd->format, 0);
-			*out_stride = DIV_ROUND_UP(strides[0], bytes_per_pixel);
-		} else {
-			*out_stride = hnd->pixel_stride;
-		}
-
+		ret = gralloc0_get_buffer_info(mod, handle, hnd, &scratch, out_stride);
 		break;
 	case GRALLOC_DRM_GET_FORMAT:
 		out_format = va_arg(args, int32_t *);
@@ -290,24 +342,19 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 		break;
 	case GRALLOC_DRM_GET_BUFFER_INFO:
 		info = va_arg(args, struct cros_gralloc0_buffer_info *);
-		memset(info, 0, sizeof(*info));
-		info->drm_fourcc = drv_get_standard_fourcc(hnd->format);
-		info->num_fds = hnd->num_planes;
-		for (int i = 0; i < info->num_fds; i++)
-			info->fds[i] = hnd->fds[i];
-
-		ret = mod->driver->resource_info(handle, strides, offsets, &format_modifier);
+		ret = gralloc0_get_buffer_info(mod, handle, hnd, info, &pixel_stride);
+		break;
+	case GRALLOC_DRM_GET_BUFFER_INFO_ALL:
+		info_all = va_arg(args, struct cros_gralloc0_buffer_info_all *);
+		ret = gralloc0_get_buffer_info(mod, handle, hnd, &info_all->info,
+					       &info_all->pixel_stride);
 		if (ret)
 			break;
 
-		info->modifier = format_modifier ? format_modifier : hnd->format_modifier;
-		for (uint32_t i = 0; i < DRV_MAX_PLANES; i++) {
-			if (!strides[i])
-				break;
-
-			info->stride[i] = strides[i];
-			info->offset[i] = offsets[i];
-		}
+		info_all->width = hnd->width;
+		info_all->height = hnd->height;
+		info_all->droid_format = hnd->droid_format;
+		info_all->usage = hnd->usage;
 		break;
 	case GRALLOC_DRM_GET_USAGE:
 		req_usage = va_arg(args, uint32_t);
@@ -316,6 +363,30 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 			gralloc_usage |= BUFFER_USAGE_FRONT_RENDERING;
 		*out_gralloc_usage = gralloc_usage;
 		break;
+	case GRALLOC_DRM_MARK_DIRTY:
+		/* Same region arguments as lock(). */
+		rect.x = va_arg(args, int);
+		rect.y = va_arg(args, int);
+		rect.width = va_arg(args, int);
+		rect.height = va_arg(args, int);
+		ret = mod->driver->mark_dirty(handle, &rect);
+		break;
+	case GRALLOC_DRM_PREALLOCATE: {
+		/* Same arguments as alloc(), then the number of buffers. */
+		struct cros_gralloc_buffer_descriptor descriptor;
+		descriptor.width = va_arg(args, int);
+		descriptor.height = va_arg(args, int);
+		descriptor.droid_format = va_arg(args, int);
+		descriptor.droid_usage = va_arg(args, int);
+		descriptor.drm_format = cros_gralloc_convert_format(descriptor.droid_format);
+		descriptor.use_flags = cros_gralloc_convert_usage(descriptor.droid_usage);
+		descriptor.reserved_region_size = 0;
+		ret = mod->driver->preallocate(&descriptor, va_arg(args, uint32_t));
+		break;
+	}
+	case GRALLOC_DRM_TRIM_MEMORY:
+		mod->driver->trim_memory();
+		break;
 	default:
 		ret = -EINVAL;
 	}
@@ -0,0 +1,466 @@
+/*
+ * Copyright 2023 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Please run clang-format on this file after making changes:
+ *
+ * clang-format -style=file -i grallocbench.c
+ *
+ */
+
+/*
+ * Measures the cost of the gralloc0 entry points. Every result is a single CSV line:
+ *
+ * benchmark,format,usage,width,height,threads,ops,ops_per_sec,p50_ns,p99_ns,max_ns
+ *
+ * so that runs on different backends can be compared, or tracked across builds, with standard
+ * tools.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/native_handle.h>
+#include <hardware/gralloc.h>
+#include <system/graphics.h>
+
+#define ARRAY_SIZE(A) (sizeof(A) / sizeof(*(A)))
+
+#define MAX_THREADS 64
+
+struct grallocbench_context {
+	struct gralloc_module_t *module;
+	struct alloc_device_t *device;
+	uint32_t width;
+	uint32_t height;
+	uint32_t iterations;
+	uint32_t threads;
+};
+
+struct combinations {
+	int32_t format;
+	int32_t usage;
+};
+
+// clang-format off
+static struct combinations combos[] = {
+	{ HAL_PIXEL_FORMAT_RGBA_8888,
+	  GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_COMPOSER },
+	{ HAL_PIXEL_FORMAT_RGBA_8888,
+	  GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_HW_TEXTURE },
+	{ HAL_PIXEL_FORMAT_RGBX_8888,
+	  GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN },
+	{ HAL_PIXEL_FORMAT_RGB_565,
+	  GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN },
+	{ HAL_PIXEL_FORMAT_YCbCr_420_888,
+	  GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_HW_TEXTURE },
+	{ HAL_PIXEL_FORMAT_YV12,
+	  GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_COMPOSER },
+	{ HAL_PIXEL_FORMAT_BLOB,
+	  GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN },
+};
+// clang-format on
+
+struct grallocbench_result {
+	uint64_t *samples;
+	uint32_t num_samples;
+	uint64_t elapsed_ns;
+};
+
+struct grallocbench_benchmark {
+	const char *name;
+	/* Records one sample per operation into |result|; returns 0 if an operation failed. */
+	int (*run)(struct grallocbench_context *ctx, const struct combinations *combo,
+		   struct grallocbench_result *result);
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int is_ycbcr(int32_t format)
+{
+	return format == HAL_PIXEL_FORMAT_YCbCr_420_888 || format == HAL_PIXEL_FORMAT_YV12;
+}
+
+static native_handle_t *duplicate_buffer_handle(buffer_handle_t handle)
+{
+	native_handle_t *hnd = native_handle_create(handle->numFds, handle->numInts);
+
+	if (hnd == NULL)
+		return NULL;
+
+	for (int i = 0; i < handle->numFds; i++)
+		hnd->data[i] = dup(handle->data[i]);
+
+	memcpy(hnd->data + handle->numFds, handle->data + handle->numFds,
+	       sizeof(int) * handle->numInts);
+
+	return hnd;
+}
+
+static void grallocbench_dims(struct grallocbench_context *ctx, const struct combinations *combo,
+			      int *w, int *h)
+{
+	/* BLOB buffers are sized in bytes by their width. */
+	if (combo->format == HAL_PIXEL_FORMAT_BLOB) {
+		*w = ctx->width * ctx->height * 4;
+		*h = 1;
+	} else {
+		*w = ctx->width;
+		*h = ctx->height;
+	}
+}
+
+static int bench_alloc_free(struct grallocbench_context *ctx, const struct combinations *combo,
+			    struct grallocbench_result *result)
+{
+	buffer_handle_t handle;
+	int w, h, stride;
+
+	grallocbench_dims(ctx, combo, &w, &h);
+	for (uint32_t i = 0; i < ctx->iterations; i++) {
+		uint64_t start = now_ns();
+
+		if (ctx->device->alloc(ctx->device, w, h, combo->format, combo->usage, &handle,
+				       &stride))
+			return 0;
+		if (ctx->device->free(ctx->device, handle))
+			return 0;
+
+		result->samples[result->num_samples++] = now_ns() - start;
+	}
+
+	return 1;
+}
+
+static int bench_import(struct grallocbench_context *ctx, const struct combinations *combo,
+			struct grallocbench_result *result)
+{
+	buffer_handle_t handle;
+	int w, h, stride, ret = 1;
+
+	grallocbench_dims(ctx, combo, &w, &h);
+	if (ctx->device->alloc(ctx->device, w, h, combo->format, combo->usage, &handle, &stride))
+		return 0;
+
+	for (uint32_t i = 0; i < ctx->iterations && ret; i++) {
+		/* A fresh handle each time, the way another process would receive it. */
+		native_handle_t *imported = duplicate_buffer_handle(handle);
+		uint64_t start;
+
+		if (!imported) {
+			ret = 0;
+			break;
+		}
+
+		start = now_ns();
+		if (ctx->module->registerBuffer(ctx->module, imported) ||
+		    ctx->module->unregisterBuffer(ctx->module, imported))
+			ret = 0;
+		result->samples[result->num_samples++] = now_ns() - start;
+
+		native_handle_close(imported);
+		native_handle_delete(imported);
+	}
+
+	ctx->device->free(ctx->device, handle);
+	return ret;
+}
+
+static int bench_lock(struct grallocbench_context *ctx, const struct combinations *combo,
+		      struct grallocbench_result *result)
+{
+	buffer_handle_t handle;
+	int w, h, stride, ret = 1;
+
+	if (!(combo->usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK)))
+		return 1;
+
+	grallocbench_dims(ctx, combo, &w, &h);
+	if (ctx->device->alloc(ctx->device, w, h, combo->format, combo->usage, &handle, &stride))
+		return 0;
+
+	for (uint32_t i = 0; i < ctx->iterations && ret; i++) {
+		struct android_ycbcr ycbcr;
+		void *vaddr;
+		uint64_t start = now_ns();
+
+		if (is_ycbcr(combo->format))
+			ret = ctx->module->lock_ycbcr(ctx->module, handle, combo->usage, 0, 0, w,
+						      h, &ycbcr) == 0;
+		else
+			ret = ctx->module->lock(ctx->module, handle, combo->usage, 0, 0, w, h,
+						&vaddr) == 0;
+		if (ret)
+			ret = ctx->module->unlock(ctx->module, handle) == 0;
+
+		result->samples[result->num_samples++] = now_ns() - start;
+	}
+
+	ctx->device->free(ctx->device, handle);
+	return ret;
+}
+
+/* Not every backend supports every combination; those it doesn't are skipped. */
+static int is_supported(struct grallocbench_context *ctx, const struct combinations *combo)
+{
+	buffer_handle_t handle;
+	int w, h, stride;
+
+	grallocbench_dims(ctx, combo, &w, &h);
+	if (ctx->device->alloc(ctx->device, w, h, combo->format, combo->usage, &handle, &stride))
+		return 0;
+
+	ctx->device->free(ctx->device, handle);
+	return 1;
+}
+
+static const struct grallocbench_benchmark benchmarks[] = {
+	{ "alloc_free", bench_alloc_free },
+	{ "import", bench_import },
+	{ "lock", bench_lock },
+};
+
+struct grallocbench_thread {
+	pthread_t thread;
+	struct grallocbench_context *ctx;
+	const struct grallocbench_benchmark *benchmark;
+	const struct combinations *combo;
+	pthread_barrier_t *barrier;
+	struct grallocbench_result result;
+	int success;
+};
+
+static void *grallocbench_thread_main(void *arg)
+{
+	struct grallocbench_thread *t = arg;
+
+	/* Start together, so that the threads actually contend. */
+	pthread_barrier_wait(t->barrier);
+	t->success = t->benchmark->run(t->ctx, t->combo, &t->result);
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void print_result(struct grallocbench_context *ctx, const char *name,
+			 const struct combinations *combo, uint32_t threads,
+			 struct grallocbench_result *result)
+{
+	uint32_t n = result->num_samples;
+	double ops_per_sec;
+
+	if (!n)
+		return;
+
+	qsort(result->samples, n, sizeof(*result->samples), compare_u64);
+	ops_per_sec = result->elapsed_ns ? n * 1e9 / result->elapsed_ns : 0;
+
+	printf("%s,0x%x,0x%x,%u,%u,%u,%u,%.0f,%llu,%llu,%llu\n", name, combo->format,
+	       combo->usage, ctx->width, ctx->height, threads, n, ops_per_sec,
+	       (unsigned long long)result->samples[(n - 1) / 2],
+	       (unsigned long long)result->samples[(n - 1) * 99 / 100],
+	       (unsigned long long)result->samples[n - 1]);
+}
+
+static int run_single(struct grallocbench_context *ctx, const struct grallocbench_benchmark *b,
+		      const struct combinations *combo)
+{
+	struct grallocbench_result result = { 0 };
+	uint64_t start;
+	int success;
+
+	result.samples = calloc(ctx->iterations, sizeof(*result.samples));
+	if (!result.samples)
+		return 0;
+
+	start = now_ns();
+	success = b->run(ctx, combo, &result);
+	result.elapsed_ns = now_ns() - start;
+
+	if (success)
+		print_result(ctx, b->name, combo, 1, &result);
+
+	free(result.samples);
+	return success;
+}
+
+static int run_threaded(struct grallocbench_context *ctx, const struct grallocbench_benchmark *b,
+			const struct combinations *combo)
+{
+	struct grallocbench_thread threads[MAX_THREADS] = { 0 };
+	struct grallocbench_result merged = { 0 };
+	pthread_barrier_t barrier;
+	uint32_t started = 0;
+	uint64_t start;
+	int success = 1;
+
+	merged.samples = calloc((size_t)ctx->threads * ctx->iterations, sizeof(*merged.samples));
+	if (!merged.samples)
+		return 0;
+
+	pthread_barrier_init(&barrier, NULL, ctx->threads + 1);
+	for (uint32_t i = 0; i < ctx->threads; i++) {
+		threads[i].ctx = ctx;
+		threads[i].benchmark = b;
+		threads[i].combo = combo;
+		threads[i].barrier = &barrier;
+		threads[i].result.samples = merged.samples + (size_t)i * ctx->iterations;
+	}
+
+	for (; started < ctx->threads; started++) {
+		if (pthread_create(&threads[started].thread, NULL, grallocbench_thread_main,
+				   &threads[started]))
+			break;
+	}
+
+	if (started < ctx->threads) {
+		/* The barrier can't be passed anymore; there is no clean way out. */
+		fprintf(stderr, "failed to start benchmark threads\n");
+		exit(1);
+	}
+
+	start = now_ns();
+	pthread_barrier_wait(&barrier);
+	for (uint32_t i = 0; i < ctx->threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		success &= threads[i].success;
+	}
+	merged.elapsed_ns = now_ns() - start;
+	pthread_barrier_destroy(&barrier);
+
+	/* Compact the per-thread sample ranges into one sorted set. */
+	for (uint32_t i = 0; i < ctx->threads; i++) {
+		memmove(merged.samples + merged.num_samples, threads[i].result.samples,
+			threads[i].result.num_samples * sizeof(*merged.samples));
+		merged.num_samples += threads[i].result.num_samples;
+	}
+
+	if (success)
+		print_result(ctx, b->name, combo, ctx->threads, &merged);
+
+	free(merged.samples);
+	return success;
+}
+
+static struct grallocbench_context *init_gralloc(void)
+{
+	hw_module_t const *hw_module;
+	struct grallocbench_context *ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	if (hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &hw_module))
+		return NULL;
+
+	gralloc_open(hw_module, &ctx->device);
+	ctx->module = (gralloc_module_t *)hw_module;
+	if (!ctx->module || !ctx->device)
+		return NULL;
+
+	return ctx;
+}
+
+static void print_help(const char *argv0)
+{
+	printf("usage: %s [-i iterations] [-t threads] [-s WxH] <benchmark>\n\n", argv0);
+	printf("Benchmarks:\n");
+	for (uint32_t i = 0; i < ARRAY_SIZE(benchmarks); i++)
+		printf("  %s\n", benchmarks[i].name);
+	printf("  all\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct grallocbench_context *ctx;
+	uint32_t iterations = 1000, num_threads = 4, width = 1920, height = 1080;
+	uint32_t num_run = 0;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "i:t:s:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			num_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if (sscanf(optarg, "%ux%u", &width, &height) != 2)
+				goto print_usage;
+			break;
+		default:
+			goto print_usage;
+		}
+	}
+
+	if (optind != argc - 1 || !iterations || !width || !height || num_threads > MAX_THREADS)
+		goto print_usage;
+
+	ctx = init_gralloc();
+	if (!ctx) {
+		fprintf(stderr, "failed to initialize gralloc\n");
+		return 1;
+	}
+
+	ctx->width = width;
+	ctx->height = height;
+	ctx->iterations = iterations;
+	ctx->threads = num_threads;
+
+	printf("benchmark,format,usage,width,height,threads,ops,ops_per_sec,"
+	       "p50_ns,p99_ns,max_ns\n");
+	for (uint32_t i = 0; i < ARRAY_SIZE(benchmarks); i++) {
+		const struct grallocbench_benchmark *b = &benchmarks[i];
+
+		if (strcmp(b->name, argv[optind]) && strcmp("all", argv[optind]))
+			continue;
+
+		for (uint32_t j = 0; j < ARRAY_SIZE(combos); j++) {
+			int success;
+
+			if (!is_supported(ctx, &combos[j]))
+				continue;
+
+			success = run_single(ctx, b, &combos[j]);
+			if (success && ctx->threads > 1)
+				success = run_threaded(ctx, b, &combos[j]);
+
+			if (!success) {
+				fprintf(stderr, "%s failed for format 0x%x usage 0x%x\n", b->name,
+					combos[j].format, combos[j].usage);
+				ret = 1;
+			}
+		}
+
+		num_run++;
+	}
+
+	gralloc_close(ctx->device);
+
+	if (!num_run)
+		goto print_usage;
+
+	return ret;
+
+print_usage:
+	print_help(argv[0]);
+	return 0;
+}
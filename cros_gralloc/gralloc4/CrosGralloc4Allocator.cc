@@ -56,20 +56,23 @@ Error CrosGralloc4Allocator::initializeMetadata(
 
     snprintf(crosMetadata->name, CROS_GRALLOC4_METADATA_MAX_NAME_SIZE, "%s",
              crosDescriptor.name.c_str());
-    crosMetadata->dataspace = Dataspace::UNKNOWN;
-    crosMetadata->blendMode = BlendMode::INVALID;
+    initCrosGralloc4MetadataSequence(crosMetadata);
+    writeCrosGralloc4Metadata(crosMetadata, [](CrosGralloc4Metadata& metadata) {
+        metadata.dataspace = Dataspace::UNKNOWN;
+        metadata.blendMode = BlendMode::INVALID;
+    });
 
     return Error::NONE;
 }
 
-Error CrosGralloc4Allocator::allocate(const BufferDescriptorInfo& descriptor, uint32_t* outStride,
-                                      hidl_handle* outHandle) {
+Error CrosGralloc4Allocator::allocate(const BufferDescriptorInfo& descriptor, uint32_t count,
+                                      uint32_t* outStride, hidl_vec<hidl_handle>* outHandles) {
     if (!mDriver) {
         ALOGE("Failed to allocate. Driver is uninitialized.");
         return Error::NO_RESOURCES;
     }
 
-    if (!outStride || !outHandle) {
+    if (!outStride || !outHandles) {
         return Error::NO_RESOURCES;
     }
 
@@ -89,24 +92,35 @@ Error CrosGralloc4Allocator::allocate(const BufferDescriptorInfo& descriptor, ui
         return Error::UNSUPPORTED;
     }
 
-    native_handle_t* handle;
-    int ret = mDriver->allocate(&crosDescriptor, &handle);
+    std::vector<native_handle_t*> handles(count, nullptr);
+    int ret = mDriver->allocate_batch(&crosDescriptor, count, /*parallel=*/count > 1,
+                                      handles.data());
     if (ret) {
         return Error::NO_RESOURCES;
     }
 
-    cros_gralloc_handle_t crosHandle = cros_gralloc_convert_handle(handle);
+    Error error = Error::NONE;
+    for (native_handle_t* handle : handles) {
+        error = initializeMetadata(cros_gralloc_convert_handle(handle), crosDescriptor);
+        if (error != Error::NONE) {
+            break;
+        }
+    }
 
-    Error error = initializeMetadata(crosHandle, crosDescriptor);
     if (error != Error::NONE) {
-        mDriver->release(handle);
-        native_handle_close(handle);
-        native_handle_delete(handle);
+        for (native_handle_t* handle : handles) {
+            mDriver->release(handle);
+            native_handle_close(handle);
+            native_handle_delete(handle);
+        }
         return error;
     }
 
-    outHandle->setTo(handle, /*shouldOwn=*/true);
-    *outStride = crosHandle->pixel_stride;
+    outHandles->resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        (*outHandles)[i].setTo(handles[i], /*shouldOwn=*/true);
+    }
+    *outStride = count ? cros_gralloc_convert_handle(handles[0])->pixel_stride : 0;
 
     return Error::NONE;
 }
@@ -130,19 +144,12 @@ Return<void> CrosGralloc4Allocator::allocate(const hidl_vec<uint8_t>& descriptor
         return Void();
     }
 
-    handles.resize(count);
-
     uint32_t stride = 0;
-    for (int i = 0; i < handles.size(); i++) {
-        Error err = allocate(description, &stride, &(handles[i]));
-        if (err != Error::NONE) {
-            for (int j = 0; j < i; j++) {
-                mDriver->release(handles[j].getNativeHandle());
-            }
-            handles.resize(0);
-            hidlCb(err, 0, handles);
-            return Void();
-        }
+    Error err = allocate(description, count, &stride, &handles);
+    if (err != Error::NONE) {
+        handles.resize(0);
+        hidlCb(err, 0, handles);
+        return Void();
     }
 
     hidlCb(Error::NONE, stride, handles);
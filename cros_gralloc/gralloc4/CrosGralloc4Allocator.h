@@ -28,7 +28,8 @@ class CrosGralloc4Allocator : public android::hardware::graphics::allocator::V4_
     android::hardware::graphics::mapper::V4_0::Error allocate(
             const android::hardware::graphics::mapper::V4_0::IMapper::BufferDescriptorInfo&
                     description,
-            uint32_t* outStride, android::hardware::hidl_handle* outHandle);
+            uint32_t count, uint32_t* outStride,
+            android::hardware::hidl_vec<android::hardware::hidl_handle>* outHandles);
 
     cros_gralloc_driver* mDriver = nullptr;
 };
@@ -13,6 +13,7 @@
 #include <cutils/native_handle.h>
 #include <cutils/properties.h>
 #include <gralloctypes/Gralloc4.h>
+#include <unistd.h>
 
 #include "cros_gralloc/cros_gralloc_helpers.h"
 #include "cros_gralloc/gralloc4/CrosGralloc4Utils.h"
@@ -30,6 +31,9 @@ using android::hardware::graphics::common::V1_2::PixelFormat;
 using android::hardware::graphics::mapper::V4_0::Error;
 using android::hardware::graphics::mapper::V4_0::IMapper;
 
+// Vendor metadata type of the extra dumpBuffers() entry carrying the driver stats as text.
+static const MetadataType kMinigbmStatsMetadataType = {"minigbm.Stats", 0};
+
 Return<void> CrosGralloc4Mapper::createDescriptor(const BufferDescriptorInfo& description,
                                                   createDescriptor_cb hidlCb) {
     hidl_vec<uint8_t> descriptor;
@@ -320,11 +324,19 @@ Return<void> CrosGralloc4Mapper::unlock(void* rawHandle, unlock_cb hidlCb) {
     ret = convertToFenceHandle(releaseFenceFd, &releaseFenceHandle);
     if (ret) {
         ALOGE("Failed to unlock. Failed to convert release fence to handle.");
+        if (releaseFenceFd >= 0) {
+            close(releaseFenceFd);
+        }
         hidlCb(Error::BAD_BUFFER, nullptr);
         return Void();
     }
 
     hidlCb(Error::NONE, releaseFenceHandle);
+
+    /* The handle doesn't own the fence fd; the caller dups it during the callback. */
+    if (releaseFenceFd >= 0) {
+        close(releaseFenceFd);
+    }
     return Void();
 }
 
@@ -437,6 +449,30 @@ Return<void> CrosGralloc4Mapper::get(void* rawHandle, const MetadataType& metada
     return Void();
 }
 
+/*
+ * Metadata that can't change once a buffer is allocated. The name lives in the reserved region but
+ * is only written by the allocator, before the buffer is handed out.
+ */
+static bool isImmutableMetadataType(const MetadataType& metadataType) {
+    return metadataType == android::gralloc4::MetadataType_BufferId ||
+           metadataType == android::gralloc4::MetadataType_Name ||
+           metadataType == android::gralloc4::MetadataType_Width ||
+           metadataType == android::gralloc4::MetadataType_Height ||
+           metadataType == android::gralloc4::MetadataType_LayerCount ||
+           metadataType == android::gralloc4::MetadataType_PixelFormatRequested ||
+           metadataType == android::gralloc4::MetadataType_PixelFormatFourCC ||
+           metadataType == android::gralloc4::MetadataType_PixelFormatModifier ||
+           metadataType == android::gralloc4::MetadataType_Usage ||
+           metadataType == android::gralloc4::MetadataType_AllocationSize ||
+           metadataType == android::gralloc4::MetadataType_ProtectedContent ||
+           metadataType == android::gralloc4::MetadataType_Compression ||
+           metadataType == android::gralloc4::MetadataType_Interlaced ||
+           metadataType == android::gralloc4::MetadataType_ChromaSiting ||
+           metadataType == android::gralloc4::MetadataType_PlaneLayouts ||
+           metadataType == android::gralloc4::MetadataType_Crop ||
+           metadataType == android::gralloc4::MetadataType_Smpte2094_40;
+}
+
 Return<void> CrosGralloc4Mapper::get(const cros_gralloc_buffer* crosBuffer,
                                      const MetadataType& metadataType, get_cb hidlCb) {
     hidl_vec<uint8_t> encodedMetadata;
@@ -453,7 +489,22 @@ Return<void> CrosGralloc4Mapper::get(const cros_gralloc_buffer* crosBuffer,
         return Void();
     }
 
+    /* Immutable metadata is encoded once per buffer and then served without copies. */
+    const bool immutable = isImmutableMetadataType(metadataType);
+    if (immutable) {
+        const std::vector<uint8_t>* cached = crosBuffer->get_cached_encoding(metadataType.value);
+        if (cached) {
+            encodedMetadata.setToExternal(const_cast<uint8_t*>(cached->data()), cached->size());
+            hidlCb(Error::NONE, encodedMetadata);
+            return Void();
+        }
+    }
+
     const CrosGralloc4Metadata* crosMetadata = nullptr;
+    BlendMode blendMode = BlendMode::INVALID;
+    Dataspace dataspace = Dataspace::UNKNOWN;
+    std::optional<aidl::android::hardware::graphics::common::Cta861_3> cta861_3;
+    std::optional<aidl::android::hardware::graphics::common::Smpte2086> smpte2086;
     if (metadataType == android::gralloc4::MetadataType_BlendMode ||
         metadataType == android::gralloc4::MetadataType_Cta861_3 ||
         metadataType == android::gralloc4::MetadataType_Dataspace ||
@@ -465,6 +516,14 @@ Return<void> CrosGralloc4Mapper::get(const cros_gralloc_buffer* crosBuffer,
             hidlCb(Error::NO_RESOURCES, encodedMetadata);
             return Void();
         }
+
+        /* Snapshot the mutable fields; a writer may be updating them concurrently. */
+        readCrosGralloc4Metadata(crosMetadata, [&](const CrosGralloc4Metadata& metadata) {
+            blendMode = metadata.blendMode;
+            dataspace = metadata.dataspace;
+            cta861_3 = metadata.cta861_3;
+            smpte2086 = metadata.smpte2086;
+        });
     }
 
     android::status_t status = android::NO_ERROR;
@@ -537,13 +596,13 @@ Return<void> CrosGralloc4Mapper::get(const cros_gralloc_buffer* crosBuffer,
 
         status = android::gralloc4::encodeCrop(crops, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_Dataspace) {
-        status = android::gralloc4::encodeDataspace(crosMetadata->dataspace, &encodedMetadata);
+        status = android::gralloc4::encodeDataspace(dataspace, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_BlendMode) {
-        status = android::gralloc4::encodeBlendMode(crosMetadata->blendMode, &encodedMetadata);
+        status = android::gralloc4::encodeBlendMode(blendMode, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_Smpte2086) {
-        status = android::gralloc4::encodeSmpte2086(crosMetadata->smpte2086, &encodedMetadata);
+        status = android::gralloc4::encodeSmpte2086(smpte2086, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_Cta861_3) {
-        status = android::gralloc4::encodeCta861_3(crosMetadata->cta861_3, &encodedMetadata);
+        status = android::gralloc4::encodeCta861_3(cta861_3, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_Smpte2094_40) {
         status = android::gralloc4::encodeSmpte2094_40(std::nullopt, &encodedMetadata);
     } else {
@@ -557,6 +616,12 @@ Return<void> CrosGralloc4Mapper::get(const cros_gralloc_buffer* crosBuffer,
         return Void();
     }
 
+    if (immutable) {
+        crosBuffer->cache_encoding(
+                metadataType.value,
+                std::vector<uint8_t>(encodedMetadata.begin(), encodedMetadata.end()));
+    }
+
     hidlCb(Error::NONE, encodedMetadata);
     return Void();
 }
@@ -631,30 +696,47 @@ Error CrosGralloc4Mapper::set(cros_gralloc_buffer* crosBuffer, const MetadataTyp
         return Error::UNSUPPORTED;
     }
 
+    /* Decode before touching the shared metadata so that readers never see a partial update. */
     if (metadataType == android::gralloc4::MetadataType_BlendMode) {
-        auto status = android::gralloc4::decodeBlendMode(encodedMetadata, &crosMetadata->blendMode);
+        BlendMode blendMode;
+        auto status = android::gralloc4::decodeBlendMode(encodedMetadata, &blendMode);
         if (status != android::NO_ERROR) {
             ALOGE("Failed to set. Failed to decode blend mode.");
             return Error::UNSUPPORTED;
         }
+        writeCrosGralloc4Metadata(crosMetadata, [&](CrosGralloc4Metadata& metadata) {
+            metadata.blendMode = blendMode;
+        });
     } else if (metadataType == android::gralloc4::MetadataType_Cta861_3) {
-        auto status = android::gralloc4::decodeCta861_3(encodedMetadata, &crosMetadata->cta861_3);
+        std::optional<aidl::android::hardware::graphics::common::Cta861_3> cta861_3;
+        auto status = android::gralloc4::decodeCta861_3(encodedMetadata, &cta861_3);
         if (status != android::NO_ERROR) {
             ALOGE("Failed to set. Failed to decode cta861_3.");
             return Error::UNSUPPORTED;
         }
+        writeCrosGralloc4Metadata(crosMetadata, [&](CrosGralloc4Metadata& metadata) {
+            metadata.cta861_3 = cta861_3;
+        });
     } else if (metadataType == android::gralloc4::MetadataType_Dataspace) {
-        auto status = android::gralloc4::decodeDataspace(encodedMetadata, &crosMetadata->dataspace);
+        Dataspace dataspace;
+        auto status = android::gralloc4::decodeDataspace(encodedMetadata, &dataspace);
         if (status != android::NO_ERROR) {
             ALOGE("Failed to set. Failed to decode dataspace.");
             return Error::UNSUPPORTED;
         }
+        writeCrosGralloc4Metadata(crosMetadata, [&](CrosGralloc4Metadata& metadata) {
+            metadata.dataspace = dataspace;
+        });
     } else if (metadataType == android::gralloc4::MetadataType_Smpte2086) {
-        auto status = android::gralloc4::decodeSmpte2086(encodedMetadata, &crosMetadata->smpte2086);
+        std::optional<aidl::android::hardware::graphics::common::Smpte2086> smpte2086;
+        auto status = android::gralloc4::decodeSmpte2086(encodedMetadata, &smpte2086);
         if (status != android::NO_ERROR) {
             ALOGE("Failed to set. Failed to decode smpte2086.");
             return Error::UNSUPPORTED;
         }
+        writeCrosGralloc4Metadata(crosMetadata, [&](CrosGralloc4Metadata& metadata) {
+            metadata.smpte2086 = smpte2086;
+        });
     }
 
     return Error::NONE;
@@ -1039,6 +1121,17 @@ Return<void> CrosGralloc4Mapper::dumpBuffers(dumpBuffers_cb hidlCb) {
     mDriver->with_each_buffer(
             [&](cros_gralloc_buffer* crosBuffer) { dumpBuffer(crosBuffer, dumpBufferCallback); });
 
+    // dumpBuffers() has no free-form output, so the driver stats ride along as one more
+    // BufferDump holding a vendor metadata entry with the text.
+    std::string stats = mDriver->dump_stats();
+    MetadataDump statsDump;
+    statsDump.metadataType = kMinigbmStatsMetadataType;
+    statsDump.metadata = hidl_vec<uint8_t>(stats.begin(), stats.end());
+
+    BufferDump bufferDump;
+    bufferDump.metadataDump = std::vector<MetadataDump>{statsDump};
+    bufferDumps.push_back(bufferDump);
+
     hidlCb(error, bufferDumps);
     return Void();
 }
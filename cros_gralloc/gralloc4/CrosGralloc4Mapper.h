@@ -97,7 +97,7 @@ class CrosGralloc4Mapper : public android::hardware::graphics::mapper::V4_0::IMa
     int getResolvedDrmFormat(android::hardware::graphics::common::V1_2::PixelFormat pixelFormat,
                              uint64_t bufferUsage, uint32_t* outDrmFormat);
 
-    cros_gralloc_driver* mDriver = cros_gralloc_driver::get_instance();
+    cros_gralloc_driver* mDriver = cros_gralloc_driver::get_instance(/*mapper_only=*/true);
 };
 
 extern "C" android::hardware::graphics::mapper::V4_0::IMapper* HIDL_FETCH_IMapper(const char* name);
@@ -12,7 +12,17 @@
 #include <aidl/android/hardware/graphics/common/Dataspace.h>
 #include <aidl/android/hardware/graphics/common/Smpte2086.h>
 
-#define CROS_GRALLOC4_METADATA_MAX_NAME_SIZE 1024
+#include <atomic>
+#include <thread>
+
+/*
+ * |name| used to take 1024 bytes. Its last 8 now hold the sequence count, so the fields after it
+ * stay where mappers built before the count expect them.
+ */
+#define CROS_GRALLOC4_METADATA_MAX_NAME_SIZE 1016
+#define CROS_GRALLOC4_METADATA_SEQUENCE_MAGIC 0x71657363 /* "csqe" */
+/* How long to wait out an odd count before assuming its writer died mid-update. */
+#define CROS_GRALLOC4_METADATA_MAX_RETRIES 1000
 
 /*
  * The metadata for cros_gralloc_buffer-s that should reside in a shared memory region
@@ -28,10 +38,99 @@ struct CrosGralloc4Metadata {
      * handles.
      */
     char name[CROS_GRALLOC4_METADATA_MAX_NAME_SIZE];
+
+    /*
+     * Sequence count guarding the mutable fields below, which may be rewritten every frame by
+     * one process while others read them. It is odd while a write is in progress, and only
+     * valid if |sequenceMagic| is CROS_GRALLOC4_METADATA_SEQUENCE_MAGIC: buffers allocated
+     * before the count existed have zeroes here. Access the fields through
+     * readCrosGralloc4Metadata() and writeCrosGralloc4Metadata().
+     */
+    uint32_t sequenceMagic;
+    std::atomic<uint32_t> sequence;
     aidl::android::hardware::graphics::common::BlendMode blendMode;
     aidl::android::hardware::graphics::common::Dataspace dataspace;
     std::optional<aidl::android::hardware::graphics::common::Cta861_3> cta861_3;
     std::optional<aidl::android::hardware::graphics::common::Smpte2086> smpte2086;
 };
 
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "The metadata sequence count is shared across processes.");
+
+/* Sets up the sequence count of freshly allocated metadata, before any other process sees it. */
+inline void initCrosGralloc4MetadataSequence(CrosGralloc4Metadata* metadata) {
+    metadata->sequenceMagic = CROS_GRALLOC4_METADATA_SEQUENCE_MAGIC;
+    metadata->sequence.store(0, std::memory_order_relaxed);
+}
+
+/*
+ * Runs |reader| on |metadata| until it observes a state no writer modified meanwhile. |reader|
+ * may run more than once and must only copy fields out. Without a sequence count, or once a
+ * writer has kept it odd for too long, the last read is taken as is.
+ */
+template <typename Reader>
+void readCrosGralloc4Metadata(const CrosGralloc4Metadata* metadata, Reader reader) {
+    if (metadata->sequenceMagic != CROS_GRALLOC4_METADATA_SEQUENCE_MAGIC) {
+        reader(*metadata);
+        return;
+    }
+
+    for (uint32_t tries = 0; tries < CROS_GRALLOC4_METADATA_MAX_RETRIES; tries++) {
+        uint32_t sequence = metadata->sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        reader(*metadata);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (metadata->sequence.load(std::memory_order_relaxed) == sequence) {
+            return;
+        }
+    }
+
+    reader(*metadata);
+}
+
+/*
+ * Runs |writer| on |metadata| while excluding other writers and invalidating concurrent reads.
+ * Writers own the count from the compare-and-swap that makes it odd until the one that makes it
+ * even again. A count that stays odd is taken to belong to a writer that died, and is taken over
+ * with a swap to the next odd value, so only one waiting writer can win it and the presumed dead
+ * one can no longer release it.
+ */
+template <typename Writer>
+void writeCrosGralloc4Metadata(CrosGralloc4Metadata* metadata, Writer writer) {
+    if (metadata->sequenceMagic != CROS_GRALLOC4_METADATA_SEQUENCE_MAGIC) {
+        writer(*metadata);
+        return;
+    }
+
+    uint32_t sequence = metadata->sequence.load(std::memory_order_relaxed);
+    uint32_t owned;
+    for (uint32_t tries = 0;; tries++) {
+        if (!(sequence & 1)) {
+            owned = sequence + 1;
+        } else if (tries >= CROS_GRALLOC4_METADATA_MAX_RETRIES) {
+            owned = sequence + 2;
+        } else {
+            std::this_thread::yield();
+            sequence = metadata->sequence.load(std::memory_order_relaxed);
+            continue;
+        }
+
+        if (metadata->sequence.compare_exchange_weak(sequence, owned, std::memory_order_acquire,
+                                                     std::memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);
+    writer(*metadata);
+    /* Fails only if another writer took the count over, in which case it releases it. */
+    metadata->sequence.compare_exchange_strong(owned, owned + 1, std::memory_order_release,
+                                               std::memory_order_relaxed);
+}
+
 #endif
@@ -20,6 +20,7 @@
 #include <unistd.h>
 
 #include <memory>
+#include <utility>
 
 /*
  * Using UniqueFd:
@@ -16,6 +16,8 @@ struct backend dmabuf_backend = {
 	.bo_import = dmabuf_bo_import,
 	.bo_map = dmabuf_bo_map,
 	.bo_unmap = dmabuf_bo_unmap,
+	.bo_invalidate = dmabuf_bo_invalidate,
+	.bo_flush = dmabuf_bo_flush,
 	.resolve_format_and_use_flags = dmabuf_resolve_format_and_use_flags,
 	.bo_get_plane_fd = dmabuf_bo_get_plane_fd,
 };
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2022 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#define LOG_TAG "DMABUF-GRALLOC"
+
+#include "dmabuf_heap_pool.h"
+
+extern "C" {
+#include "drv_helpers.h"
+}
+
+#include "dma-heap.h"
+#include "drv_priv.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+static size_t dmabuf_pool_size_class(size_t len)
+{
+	return ALIGN(len, (size_t)sysconf(_SC_PAGESIZE));
+}
+
+DmabufHeapPool::DmabufHeapPool(const char *name, int heap_fd) : name_(name), heap_fd_(heap_fd)
+{
+}
+
+DmabufHeapPool::~DmabufHeapPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	cond_.notify_all();
+
+	if (worker_.joinable())
+		worker_.join();
+}
+
+void DmabufHeapPool::configure(const std::string &spec)
+{
+	size_t pos = 0;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	while (pos < spec.size()) {
+		size_t end = spec.find(',', pos);
+		std::string entry = spec.substr(pos, end == std::string::npos ? end : end - pos);
+		unsigned long long width, height = 0;
+		unsigned count;
+		size_t len;
+
+		pos = end == std::string::npos ? spec.size() : end + 1;
+
+		if (sscanf(entry.c_str(), "%llux%llu:%u", &width, &height, &count) == 3) {
+			len = width * height * 4;
+		} else if (sscanf(entry.c_str(), "%llu:%u", &width, &count) == 2) {
+			len = width;
+		} else {
+			drv_loge("%s pool: ignoring malformed entry '%s'", name_.c_str(),
+				 entry.c_str());
+			continue;
+		}
+
+		if (!len || !count)
+			continue;
+
+		classes_[dmabuf_pool_size_class(len)].target += count;
+	}
+
+	if (!classes_.empty() && !worker_.joinable())
+		worker_ = std::thread(&DmabufHeapPool::refill_worker, this);
+}
+
+UniqueFd DmabufHeapPool::heap_alloc(size_t len)
+{
+	struct dma_heap_allocation_data heap_data {
+		.len = len, .fd_flags = O_RDWR | O_CLOEXEC,
+	};
+
+	if (ioctl(heap_fd_, DMA_HEAP_IOCTL_ALLOC, &heap_data))
+		return UniqueFd();
+
+	return UniqueFd((int)heap_data.fd);
+}
+
+UniqueFd DmabufHeapPool::alloc(size_t len)
+{
+	size_t size = dmabuf_pool_size_class(len);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = classes_.find(size);
+		if (it != classes_.end()) {
+			SizeClass &sc = it->second;
+
+			sc.paused = false;
+			if (!sc.free.empty()) {
+				UniqueFd fd = std::move(sc.free.back());
+				sc.free.pop_back();
+				sc.hits++;
+				cond_.notify_one();
+				return fd;
+			}
+
+			sc.misses++;
+			cond_.notify_one();
+		}
+	}
+
+	return heap_alloc(size);
+}
+
+void DmabufHeapPool::trim()
+{
+	std::vector<UniqueFd> freed;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto &it : classes_) {
+			for (auto &fd : it.second.free)
+				freed.push_back(std::move(fd));
+
+			it.second.free.clear();
+			it.second.paused = true;
+		}
+	}
+
+	if (!freed.empty())
+		drv_logi("%s pool: released %zu buffers", name_.c_str(), freed.size());
+}
+
+void DmabufHeapPool::log_occupancy()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (const auto &it : classes_) {
+		const SizeClass &sc = it.second;
+		drv_logi("%s pool: size=%zu free=%zu/%u hits=%" PRIu64 " misses=%" PRIu64,
+			 name_.c_str(), it.first, sc.free.size(), sc.target, sc.hits, sc.misses);
+	}
+}
+
+bool DmabufHeapPool::find_refill_locked(size_t *out_len)
+{
+	for (const auto &it : classes_) {
+		if (!it.second.paused && it.second.free.size() < it.second.target) {
+			*out_len = it.first;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void DmabufHeapPool::refill_worker()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	for (;;) {
+		size_t len = 0;
+
+		cond_.wait(lock, [&] { return stop_ || find_refill_locked(&len); });
+		if (stop_)
+			return;
+
+		/* CMA allocations can take milliseconds, keep them out of the lock. */
+		lock.unlock();
+		UniqueFd fd = heap_alloc(len);
+		int err = errno;
+		lock.lock();
+
+		SizeClass &sc = classes_[len];
+		if (!fd) {
+			/* Don't fight the heap under pressure; wait for the next take of this size. */
+			drv_logi("%s pool: stopped refilling size=%zu, errno: %i", name_.c_str(), len,
+				 -err);
+			sc.paused = true;
+			continue;
+		}
+
+		if (!sc.paused && sc.free.size() < sc.target)
+			sc.free.push_back(std::move(fd));
+	}
+}
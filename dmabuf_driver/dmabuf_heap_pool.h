@@ -0,0 +1,70 @@
+/*
+ * Copyright 2022 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#pragma once
+
+#include "UniqueFd.h"
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Keeps a reserve of freshly allocated dma-bufs from one dma-heap, grouped by page aligned size,
+ * so that allocations of a reserved size skip DMA_HEAP_IOCTL_ALLOC. A worker thread tops the
+ * reserve back up after every hit.
+ *
+ * Only never-exported buffers are pooled: the allocator can't tell when the clients it handed a
+ * buffer to are done with it, so freed buffers are never recycled.
+ */
+class DmabufHeapPool
+{
+      public:
+	/* |heap_fd| is borrowed and must outlive the pool. */
+	DmabufHeapPool(const char *name, int heap_fd);
+	~DmabufHeapPool();
+
+	/*
+	 * Parses "<size>:<count>[,<size>:<count>...]", where <size> is a byte count or <w>x<h>
+	 * for that many 32bpp pixels, and starts filling the reserve in the background.
+	 */
+	void configure(const std::string &spec);
+
+	/* Returns a pooled buffer of exactly |len| (page aligned) bytes, or allocates one. */
+	UniqueFd alloc(size_t len);
+
+	/* Frees every pooled buffer; refilling resumes for a size once a buffer of it is taken. */
+	void trim();
+
+	void log_occupancy();
+
+      private:
+	struct SizeClass {
+		uint32_t target = 0;
+		bool paused = false;
+		std::vector<UniqueFd> free;
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+	};
+
+	UniqueFd heap_alloc(size_t len);
+	bool find_refill_locked(size_t *out_len);
+	void refill_worker();
+
+	DmabufHeapPool(const DmabufHeapPool &) = delete;
+	DmabufHeapPool &operator=(const DmabufHeapPool &) = delete;
+
+	std::string name_;
+	int heap_fd_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	bool stop_ = false;
+	std::map<size_t, SizeClass> classes_;
+	std::thread worker_;
+};
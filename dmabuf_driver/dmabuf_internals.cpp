@@ -6,6 +6,7 @@ extern "C" {
 
 #include "UniqueFd.h"
 #include "dma-heap.h"
+#include "dmabuf_heap_pool.h"
 #include "drv_priv.h"
 #include "util.h"
 #include <algorithm>
@@ -17,6 +18,7 @@ extern "C" {
 #include <iterator>
 #include <linux/dma-buf.h>
 #include <log/log.h>
+#include <mutex>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -63,10 +65,10 @@ static struct format_metadata linear_metadata = { 1, 0, DRM_FORMAT_MOD_LINEAR };
 
 int dmabuf_driver_init(struct driver *drv)
 {
-	// TODO
 	/*
 	 * in case no allocation needed (Mapper HAL), we do not need to
-	 * waste a time to initialize the internals of the driver.
+	 * waste a time to initialize the internals of the driver: the first
+	 * allocation does.
 	 */
 	drv_add_combinations(drv, scanout_render_formats, ARRAY_SIZE(scanout_render_formats),
 			     &linear_metadata, BO_USE_RENDER_MASK | BO_USE_SCANOUT);
@@ -106,16 +108,49 @@ struct DmabufDriver {
 	UniqueFd system_heap_fd;
 	UniqueFd system_heap_uncached_fd;
 	UniqueFd cma_heap_fd;
+	/* Declared after the heap fds they borrow, so they are destroyed first. */
+	std::unique_ptr<DmabufHeapPool> system_pool;
+	std::unique_ptr<DmabufHeapPool> system_uncached_pool;
+	std::unique_ptr<DmabufHeapPool> cma_pool;
+
+	~DmabufDriver()
+	{
+		/* The pools are missing if initialization gave up before creating them. */
+		for (auto pool : { &system_pool, &system_uncached_pool, &cma_pool }) {
+			if (*pool)
+				(*pool)->log_occupancy();
+		}
+	}
 };
 
+/*
+ * Reserves are configured per heap, e.g. vendor.minigbm.dmabuf.pool.cma=1920x1080:3 keeps three
+ * display sized scanout buffers allocated from CMA. See DmabufHeapPool::configure(). Mapper-only
+ * processes keep no reserves: they rarely allocate, so reserves would only pin memory there.
+ */
+static std::unique_ptr<DmabufHeapPool> dmabuf_create_pool(struct driver *drv, const char *name,
+							  int heap_fd)
+{
+	char prop[PROPERTY_VALUE_MAX];
+	std::string key = std::string("vendor.minigbm.dmabuf.pool.") + name;
+	auto pool = std::make_unique<DmabufHeapPool>(name, heap_fd);
+
+	if (!drv->mapper_only && property_get(key.c_str(), prop, "") > 0)
+		pool->configure(prop);
+
+	return pool;
+}
+
 struct DmabufDriverPriv {
 	std::shared_ptr<DmabufDriver> dmabuf_drv;
 };
 
 static std::shared_ptr<DmabufDriver> dmabuf_get_or_init_driver(struct driver *drv)
 {
+	static std::mutex init_lock;
 	std::shared_ptr<DmabufDriver> dmabuf_drv;
 
+	std::lock_guard<std::mutex> lock(init_lock);
 	if (!drv->priv) {
 		dmabuf_drv = std::make_unique<DmabufDriver>();
 		dmabuf_drv->system_heap_fd =
@@ -142,6 +177,13 @@ static std::shared_ptr<DmabufDriver> dmabuf_get_or_init_driver(struct driver *dr
 			dmabuf_drv->cma_heap_fd = UniqueFd(dup(dmabuf_drv->system_heap_fd.Get()));
 		}
 
+		dmabuf_drv->system_pool =
+		    dmabuf_create_pool(drv, "system", dmabuf_drv->system_heap_fd.Get());
+		dmabuf_drv->system_uncached_pool = dmabuf_create_pool(
+		    drv, "system-uncached", dmabuf_drv->system_heap_uncached_fd.Get());
+		dmabuf_drv->cma_pool =
+		    dmabuf_create_pool(drv, "cma", dmabuf_drv->cma_heap_fd.Get());
+
 		auto priv = new DmabufDriverPriv();
 		priv->dmabuf_drv = dmabuf_drv;
 		drv->priv = priv;
@@ -164,19 +206,6 @@ struct DmabufBoPriv {
 	UniqueFd fds[DRV_MAX_PLANES];
 };
 
-static void dmabuf_inode_to_handle(struct bo *bo)
-{
-	// DRM handles are used as unique buffer keys
-	// Since we are not relying on DRM, provide fstat->inode instead
-	auto priv = (DmabufBoPriv *)bo->priv;
-
-	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
-		struct stat sb;
-		fstat(priv->fds[plane].Get(), &sb);
-		bo->handles[plane].u64 = sb.st_ino;
-	}
-}
-
 int dmabuf_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 		     uint64_t use_flags)
 {
@@ -187,26 +216,43 @@ int dmabuf_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t fo
 
 	int stride = drv_stride_from_format(format, width, 0);
 	drv_bo_from_format(bo, stride, height, format);
+	bo->meta.total_size = drv_bo_align_size(bo, bo->meta.total_size);
 
-	struct dma_heap_allocation_data heap_data {
-		.len = bo->meta.total_size, .fd_flags = O_RDWR | O_CLOEXEC,
-	};
-
-	int heap_fd = drv->system_heap_fd.Get();
+	DmabufHeapPool *pool = drv->system_pool.get();
 
 	if (!(use_flags & BO_USE_SW_MASK))
-		heap_fd = drv->system_heap_uncached_fd.Get();
+		pool = drv->system_uncached_pool.get();
 
-	if (use_flags & BO_USE_SCANOUT)
-		heap_fd = drv->cma_heap_fd.Get();
+	/* Over budget, scanout buffers come from the system heap, as without a CMA heap. */
+	if ((use_flags & BO_USE_SCANOUT) &&
+	    drv_heap_has_room(bo->drv, DRV_HEAP_CMA, bo->meta.total_size)) {
+		pool = drv->cma_pool.get();
+		bo->heap = DRV_HEAP_CMA;
+	}
 
-	auto buf_fd = UniqueFd(ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &heap_data));
+	auto buf_fd = pool->alloc(bo->meta.total_size);
+
+	if (!buf_fd && errno == ENOMEM) {
+		/* Give the reserves back to the heaps and try once more. */
+		for (auto p : { &drv->system_pool, &drv->system_uncached_pool, &drv->cma_pool })
+			(*p)->trim();
+
+		buf_fd = pool->alloc(bo->meta.total_size);
+	}
 
 	if (!buf_fd) {
 		drv_loge("dmabuf allocation error, errno = %i", -errno);
 		return -errno;
 	}
 
+	// DRM handles are used as unique buffer keys
+	// Since we are not relying on DRM, provide the dma-buf inode instead
+	int fds[DRV_MAX_PLANES];
+	std::fill(std::begin(fds), std::end(fds), buf_fd.Get());
+	int ret = drv_bo_inode_handles(bo, fds);
+	if (ret)
+		return ret;
+
 	auto priv = new DmabufBoPriv();
 	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
 		priv->fds[plane] = UniqueFd(dup(buf_fd.Get()));
@@ -214,8 +260,6 @@ int dmabuf_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t fo
 
 	bo->priv = priv;
 
-	dmabuf_inode_to_handle(bo);
-
 	return 0;
 }
 
@@ -225,6 +269,11 @@ int dmabuf_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 		drv_loge("%s bo isn't empty", __func__);
 		return -EINVAL;
 	}
+
+	int ret = drv_bo_inode_handles(bo, data->fds);
+	if (ret)
+		return ret;
+
 	auto priv = new DmabufBoPriv();
 	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
 		priv->fds[plane] = UniqueFd(dup(data->fds[plane]));
@@ -232,8 +281,6 @@ int dmabuf_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 
 	bo->priv = priv;
 
-	dmabuf_inode_to_handle(bo);
-
 	return 0;
 }
 
@@ -257,8 +304,7 @@ void *dmabuf_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_f
 
 	auto priv = (DmabufBoPriv *)bo->priv;
 
-	void *buf =
-	    mmap(0, vma->length, drv_get_prot(map_flags), MAP_SHARED, priv->fds[0].Get(), 0);
+	void *buf = drv_bo_mmap(bo, vma->length, drv_get_prot(map_flags), priv->fds[0].Get(), 0);
 	if (buf == MAP_FAILED) {
 		drv_loge("%s mmap err, errno: %i", __func__, -errno);
 		return buf;
@@ -271,3 +317,25 @@ int dmabuf_bo_unmap(struct bo *bo, struct vma *vma)
 {
 	return munmap(vma->addr, vma->length);
 }
+
+/* System heap buffers software uses are cached, so CPU access needs cache maintenance. */
+static int dmabuf_bo_sync(struct bo *bo, struct mapping *mapping, bool end)
+{
+	auto priv = (DmabufBoPriv *)bo->priv;
+	int fds[DRV_MAX_PLANES];
+
+	for (size_t plane = 0; plane < bo->meta.num_planes; plane++)
+		fds[plane] = priv->fds[plane].Get();
+
+	return drv_bo_dmabuf_sync(bo, mapping->vma, fds, end);
+}
+
+int dmabuf_bo_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	return dmabuf_bo_sync(bo, mapping, false);
+}
+
+int dmabuf_bo_flush(struct bo *bo, struct mapping *mapping, int *out_fence)
+{
+	return dmabuf_bo_sync(bo, mapping, true);
+}
@@ -31,5 +31,7 @@ int dmabuf_bo_destroy(struct bo *bo);
 
 void *dmabuf_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
 int dmabuf_bo_unmap(struct bo *bo, struct vma *vma);
+int dmabuf_bo_invalidate(struct bo *bo, struct mapping *mapping);
+int dmabuf_bo_flush(struct bo *bo, struct mapping *mapping, int *out_fence);
 
 int dmabuf_bo_get_plane_fd(struct bo *bo, size_t plane);
@@ -4,14 +4,20 @@
  * found in the LICENSE file.
  */
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
@@ -21,7 +27,10 @@
 #endif
 
 #include "drv_helpers.h"
+#include "drv_layout_cache.h"
 #include "drv_priv.h"
+#include "drv_slab.h"
+#include "drv_stats.h"
 #include "util.h"
 
 #ifdef DRV_EXTERNAL
@@ -103,7 +112,887 @@ static const struct backend *drv_get_backend(int fd)
 }
 #endif
 
-struct driver *drv_create(int fd)
+bool drv_has_backend(int fd)
+{
+	return drv_get_backend(fd) != NULL;
+}
+
+/*
+ * The device node picked by a process can be shared with later ones through a file named by
+ * MINIGBM_NODE_CACHE, suffixed with the selection policy so callers that pick devices
+ * differently don't override each other. It is only trusted for the boot it was written in,
+ * and only if the node still is the same device.
+ */
+#define DRV_NODE_CACHE_MAGIC 0x646e6763 /* "cgnd" */
+#define DRV_NODE_CACHE_VERSION 1
+#define DRV_BOOT_ID_SIZE 40
+
+struct drv_node_cache {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t rdev;
+	char boot_id[DRV_BOOT_ID_SIZE];
+	char path[64];
+};
+
+static bool drv_node_cache_path(const char *policy, char *path, size_t size)
+{
+	const char *cache_path = getenv("MINIGBM_NODE_CACHE");
+	int len;
+
+	if (!cache_path)
+		return false;
+
+	len = snprintf(path, size, "%s.%s", cache_path, policy);
+	return len > 0 && (size_t)len < size;
+}
+
+static int drv_node_cache_key(struct drv_node_cache *cache)
+{
+	ssize_t len;
+	int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return -errno;
+
+	memset(cache, 0, sizeof(*cache));
+	len = read(fd, cache->boot_id, sizeof(cache->boot_id) - 1);
+	close(fd);
+	if (len <= 0)
+		return -EINVAL;
+
+	cache->magic = DRV_NODE_CACHE_MAGIC;
+	cache->version = DRV_NODE_CACHE_VERSION;
+	return 0;
+}
+
+int drv_open_cached_node(const char *policy)
+{
+	int fd;
+	struct stat st;
+	struct drv_node_cache key, cache;
+	char cache_path[PATH_MAX];
+
+	if (!drv_node_cache_path(policy, cache_path, sizeof(cache_path)) ||
+	    drv_node_cache_key(&key))
+		return -1;
+
+	if (!drv_read_cache_file(cache_path, &cache, sizeof(cache)))
+		return -1;
+
+	if (cache.magic != key.magic || cache.version != key.version ||
+	    memcmp(cache.boot_id, key.boot_id, sizeof(key.boot_id)) ||
+	    !memchr(cache.path, '\0', sizeof(cache.path)))
+		return -1;
+
+	fd = open(cache.path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) || st.st_rdev != cache.rdev || !drv_has_backend(fd)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void drv_cache_node(int fd, const char *policy)
+{
+	char fd_path[32];
+	ssize_t len;
+	struct stat st;
+	struct drv_node_cache cache;
+	char cache_path[PATH_MAX];
+
+	if (!drv_node_cache_path(policy, cache_path, sizeof(cache_path)) ||
+	    drv_node_cache_key(&cache) || fstat(fd, &st))
+		return;
+
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+	len = readlink(fd_path, cache.path, sizeof(cache.path) - 1);
+	if (len <= 0)
+		return;
+
+	cache.rdev = st.st_rdev;
+
+	if (drv_write_cache_file(cache_path, &cache, sizeof(cache)))
+		drv_logi("Failed to write node cache %s\n", cache_path);
+}
+
+#define DRV_COMBO_MEMO_SIZE 64
+
+/*
+ * A memoized drv_get_combination() result. Entries are updated with a per-entry sequence
+ * count so lookups stay lock-free: an odd |seq| means a writer is updating the entry, and
+ * zero means the entry has never been filled.
+ */
+struct combination_memo_entry {
+	atomic_uint seq;
+	_Atomic uint32_t format;
+	_Atomic uint64_t use_flags;
+	_Atomic(struct combination *) combo;
+};
+
+/* All combinations of one format, sorted by descending priority. */
+struct combination_bucket {
+	uint32_t format;
+	uint32_t start;
+	uint32_t count;
+};
+
+struct combination_index {
+	struct combination **combos;
+	struct combination_bucket *buckets;
+	uint32_t num_buckets;
+	struct combination_memo_entry memo[DRV_COMBO_MEMO_SIZE];
+};
+
+struct combination_sort_entry {
+	struct combination *combo;
+	uint32_t idx;
+};
+
+static int combination_sort_compare(const void *a, const void *b)
+{
+	const struct combination_sort_entry *ea = a;
+	const struct combination_sort_entry *eb = b;
+
+	if (ea->combo->format != eb->combo->format)
+		return ea->combo->format < eb->combo->format ? -1 : 1;
+
+	if (ea->combo->metadata.priority != eb->combo->metadata.priority)
+		return ea->combo->metadata.priority > eb->combo->metadata.priority ? -1 : 1;
+
+	/* Keep insertion order between equal priorities, as the linear scan did. */
+	return ea->idx < eb->idx ? -1 : (ea->idx > eb->idx);
+}
+
+static struct combination_index *drv_combination_index_create(struct drv_array *combos)
+{
+	struct combination_index *index;
+	struct combination_sort_entry *entries;
+	uint32_t i, num_combos = drv_array_size(combos);
+
+	index = calloc(1, sizeof(*index));
+	if (!index)
+		return NULL;
+
+	if (!num_combos)
+		return index;
+
+	entries = calloc(num_combos, sizeof(*entries));
+	index->combos = calloc(num_combos, sizeof(*index->combos));
+	index->buckets = calloc(num_combos, sizeof(*index->buckets));
+	if (!entries || !index->combos || !index->buckets) {
+		free(entries);
+		free(index->combos);
+		free(index->buckets);
+		free(index);
+		return NULL;
+	}
+
+	for (i = 0; i < num_combos; i++) {
+		entries[i].combo = drv_array_at_idx(combos, i);
+		entries[i].idx = i;
+	}
+
+	qsort(entries, num_combos, sizeof(*entries), combination_sort_compare);
+
+	for (i = 0; i < num_combos; i++) {
+		struct combination_bucket *bucket =
+		    index->num_buckets ? &index->buckets[index->num_buckets - 1] : NULL;
+
+		index->combos[i] = entries[i].combo;
+		if (!bucket || bucket->format != entries[i].combo->format) {
+			bucket = &index->buckets[index->num_buckets++];
+			bucket->format = entries[i].combo->format;
+			bucket->start = i;
+		}
+
+		bucket->count++;
+	}
+
+	free(entries);
+	return index;
+}
+
+static void drv_combination_index_destroy(struct combination_index *index)
+{
+	if (!index)
+		return;
+
+	free(index->combos);
+	free(index->buckets);
+	free(index);
+}
+
+static struct combination *drv_combination_index_lookup(struct combination_index *index,
+							 uint32_t format, uint64_t use_flags)
+{
+	uint32_t lo = 0, hi = index->num_buckets;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const struct combination_bucket *bucket = &index->buckets[mid];
+
+		if (bucket->format < format) {
+			lo = mid + 1;
+		} else if (bucket->format > format) {
+			hi = mid;
+		} else {
+			for (uint32_t i = bucket->start; i < bucket->start + bucket->count; i++) {
+				struct combination *curr = index->combos[i];
+				if (use_flags == (curr->use_flags & use_flags))
+					return curr;
+			}
+
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+static struct combination_memo_entry *drv_combination_memo_entry(struct combination_index *index,
+								 uint32_t format,
+								 uint64_t use_flags)
+{
+	uint64_t hash = (format * 0x9e3779b97f4a7c15ull) ^ (use_flags * 0xc2b2ae3d27d4eb4full);
+
+	return &index->memo[(hash >> 32) % DRV_COMBO_MEMO_SIZE];
+}
+
+static bool drv_combination_memo_get(struct combination_index *index, uint32_t format,
+				     uint64_t use_flags, struct combination **out_combo)
+{
+	struct combination_memo_entry *entry =
+	    drv_combination_memo_entry(index, format, use_flags);
+	unsigned int seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+	struct combination *combo;
+	bool match;
+
+	if (!seq || (seq & 1))
+		return false;
+
+	match = atomic_load_explicit(&entry->format, memory_order_relaxed) == format &&
+		atomic_load_explicit(&entry->use_flags, memory_order_relaxed) == use_flags;
+	combo = atomic_load_explicit(&entry->combo, memory_order_relaxed);
+
+	atomic_thread_fence(memory_order_acquire);
+	if (!match || atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq)
+		return false;
+
+	*out_combo = combo;
+	return true;
+}
+
+static void drv_combination_memo_put(struct combination_index *index, uint32_t format,
+				     uint64_t use_flags, struct combination *combo)
+{
+	struct combination_memo_entry *entry =
+	    drv_combination_memo_entry(index, format, use_flags);
+	unsigned int seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+
+	/* Another thread is filling this entry; the memo is best effort, so just skip it. */
+	if ((seq & 1) || !atomic_compare_exchange_strong_explicit(&entry->seq, &seq, seq + 1,
+								  memory_order_acquire,
+								  memory_order_relaxed))
+		return;
+
+	atomic_store_explicit(&entry->format, format, memory_order_relaxed);
+	atomic_store_explicit(&entry->use_flags, use_flags, memory_order_relaxed);
+	atomic_store_explicit(&entry->combo, combo, memory_order_relaxed);
+	atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+}
+
+#define DRV_HANDLE_TABLE_SHARDS 16
+#define DRV_HANDLE_SHARD_MIN_SLOTS 16
+
+/* A GEM handle and the number of bos referencing it. A zero |count| marks an empty slot. */
+struct handle_refcount {
+	uint32_t handle;
+	uint32_t count;
+};
+
+/* An open-addressed, linearly probed table covering the handles that hash to this shard. */
+struct handle_shard {
+	pthread_mutex_t lock;
+	struct handle_refcount *slots;
+	uint32_t num_slots;
+	uint32_t num_used;
+};
+
+struct handle_table {
+	struct handle_shard shards[DRV_HANDLE_TABLE_SHARDS];
+	atomic_uint num_live_handles;
+};
+
+static inline uint32_t drv_handle_hash(uint32_t handle)
+{
+	return handle * 2654435761u;
+}
+
+static struct handle_shard *drv_handle_shard(struct handle_table *table, uint32_t handle)
+{
+	return &table->shards[drv_handle_hash(handle) % DRV_HANDLE_TABLE_SHARDS];
+}
+
+static uint32_t drv_handle_slot(struct handle_shard *shard, uint32_t handle)
+{
+	uint32_t mask = shard->num_slots - 1;
+	uint32_t i = (drv_handle_hash(handle) / DRV_HANDLE_TABLE_SHARDS) & mask;
+
+	while (shard->slots[i].count && shard->slots[i].handle != handle)
+		i = (i + 1) & mask;
+
+	return i;
+}
+
+static int drv_handle_shard_grow(struct handle_shard *shard)
+{
+	struct handle_refcount *old_slots = shard->slots;
+	uint32_t old_num_slots = shard->num_slots;
+	uint32_t num_slots = old_num_slots ? old_num_slots * 2 : DRV_HANDLE_SHARD_MIN_SLOTS;
+	struct handle_refcount *slots = calloc(num_slots, sizeof(*slots));
+
+	if (!slots)
+		return -ENOMEM;
+
+	shard->slots = slots;
+	shard->num_slots = num_slots;
+	for (uint32_t i = 0; i < old_num_slots; i++) {
+		if (old_slots[i].count)
+			shard->slots[drv_handle_slot(shard, old_slots[i].handle)] = old_slots[i];
+	}
+
+	free(old_slots);
+	return 0;
+}
+
+/* Removes the entry at |i|, shifting later members of its probe chain back into the gap. */
+static void drv_handle_shard_remove(struct handle_shard *shard, uint32_t i)
+{
+	uint32_t mask = shard->num_slots - 1;
+	uint32_t j = i;
+
+	for (;;) {
+		uint32_t home;
+
+		shard->slots[i].count = 0;
+		do {
+			j = (j + 1) & mask;
+			if (!shard->slots[j].count) {
+				shard->num_used--;
+				return;
+			}
+
+			home = (drv_handle_hash(shard->slots[j].handle) / DRV_HANDLE_TABLE_SHARDS) &
+			       mask;
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+		shard->slots[i] = shard->slots[j];
+		i = j;
+	}
+}
+
+static struct handle_table *drv_handle_table_create(void)
+{
+	struct handle_table *table = calloc(1, sizeof(*table));
+	uint32_t i;
+
+	if (!table)
+		return NULL;
+
+	for (i = 0; i < DRV_HANDLE_TABLE_SHARDS; i++) {
+		if (pthread_mutex_init(&table->shards[i].lock, NULL))
+			goto destroy_locks;
+	}
+
+	return table;
+
+destroy_locks:
+	while (i--)
+		pthread_mutex_destroy(&table->shards[i].lock);
+	free(table);
+	return NULL;
+}
+
+static void drv_handle_table_destroy(struct handle_table *table)
+{
+	for (uint32_t i = 0; i < DRV_HANDLE_TABLE_SHARDS; i++) {
+		pthread_mutex_destroy(&table->shards[i].lock);
+		free(table->shards[i].slots);
+	}
+
+	free(table);
+}
+
+/*
+ * Takes a reference on |handle|. Returns the new reference count, or 0 on allocation failure,
+ * which only happens when |handle| had no references.
+ */
+static uint32_t drv_handle_table_get(struct handle_table *table, uint32_t handle)
+{
+	struct handle_shard *shard = drv_handle_shard(table, handle);
+	uint32_t count = 0, i;
+
+	pthread_mutex_lock(&shard->lock);
+	if (shard->num_slots) {
+		i = drv_handle_slot(shard, handle);
+		if (shard->slots[i].count)
+			goto ref;
+	}
+
+	/* Keep the load factor at or below 3/4 so probe chains stay short. */
+	if ((shard->num_used + 1) * 4 > shard->num_slots * 3) {
+		if (drv_handle_shard_grow(shard))
+			goto out;
+	}
+
+	i = drv_handle_slot(shard, handle);
+	if (!shard->slots[i].count) {
+		shard->slots[i].handle = handle;
+		shard->num_used++;
+		atomic_fetch_add_explicit(&table->num_live_handles, 1, memory_order_relaxed);
+	}
+
+ref:
+	count = ++shard->slots[i].count;
+out:
+	pthread_mutex_unlock(&shard->lock);
+	return count;
+}
+
+/* Drops a reference on |handle|, if it has any. Returns the remaining reference count. */
+static uint32_t drv_handle_table_put(struct handle_table *table, uint32_t handle)
+{
+	struct handle_shard *shard = drv_handle_shard(table, handle);
+	uint32_t count = 0, i;
+
+	pthread_mutex_lock(&shard->lock);
+	if (!shard->num_slots)
+		goto out;
+
+	i = drv_handle_slot(shard, handle);
+	if (!shard->slots[i].count)
+		goto out;
+
+	count = --shard->slots[i].count;
+	if (!count) {
+		drv_handle_shard_remove(shard, i);
+		atomic_fetch_sub_explicit(&table->num_live_handles, 1, memory_order_relaxed);
+	}
+out:
+	pthread_mutex_unlock(&shard->lock);
+	return count;
+}
+
+/*
+ * CPU mappings are tracked per GEM handle in |drv->mappings|. Each handle owns one VMA per set of
+ * map flags, and each VMA keeps the list of rectangles that are currently mapped through it, so
+ * map and unmap never have to walk mappings belonging to other buffers.
+ */
+struct mapping_entry {
+	/* Must be first: drv_bo_map() hands out a pointer to |mapping|. */
+	struct mapping mapping;
+	struct mapping_entry *prev;
+	struct mapping_entry *next;
+	struct vma_entry *vma_entry;
+};
+
+struct vma_entry {
+	struct vma vma;
+	struct vma_entry *next;
+	struct mapping_entry *mappings;
+	/* Set once any mapping of the vma asked for BO_MAP_PERSISTENT. */
+	bool persistent;
+	/* While parked: the bo that last unmapped the vma, and its place in the LRU list. */
+	struct bo *parked_bo;
+	struct vma_entry *lru_prev;
+	struct vma_entry *lru_next;
+};
+
+/* Address space idle BO_MAP_PERSISTENT mappings may hold, unless MINIGBM_MAP_CACHE_BYTES is set. */
+#define DRV_DEFAULT_PARKED_VMAS_MAX_BYTES (64ull << 20)
+
+static const char *drv_heap_names[DRV_NUM_HEAPS] = {
+	[DRV_HEAP_SYSTEM] = "system", [DRV_HEAP_CMA] = "cma",	[DRV_HEAP_GTT] = "gtt",
+	[DRV_HEAP_VRAM] = "vram",     [DRV_HEAP_BLOB] = "blob",
+};
+
+const char *drv_heap_name(enum drv_heap heap)
+{
+	assert(heap < DRV_NUM_HEAPS);
+	return drv_heap_names[heap];
+}
+
+void drv_get_heap_usage(struct driver *drv, enum drv_heap heap, struct drv_heap_usage *usage)
+{
+	struct drv_heap_counters *counters = &drv->heaps[heap];
+
+	assert(heap < DRV_NUM_HEAPS);
+	usage->allocated_bytes = __atomic_load_n(&counters->allocated_bytes, __ATOMIC_RELAXED);
+	usage->allocated_buffers = __atomic_load_n(&counters->allocated_buffers, __ATOMIC_RELAXED);
+	usage->imported_bytes = __atomic_load_n(&counters->imported_bytes, __ATOMIC_RELAXED);
+	usage->imported_buffers = __atomic_load_n(&counters->imported_buffers, __ATOMIC_RELAXED);
+	usage->budget = __atomic_load_n(&counters->budget, __ATOMIC_RELAXED);
+}
+
+void drv_set_heap_budget(struct driver *drv, enum drv_heap heap, uint64_t budget)
+{
+	assert(heap < DRV_NUM_HEAPS);
+	__atomic_store_n(&drv->heaps[heap].budget, budget, __ATOMIC_RELAXED);
+}
+
+/* Parses "<heap>=<bytes>[K|M|G][,...]", as taken by MINIGBM_HEAP_BUDGETS. */
+static void drv_parse_heap_budgets(struct driver *drv, const char *spec)
+{
+	char *copy = strdup(spec);
+	char *entry, *saveptr = NULL;
+
+	if (!copy)
+		return;
+
+	for (entry = strtok_r(copy, ",", &saveptr); entry; entry = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(entry, '=');
+		char *end;
+		uint64_t budget;
+		uint32_t heap, shift;
+
+		if (!value) {
+			drv_loge("ignoring malformed heap budget '%s'\n", entry);
+			continue;
+		}
+
+		*value++ = '\0';
+		for (heap = 0; heap < DRV_NUM_HEAPS; heap++)
+			if (!strcmp(entry, drv_heap_names[heap]))
+				break;
+
+		errno = 0;
+		budget = strtoull(value, &end, 0);
+		shift = 0;
+		switch (*end) {
+		case 'G':
+			shift += 10;
+			/* fallthrough */
+		case 'M':
+			shift += 10;
+			/* fallthrough */
+		case 'K':
+			shift += 10;
+			end++;
+			break;
+		}
+
+		/* The whole value must be a size: no sign, trailing garbage or overflow. */
+		if (heap == DRV_NUM_HEAPS || !isdigit((unsigned char)*value) || *end || errno ||
+		    budget > (UINT64_MAX >> shift)) {
+			drv_loge("ignoring malformed heap budget '%s=%s'\n", entry, value);
+			continue;
+		}
+
+		budget <<= shift;
+		drv_set_heap_budget(drv, heap, budget);
+	}
+
+	free(copy);
+}
+
+static const struct {
+	const char *name;
+	uint64_t use_flag;
+} drv_use_flag_names[] = {
+	{ "scanout", BO_USE_SCANOUT },
+	{ "cursor", BO_USE_CURSOR },
+	{ "rendering", BO_USE_RENDERING },
+	{ "linear", BO_USE_LINEAR },
+	{ "texture", BO_USE_TEXTURE },
+	{ "camera_write", BO_USE_CAMERA_WRITE },
+	{ "camera_read", BO_USE_CAMERA_READ },
+	{ "protected", BO_USE_PROTECTED },
+	{ "sw_read_often", BO_USE_SW_READ_OFTEN },
+	{ "sw_read_rarely", BO_USE_SW_READ_RARELY },
+	{ "sw_write_often", BO_USE_SW_WRITE_OFTEN },
+	{ "sw_write_rarely", BO_USE_SW_WRITE_RARELY },
+	{ "hw_video_decoder", BO_USE_HW_VIDEO_DECODER },
+	{ "hw_video_encoder", BO_USE_HW_VIDEO_ENCODER },
+	{ "front_rendering", BO_USE_FRONT_RENDERING },
+	{ "renderscript", BO_USE_RENDERSCRIPT },
+	{ "gpu_data_buffer", BO_USE_GPU_DATA_BUFFER },
+	{ "sensor_direct_data", BO_USE_SENSOR_DIRECT_DATA },
+};
+
+/* Policy files are a handful of lines; anything larger is not one. */
+#define DRV_COMPRESSION_POLICY_MAX_SIZE 4096
+
+static int drv_parse_use_flags(char *spec, uint64_t *out_use_flags)
+{
+	char *name, *saveptr = NULL;
+
+	*out_use_flags = 0;
+	for (name = strtok_r(spec, "|", &saveptr); name; name = strtok_r(NULL, "|", &saveptr)) {
+		size_t i;
+
+		for (i = 0; i < ARRAY_SIZE(drv_use_flag_names); i++)
+			if (!strcmp(name, drv_use_flag_names[i].name))
+				break;
+
+		if (i == ARRAY_SIZE(drv_use_flag_names))
+			return -EINVAL;
+
+		*out_use_flags |= drv_use_flag_names[i].use_flag;
+	}
+
+	return *out_use_flags ? 0 : -EINVAL;
+}
+
+/* Takes "<width>x<height>" or a pixel count. */
+static int drv_parse_pixels(const char *spec, uint64_t *out_pixels)
+{
+	unsigned long long width, height;
+	char tail;
+
+	if (sscanf(spec, "%llux%llu%c", &width, &height, &tail) == 2) {
+		*out_pixels = width * height;
+		return 0;
+	}
+
+	if (sscanf(spec, "%llu%c", &width, &tail) == 1) {
+		*out_pixels = width;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/* Parses one "on|off[:<key>=<value>...]" rule. */
+static int drv_parse_compression_rule(char *spec, struct drv_compression_rule *rule)
+{
+	char *item, *saveptr = NULL;
+
+	memset(rule, 0, sizeof(*rule));
+
+	item = strtok_r(spec, ":", &saveptr);
+	if (!item)
+		return -EINVAL;
+
+	if (!strcmp(item, "on"))
+		rule->allow = true;
+	else if (strcmp(item, "off"))
+		return -EINVAL;
+
+	while ((item = strtok_r(NULL, ":", &saveptr))) {
+		char *value = strchr(item, '=');
+		size_t len;
+
+		if (!value)
+			return -EINVAL;
+
+		*value++ = '\0';
+		if (!strcmp(item, "format")) {
+			/* Fourccs shorter than four characters, like R8, are space padded. */
+			len = strlen(value);
+			if (!len || len > 4)
+				return -EINVAL;
+
+			rule->format =
+			    fourcc_code(value[0], len > 1 ? value[1] : ' ', len > 2 ? value[2] : ' ',
+					len > 3 ? value[3] : ' ');
+		} else if (!strcmp(item, "use")) {
+			if (drv_parse_use_flags(value, &rule->use_flags))
+				return -EINVAL;
+		} else if (!strcmp(item, "min_size")) {
+			if (drv_parse_pixels(value, &rule->min_pixels))
+				return -EINVAL;
+		} else if (!strcmp(item, "max_size")) {
+			if (drv_parse_pixels(value, &rule->max_pixels))
+				return -EINVAL;
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static char *drv_read_compression_policy_file(const char *path)
+{
+	char *buf;
+	size_t len;
+	FILE *file;
+
+	file = fopen(path, "re");
+	if (!file) {
+		drv_loge("failed to open compression policy %s\n", path);
+		return NULL;
+	}
+
+	buf = calloc(1, DRV_COMPRESSION_POLICY_MAX_SIZE + 1);
+	if (buf) {
+		len = fread(buf, 1, DRV_COMPRESSION_POLICY_MAX_SIZE + 1, file);
+		if (len > DRV_COMPRESSION_POLICY_MAX_SIZE) {
+			drv_loge("compression policy %s is too large\n", path);
+			free(buf);
+			buf = NULL;
+		}
+	}
+
+	fclose(file);
+	return buf;
+}
+
+int drv_set_huge_page_policy(struct driver *drv, const char *spec)
+{
+	uint64_t use_flags = 0;
+	char *copy;
+	int ret = 0;
+
+	if (!strcmp(spec, "0") || !strcmp(spec, "off")) {
+		drv->huge_page_use_flags = 0;
+		return 0;
+	}
+
+	if (!strcmp(spec, "1") || !strcmp(spec, "on")) {
+		drv->huge_page_use_flags = DRV_HUGE_PAGE_DEFAULT_USE_FLAGS;
+		return 0;
+	}
+
+	copy = strdup(spec);
+	if (!copy)
+		return -ENOMEM;
+
+	if (drv_parse_use_flags(copy, &use_flags)) {
+		drv_loge("ignoring malformed huge page policy '%s'\n", spec);
+		ret = -EINVAL;
+	} else {
+		drv->huge_page_use_flags = use_flags;
+	}
+
+	free(copy);
+	return ret;
+}
+
+int drv_set_compression_policy(struct driver *drv, const char *spec)
+{
+	struct drv_compression_rule *rules = NULL;
+	char *copy, *entry, *saveptr = NULL;
+	uint32_t num_rules = 0;
+	size_t max_rules = 1;
+	const char *c;
+
+	if (spec[0] == '/')
+		copy = drv_read_compression_policy_file(spec);
+	else
+		copy = strdup(spec);
+
+	if (!copy)
+		return -ENOMEM;
+
+	for (c = copy; *c; c++)
+		if (*c == ',' || *c == '\n')
+			max_rules++;
+
+	rules = calloc(max_rules, sizeof(*rules));
+	if (!rules) {
+		free(copy);
+		return -ENOMEM;
+	}
+
+	for (entry = strtok_r(copy, ",\n", &saveptr); entry;
+	     entry = strtok_r(NULL, ",\n", &saveptr)) {
+		char *rule = entry + strspn(entry, " \t");
+
+		/* Blank lines and comments, for policy files. */
+		if (!*rule || *rule == '#')
+			continue;
+
+		if (drv_parse_compression_rule(rule, &rules[num_rules])) {
+			drv_loge("ignoring malformed compression rule '%s'\n", entry);
+			continue;
+		}
+
+		num_rules++;
+	}
+
+	free(copy);
+	free(drv->compression_rules);
+	drv->compression_rules = rules;
+	drv->num_compression_rules = num_rules;
+	return 0;
+}
+
+bool drv_compression_allowed(struct driver *drv, uint32_t format, uint64_t use_flags,
+			     uint32_t width, uint32_t height)
+{
+	uint64_t pixels = (uint64_t)width * height;
+	uint32_t i;
+
+	if (!drv->compression)
+		return false;
+
+	for (i = 0; i < drv->num_compression_rules; i++) {
+		const struct drv_compression_rule *rule = &drv->compression_rules[i];
+
+		if (rule->format && rule->format != format)
+			continue;
+		if (rule->use_flags && !(rule->use_flags & use_flags))
+			continue;
+		if (rule->min_pixels && pixels < rule->min_pixels)
+			continue;
+		if (rule->max_pixels && pixels > rule->max_pixels)
+			continue;
+
+		return rule->allow;
+	}
+
+	return true;
+}
+
+/* Counts |bo| in its heap's live totals, until drv_bo_destroy(). */
+static void drv_bo_account(struct bo *bo, bool imported)
+{
+	struct drv_heap_counters *counters;
+
+	assert(bo->heap < DRV_NUM_HEAPS);
+	counters = &bo->drv->heaps[bo->heap];
+
+	if (imported) {
+		__atomic_fetch_add(&counters->imported_bytes, bo->meta.total_size,
+				   __ATOMIC_RELAXED);
+		__atomic_fetch_add(&counters->imported_buffers, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&counters->allocated_bytes, bo->meta.total_size,
+				   __ATOMIC_RELAXED);
+		__atomic_fetch_add(&counters->allocated_buffers, 1, __ATOMIC_RELAXED);
+	}
+
+	bo->accounted = true;
+	bo->imported = imported;
+}
+
+static void drv_bo_unaccount(struct bo *bo)
+{
+	struct drv_heap_counters *counters = &bo->drv->heaps[bo->heap];
+
+	if (!bo->accounted)
+		return;
+
+	if (bo->imported) {
+		__atomic_fetch_sub(&counters->imported_bytes, bo->meta.total_size,
+				   __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&counters->imported_buffers, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_sub(&counters->allocated_bytes, bo->meta.total_size,
+				   __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&counters->allocated_buffers, 1, __ATOMIC_RELAXED);
+	}
+
+	bo->accounted = false;
+}
+
+static struct driver *drv_create_internal(int fd, bool mapper_only)
 {
 	struct driver *drv;
 	int ret;
@@ -113,70 +1002,126 @@ struct driver *drv_create(int fd)
 	if (!drv)
 		return NULL;
 
+	drv->mapper_only = mapper_only;
+
 	char *minigbm_debug;
 	minigbm_debug = getenv("MINIGBM_DEBUG");
 	drv->compression = (minigbm_debug == NULL) || (strcmp(minigbm_debug, "nocompression") != 0);
 
+	if (getenv("MINIGBM_HUGE_PAGES"))
+		drv_set_huge_page_policy(drv, getenv("MINIGBM_HUGE_PAGES"));
+
+	if (getenv("MINIGBM_STATS"))
+		drv->stats = drv_stats_create();
+
+	if (getenv("MINIGBM_HEAP_BUDGETS"))
+		drv_parse_heap_budgets(drv, getenv("MINIGBM_HEAP_BUDGETS"));
+
+	if (getenv("MINIGBM_COMPRESSION_POLICY"))
+		drv_set_compression_policy(drv, getenv("MINIGBM_COMPRESSION_POLICY"));
+
 	drv->fd = fd;
 	drv->backend = drv_get_backend(fd);
 
 	if (!drv->backend)
 		goto free_driver;
 
-	if (pthread_mutex_init(&drv->buffer_table_lock, NULL))
-		goto free_driver;
-
-	drv->buffer_table = drmHashCreate();
+	drv->buffer_table = drv_handle_table_create();
 	if (!drv->buffer_table)
-		goto free_buffer_table_lock;
+		goto free_driver;
 
 	if (pthread_mutex_init(&drv->mappings_lock, NULL))
 		goto free_buffer_table;
 
-	drv->mappings = drv_array_init(sizeof(struct mapping));
+	drv->mappings = drmHashCreate();
 	if (!drv->mappings)
 		goto free_mappings_lock;
 
+	drv->parked_vmas_max_bytes = DRV_DEFAULT_PARKED_VMAS_MAX_BYTES;
+	if (getenv("MINIGBM_MAP_CACHE_BYTES"))
+		drv->parked_vmas_max_bytes = strtoull(getenv("MINIGBM_MAP_CACHE_BYTES"), NULL, 0);
+
+	drv->bo_slab = drv_slab_create(sizeof(struct bo));
+	drv->vma_slab = drv_slab_create(sizeof(struct vma_entry));
+	drv->mapping_slab = drv_slab_create(sizeof(struct mapping_entry));
+	if (!drv->bo_slab || !drv->vma_slab || !drv->mapping_slab)
+		goto free_slabs;
+
 	drv->combos = drv_array_init(sizeof(struct combination));
 	if (!drv->combos)
-		goto free_mappings;
+		goto free_slabs;
 
 	if (drv->backend->init) {
 		ret = drv->backend->init(drv);
 		if (ret) {
 			drv_array_destroy(drv->combos);
-			goto free_mappings;
+			goto free_slabs;
 		}
 	}
 
+	/* Without a cache, every allocation just computes its layout. */
+	if (drv->backend->bo_compute_metadata)
+		drv->layout_cache = drv_layout_cache_create();
+
+	/* The backend is done adding combinations; a failure here just means linear lookups. */
+	drv->combo_index = drv_combination_index_create(drv->combos);
+	if (!drv->combo_index)
+		drv_logv("failed to build combination index\n");
+
 	return drv;
 
-free_mappings:
-	drv_array_destroy(drv->mappings);
+free_slabs:
+	drv_slab_destroy(drv->mapping_slab);
+	drv_slab_destroy(drv->vma_slab);
+	drv_slab_destroy(drv->bo_slab);
+	drmHashDestroy(drv->mappings);
 free_mappings_lock:
 	pthread_mutex_destroy(&drv->mappings_lock);
 free_buffer_table:
-	drmHashDestroy(drv->buffer_table);
-free_buffer_table_lock:
-	pthread_mutex_destroy(&drv->buffer_table_lock);
+	drv_handle_table_destroy(drv->buffer_table);
 free_driver:
+	drv_stats_destroy(drv->stats);
+	free(drv->compression_rules);
 	free(drv);
 	return NULL;
 }
 
+struct driver *drv_create(int fd)
+{
+	return drv_create_internal(fd, false);
+}
+
+struct driver *drv_create_mapper_only(int fd)
+{
+	return drv_create_internal(fd, true);
+}
+
 void drv_destroy(struct driver *drv)
 {
 	if (drv->backend->close)
 		drv->backend->close(drv);
 
+	drv_layout_cache_destroy(drv->layout_cache);
+	drv_combination_index_destroy(drv->combo_index);
 	drv_array_destroy(drv->combos);
 
-	drv_array_destroy(drv->mappings);
+	/* drv_bo_destroy() drops parked vmas, so none can be left once every bo is gone. */
+	assert(!drv->parked_vmas_head);
+	drmHashDestroy(drv->mappings);
 	pthread_mutex_destroy(&drv->mappings_lock);
 
-	drmHashDestroy(drv->buffer_table);
-	pthread_mutex_destroy(&drv->buffer_table_lock);
+	free(drv->shadow_cache);
+	drv_slab_destroy(drv->mapping_slab);
+	drv_slab_destroy(drv->vma_slab);
+	drv_slab_destroy(drv->bo_slab);
 
+	drv_handle_table_destroy(drv->buffer_table);
+
+	if (drv->stats && getenv("MINIGBM_STATS"))
+		drv_stats_log(drv);
+	drv_stats_destroy(drv->stats);
+
+	free(drv->compression_rules);
 	free(drv);
 }
 
@@ -190,6 +1135,11 @@ const char *drv_get_name(struct driver *drv)
 	return drv->backend->name;
 }
 
+uint32_t drv_get_num_live_handles(struct driver *drv)
+{
+	return atomic_load_explicit(&drv->buffer_table->num_live_handles, memory_order_relaxed);
+}
+
 struct combination *drv_get_combination(struct driver *drv, uint32_t format, uint64_t use_flags)
 {
 	struct combination *curr, *best;
@@ -197,6 +1147,15 @@ struct combination *drv_get_combination(struct driver *drv, uint32_t format, uin
 	if (format == DRM_FORMAT_NONE || use_flags == BO_USE_NONE)
 		return 0;
 
+	if (drv->combo_index) {
+		if (drv_combination_memo_get(drv->combo_index, format, use_flags, &best))
+			return best;
+
+		best = drv_combination_index_lookup(drv->combo_index, format, use_flags);
+		drv_combination_memo_put(drv->combo_index, format, use_flags, best);
+		return best;
+	}
+
 	best = NULL;
 	uint32_t i;
 	for (i = 0; i < drv_array_size(drv->combos); i++) {
@@ -209,12 +1168,37 @@ struct combination *drv_get_combination(struct driver *drv, uint32_t format, uin
 	return best;
 }
 
+struct combination *drv_get_combination_with_policy(struct driver *drv, uint32_t format,
+						    uint64_t use_flags, uint32_t width,
+						    uint32_t height)
+{
+	struct combination *curr, *best, *compressed = drv_get_combination(drv, format, use_flags);
+	uint32_t i;
+
+	if (!compressed || !drv_modifier_is_compressed(compressed->metadata.modifier) ||
+	    drv_compression_allowed(drv, format, use_flags, width, height))
+		return compressed;
+
+	best = NULL;
+	for (i = 0; i < drv_array_size(drv->combos); i++) {
+		curr = drv_array_at_idx(drv->combos, i);
+		if (format != curr->format || use_flags != (curr->use_flags & use_flags) ||
+		    drv_modifier_is_compressed(curr->metadata.modifier))
+			continue;
+		if (!best || best->metadata.priority < curr->metadata.priority)
+			best = curr;
+	}
+
+	/* The policy steers between layouts; it doesn't make a supported buffer unsupported. */
+	return best ? best : compressed;
+}
+
 struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 		      uint64_t use_flags, bool is_test_buffer)
 {
 
 	struct bo *bo;
-	bo = (struct bo *)calloc(1, sizeof(*bo));
+	bo = (struct bo *)drv_slab_alloc(drv->bo_slab);
 
 	if (!bo)
 		return NULL;
@@ -226,9 +1210,11 @@ struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint3
 	bo->meta.use_flags = use_flags;
 	bo->meta.num_planes = drv_num_planes_from_format(format);
 	bo->is_test_buffer = is_test_buffer;
+	for (size_t plane = 0; plane < DRV_MAX_PLANES; plane++)
+		bo->plane_fds[plane] = -1;
 
 	if (!bo->meta.num_planes) {
-		free(bo);
+		drv_slab_free(drv->bo_slab, bo);
 		errno = EINVAL;
 		return NULL;
 	}
@@ -236,10 +1222,152 @@ struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint3
 	return bo;
 }
 
+static struct vma_entry *drv_vma_entry_find(struct driver *drv, uint32_t handle,
+					    uint32_t map_flags)
+{
+	struct vma_entry *entry;
+
+	if (drmHashLookup(drv->mappings, handle, (void **)&entry))
+		return NULL;
+
+	for (; entry; entry = entry->next)
+		if (entry->vma.map_flags == map_flags)
+			return entry;
+
+	return NULL;
+}
+
+static int drv_vma_entry_insert(struct driver *drv, struct vma_entry *entry)
+{
+	struct vma_entry *head;
+
+	if (!drmHashLookup(drv->mappings, entry->vma.handle, (void **)&head)) {
+		/* Keep the existing head so the hash entry doesn't need to be replaced. */
+		entry->next = head->next;
+		head->next = entry;
+		return 0;
+	}
+
+	return drmHashInsert(drv->mappings, entry->vma.handle, entry) ? -ENOMEM : 0;
+}
+
+static void drv_vma_entry_remove(struct driver *drv, struct vma_entry *entry)
+{
+	struct vma_entry *head, **link;
+
+	if (drmHashLookup(drv->mappings, entry->vma.handle, (void **)&head))
+		return;
+
+	if (head == entry) {
+		drmHashDelete(drv->mappings, entry->vma.handle);
+		if (entry->next)
+			drmHashInsert(drv->mappings, entry->vma.handle, entry->next);
+		return;
+	}
+
+	for (link = &head->next; *link; link = &(*link)->next) {
+		if (*link == entry) {
+			*link = entry->next;
+			return;
+		}
+	}
+}
+
+static void drv_vma_entry_unpark(struct driver *drv, struct vma_entry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		drv->parked_vmas_head = entry->lru_next;
+
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		drv->parked_vmas_tail = entry->lru_prev;
+
+	drv->parked_vmas_bytes -= entry->vma.length;
+	entry->parked_bo = NULL;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void drv_vma_entry_park(struct driver *drv, struct bo *bo, struct vma_entry *entry)
+{
+	entry->parked_bo = bo;
+	entry->lru_prev = drv->parked_vmas_tail;
+	entry->lru_next = NULL;
+	if (drv->parked_vmas_tail)
+		drv->parked_vmas_tail->lru_next = entry;
+	else
+		drv->parked_vmas_head = entry;
+
+	drv->parked_vmas_tail = entry;
+	drv->parked_vmas_bytes += entry->vma.length;
+}
+
+static int drv_vma_entry_destroy(struct driver *drv, struct bo *bo, struct vma_entry *entry)
+{
+	struct drv_stat_scope scope;
+	int ret;
+
+	drv_stat_begin(drv, DRV_STAT_BO_UNMAP, &scope);
+	ret = drv->backend->bo_unmap(bo, &entry->vma);
+	drv_stat_end(drv, DRV_STAT_BO_UNMAP, &scope);
+	drv_vma_entry_remove(drv, entry);
+	drv_slab_free(drv->vma_slab, entry);
+
+	return ret;
+}
+
+/* Unmaps parked vmas, oldest first, until at most |max_bytes| of them remain. */
+static void drv_trim_parked_vmas(struct driver *drv, size_t max_bytes)
+{
+	while (drv->parked_vmas_head && drv->parked_vmas_bytes > max_bytes) {
+		struct vma_entry *entry = drv->parked_vmas_head;
+		struct bo *bo = entry->parked_bo;
+
+		drv_vma_entry_unpark(drv, entry);
+		if (drv_vma_entry_destroy(drv, bo, entry))
+			drv_loge("munmap failed\n");
+	}
+}
+
+/*
+ * Parked vmas remember the bo that parked them so that they can be unmapped later. Another bo
+ * sharing the GEM handle may outlive that one, so drop them before the bo goes away.
+ */
+static void drv_bo_drop_parked_vmas(struct bo *bo)
+{
+	struct driver *drv = bo->drv;
+	struct vma_entry *entry, *next;
+
+	pthread_mutex_lock(&drv->mappings_lock);
+	for (entry = drv->parked_vmas_head; entry; entry = next) {
+		next = entry->lru_next;
+		if (entry->parked_bo != bo)
+			continue;
+
+		drv_vma_entry_unpark(drv, entry);
+		if (drv_vma_entry_destroy(drv, bo, entry))
+			drv_loge("munmap failed\n");
+	}
+	pthread_mutex_unlock(&drv->mappings_lock);
+}
+
+static void drv_mapping_entry_unlink(struct mapping_entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		entry->vma_entry->mappings = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+}
+
 static void drv_bo_mapping_destroy(struct bo *bo)
 {
 	struct driver *drv = bo->drv;
-	uint32_t idx = 0;
 
 	/*
 	 * This function is called right before the buffer is destroyed. It will free any mappings
@@ -247,50 +1375,90 @@ static void drv_bo_mapping_destroy(struct bo *bo)
 	 */
 	pthread_mutex_lock(&drv->mappings_lock);
 	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
-		while (idx < drv_array_size(drv->mappings)) {
-			struct mapping *mapping =
-			    (struct mapping *)drv_array_at_idx(drv->mappings, idx);
-			if (mapping->vma->handle != bo->handles[plane].u32) {
-				idx++;
-				continue;
+		struct vma_entry *entry;
+
+		/* Planes sharing a handle find nothing left after the first one is handled. */
+		while (!drmHashLookup(drv->mappings, bo->handles[plane].u32, (void **)&entry)) {
+			int ret = drv->backend->bo_unmap(bo, &entry->vma);
+			if (ret) {
+				pthread_mutex_unlock(&drv->mappings_lock);
+				assert(ret);
+				drv_loge("munmap failed\n");
+				return;
 			}
 
-			if (!--mapping->vma->refcount) {
-				int ret = drv->backend->bo_unmap(bo, mapping->vma);
-				if (ret) {
-					pthread_mutex_unlock(&drv->mappings_lock);
-					assert(ret);
-					drv_loge("munmap failed\n");
-					return;
-				}
+			if (entry->parked_bo)
+				drv_vma_entry_unpark(drv, entry);
 
-				free(mapping->vma);
+			drv_vma_entry_remove(drv, entry);
+			while (entry->mappings) {
+				struct mapping_entry *mapping = entry->mappings;
+				entry->mappings = mapping->next;
+				drv_slab_free(drv->mapping_slab, mapping);
 			}
 
-			/* This shrinks and shifts the array, so don't increment idx. */
-			drv_array_remove(drv->mappings, idx);
+			drv_slab_free(drv->vma_slab, entry);
 		}
 	}
 	pthread_mutex_unlock(&drv->mappings_lock);
 }
 
 /*
- * Acquire a reference on plane buffers of the bo.
+ * Drop the references the first |num_planes| planes of the bo hold. Return true when that was the
+ * last reference on each of their buffers. The result comes from the same locked decrement that
+ * removes a handle, so exactly one of the bos sharing a handle sees it released.
  */
-static void drv_bo_acquire(struct bo *bo)
+static bool drv_bo_put_handles(struct bo *bo, size_t num_planes)
 {
 	struct driver *drv = bo->drv;
+	uint32_t remaining[DRV_MAX_PLANES];
+	bool released = true;
 
-	pthread_mutex_lock(&drv->buffer_table_lock);
-	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
-		uintptr_t num = 0;
+	for (size_t plane = 0; plane < num_planes; plane++)
+		remaining[plane] = drv_handle_table_put(drv->buffer_table, bo->handles[plane].u32);
 
-		if (!drmHashLookup(drv->buffer_table, bo->handles[plane].u32, (void **)&num))
-			drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
+	/* The same buffer can back multiple planes with different offsets. */
+	for (size_t plane = 0; plane < num_planes; plane++) {
+		bool last = false;
 
-		drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num + 1));
+		for (size_t other = 0; other < num_planes; other++) {
+			if (bo->handles[other].u32 == bo->handles[plane].u32 && !remaining[other])
+				last = true;
+		}
+
+		released &= last;
 	}
-	pthread_mutex_unlock(&drv->buffer_table_lock);
+
+	return released;
+}
+
+/*
+ * Acquire a reference on plane buffers of the bo. On failure, the references already taken are
+ * dropped and the bo's buffers are closed if no other bo shares them.
+ */
+static int drv_bo_acquire(struct bo *bo)
+{
+	struct driver *drv = bo->drv;
+	size_t plane;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		if (!drv_handle_table_get(drv->buffer_table, bo->handles[plane].u32))
+			goto release;
+	}
+
+	return 0;
+
+release:
+	drv_loge("failed to track GEM handle %u\n", bo->handles[plane].u32);
+
+	if (drv->backend->bo_release)
+		drv->backend->bo_release(bo);
+
+	/* The failed handle had no references, so it is ours to close once nothing else is. */
+	if (drv_bo_put_handles(bo, plane))
+		drv->backend->bo_destroy(bo);
+
+	return -ENOMEM;
 }
 
 /*
@@ -300,34 +1468,31 @@ static void drv_bo_acquire(struct bo *bo)
 static bool drv_bo_release(struct bo *bo)
 {
 	struct driver *drv = bo->drv;
-	uintptr_t num;
 
 	if (drv->backend->bo_release)
 		drv->backend->bo_release(bo);
 
-	pthread_mutex_lock(&drv->buffer_table_lock);
-	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
-		if (!drmHashLookup(drv->buffer_table, bo->handles[plane].u32, (void **)&num)) {
-			drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
+	return drv_bo_put_handles(bo, bo->meta.num_planes);
+}
 
-			if (num > 1) {
-				drmHashInsert(drv->buffer_table, bo->handles[plane].u32,
-					      (void *)(num - 1));
-			}
-		}
-	}
+/* bo_compute_metadata() is a pure function of its arguments, so its results are memoized. */
+static int drv_bo_compute_metadata(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+				   uint64_t use_flags, const uint64_t *modifiers, uint32_t count)
+{
+	struct driver *drv = bo->drv;
+	int ret;
 
-	/* The same buffer can back multiple planes with different offsets. */
-	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
-		if (!drmHashLookup(drv->buffer_table, bo->handles[plane].u32, (void **)&num)) {
-			/* num is positive if found in the hashmap. */
-			pthread_mutex_unlock(&drv->buffer_table_lock);
-			return false;
-		}
-	}
-	pthread_mutex_unlock(&drv->buffer_table_lock);
+	if (drv_layout_cache_lookup(drv->layout_cache, width, height, format, use_flags, modifiers,
+				    count, &bo->meta))
+		return 0;
+
+	ret = drv->backend->bo_compute_metadata(bo, width, height, format, use_flags, modifiers,
+						count);
+	if (ret == 0)
+		drv_layout_cache_insert(drv->layout_cache, width, height, format, use_flags,
+					modifiers, count, &bo->meta);
 
-	return true;
+	return ret;
 }
 
 struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
@@ -336,6 +1501,7 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 	int ret;
 	struct bo *bo;
 	bool is_test_alloc;
+	struct drv_stat_scope scope;
 
 	is_test_alloc = use_flags & BO_USE_TEST_ALLOC;
 	use_flags &= ~BO_USE_TEST_ALLOC;
@@ -345,23 +1511,35 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 	if (!bo)
 		return NULL;
 
+	drv_stat_begin(drv, DRV_STAT_BO_CREATE, &scope);
+
 	ret = -EINVAL;
 	if (drv->backend->bo_compute_metadata) {
-		ret = drv->backend->bo_compute_metadata(bo, width, height, format, use_flags, NULL,
-							0);
+		ret = drv_bo_compute_metadata(bo, width, height, format, use_flags, NULL, 0);
 		if (!is_test_alloc && ret == 0)
 			ret = drv->backend->bo_create_from_metadata(bo);
 	} else if (!is_test_alloc) {
 		ret = drv->backend->bo_create(bo, width, height, format, use_flags);
 	}
 
+	drv_stat_end(drv, DRV_STAT_BO_CREATE, &scope);
+
 	if (ret) {
 		errno = -ret;
-		free(bo);
+		drv_slab_free(drv->bo_slab, bo);
 		return NULL;
 	}
 
-	drv_bo_acquire(bo);
+	if (!is_test_alloc && drv_bo_acquire(bo)) {
+		errno = ENOMEM;
+		drv_slab_free(drv->bo_slab, bo);
+		return NULL;
+	}
+
+	if (!is_test_alloc) {
+		drv_bo_account(bo, false);
+		bo->stats_recorded = drv_stats_record_alloc(drv, format, bo->meta.total_size);
+	}
 
 	return bo;
 }
@@ -371,6 +1549,7 @@ struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint
 {
 	int ret;
 	struct bo *bo;
+	struct drv_stat_scope scope;
 
 	if (!drv->backend->bo_create_with_modifiers && !drv->backend->bo_compute_metadata) {
 		errno = ENOENT;
@@ -382,10 +1561,12 @@ struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint
 	if (!bo)
 		return NULL;
 
+	drv_stat_begin(drv, DRV_STAT_BO_CREATE, &scope);
+
 	ret = -EINVAL;
 	if (drv->backend->bo_compute_metadata) {
-		ret = drv->backend->bo_compute_metadata(bo, width, height, format, BO_USE_NONE,
-							modifiers, count);
+		ret = drv_bo_compute_metadata(bo, width, height, format, BO_USE_NONE, modifiers,
+					      count);
 		if (ret == 0)
 			ret = drv->backend->bo_create_from_metadata(bo);
 	} else {
@@ -393,59 +1574,131 @@ struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint
 							     count);
 	}
 
+	drv_stat_end(drv, DRV_STAT_BO_CREATE, &scope);
+
 	if (ret) {
-		free(bo);
+		drv_slab_free(drv->bo_slab, bo);
+		return NULL;
+	}
+
+	if (drv_bo_acquire(bo)) {
+		errno = ENOMEM;
+		drv_slab_free(drv->bo_slab, bo);
 		return NULL;
 	}
 
-	drv_bo_acquire(bo);
+	drv_bo_account(bo, false);
+	bo->stats_recorded = drv_stats_record_alloc(drv, format, bo->meta.total_size);
 
 	return bo;
 }
 
+int drv_bo_query_layout(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags)
+{
+	struct bo *bo;
+	int ret;
+
+	if (!drv->backend->bo_compute_metadata && !drv->backend->bo_query_layout)
+		return -ENOTSUP;
+
+	bo = drv_bo_new(drv, width, height, format, use_flags, true);
+	if (!bo)
+		return -errno;
+
+	if (drv->backend->bo_compute_metadata)
+		ret = drv_bo_compute_metadata(bo, width, height, format, use_flags, NULL, 0);
+	else
+		ret = drv->backend->bo_query_layout(bo);
+
+	drv_slab_free(drv->bo_slab, bo);
+	return ret;
+}
+
 void drv_bo_destroy(struct bo *bo)
 {
+	if (!bo->is_test_buffer)
+		drv_bo_drop_parked_vmas(bo);
+
 	if (!bo->is_test_buffer && drv_bo_release(bo)) {
 		drv_bo_mapping_destroy(bo);
 		bo->drv->backend->bo_destroy(bo);
 	}
 
-	free(bo);
+	for (size_t plane = 0; plane < DRV_MAX_PLANES; plane++) {
+		if (bo->plane_fds[plane] >= 0) {
+			close(bo->plane_fds[plane]);
+			__atomic_fetch_sub(&bo->drv->num_cached_plane_fds, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	drv_bo_unaccount(bo);
+	if (bo->stats_recorded)
+		drv_stats_record_free(bo->drv, bo->meta.format, bo->meta.total_size);
+
+	drv_slab_free(bo->drv->bo_slab, bo);
 }
 
-struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
+/*
+ * |fd_sizes|, if non-NULL, holds the size of the dma-buf behind each plane's fd, so they don't
+ * have to be probed.
+ */
+static struct bo *drv_bo_import_sized(struct driver *drv, struct drv_import_fd_data *data,
+				      const off_t *fd_sizes)
 {
 	int ret;
 	size_t plane;
 	struct bo *bo;
-	off_t seek_end;
+	off_t seek_end = 0;
+	bool has_sizes = true;
+	struct drv_stat_scope scope;
 
 	bo = drv_bo_new(drv, data->width, data->height, data->format, data->use_flags, false);
 
 	if (!bo)
 		return NULL;
 
+	drv_stat_begin(drv, DRV_STAT_BO_IMPORT, &scope);
 	ret = drv->backend->bo_import(bo, data);
+	drv_stat_end(drv, DRV_STAT_BO_IMPORT, &scope);
 	if (ret) {
-		free(bo);
+		drv_slab_free(drv->bo_slab, bo);
+		return NULL;
+	}
+
+	if (drv_bo_acquire(bo)) {
+		errno = ENOMEM;
+		drv_slab_free(drv->bo_slab, bo);
 		return NULL;
 	}
 
-	drv_bo_acquire(bo);
+	for (plane = 0; plane < bo->meta.num_planes; plane++)
+		has_sizes &= data->sizes[plane] != 0;
 
 	bo->meta.format_modifier = data->format_modifier;
 	for (plane = 0; plane < bo->meta.num_planes; plane++) {
 		bo->meta.strides[plane] = data->strides[plane];
 		bo->meta.offsets[plane] = data->offsets[plane];
 
-		seek_end = lseek(data->fds[plane], 0, SEEK_END);
-		if (seek_end == (off_t)(-1)) {
-			drv_loge("lseek() failed with %s\n", strerror(errno));
-			goto destroy_bo;
+		/*
+		 * Planes sharing the previous plane's fd share its size too. Sizes from the caller
+		 * are still checked against it, since the handle may come from another process.
+		 */
+		if (fd_sizes) {
+			seek_end = fd_sizes[plane];
+		} else if (!plane || data->fds[plane] != data->fds[plane - 1]) {
+			seek_end = lseek(data->fds[plane], 0, SEEK_END);
+			if (seek_end == (off_t)(-1)) {
+				drv_loge("lseek() failed with %s\n", strerror(errno));
+				goto destroy_bo;
+			}
+
+			lseek(data->fds[plane], 0, SEEK_SET);
 		}
 
-		lseek(data->fds[plane], 0, SEEK_SET);
-		if (plane == bo->meta.num_planes - 1 || data->offsets[plane + 1] == 0)
+		if (has_sizes)
+			bo->meta.sizes[plane] = data->sizes[plane];
+		else if (plane == bo->meta.num_planes - 1 || data->offsets[plane + 1] == 0)
 			bo->meta.sizes[plane] = seek_end - data->offsets[plane];
 		else
 			bo->meta.sizes[plane] = data->offsets[plane + 1] - data->offsets[plane];
@@ -458,6 +1711,7 @@ struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 		bo->meta.total_size += bo->meta.sizes[plane];
 	}
 
+	drv_bo_account(bo, true);
 	return bo;
 
 destroy_bo:
@@ -465,13 +1719,164 @@ destroy_bo:
 	return NULL;
 }
 
+struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
+{
+	return drv_bo_import_sized(drv, data, NULL);
+}
+
+struct drv_import_dmabuf {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+};
+
+/*
+ * Returns the batch's record of the dma-buf |fd| refers to, adding it if this is the first fd
+ * for it. fstat() reports a dma-buf's size, which saves the two lseek()s per plane.
+ */
+static struct drv_import_dmabuf *drv_import_dmabuf_lookup(struct drv_import_dmabuf *dmabufs,
+							  size_t *num_dmabufs, int fd)
+{
+	struct stat sb;
+	size_t i;
+
+	for (i = 0; i < *num_dmabufs; i++) {
+		if (dmabufs[i].fd == fd)
+			return &dmabufs[i];
+	}
+
+	if (fstat(fd, &sb)) {
+		drv_loge("fstat() failed with %s\n", strerror(errno));
+		return NULL;
+	}
+
+	for (i = 0; i < *num_dmabufs; i++) {
+		if (dmabufs[i].dev == sb.st_dev && dmabufs[i].ino == sb.st_ino)
+			return &dmabufs[i];
+	}
+
+	dmabufs[i].fd = fd;
+	dmabufs[i].dev = sb.st_dev;
+	dmabufs[i].ino = sb.st_ino;
+	dmabufs[i].size = sb.st_size;
+	(*num_dmabufs)++;
+	return &dmabufs[i];
+}
+
+size_t drv_bo_import_batch(struct driver *drv, const struct drv_import_fd_data *data, size_t count,
+			   struct bo **out_bos)
+{
+	struct drv_import_dmabuf *dmabufs;
+	size_t num_dmabufs = 0, num_imported = 0;
+
+	/* Without room to track dma-bufs, every buffer is imported as drv_bo_import() would. */
+	dmabufs = calloc(count * DRV_MAX_PLANES, sizeof(*dmabufs));
+
+	for (size_t i = 0; i < count; i++) {
+		struct drv_import_fd_data canonical = data[i];
+		off_t fd_sizes[DRV_MAX_PLANES] = { 0 };
+		size_t num_planes = drv_num_planes_from_modifier(drv, canonical.format,
+								 canonical.format_modifier);
+		bool sized = dmabufs != NULL;
+
+		/*
+		 * Point every plane at the first fd seen for its dma-buf so the backend sees planes
+		 * of the same buffer as sharing an fd, whatever fds the client passed.
+		 */
+		for (size_t plane = 0; sized && plane < num_planes && plane < DRV_MAX_PLANES;
+		     plane++) {
+			struct drv_import_dmabuf *dmabuf =
+			    drv_import_dmabuf_lookup(dmabufs, &num_dmabufs, canonical.fds[plane]);
+
+			if (!dmabuf) {
+				sized = false;
+				break;
+			}
+
+			canonical.fds[plane] = dmabuf->fd;
+			fd_sizes[plane] = dmabuf->size;
+		}
+
+		if (!sized)
+			canonical = data[i];
+
+		out_bos[i] = drv_bo_import_sized(drv, &canonical, sized ? fd_sizes : NULL);
+		num_imported += out_bos[i] != NULL;
+	}
+
+	free(dmabufs);
+	return num_imported;
+}
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/*
+ * Faults in the rows of every plane in |mapping|'s vma that its rectangle covers. The kernel
+ * refuses MADV_POPULATE_* with EINVAL on VM_PFNMAP/VM_IO mappings, which most GEM and dma-heap
+ * mmaps are, and before 5.14; nothing else would prefault those, so the driver stops trying.
+ */
+static void drv_bo_prefault(struct bo *bo, struct mapping *mapping, size_t mapped_plane)
+{
+	const struct rectangle *rect = &mapping->rect;
+	uint8_t *base = mapping->vma->addr;
+	uintptr_t page_mask = (uintptr_t)getpagesize() - 1;
+	int advice = (mapping->vma->map_flags & BO_MAP_WRITE) ? MADV_POPULATE_WRITE
+							       : MADV_POPULATE_READ;
+
+	if (__atomic_load_n(&bo->drv->prefault_unsupported, __ATOMIC_RELAXED))
+		return;
+
+	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
+		uint32_t subsample, stride = bo->meta.strides[plane];
+		size_t start, end;
+		uintptr_t first, last;
+
+		/* Other handles are other buffers, with their own vmas. */
+		if (bo->handles[plane].u32 != bo->handles[mapped_plane].u32)
+			continue;
+
+		subsample = drv_vertical_subsampling_from_format(bo->meta.format, plane);
+		start = (size_t)(rect->y / subsample) * stride;
+		end = (size_t)DIV_ROUND_UP(rect->y + rect->height, subsample) * stride;
+		if (end > bo->meta.sizes[plane])
+			end = bo->meta.sizes[plane];
+
+		start += bo->meta.offsets[plane];
+		end += bo->meta.offsets[plane];
+		if (end > mapping->vma->length)
+			end = mapping->vma->length;
+		if (start >= end)
+			continue;
+
+		first = (uintptr_t)(base + start) & ~page_mask;
+		last = ((uintptr_t)(base + end) + page_mask) & ~page_mask;
+		if (madvise((void *)first, last - first, advice) && errno == EINVAL) {
+			__atomic_store_n(&bo->drv->prefault_unsupported, true, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
 void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
 		 struct mapping **map_data, size_t plane)
 {
 	struct driver *drv = bo->drv;
-	uint32_t i;
+	uint32_t handle = bo->handles[plane].u32;
 	uint8_t *addr;
-	struct mapping mapping = { 0 };
+	struct vma_entry *vma_entry;
+	struct mapping_entry *mapping;
+	struct drv_stat_scope scope;
+	bool persistent = map_flags & BO_MAP_PERSISTENT;
+	bool prefault = map_flags & BO_MAP_PREFAULT;
+	bool new_vma = false;
+
+	map_flags &= ~(BO_MAP_PERSISTENT | BO_MAP_PREFAULT);
 
 	assert(rect->width >= 0);
 	assert(rect->height >= 0);
@@ -484,72 +1889,95 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 	if (bo->is_test_buffer)
 		return MAP_FAILED;
 
-	mapping.rect = *rect;
-	mapping.refcount = 1;
-
 	pthread_mutex_lock(&drv->mappings_lock);
 
-	for (i = 0; i < drv_array_size(drv->mappings); i++) {
-		struct mapping *prior = (struct mapping *)drv_array_at_idx(drv->mappings, i);
-		if (prior->vma->handle != bo->handles[plane].u32 ||
-		    prior->vma->map_flags != map_flags)
-			continue;
+	vma_entry = drv_vma_entry_find(drv, handle, map_flags);
+	if (vma_entry) {
+		if (vma_entry->parked_bo)
+			drv_vma_entry_unpark(drv, vma_entry);
 
-		if (rect->x != prior->rect.x || rect->y != prior->rect.y ||
-		    rect->width != prior->rect.width || rect->height != prior->rect.height)
-			continue;
+		for (mapping = vma_entry->mappings; mapping; mapping = mapping->next) {
+			const struct rectangle *prior = &mapping->mapping.rect;
+			if (rect->x != prior->x || rect->y != prior->y ||
+			    rect->width != prior->width || rect->height != prior->height)
+				continue;
 
-		prior->refcount++;
-		*map_data = prior;
-		goto exact_match;
-	}
+			mapping->mapping.refcount++;
+			goto exact_match;
+		}
+	} else {
+		vma_entry = drv_slab_alloc(drv->vma_slab);
+		if (!vma_entry)
+			goto fail;
+
+		memcpy(vma_entry->vma.map_strides, bo->meta.strides,
+		       sizeof(vma_entry->vma.map_strides));
+		drv_stat_begin(drv, DRV_STAT_BO_MAP, &scope);
+		addr = drv->backend->bo_map(bo, &vma_entry->vma, plane, map_flags);
+		drv_stat_end(drv, DRV_STAT_BO_MAP, &scope);
+		if (addr == MAP_FAILED) {
+			drv_slab_free(drv->vma_slab, vma_entry);
+			goto fail;
+		}
 
-	for (i = 0; i < drv_array_size(drv->mappings); i++) {
-		struct mapping *prior = (struct mapping *)drv_array_at_idx(drv->mappings, i);
-		if (prior->vma->handle != bo->handles[plane].u32 ||
-		    prior->vma->map_flags != map_flags)
-			continue;
+		vma_entry->vma.addr = addr;
+		vma_entry->vma.handle = handle;
+		vma_entry->vma.map_flags = map_flags;
 
-		prior->vma->refcount++;
-		mapping.vma = prior->vma;
-		goto success;
-	}
+		if (drv_vma_entry_insert(drv, vma_entry)) {
+			drv->backend->bo_unmap(bo, &vma_entry->vma);
+			drv_slab_free(drv->vma_slab, vma_entry);
+			goto fail;
+		}
 
-	mapping.vma = calloc(1, sizeof(*mapping.vma));
-	if (!mapping.vma) {
-		*map_data = NULL;
-		pthread_mutex_unlock(&drv->mappings_lock);
-		return MAP_FAILED;
+		new_vma = true;
 	}
 
-	memcpy(mapping.vma->map_strides, bo->meta.strides, sizeof(mapping.vma->map_strides));
-	addr = drv->backend->bo_map(bo, mapping.vma, plane, map_flags);
-	if (addr == MAP_FAILED) {
-		*map_data = NULL;
-		free(mapping.vma);
-		pthread_mutex_unlock(&drv->mappings_lock);
-		return MAP_FAILED;
+	mapping = drv_slab_alloc(drv->mapping_slab);
+	if (!mapping) {
+		if (!vma_entry->mappings) {
+			drv->backend->bo_unmap(bo, &vma_entry->vma);
+			drv_vma_entry_remove(drv, vma_entry);
+			drv_slab_free(drv->vma_slab, vma_entry);
+		}
+		goto fail;
 	}
 
-	mapping.vma->refcount = 1;
-	mapping.vma->addr = addr;
-	mapping.vma->handle = bo->handles[plane].u32;
-	mapping.vma->map_flags = map_flags;
+	mapping->mapping.vma = &vma_entry->vma;
+	mapping->mapping.rect = *rect;
+	mapping->mapping.refcount = 1;
+	mapping->vma_entry = vma_entry;
+	mapping->next = vma_entry->mappings;
+	if (mapping->next)
+		mapping->next->prev = mapping;
+	vma_entry->mappings = mapping;
+	vma_entry->vma.refcount++;
+	vma_entry->persistent |= persistent;
 
-success:
-	*map_data = drv_array_append(drv->mappings, &mapping);
 exact_match:
+	*map_data = &mapping->mapping;
 	drv_bo_invalidate(bo, *map_data);
 	addr = (uint8_t *)((*map_data)->vma->addr);
 	addr += drv_bo_get_plane_offset(bo, plane);
 	pthread_mutex_unlock(&drv->mappings_lock);
+
+	/* Later maps of a vma mostly touch pages it already faulted in. Our reference keeps it. */
+	if (prefault && new_vma)
+		drv_bo_prefault(bo, *map_data, plane);
+
 	return (void *)addr;
+
+fail:
+	*map_data = NULL;
+	pthread_mutex_unlock(&drv->mappings_lock);
+	return MAP_FAILED;
 }
 
 int drv_bo_unmap(struct bo *bo, struct mapping *mapping)
 {
 	struct driver *drv = bo->drv;
-	uint32_t i;
+	struct mapping_entry *entry = (struct mapping_entry *)mapping;
+	struct vma_entry *vma_entry = entry->vma_entry;
 	int ret = 0;
 
 	pthread_mutex_lock(&drv->mappings_lock);
@@ -557,15 +1985,22 @@ int drv_bo_unmap(struct bo *bo, struct mapping *mapping)
 	if (--mapping->refcount)
 		goto out;
 
-	if (!--mapping->vma->refcount) {
-		ret = drv->backend->bo_unmap(bo, mapping->vma);
-		free(mapping->vma);
-	}
-
-	for (i = 0; i < drv_array_size(drv->mappings); i++) {
-		if (mapping == (struct mapping *)drv_array_at_idx(drv->mappings, i)) {
-			drv_array_remove(drv->mappings, i);
-			break;
+	drv_mapping_entry_unlink(entry);
+	drv_slab_free(drv->mapping_slab, entry);
+
+	if (!--vma_entry->vma.refcount) {
+		size_t max_bytes = drv->parked_vmas_max_bytes;
+
+		/*
+		 * A backend's |priv| state, e.g. which staged rows are valid or dirty, is only
+		 * reconciled with the buffer by bo_unmap, so such vmas can't be parked.
+		 */
+		if (vma_entry->persistent && !vma_entry->vma.priv &&
+		    vma_entry->vma.length <= max_bytes) {
+			drv_trim_parked_vmas(drv, max_bytes - vma_entry->vma.length);
+			drv_vma_entry_park(drv, bo, vma_entry);
+		} else {
+			ret = drv_vma_entry_destroy(drv, bo, vma_entry);
 		}
 	}
 
@@ -576,6 +2011,7 @@ out:
 
 int drv_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
+	struct drv_stat_scope scope;
 	int ret = 0;
 
 	assert(mapping);
@@ -583,14 +2019,18 @@ int drv_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	assert(mapping->refcount > 0);
 	assert(mapping->vma->refcount > 0);
 
-	if (bo->drv->backend->bo_invalidate)
+	if (bo->drv->backend->bo_invalidate) {
+		drv_stat_begin(bo->drv, DRV_STAT_BO_INVALIDATE, &scope);
 		ret = bo->drv->backend->bo_invalidate(bo, mapping);
+		drv_stat_end(bo->drv, DRV_STAT_BO_INVALIDATE, &scope);
+	}
 
 	return ret;
 }
 
-int drv_bo_flush(struct bo *bo, struct mapping *mapping)
+int drv_bo_flush(struct bo *bo, struct mapping *mapping, int *out_fence)
 {
+	struct drv_stat_scope scope;
 	int ret = 0;
 
 	assert(mapping);
@@ -598,13 +2038,22 @@ int drv_bo_flush(struct bo *bo, struct mapping *mapping)
 	assert(mapping->refcount > 0);
 	assert(mapping->vma->refcount > 0);
 
-	if (bo->drv->backend->bo_flush)
-		ret = bo->drv->backend->bo_flush(bo, mapping);
+	if (out_fence)
+		*out_fence = -1;
+
+	if (bo->drv->backend->bo_flush) {
+		drv_stat_begin(bo->drv, DRV_STAT_BO_FLUSH, &scope);
+		ret = bo->drv->backend->bo_flush(bo, mapping, out_fence);
+		drv_stat_end(bo->drv, DRV_STAT_BO_FLUSH, &scope);
+	}
+
+	if (!ret)
+		mapping->num_dirty_rects = 0;
 
 	return ret;
 }
 
-int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
+int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping, int *out_fence)
 {
 	int ret = 0;
 
@@ -614,14 +2063,163 @@ int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
 	assert(mapping->vma->refcount > 0);
 	assert(!(bo->meta.use_flags & BO_USE_PROTECTED));
 
+	if (out_fence)
+		*out_fence = -1;
+
 	if (bo->drv->backend->bo_flush)
-		ret = bo->drv->backend->bo_flush(bo, mapping);
-	else
+		ret = drv_bo_flush(bo, mapping, out_fence);
+
+	/* Persistent mappings are parked rather than unmapped, so they can always be released. */
+	if (!ret && (!bo->drv->backend->bo_flush ||
+		     ((struct mapping_entry *)mapping)->vma_entry->persistent))
 		ret = drv_bo_unmap(bo, mapping);
 
 	return ret;
 }
 
+static int drv_bo_copy_cpu(struct bo *dst, struct bo *src, const struct rectangle *rect)
+{
+	int ret = 0;
+
+	for (size_t plane = 0; plane < src->meta.num_planes && !ret; plane++) {
+		uint32_t hsub = drv_horizontal_subsampling_from_format(src->meta.format, plane);
+		uint32_t vsub = drv_vertical_subsampling_from_format(src->meta.format, plane);
+		uint32_t bpp = drv_bytes_per_pixel_from_format(src->meta.format, plane);
+		size_t x0 = (size_t)(rect->x / hsub) * bpp;
+		size_t x1 = (size_t)DIV_ROUND_UP(rect->x + rect->width, hsub) * bpp;
+		uint32_t y0 = rect->y / vsub;
+		uint32_t y1 = DIV_ROUND_UP(rect->y + rect->height, vsub);
+		struct mapping *src_map, *dst_map;
+		uint32_t src_stride, dst_stride;
+		uint8_t *src_addr, *dst_addr;
+
+		src_addr = drv_bo_map(src, rect, BO_MAP_READ, &src_map, plane);
+		if (src_addr == MAP_FAILED)
+			return -ENOMEM;
+
+		dst_addr = drv_bo_map(dst, rect, BO_MAP_WRITE, &dst_map, plane);
+		if (dst_addr == MAP_FAILED) {
+			drv_bo_unmap(src, src_map);
+			return -ENOMEM;
+		}
+
+		src_stride = src_map->vma->map_strides[plane];
+		dst_stride = dst_map->vma->map_strides[plane];
+		for (uint32_t y = y0; y < y1; y++)
+			memcpy(dst_addr + (size_t)y * dst_stride + x0,
+			       src_addr + (size_t)y * src_stride + x0, x1 - x0);
+
+		ret = drv_bo_flush(dst, dst_map, NULL);
+		drv_bo_unmap(dst, dst_map);
+		drv_bo_unmap(src, src_map);
+	}
+
+	return ret;
+}
+
+int drv_bo_copy(struct bo *dst, struct bo *src, const struct rectangle *rect)
+{
+	int ret;
+
+	if (dst->drv != src->drv || dst->meta.format != src->meta.format || dst == src)
+		return -EINVAL;
+
+	if (!rect->width || !rect->height)
+		return 0;
+
+	if (rect->x + rect->width > src->meta.width || rect->x + rect->width > dst->meta.width ||
+	    rect->y + rect->height > src->meta.height || rect->y + rect->height > dst->meta.height)
+		return -EINVAL;
+
+	if (src->drv->backend->bo_copy) {
+		ret = src->drv->backend->bo_copy(dst, src, rect);
+		if (ret != -ENOTSUP)
+			return ret;
+	}
+
+	/* Neither protected nor test buffers can be mapped. */
+	if ((src->meta.use_flags | dst->meta.use_flags) & BO_USE_PROTECTED)
+		return -ENOTSUP;
+	if (src->is_test_buffer || dst->is_test_buffer)
+		return -EINVAL;
+
+	return drv_bo_copy_cpu(dst, src, rect);
+}
+
+static uint64_t drv_rect_area(const struct rectangle *rect)
+{
+	return (uint64_t)rect->width * rect->height;
+}
+
+static struct rectangle drv_rect_union(const struct rectangle *a, const struct rectangle *b)
+{
+	struct rectangle u;
+	uint32_t x1 = MAX(a->x + a->width, b->x + b->width);
+	uint32_t y1 = MAX(a->y + a->height, b->y + b->height);
+
+	u.x = a->x < b->x ? a->x : b->x;
+	u.y = a->y < b->y ? a->y : b->y;
+	u.width = x1 - u.x;
+	u.height = y1 - u.y;
+	return u;
+}
+
+int drv_bo_mark_dirty(struct bo *bo, struct mapping *mapping, const struct rectangle *rect)
+{
+	struct rectangle dirty;
+	uint32_t x1, y1, i;
+
+	assert(mapping);
+	assert(mapping->refcount > 0);
+
+	x1 = rect->x + rect->width;
+	if (x1 > mapping->rect.x + mapping->rect.width)
+		x1 = mapping->rect.x + mapping->rect.width;
+	y1 = rect->y + rect->height;
+	if (y1 > mapping->rect.y + mapping->rect.height)
+		y1 = mapping->rect.y + mapping->rect.height;
+
+	dirty.x = MAX(rect->x, mapping->rect.x);
+	dirty.y = MAX(rect->y, mapping->rect.y);
+	if (x1 <= dirty.x || y1 <= dirty.y)
+		return 0;
+
+	dirty.width = x1 - dirty.x;
+	dirty.height = y1 - dirty.y;
+
+	/*
+	 * Coalesce with every rectangle whose union with the new one covers no more than the two
+	 * did (overlapping, nested or sharing an edge), so backends issue fewer and larger copies.
+	 * When all slots are taken, the rectangle that grows the least absorbs it.
+	 */
+	for (;;) {
+		uint64_t best_growth = UINT64_MAX;
+		uint32_t best = mapping->num_dirty_rects;
+
+		for (i = 0; i < mapping->num_dirty_rects; i++) {
+			const struct rectangle *prior = &mapping->dirty_rects[i];
+			struct rectangle u = drv_rect_union(prior, &dirty);
+			uint64_t areas = drv_rect_area(prior) + drv_rect_area(&dirty);
+			uint64_t growth = drv_rect_area(&u) > areas ? drv_rect_area(&u) - areas : 0;
+
+			if (growth < best_growth) {
+				best_growth = growth;
+				best = i;
+			}
+		}
+
+		if (best == mapping->num_dirty_rects ||
+		    (best_growth && mapping->num_dirty_rects < DRV_MAX_DIRTY_RECTS))
+			break;
+
+		dirty = drv_rect_union(&mapping->dirty_rects[best], &dirty);
+		mapping->dirty_rects[best] = mapping->dirty_rects[--mapping->num_dirty_rects];
+	}
+
+	mapping->dirty_rects[mapping->num_dirty_rects++] = dirty;
+	return 0;
+}
+
 uint32_t drv_bo_get_width(struct bo *bo)
 {
 	return bo->meta.width;
@@ -646,30 +2244,88 @@ union bo_handle drv_bo_get_plane_handle(struct bo *bo, size_t plane)
 #define DRM_RDWR O_RDWR
 #endif
 
+static int drv_bo_export_plane(struct bo *bo, size_t plane)
+{
+	struct driver *drv = bo->drv;
+	uint32_t flags = DRM_CLOEXEC;
+	int ret, fd;
+
+	if (!__atomic_load_n(&drv->prime_no_rdwr, __ATOMIC_RELAXED))
+		flags |= DRM_RDWR;
+
+	ret = drmPrimeHandleToFD(drv->fd, bo->handles[plane].u32, flags, &fd);
+
+	// Older DRM implementations blocked DRM_RDWR, but gave a read/write mapping anyways
+	if (ret && (flags & DRM_RDWR)) {
+		ret = drmPrimeHandleToFD(drv->fd, bo->handles[plane].u32, DRM_CLOEXEC, &fd);
+		if (!ret)
+			__atomic_store_n(&drv->prime_no_rdwr, true, __ATOMIC_RELAXED);
+	}
+
+	if (ret)
+		drv_loge("Failed to get plane fd: %s\n", strerror(errno));
+
+	return (ret) ? ret : fd;
+}
+
 int drv_bo_get_plane_fd(struct bo *bo, size_t plane)
 {
 
-	int ret, fd;
+	int fd, dup_fd, expected = -1;
+	size_t slot = plane;
 	assert(plane < bo->meta.num_planes);
 
 	if (bo->is_test_buffer)
 		return -EINVAL;
 
+	__atomic_store_n(&bo->exported, true, __ATOMIC_RELAXED);
+
 	if (bo->drv->backend->bo_get_plane_fd) {
 		fd = bo->drv->backend->bo_get_plane_fd(bo, plane);
 		return fd;
 	}
 
-	ret = drmPrimeHandleToFD(bo->drv->fd, bo->handles[plane].u32, DRM_CLOEXEC | DRM_RDWR, &fd);
+	for (size_t p = 0; p < plane; p++) {
+		if (bo->handles[p].u32 == bo->handles[plane].u32) {
+			slot = p;
+			break;
+		}
+	}
 
-	// Older DRM implementations blocked DRM_RDWR, but gave a read/write mapping anyways
-	if (ret)
-		ret = drmPrimeHandleToFD(bo->drv->fd, bo->handles[plane].u32, DRM_CLOEXEC, &fd);
+	fd = __atomic_load_n(&bo->plane_fds[slot], __ATOMIC_ACQUIRE);
+	if (fd < 0) {
+		fd = drv_bo_export_plane(bo, slot);
+		if (fd < 0)
+			return fd;
+
+		/* With the cache full the caller gets the export itself and nothing stays open. */
+		if (__atomic_add_fetch(&bo->drv->num_cached_plane_fds, 1, __ATOMIC_RELAXED) >
+		    DRV_MAX_CACHED_PLANE_FDS) {
+			__atomic_fetch_sub(&bo->drv->num_cached_plane_fds, 1, __ATOMIC_RELAXED);
+			return fd;
+		}
 
-	if (ret)
-		drv_loge("Failed to get plane fd: %s\n", strerror(errno));
+		/* Another thread may have exported the same plane meanwhile; keep its fd. */
+		if (!__atomic_compare_exchange_n(&bo->plane_fds[slot], &expected, fd, false,
+						 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_fetch_sub(&bo->drv->num_cached_plane_fds, 1, __ATOMIC_RELAXED);
+			close(fd);
+			fd = expected;
+		}
+	}
 
-	return (ret) ? ret : fd;
+	dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dup_fd < 0) {
+		drv_loge("Failed to duplicate plane fd: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return dup_fd;
+}
+
+void drv_bo_set_exports_released(struct bo *bo)
+{
+	__atomic_store_n(&bo->exported, false, __ATOMIC_RELAXED);
 }
 
 uint32_t drv_bo_get_plane_offset(struct bo *bo, size_t plane)
@@ -710,6 +2366,11 @@ uint64_t drv_bo_get_use_flags(struct bo *bo)
 	return bo->meta.use_flags;
 }
 
+struct driver *drv_bo_get_driver(struct bo *bo)
+{
+	return bo->drv;
+}
+
 size_t drv_bo_get_total_size(struct bo *bo)
 {
 	return bo->meta.total_size;
@@ -768,6 +2429,95 @@ uint32_t drv_num_buffers_per_bo(struct bo *bo)
 	return count;
 }
 
+#ifdef __ANDROID__
+static int drv_log_android_prio(enum drv_log_level level)
+{
+	switch (level) {
+	case DRV_LOGV:
+		return ANDROID_LOG_VERBOSE;
+	case DRV_LOGD:
+		return ANDROID_LOG_DEBUG;
+	case DRV_LOGI:
+		return ANDROID_LOG_INFO;
+	case DRV_LOGE:
+	default:
+		return ANDROID_LOG_ERROR;
+	}
+}
+#else
+/* The lowest enum drv_log_level printed, plus one; zero until MINIGBM_LOG_LEVEL is read. */
+static int drv_log_threshold;
+
+static int drv_log_read_threshold(void)
+{
+	const char *env = getenv("MINIGBM_LOG_LEVEL");
+	int level = DRV_LOGV;
+
+	if (env) {
+		switch (env[0]) {
+		case 'd':
+			level = DRV_LOGD;
+			break;
+		case 'i':
+			level = DRV_LOGI;
+			break;
+		case 'e':
+			level = DRV_LOGE;
+			break;
+		}
+	}
+
+	return level + 1;
+}
+#endif
+
+bool drv_log_enabled(enum drv_log_level level)
+{
+#ifdef __ANDROID__
+	return __android_log_is_loggable(drv_log_android_prio(level), "minigbm",
+					 ANDROID_LOG_INFO);
+#else
+	int threshold = __atomic_load_n(&drv_log_threshold, __ATOMIC_RELAXED);
+
+	if (!threshold) {
+		threshold = drv_log_read_threshold();
+		__atomic_store_n(&drv_log_threshold, threshold, __ATOMIC_RELAXED);
+	}
+
+	return (int)level + 1 >= threshold;
+#endif
+}
+
+#define DRV_LOG_RATELIMIT_INTERVAL_S 5
+#define DRV_LOG_RATELIMIT_BURST 10
+
+bool drv_log_ratelimit(struct drv_log_ratelimit *ratelimit, const char *file, int line)
+{
+	struct timespec ts;
+	uint64_t start = __atomic_load_n(&ratelimit->interval_start, __ATOMIC_RELAXED);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	/* The first caller past the end of an interval starts the next one. */
+	if ((uint64_t)ts.tv_sec >= start + DRV_LOG_RATELIMIT_INTERVAL_S &&
+	    __atomic_compare_exchange_n(&ratelimit->interval_start, &start, (uint64_t)ts.tv_sec,
+					false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		uint32_t suppressed =
+		    __atomic_exchange_n(&ratelimit->suppressed, 0, __ATOMIC_RELAXED);
+
+		__atomic_store_n(&ratelimit->printed, 0, __ATOMIC_RELAXED);
+		if (suppressed)
+			drv_log_prefix(DRV_LOGE, "minigbm", file, line, "%u messages suppressed\n",
+				       suppressed);
+	}
+
+	if (__atomic_fetch_add(&ratelimit->printed, 1, __ATOMIC_RELAXED) < DRV_LOG_RATELIMIT_BURST)
+		return true;
+
+	__atomic_fetch_add(&ratelimit->suppressed, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
 void drv_log_prefix(enum drv_log_level level, const char *prefix, const char *file, int line,
 		    const char *format, ...)
 {
@@ -777,22 +2527,7 @@ void drv_log_prefix(enum drv_log_level level, const char *prefix, const char *fi
 	va_list args;
 	va_start(args, format);
 #ifdef __ANDROID__
-	int prio = ANDROID_LOG_ERROR;
-	switch (level) {
-	case DRV_LOGV:
-		prio = ANDROID_LOG_VERBOSE;
-		break;
-	case DRV_LOGD:
-		prio = ANDROID_LOG_DEBUG;
-		break;
-	case DRV_LOGI:
-		prio = ANDROID_LOG_INFO;
-		break;
-	case DRV_LOGE:
-	default:
-		break;
-	};
-	__android_log_vprint(prio, buf, format, args);
+	__android_log_vprint(drv_log_android_prio(level), buf, format, args);
 #else
 	if (level == DRV_LOGE) {
 		fprintf(stderr, "%s ", buf);
@@ -820,6 +2555,11 @@ int drv_resource_info(struct bo *bo, uint32_t strides[DRV_MAX_PLANES],
 	return 0;
 }
 
+bool drv_has_static_resource_info(struct driver *drv)
+{
+	return !drv->backend->resource_info;
+}
+
 uint32_t drv_get_max_texture_2d_size(struct driver *drv)
 {
 	if (drv->backend->get_max_texture_2d_size)
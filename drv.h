@@ -17,6 +17,7 @@ extern "C" {
 #include <stdlib.h>
 
 #define DRV_MAX_PLANES 4
+#define DRV_MAX_DIRTY_RECTS 4
 
 // clang-format off
 /* Use flags */
@@ -54,6 +55,19 @@ extern "C" {
 #define BO_MAP_READ (1 << 0)
 #define BO_MAP_WRITE (1 << 1)
 #define BO_MAP_READ_WRITE (BO_MAP_READ | BO_MAP_WRITE)
+/*
+ * Keep the CPU mapping around after the last unmap, so that mapping the buffer again only costs
+ * an invalidate. Parked mappings are torn down oldest first once they exceed the driver's budget.
+ * Mappings the backend shadows (amdgpu staging, i915 detiling) are never parked, since their
+ * contents are only synced with the buffer when they are unmapped.
+ */
+#define BO_MAP_PERSISTENT (1 << 2)
+/*
+ * Fault in the pages backing the mapped rectangle up front, so that a CPU writer streaming
+ * through a fresh mapping doesn't take a page fault per page. Only done when the map creates the
+ * mapping, and only where the kernel can populate it, e.g. not for VM_PFNMAP GEM mmaps.
+ */
+#define BO_MAP_PREFAULT (1 << 3)
 
 /* This is our extension to <drm_fourcc.h>.  We need to make sure we don't step
  * on the namespace of already defined formats, which can be done by using invalid
@@ -100,6 +114,8 @@ struct drv_import_fd_data {
 	int fds[DRV_MAX_PLANES];
 	uint32_t strides[DRV_MAX_PLANES];
 	uint32_t offsets[DRV_MAX_PLANES];
+	/* Optional: if every plane has a size, the fds aren't probed for theirs. */
+	uint32_t sizes[DRV_MAX_PLANES];
 	uint64_t format_modifier;
 	uint32_t width;
 	uint32_t height;
@@ -129,18 +145,147 @@ struct mapping {
 	struct vma *vma;
 	struct rectangle rect;
 	uint32_t refcount;
+	/* Parts of |rect| written since the last flush; none means all of |rect|. */
+	uint32_t num_dirty_rects;
+	struct rectangle dirty_rects[DRV_MAX_DIRTY_RECTS];
 };
 
+/* Whether drv_create() has a backend for |fd|. Only queries the DRM driver name. */
+bool drv_has_backend(int fd);
+
+/*
+ * With MINIGBM_NODE_CACHE naming a file, drv_cache_node() records the device node a process
+ * settled on. Later in the same boot, drv_open_cached_node() opens that node again so other
+ * processes can skip probing. It returns -1 if nothing usable is cached. Each |policy|, a short
+ * name of how the caller picks its device, has its own entry, so only callers that would pick
+ * the same node share one.
+ */
+int drv_open_cached_node(const char *policy);
+void drv_cache_node(int fd, const char *policy);
+
 struct driver *drv_create(int fd);
 
+/*
+ * Like drv_create(), for processes that mostly import and map buffers, such as the Mapper HAL.
+ * Backends may skip allocation-side setup that only pays off in allocating processes, such as
+ * keeping reserves of preallocated buffers; creating bos still works.
+ */
+struct driver *drv_create_mapper_only(int fd);
+
 void drv_destroy(struct driver *drv);
 
 int drv_get_fd(struct driver *drv);
 
 const char *drv_get_name(struct driver *drv);
 
+/* Returns the number of distinct GEM handles currently referenced by bos of |drv|. */
+uint32_t drv_get_num_live_handles(struct driver *drv);
+
+/* Where the memory of a bo lives, as far as its backend can tell. */
+enum drv_heap {
+	DRV_HEAP_SYSTEM,
+	DRV_HEAP_CMA,
+	DRV_HEAP_GTT,
+	DRV_HEAP_VRAM,
+	DRV_HEAP_BLOB,
+	DRV_NUM_HEAPS,
+};
+
+struct drv_heap_usage {
+	uint64_t allocated_bytes;
+	uint64_t allocated_buffers;
+	/* Imported buffers are counted by the process that allocated them too. */
+	uint64_t imported_bytes;
+	uint64_t imported_buffers;
+	/* Zero if the heap has no budget. */
+	uint64_t budget;
+};
+
+const char *drv_heap_name(enum drv_heap heap);
+
+/* Returns the live totals of the bos of |drv| in |heap|. */
+void drv_get_heap_usage(struct driver *drv, enum drv_heap heap, struct drv_heap_usage *usage);
+
+/*
+ * Sets a soft limit on the bytes |drv| allocates from |heap|, or removes it if |budget| is zero.
+ * Backends that can place a buffer in more than one heap put allocations that would exceed it
+ * elsewhere; none fail an allocation because of it. Also set at drv_create() time by
+ * MINIGBM_HEAP_BUDGETS, e.g. "cma=64M,blob=1G".
+ */
+void drv_set_heap_budget(struct driver *drv, enum drv_heap heap, uint64_t budget);
+
+enum drv_stat {
+	DRV_STAT_BO_CREATE,
+	DRV_STAT_BO_IMPORT,
+	DRV_STAT_BO_MAP,
+	DRV_STAT_BO_UNMAP,
+	DRV_STAT_BO_INVALIDATE,
+	DRV_STAT_BO_FLUSH,
+	DRV_STAT_FENCE_WAIT,
+	DRV_NUM_STATS,
+};
+
+struct drv_stat_scope {
+	uint64_t start_ns;
+	bool traced;
+};
+
+/*
+ * Starts collecting per-operation latency histograms and per-format allocation totals. Also
+ * enabled at drv_create() time by setting MINIGBM_STATS, in which case drv_destroy() logs them.
+ */
+int drv_stats_enable(struct driver *drv);
+
+/* Brackets one |stat| operation; close to free when stats and tracing are both disabled. */
+void drv_stat_begin(struct driver *drv, enum drv_stat stat, struct drv_stat_scope *scope);
+void drv_stat_end(struct driver *drv, enum drv_stat stat, struct drv_stat_scope *scope);
+
+void drv_stats_log(struct driver *drv);
+/*
+ * Prints what drv_stats_log() logs into |buf|, NUL-terminated. Returns the length of the full
+ * dump like snprintf(), so a result >= |size| means it was truncated. |buf| may be NULL when
+ * |size| is 0.
+ */
+size_t drv_stats_dump(struct driver *drv, char *buf, size_t size);
+
 struct combination *drv_get_combination(struct driver *drv, uint32_t format, uint64_t use_flags);
 
+/*
+ * Replaces the compression policy of |drv| with |spec|, a list of rules separated by commas or
+ * newlines, or the path of a file holding one if it starts with '/'. Each rule is "on" or "off"
+ * followed by any of ":format=<fourcc>", ":use=<flag>|<flag>", ":min_size=<w>x<h>" and
+ * ":max_size=<w>x<h>"; the first rule that matches an allocation decides whether it may use a
+ * compressed modifier, and allocations no rule matches may. E.g.
+ * "off:use=sw_read_often|hw_video_encoder,off:format=R8". Also set at drv_create() time by
+ * MINIGBM_COMPRESSION_POLICY. Must be called before the first allocation.
+ */
+int drv_set_compression_policy(struct driver *drv, const char *spec);
+
+/* The use flags "on" enables huge pages for in drv_set_huge_page_policy(). */
+#define DRV_HUGE_PAGE_DEFAULT_USE_FLAGS                                                           \
+	(BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN | BO_USE_RENDERSCRIPT)
+
+/*
+ * Sets which bos of 8MB or more are sized and mapped for 2MB pages: |spec| is "off" (or "0"),
+ * "on" (or "1") for DRV_HUGE_PAGE_DEFAULT_USE_FLAGS, or a list of use flags as in the
+ * compression policy, e.g. "sw_read_often|renderscript", any of which selects a bo. Off unless
+ * set; also set at drv_create() time by MINIGBM_HUGE_PAGES. Must be called before the first
+ * allocation.
+ */
+int drv_set_huge_page_policy(struct driver *drv, const char *spec);
+
+/* Whether the compression policy of |drv| lets such an allocation use a compressed modifier. */
+bool drv_compression_allowed(struct driver *drv, uint32_t format, uint64_t use_flags,
+			     uint32_t width, uint32_t height);
+
+/*
+ * Like drv_get_combination(), but skips combinations with compressed modifiers when the
+ * compression policy denies them to a |width| x |height| allocation.
+ */
+struct combination *drv_get_combination_with_policy(struct driver *drv, uint32_t format,
+						    uint64_t use_flags, uint32_t width,
+						    uint32_t height);
+
 struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 		      uint64_t use_flags, bool is_test_buffer);
 
@@ -150,10 +295,25 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint32_t height,
 					uint32_t format, const uint64_t *modifiers, uint32_t count);
 
+/*
+ * Checks that the backend can lay out such a buffer, without allocating one. Returns -ENOTSUP
+ * if the backend can't tell without allocating.
+ */
+int drv_bo_query_layout(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags);
+
 void drv_bo_destroy(struct bo *bo);
 
 struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data);
 
+/*
+ * Imports |count| buffers, storing each bo (or NULL if that import failed) in |out_bos|. Fds that
+ * refer to the same dma-buf, within one buffer or across the batch, are only probed once. Returns
+ * the number of buffers imported.
+ */
+size_t drv_bo_import_batch(struct driver *drv, const struct drv_import_fd_data *data, size_t count,
+			   struct bo **out_bos);
+
 void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
 		 struct mapping **map_data, size_t plane);
 
@@ -161,9 +321,26 @@ int drv_bo_unmap(struct bo *bo, struct mapping *mapping);
 
 int drv_bo_invalidate(struct bo *bo, struct mapping *mapping);
 
-int drv_bo_flush(struct bo *bo, struct mapping *mapping);
+/*
+ * If |out_fence| is non-NULL, the backend may return a sync file that signals once the flushed
+ * data is visible to other devices instead of waiting for that itself. It is -1 otherwise.
+ */
+int drv_bo_flush(struct bo *bo, struct mapping *mapping, int *out_fence);
+
+int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping, int *out_fence);
 
-int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping);
+/*
+ * Copies |rect| of |src| into the same rectangle of |dst|. Both bos must come from the same
+ * driver and have the same format. Backends that can copy on the GPU do so without mapping
+ * either bo; otherwise both are mapped and copied on the CPU. Returns 0 or a negative errno.
+ */
+int drv_bo_copy(struct bo *dst, struct bo *src, const struct rectangle *rect);
+
+/*
+ * Hints that |rect| of |mapping| was written, so that backends which copy on flush can skip the
+ * rest. Until the first hint after a flush, all of the mapped rectangle counts as written.
+ */
+int drv_bo_mark_dirty(struct bo *bo, struct mapping *mapping, const struct rectangle *rect);
 
 uint32_t drv_bo_get_width(struct bo *bo);
 
@@ -173,8 +350,20 @@ size_t drv_bo_get_num_planes(struct bo *bo);
 
 union bo_handle drv_bo_get_plane_handle(struct bo *bo, size_t plane);
 
+/*
+ * Returns a new dma-buf fd of |plane| that the caller owns. The first exports of a bo are kept
+ * open so later calls only duplicate them, which costs the process one more fd per exported
+ * plane while the bo lives; beyond DRV_MAX_CACHED_PLANE_FDS per driver nothing is kept.
+ */
 int drv_bo_get_plane_fd(struct bo *bo, size_t plane);
 
+/*
+ * Vouches that no dma-buf drv_bo_get_plane_fd() handed out for |bo| is still in use anywhere, so
+ * backends may keep the memory behind it for reuse once it is destroyed, as if it had never been
+ * exported. Only callers that know they are the buffer's last user can tell.
+ */
+void drv_bo_set_exports_released(struct bo *bo);
+
 uint32_t drv_bo_get_plane_offset(struct bo *bo, size_t plane);
 
 uint32_t drv_bo_get_plane_size(struct bo *bo, size_t plane);
@@ -189,6 +378,8 @@ uint32_t drv_bo_get_tiling(struct bo *bo);
 
 uint64_t drv_bo_get_use_flags(struct bo *bo);
 
+struct driver *drv_bo_get_driver(struct bo *bo);
+
 size_t drv_bo_get_total_size(struct bo *bo);
 
 uint32_t drv_bo_get_pixel_stride(struct bo *bo);
@@ -213,6 +404,12 @@ uint32_t drv_num_buffers_per_bo(struct bo *bo);
 int drv_resource_info(struct bo *bo, uint32_t strides[DRV_MAX_PLANES],
 		      uint32_t offsets[DRV_MAX_PLANES], uint64_t *format_modifier);
 
+/*
+ * True when drv_resource_info() only reports the layout bos were created or imported with, so
+ * callers holding that layout don't need the bo.
+ */
+bool drv_has_static_resource_info(struct driver *drv);
+
 uint32_t drv_get_max_texture_2d_size(struct driver *drv);
 
 enum drv_log_level {
@@ -222,9 +419,27 @@ enum drv_log_level {
 	DRV_LOGE,
 };
 
+/*
+ * Messages below DRV_LOG_MIN_LEVEL are compiled out. Release builds drop verbose messages unless
+ * the build overrides it.
+ */
+#ifndef DRV_LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define DRV_LOG_MIN_LEVEL DRV_LOGD
+#else
+#define DRV_LOG_MIN_LEVEL DRV_LOGV
+#endif
+#endif
+
+/*
+ * The level is checked before anything is formatted. At runtime, Android filters by the
+ * log.tag.minigbm property (INFO by default), other platforms by MINIGBM_LOG_LEVEL=v|d|i|e.
+ */
 #define _drv_log(level, format, ...)                                                               \
 	do {                                                                                       \
-		drv_log_prefix(level, "minigbm", __FILE__, __LINE__, format, ##__VA_ARGS__);       \
+		if ((level) >= DRV_LOG_MIN_LEVEL && drv_log_enabled(level))                        \
+			drv_log_prefix(level, "minigbm", __FILE__, __LINE__, format,               \
+				       ##__VA_ARGS__);                                             \
 	} while (0)
 
 #define drv_loge(format, ...) _drv_log(DRV_LOGE, format, ##__VA_ARGS__)
@@ -232,6 +447,28 @@ enum drv_log_level {
 #define drv_logd(format, ...) _drv_log(DRV_LOGD, format, ##__VA_ARGS__)
 #define drv_logi(format, ...) _drv_log(DRV_LOGI, format, ##__VA_ARGS__)
 
+struct drv_log_ratelimit {
+	uint64_t interval_start;
+	uint32_t printed;
+	uint32_t suppressed;
+};
+
+/*
+ * For errors on paths that can fail on every call, such as maps: prints a burst of messages per
+ * call site every few seconds, and then how many were dropped.
+ */
+#define drv_loge_ratelimited(format, ...)                                                          \
+	do {                                                                                       \
+		static struct drv_log_ratelimit _drv_ratelimit;                                    \
+		if (drv_log_enabled(DRV_LOGE) &&                                                   \
+		    drv_log_ratelimit(&_drv_ratelimit, __FILE__, __LINE__))                        \
+			drv_log_prefix(DRV_LOGE, "minigbm", __FILE__, __LINE__, format,            \
+				       ##__VA_ARGS__);                                             \
+	} while (0)
+
+bool drv_log_enabled(enum drv_log_level level);
+bool drv_log_ratelimit(struct drv_log_ratelimit *ratelimit, const char *file, int line);
+
 __attribute__((format(printf, 5, 6))) void drv_log_prefix(enum drv_log_level level,
 							  const char *prefix, const char *file,
 							  int line, const char *format, ...);
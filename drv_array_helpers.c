@@ -6,17 +6,24 @@
 #include "drv_array_helpers.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "drv_slab.h"
 #include "util.h"
 
+/*
+ * |items| holds pointers into |slab|, so items never move when the array grows or shrinks, and
+ * appending an item only allocates once the slab runs out of free objects.
+ */
 struct drv_array {
 	void **items;
 	uint32_t size;
 	uint32_t item_size;
 	uint32_t allocations;
+	struct drv_slab *slab;
 };
 
 struct drv_array *drv_array_init(uint32_t item_size)
@@ -30,7 +37,10 @@ struct drv_array *drv_array_init(uint32_t item_size)
 	/* Start with a power of 2 number of allocations. */
 	array->allocations = 2;
 	array->items = calloc(array->allocations, sizeof(*array->items));
-	if (!array->items) {
+	array->slab = drv_slab_create(item_size);
+	if (!array->items || !array->slab) {
+		drv_slab_destroy(array->slab);
+		free(array->items);
 		free(array);
 		return NULL;
 	}
@@ -39,46 +49,68 @@ struct drv_array *drv_array_init(uint32_t item_size)
 	return array;
 }
 
+static int drv_array_resize(struct drv_array *array, uint32_t allocations)
+{
+	void **new_items = realloc(array->items, allocations * sizeof(*array->items));
+	if (!new_items)
+		return -ENOMEM;
+
+	array->items = new_items;
+	array->allocations = allocations;
+	return 0;
+}
+
+int drv_array_reserve(struct drv_array *array, uint32_t count)
+{
+	uint32_t allocations = array->allocations;
+
+	while (allocations < count)
+		allocations *= 2;
+
+	if (allocations == array->allocations)
+		return 0;
+
+	return drv_array_resize(array, allocations);
+}
+
 void *drv_array_append(struct drv_array *array, void *data)
 {
 	void *item;
 
-	if (array->size >= array->allocations) {
-		void **new_items = NULL;
-		array->allocations *= 2;
-		new_items = realloc(array->items, array->allocations * sizeof(*array->items));
-		assert(new_items);
-		array->items = new_items;
-	}
+	if (array->size >= array->allocations && drv_array_reserve(array, array->size + 1))
+		return NULL;
+
+	item = drv_slab_alloc(array->slab);
+	if (!item)
+		return NULL;
 
-	item = calloc(1, array->item_size);
 	memcpy(item, data, array->item_size);
 	array->items[array->size] = item;
 	array->size++;
 	return item;
 }
 
-void drv_array_remove(struct drv_array *array, uint32_t idx)
+static void drv_array_shrink(struct drv_array *array)
 {
-	uint32_t i;
+	/*
+	 * Only give memory back once the array is a quarter full, so that alternating appends and
+	 * removals around a power of 2 don't realloc every time. A failed shrink is harmless.
+	 */
+	if (array->allocations > 2 && array->size < array->allocations / 4)
+		drv_array_resize(array, array->allocations / 2);
+}
 
+void drv_array_remove(struct drv_array *array, uint32_t idx)
+{
 	assert(array);
 	assert(idx < array->size);
 
-	free(array->items[idx]);
-	array->items[idx] = NULL;
-
-	for (i = idx + 1; i < array->size; i++)
-		array->items[i - 1] = array->items[i];
+	drv_slab_free(array->slab, array->items[idx]);
+	memmove(&array->items[idx], &array->items[idx + 1],
+		(array->size - idx - 1) * sizeof(*array->items));
 
 	array->size--;
-	if ((DIV_ROUND_UP(array->allocations, 2) > array->size) && array->allocations > 2) {
-		void **new_items = NULL;
-		array->allocations = DIV_ROUND_UP(array->allocations, 2);
-		new_items = realloc(array->items, array->allocations * sizeof(*array->items));
-		assert(new_items);
-		array->items = new_items;
-	}
+	drv_array_shrink(array);
 }
 
 void *drv_array_at_idx(struct drv_array *array, uint32_t idx)
@@ -94,11 +126,7 @@ uint32_t drv_array_size(struct drv_array *array)
 
 void drv_array_destroy(struct drv_array *array)
 {
-	uint32_t i;
-
-	for (i = 0; i < array->size; i++)
-		free(array->items[i]);
-
+	drv_slab_destroy(array->slab);
 	free(array->items);
 	free(array);
 }
@@ -13,7 +13,13 @@ struct drv_array;
 
 struct drv_array *drv_array_init(uint32_t item_size);
 
-/* The data will be copied and appended to the array. */
+/* Makes room for |count| items, so that appending up to that many never reallocates. */
+int drv_array_reserve(struct drv_array *array, uint32_t count);
+
+/*
+ * The data will be copied and appended to the array. Returns a pointer to the copy, which stays
+ * valid until the item is removed, or NULL when out of memory.
+ */
 void *drv_array_append(struct drv_array *array, void *data);
 
 /* The data at the specified index will be freed -- the array will shrink. */
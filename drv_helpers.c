@@ -8,10 +8,15 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <xf86drm.h>
@@ -24,6 +29,8 @@ struct planar_layout {
 	int horizontal_subsampling[DRV_MAX_PLANES];
 	int vertical_subsampling[DRV_MAX_PLANES];
 	int bytes_per_pixel[DRV_MAX_PLANES];
+	/* Required stride alignment in bytes, 0 for none. */
+	int stride_alignment[DRV_MAX_PLANES];
 };
 
 // clang-format off
@@ -77,6 +84,18 @@ static const struct planar_layout triplanar_yuv_420_layout = {
 	.bytes_per_pixel = { 1, 1, 1 }
 };
 
+/*
+ * The stride of Android YV12 buffers is required to be aligned to 16 bytes
+ * (see <system/graphics.h>).
+ */
+static const struct planar_layout android_yv12_layout = {
+	.num_planes = 3,
+	.horizontal_subsampling = { 1, 2, 2 },
+	.vertical_subsampling = { 1, 2, 2 },
+	.bytes_per_pixel = { 1, 1, 1 },
+	.stride_alignment = { 32, 16, 16 }
+};
+
 static const struct planar_layout biplanar_yuv_p010_layout = {
 	.num_planes = 2,
 	.horizontal_subsampling = { 1, 2 },
@@ -86,86 +105,124 @@ static const struct planar_layout biplanar_yuv_p010_layout = {
 
 // clang-format on
 
-static const struct planar_layout *layout_from_format(uint32_t format)
+struct format_layout {
+	uint32_t format;
+	const struct planar_layout *layout;
+};
+
+static const struct format_layout format_layouts[] = {
+	{ DRM_FORMAT_BGR233, &packed_1bpp_layout },
+	{ DRM_FORMAT_C8, &packed_1bpp_layout },
+	{ DRM_FORMAT_R8, &packed_1bpp_layout },
+	{ DRM_FORMAT_RGB332, &packed_1bpp_layout },
+
+	{ DRM_FORMAT_R16, &packed_2bpp_layout },
+
+	{ DRM_FORMAT_YVU420, &triplanar_yuv_420_layout },
+	{ DRM_FORMAT_YVU420_ANDROID, &android_yv12_layout },
+
+	{ DRM_FORMAT_NV12, &biplanar_yuv_420_layout },
+	{ DRM_FORMAT_NV21, &biplanar_yuv_420_layout },
+
+	{ DRM_FORMAT_P010, &biplanar_yuv_p010_layout },
+
+	{ DRM_FORMAT_ABGR1555, &packed_2bpp_layout },
+	{ DRM_FORMAT_ABGR4444, &packed_2bpp_layout },
+	{ DRM_FORMAT_ARGB1555, &packed_2bpp_layout },
+	{ DRM_FORMAT_ARGB4444, &packed_2bpp_layout },
+	{ DRM_FORMAT_BGR565, &packed_2bpp_layout },
+	{ DRM_FORMAT_BGRA4444, &packed_2bpp_layout },
+	{ DRM_FORMAT_BGRA5551, &packed_2bpp_layout },
+	{ DRM_FORMAT_BGRX4444, &packed_2bpp_layout },
+	{ DRM_FORMAT_BGRX5551, &packed_2bpp_layout },
+	{ DRM_FORMAT_GR88, &packed_2bpp_layout },
+	{ DRM_FORMAT_RG88, &packed_2bpp_layout },
+	{ DRM_FORMAT_RGB565, &packed_2bpp_layout },
+	{ DRM_FORMAT_RGBA4444, &packed_2bpp_layout },
+	{ DRM_FORMAT_RGBA5551, &packed_2bpp_layout },
+	{ DRM_FORMAT_RGBX4444, &packed_2bpp_layout },
+	{ DRM_FORMAT_RGBX5551, &packed_2bpp_layout },
+	{ DRM_FORMAT_UYVY, &packed_2bpp_layout },
+	{ DRM_FORMAT_VYUY, &packed_2bpp_layout },
+	{ DRM_FORMAT_XBGR1555, &packed_2bpp_layout },
+	{ DRM_FORMAT_XBGR4444, &packed_2bpp_layout },
+	{ DRM_FORMAT_XRGB1555, &packed_2bpp_layout },
+	{ DRM_FORMAT_XRGB4444, &packed_2bpp_layout },
+	{ DRM_FORMAT_YUYV, &packed_2bpp_layout },
+	{ DRM_FORMAT_YVYU, &packed_2bpp_layout },
+	{ DRM_FORMAT_MTISP_SXYZW10, &packed_2bpp_layout },
+
+	{ DRM_FORMAT_BGR888, &packed_3bpp_layout },
+	{ DRM_FORMAT_RGB888, &packed_3bpp_layout },
+
+	{ DRM_FORMAT_ABGR2101010, &packed_4bpp_layout },
+	{ DRM_FORMAT_ABGR8888, &packed_4bpp_layout },
+	{ DRM_FORMAT_ARGB2101010, &packed_4bpp_layout },
+	{ DRM_FORMAT_ARGB8888, &packed_4bpp_layout },
+	{ DRM_FORMAT_AYUV, &packed_4bpp_layout },
+	{ DRM_FORMAT_BGRA1010102, &packed_4bpp_layout },
+	{ DRM_FORMAT_BGRA8888, &packed_4bpp_layout },
+	{ DRM_FORMAT_BGRX1010102, &packed_4bpp_layout },
+	{ DRM_FORMAT_BGRX8888, &packed_4bpp_layout },
+	{ DRM_FORMAT_RGBA1010102, &packed_4bpp_layout },
+	{ DRM_FORMAT_RGBA8888, &packed_4bpp_layout },
+	{ DRM_FORMAT_RGBX1010102, &packed_4bpp_layout },
+	{ DRM_FORMAT_RGBX8888, &packed_4bpp_layout },
+	{ DRM_FORMAT_XBGR2101010, &packed_4bpp_layout },
+	{ DRM_FORMAT_XBGR8888, &packed_4bpp_layout },
+	{ DRM_FORMAT_XRGB2101010, &packed_4bpp_layout },
+	{ DRM_FORMAT_XRGB8888, &packed_4bpp_layout },
+
+	{ DRM_FORMAT_ABGR16161616F, &packed_8bpp_layout },
+};
+
+/*
+ * Open addressing index into format_layouts, keyed by a multiplicative hash of the fourcc. It is
+ * kept at least four times larger than the table so that lookups almost never probe twice.
+ */
+#define FORMAT_LAYOUT_HASH_BITS 8
+#define FORMAT_LAYOUT_HASH_SIZE (1 << FORMAT_LAYOUT_HASH_BITS)
+#define FORMAT_LAYOUT_EMPTY 0xff
+
+static uint8_t format_layout_hash[FORMAT_LAYOUT_HASH_SIZE];
+static pthread_once_t format_layout_hash_once = PTHREAD_ONCE_INIT;
+
+static uint32_t format_layout_slot(uint32_t format)
 {
-	switch (format) {
-	case DRM_FORMAT_BGR233:
-	case DRM_FORMAT_C8:
-	case DRM_FORMAT_R8:
-	case DRM_FORMAT_RGB332:
-		return &packed_1bpp_layout;
+	return (format * 0x9e3779b1u) >> (32 - FORMAT_LAYOUT_HASH_BITS);
+}
 
-	case DRM_FORMAT_R16:
-		return &packed_2bpp_layout;
+static void format_layout_hash_init(void)
+{
+	memset(format_layout_hash, FORMAT_LAYOUT_EMPTY, sizeof(format_layout_hash));
 
-	case DRM_FORMAT_YVU420:
-	case DRM_FORMAT_YVU420_ANDROID:
-		return &triplanar_yuv_420_layout;
+	for (size_t i = 0; i < ARRAY_SIZE(format_layouts); i++) {
+		uint32_t slot = format_layout_slot(format_layouts[i].format);
 
-	case DRM_FORMAT_NV12:
-	case DRM_FORMAT_NV21:
-		return &biplanar_yuv_420_layout;
+		while (format_layout_hash[slot] != FORMAT_LAYOUT_EMPTY)
+			slot = (slot + 1) & (FORMAT_LAYOUT_HASH_SIZE - 1);
 
-	case DRM_FORMAT_P010:
-		return &biplanar_yuv_p010_layout;
-
-	case DRM_FORMAT_ABGR1555:
-	case DRM_FORMAT_ABGR4444:
-	case DRM_FORMAT_ARGB1555:
-	case DRM_FORMAT_ARGB4444:
-	case DRM_FORMAT_BGR565:
-	case DRM_FORMAT_BGRA4444:
-	case DRM_FORMAT_BGRA5551:
-	case DRM_FORMAT_BGRX4444:
-	case DRM_FORMAT_BGRX5551:
-	case DRM_FORMAT_GR88:
-	case DRM_FORMAT_RG88:
-	case DRM_FORMAT_RGB565:
-	case DRM_FORMAT_RGBA4444:
-	case DRM_FORMAT_RGBA5551:
-	case DRM_FORMAT_RGBX4444:
-	case DRM_FORMAT_RGBX5551:
-	case DRM_FORMAT_UYVY:
-	case DRM_FORMAT_VYUY:
-	case DRM_FORMAT_XBGR1555:
-	case DRM_FORMAT_XBGR4444:
-	case DRM_FORMAT_XRGB1555:
-	case DRM_FORMAT_XRGB4444:
-	case DRM_FORMAT_YUYV:
-	case DRM_FORMAT_YVYU:
-	case DRM_FORMAT_MTISP_SXYZW10:
-		return &packed_2bpp_layout;
-
-	case DRM_FORMAT_BGR888:
-	case DRM_FORMAT_RGB888:
-		return &packed_3bpp_layout;
-
-	case DRM_FORMAT_ABGR2101010:
-	case DRM_FORMAT_ABGR8888:
-	case DRM_FORMAT_ARGB2101010:
-	case DRM_FORMAT_ARGB8888:
-	case DRM_FORMAT_AYUV:
-	case DRM_FORMAT_BGRA1010102:
-	case DRM_FORMAT_BGRA8888:
-	case DRM_FORMAT_BGRX1010102:
-	case DRM_FORMAT_BGRX8888:
-	case DRM_FORMAT_RGBA1010102:
-	case DRM_FORMAT_RGBA8888:
-	case DRM_FORMAT_RGBX1010102:
-	case DRM_FORMAT_RGBX8888:
-	case DRM_FORMAT_XBGR2101010:
-	case DRM_FORMAT_XBGR8888:
-	case DRM_FORMAT_XRGB2101010:
-	case DRM_FORMAT_XRGB8888:
-		return &packed_4bpp_layout;
-
-	case DRM_FORMAT_ABGR16161616F:
-		return &packed_8bpp_layout;
+		format_layout_hash[slot] = i;
+	}
+}
 
-	default:
-		drv_loge("UNKNOWN FORMAT %d\n", format);
-		return NULL;
+static const struct planar_layout *layout_from_format(uint32_t format)
+{
+	uint32_t slot = format_layout_slot(format);
+
+	pthread_once(&format_layout_hash_once, format_layout_hash_init);
+
+	while (format_layout_hash[slot] != FORMAT_LAYOUT_EMPTY) {
+		const struct format_layout *entry = &format_layouts[format_layout_hash[slot]];
+
+		if (entry->format == format)
+			return entry->layout;
+
+		slot = (slot + 1) & (FORMAT_LAYOUT_HASH_SIZE - 1);
 	}
+
+	drv_loge("UNKNOWN FORMAT %d\n", format);
+	return NULL;
 }
 
 size_t drv_num_planes_from_format(uint32_t format)
@@ -215,6 +272,15 @@ uint32_t drv_vertical_subsampling_from_format(uint32_t format, size_t plane)
 	return layout->vertical_subsampling[plane];
 }
 
+uint32_t drv_horizontal_subsampling_from_format(uint32_t format, size_t plane)
+{
+	const struct planar_layout *layout = layout_from_format(format);
+
+	assert(plane < layout->num_planes);
+
+	return layout->horizontal_subsampling[plane];
+}
+
 uint32_t drv_bytes_per_pixel_from_format(uint32_t format, size_t plane)
 {
 	const struct planar_layout *layout = layout_from_format(format);
@@ -235,12 +301,8 @@ uint32_t drv_stride_from_format(uint32_t format, uint32_t width, size_t plane)
 	uint32_t plane_width = DIV_ROUND_UP(width, layout->horizontal_subsampling[plane]);
 	uint32_t stride = plane_width * layout->bytes_per_pixel[plane];
 
-	/*
-	 * The stride of Android YV12 buffers is required to be aligned to 16 bytes
-	 * (see <system/graphics.h>).
-	 */
-	if (format == DRM_FORMAT_YVU420_ANDROID)
-		stride = (plane == 0) ? ALIGN(stride, 32) : ALIGN(stride, 16);
+	if (layout->stride_alignment[plane])
+		stride = ALIGN(stride, layout->stride_alignment[plane]);
 
 	return stride;
 }
@@ -433,6 +495,12 @@ int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	struct drm_prime_handle prime_handle;
 
 	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		/* The kernel would return the same handle; skip the lookup. */
+		if (plane && data->fds[plane] == data->fds[plane - 1]) {
+			bo->handles[plane].u32 = bo->handles[plane - 1].u32;
+			continue;
+		}
+
 		memset(&prime_handle, 0, sizeof(prime_handle));
 		prime_handle.fd = data->fds[plane];
 
@@ -459,27 +527,82 @@ int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	return 0;
 }
 
-void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+int drv_bo_inode_handles(struct bo *bo, const int *fds)
+{
+	struct stat sb;
+	size_t plane, prior;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		for (prior = 0; prior < plane; prior++) {
+			if (fds[prior] == fds[plane])
+				break;
+		}
+
+		if (prior < plane) {
+			bo->handles[plane].u64 = bo->handles[prior].u64;
+			continue;
+		}
+
+		if (fstat(fds[plane], &sb)) {
+			drv_loge("fstat() failed with %s\n", strerror(errno));
+			return -errno;
+		}
+
+		bo->handles[plane].u64 = sb.st_ino;
+	}
+
+	return 0;
+}
+
+int drv_bo_get_mmap_offset(struct bo *bo, size_t plane,
+			   int (*query)(struct bo *bo, uint32_t handle, uint64_t *offset),
+			   uint64_t *offset)
+{
+	int ret;
+
+	if (!bo->mmap_offsets[plane]) {
+		ret = query(bo, bo->handles[plane].u32, &bo->mmap_offsets[plane]);
+		if (ret) {
+			bo->mmap_offsets[plane] = 0;
+			return ret;
+		}
+	}
+
+	*offset = bo->mmap_offsets[plane];
+	return 0;
+}
+
+static int drv_dumb_bo_query_mmap_offset(struct bo *bo, uint32_t handle, uint64_t *offset)
 {
 	int ret;
-	size_t i;
 	struct drm_mode_map_dumb map_dumb;
 
 	memset(&map_dumb, 0, sizeof(map_dumb));
-	map_dumb.handle = bo->handles[plane].u32;
+	map_dumb.handle = handle;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb);
 	if (ret) {
 		drv_loge("DRM_IOCTL_MODE_MAP_DUMB failed\n");
-		return MAP_FAILED;
+		return ret;
 	}
 
+	*offset = map_dumb.offset;
+	return 0;
+}
+
+void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	size_t i;
+	uint64_t offset;
+
+	if (drv_bo_get_mmap_offset(bo, plane, drv_dumb_bo_query_mmap_offset, &offset))
+		return MAP_FAILED;
+
 	for (i = 0; i < bo->meta.num_planes; i++)
 		if (bo->handles[i].u32 == bo->handles[plane].u32)
 			vma->length += bo->meta.sizes[i];
 
-	return mmap(0, vma->length, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    map_dumb.offset);
+	return drv_bo_mmap(bo, vma->length, drv_get_prot(map_flags), bo->drv->fd, offset);
 }
 
 int drv_bo_munmap(struct bo *bo, struct vma *vma)
@@ -492,6 +615,205 @@ int drv_get_prot(uint32_t map_flags)
 	return (BO_MAP_WRITE & map_flags) ? PROT_WRITE | PROT_READ : PROT_READ;
 }
 
+#define DRV_HUGE_PAGE_SIZE (2ul << 20)
+/* Below this, rounding up to a huge page could waste more than a quarter of the buffer. */
+#define DRV_HUGE_PAGE_MIN_SIZE (8ul << 20)
+
+static bool drv_bo_wants_huge_pages(struct bo *bo, size_t size)
+{
+	return size >= DRV_HUGE_PAGE_MIN_SIZE && (bo->meta.use_flags & bo->drv->huge_page_use_flags);
+}
+
+size_t drv_bo_align_size(struct bo *bo, size_t size)
+{
+	return drv_bo_wants_huge_pages(bo, size) ? ALIGN(size, DRV_HUGE_PAGE_SIZE) : size;
+}
+
+void *drv_bo_mmap(struct bo *bo, size_t length, int prot, int fd, off_t offset)
+{
+	uint8_t *reserved, *addr;
+	size_t reserved_length, head, page_length;
+
+	if (!drv_bo_wants_huge_pages(bo, length))
+		return mmap(0, length, prot, MAP_SHARED, fd, offset);
+
+	/* Reserve enough address space to carve an aligned range out of, then map over it. */
+	reserved_length = length + DRV_HUGE_PAGE_SIZE;
+	reserved = mmap(0, reserved_length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			-1, 0);
+	if (reserved == MAP_FAILED)
+		return mmap(0, length, prot, MAP_SHARED, fd, offset);
+
+	addr = (uint8_t *)ALIGN((uintptr_t)reserved, DRV_HUGE_PAGE_SIZE);
+	if (mmap(addr, length, prot, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+		munmap(reserved, reserved_length);
+		return MAP_FAILED;
+	}
+
+	head = addr - reserved;
+	page_length = ALIGN(length, (size_t)getpagesize());
+	if (head)
+		munmap(reserved, head);
+	if (reserved_length > head + page_length)
+		munmap(addr + page_length, reserved_length - head - page_length);
+
+	/* Only a hint: most mappings of device memory can't use huge pages anyway. */
+	madvise(addr, length, MADV_HUGEPAGE);
+
+	return addr;
+}
+
+void *drv_shadow_alloc(struct driver *drv, size_t size)
+{
+	void *shadow = drv->shadow_cache;
+
+	if (shadow && drv->shadow_cache_size >= size) {
+		drv->shadow_cache = NULL;
+		return shadow;
+	}
+
+	return malloc(size);
+}
+
+void drv_shadow_free(struct driver *drv, void *shadow, size_t size)
+{
+	/* Keep the larger of the two, it can back more buffers. */
+	if (drv->shadow_cache && drv->shadow_cache_size >= size) {
+		free(shadow);
+		return;
+	}
+
+	free(drv->shadow_cache);
+	drv->shadow_cache = shadow;
+	drv->shadow_cache_size = size;
+}
+
+/*
+ * Copies, for each plane, the rows that |rect| covers. The rows of a plane are contiguous, so
+ * that is one copy per plane; partial-width rects are rare enough not to be worth more copies.
+ */
+static void drv_shadow_copy_rect(struct bo *bo, uint8_t *dst, const uint8_t *src,
+				 const struct rectangle *rect)
+{
+	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
+		uint32_t subsample = drv_vertical_subsampling_from_format(bo->meta.format, plane);
+		uint32_t stride = bo->meta.strides[plane];
+		size_t start = (size_t)(rect->y / subsample) * stride;
+		size_t end = (size_t)DIV_ROUND_UP(rect->y + rect->height, subsample) * stride;
+
+		if (end > bo->meta.sizes[plane])
+			end = bo->meta.sizes[plane];
+		if (start < end)
+			memcpy(dst + bo->meta.offsets[plane] + start,
+			       src + bo->meta.offsets[plane] + start, end - start);
+	}
+}
+
+void drv_shadow_copy_in(struct bo *bo, struct mapping *mapping, void *shadow, const void *addr)
+{
+	drv_shadow_copy_rect(bo, shadow, addr, &mapping->rect);
+}
+
+void drv_shadow_copy_out(struct bo *bo, struct mapping *mapping, void *addr, const void *shadow)
+{
+	if (!mapping->num_dirty_rects) {
+		drv_shadow_copy_rect(bo, addr, shadow, &mapping->rect);
+		return;
+	}
+
+	for (uint32_t i = 0; i < mapping->num_dirty_rects; i++)
+		drv_shadow_copy_rect(bo, addr, shadow, &mapping->dirty_rects[i]);
+}
+
+int drv_bo_dmabuf_sync(struct bo *bo, const struct vma *vma, const int *fds, bool end)
+{
+	struct dma_buf_sync sync = { 0 };
+	size_t plane, prior;
+	int ret = 0;
+
+	if (vma->map_flags & BO_MAP_READ)
+		sync.flags |= DMA_BUF_SYNC_READ;
+	if (vma->map_flags & BO_MAP_WRITE)
+		sync.flags |= DMA_BUF_SYNC_WRITE;
+	if (!sync.flags)
+		return 0;
+
+	/*
+	 * Every START needs a matching END with the same access flags, even for read-only
+	 * access, since exporters track CPU access between the two.
+	 */
+	sync.flags |= end ? DMA_BUF_SYNC_END : DMA_BUF_SYNC_START;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		/* Planes usually share their buffer, which only needs syncing once. */
+		for (prior = 0; prior < plane; prior++) {
+			if (bo->handles[prior].u64 == bo->handles[plane].u64)
+				break;
+		}
+		if (prior < plane || fds[plane] < 0)
+			continue;
+
+		while (ioctl(fds[plane], DMA_BUF_IOCTL_SYNC, &sync)) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+
+			drv_loge_ratelimited("DMA_BUF_IOCTL_SYNC failed: %s\n", strerror(errno));
+			ret = -errno;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+bool drv_read_cache_file(const char *path, void *data, size_t size)
+{
+	ssize_t len;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return false;
+
+	len = read(fd, data, size);
+	close(fd);
+	return len == (ssize_t)size;
+}
+
+int drv_write_cache_file(const char *path, const void *data, size_t size)
+{
+	int tmp_fd, ret = 0;
+	char *tmp_path;
+
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0)
+		return -ENOMEM;
+
+	/* Readers only ever see a complete file, so write a private copy and rename it over. */
+	tmp_fd = mkstemp(tmp_path);
+	if (tmp_fd < 0) {
+		ret = -errno;
+		free(tmp_path);
+		return ret;
+	}
+
+	if (fchmod(tmp_fd, 0644) || write(tmp_fd, data, size) != (ssize_t)size ||
+	    rename(tmp_path, path)) {
+		ret = -errno;
+		unlink(tmp_path);
+	}
+
+	close(tmp_fd);
+	free(tmp_path);
+	return ret;
+}
+
+bool drv_heap_has_room(struct driver *drv, uint32_t heap, uint64_t size)
+{
+	struct drv_heap_usage usage;
+
+	drv_get_heap_usage(drv, heap, &usage);
+	return !usage.budget || usage.allocated_bytes + size <= usage.budget;
+}
+
 void drv_add_combination(struct driver *drv, const uint32_t format,
 			 struct format_metadata *metadata, uint64_t use_flags)
 {
@@ -499,6 +821,7 @@ void drv_add_combination(struct driver *drv, const uint32_t format,
 				     .metadata = *metadata,
 				     .use_flags = use_flags };
 
+	assert(!drv->combo_index);
 	drv_array_append(drv->combos, &combo);
 }
 
@@ -507,6 +830,8 @@ void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t
 {
 	uint32_t i;
 
+	assert(!drv->combo_index);
+	drv_array_reserve(drv->combos, drv_array_size(drv->combos) + num_formats);
 	for (i = 0; i < num_formats; i++) {
 		struct combination combo = { .format = formats[i],
 					     .metadata = *metadata,
@@ -521,6 +846,8 @@ void drv_modify_combination(struct driver *drv, uint32_t format, struct format_m
 {
 	uint32_t i;
 	struct combination *combo;
+
+	assert(!drv->combo_index);
 	/* Attempts to add the specified flags to an existing combination. */
 	for (i = 0; i < drv_array_size(drv->combos); i++) {
 		combo = (struct combination *)drv_array_at_idx(drv->combos, i);
@@ -576,6 +903,58 @@ bool drv_has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier)
 	return false;
 }
 
+/*
+ * Whether |modifier| is a bandwidth compressed layout: Intel CCS, Qualcomm UBWC, ARM AFBC/AFRC
+ * or AMD DCC. Tiled-only layouts of the same vendors are not.
+ */
+bool drv_modifier_is_compressed(uint64_t modifier)
+{
+	uint64_t vendor = modifier >> 56;
+
+	switch (vendor) {
+	case DRM_FORMAT_MOD_VENDOR_INTEL:
+		switch (modifier & 0x00ffffffffffffffULL) {
+		case 4:  /* Y_TILED_CCS */
+		case 5:  /* Yf_TILED_CCS */
+		case 6:  /* Y_TILED_GEN12_RC_CCS */
+		case 7:  /* Y_TILED_GEN12_MC_CCS */
+		case 8:  /* Y_TILED_GEN12_RC_CCS_CC */
+		case 10: /* 4_TILED_DG2_RC_CCS */
+		case 11: /* 4_TILED_DG2_MC_CCS */
+		case 12: /* 4_TILED_DG2_RC_CCS_CC */
+		case 13: /* 4_TILED_MTL_RC_CCS */
+		case 14: /* 4_TILED_MTL_MC_CCS */
+		case 15: /* 4_TILED_MTL_RC_CCS_CC */
+			return true;
+		}
+		return false;
+	case DRM_FORMAT_MOD_VENDOR_QCOM:
+		return modifier == DRM_FORMAT_MOD_QCOM_COMPRESSED;
+	case DRM_FORMAT_MOD_VENDOR_ARM:
+		/* Type 0 is AFBC and type 2 AFRC; type 1 holds the uncompressed layouts. */
+		return ((modifier >> 52) & 0xf) == 0 || ((modifier >> 52) & 0xf) == 2;
+	case DRM_FORMAT_MOD_VENDOR_AMD:
+		/* AMD_FMT_MOD_DCC. */
+		return (modifier >> 13) & 1;
+	}
+
+	return false;
+}
+
+/* Like drv_pick_modifier(), but never picks a compressed modifier. */
+uint64_t drv_pick_uncompressed_modifier(const uint64_t *modifiers, uint32_t count,
+					const uint64_t *modifier_order, uint32_t order_count)
+{
+	uint32_t i;
+
+	for (i = 0; i < order_count; i++)
+		if (!drv_modifier_is_compressed(modifier_order[i]) &&
+		    drv_has_modifier(modifiers, count, modifier_order[i]))
+			return modifier_order[i];
+
+	return DRM_FORMAT_MOD_LINEAR;
+}
+
 void drv_resolve_format_and_use_flags_helper(struct driver *drv, uint32_t format,
 					     uint64_t use_flags, uint32_t *out_format,
 					     uint64_t *out_use_flags)
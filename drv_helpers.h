@@ -20,6 +20,7 @@ struct format_metadata;
 
 uint32_t drv_height_from_format(uint32_t format, uint32_t height, size_t plane);
 uint32_t drv_vertical_subsampling_from_format(uint32_t format, size_t plane);
+uint32_t drv_horizontal_subsampling_from_format(uint32_t format, size_t plane);
 uint32_t drv_size_from_format(uint32_t format, uint32_t stride, uint32_t height, size_t plane);
 int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height, uint32_t format);
 int drv_bo_from_format_and_padding(struct bo *bo, uint32_t stride, uint32_t aligned_height,
@@ -31,9 +32,54 @@ int drv_dumb_bo_create_ex(struct bo *bo, uint32_t width, uint32_t height, uint32
 int drv_dumb_bo_destroy(struct bo *bo);
 int drv_gem_bo_destroy(struct bo *bo);
 int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data);
+/*
+ * For backends without GEM handles: uses the inode of each plane's dma-buf as its handle. Planes
+ * passing the same fd share one fstat().
+ */
+int drv_bo_inode_handles(struct bo *bo, const int *fds);
+/*
+ * The fake mmap offset of a GEM handle never changes, so backends whose map path asks the kernel
+ * for it go through this instead: |query| only runs on the first map of |plane|. Called with
+ * |mappings_lock| held, as backend map hooks are.
+ */
+int drv_bo_get_mmap_offset(struct bo *bo, size_t plane,
+			   int (*query)(struct bo *bo, uint32_t handle, uint64_t *offset),
+			   uint64_t *offset);
 void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
 int drv_bo_munmap(struct bo *bo, struct vma *vma);
 int drv_get_prot(uint32_t map_flags);
+/*
+ * Large buffers the CPU accesses often are sized and mapped so that the kernel can back them
+ * with 2MB pages: drv_bo_align_size() rounds their size up to a huge page, and drv_bo_mmap()
+ * places their mappings on a huge page boundary. Other buffers are left as they are.
+ * MINIGBM_HUGE_PAGES=0 turns both off.
+ */
+size_t drv_bo_align_size(struct bo *bo, size_t size);
+void *drv_bo_mmap(struct bo *bo, size_t length, int prot, int fd, off_t offset);
+/*
+ * Cached shadow buffers for backends whose mappings are too slow to access directly. The driver
+ * keeps the last freed shadow for the next map, so map cycles don't reallocate it. Must be
+ * called with |mappings_lock| held, as backend map and unmap hooks are.
+ */
+void *drv_shadow_alloc(struct driver *drv, size_t size);
+void drv_shadow_free(struct driver *drv, void *shadow, size_t size);
+/* Copies the rows of every plane of |bo| that |mapping| can access, or has written to. */
+void drv_shadow_copy_in(struct bo *bo, struct mapping *mapping, void *shadow, const void *addr);
+void drv_shadow_copy_out(struct bo *bo, struct mapping *mapping, void *addr, const void *shadow);
+/*
+ * Brackets CPU access through |vma| with DMA_BUF_IOCTL_SYNC on the dma-bufs (one per plane in
+ * |fds|) behind it: call with |end| false once the vma is about to be accessed and with |end|
+ * true once that access is done, whether or not it wrote. Each distinct buffer is synced once.
+ */
+int drv_bo_dmabuf_sync(struct bo *bo, const struct vma *vma, const int *fds, bool end);
+/*
+ * Small files that share state computed by one process with later ones. Reads fail unless the
+ * file starts with |size| bytes; writes replace the file atomically.
+ */
+bool drv_read_cache_file(const char *path, void *data, size_t size);
+int drv_write_cache_file(const char *path, const void *data, size_t size);
+/* Whether allocating |size| more bytes from |heap| stays within its budget, if it has one. */
+bool drv_heap_has_room(struct driver *drv, uint32_t heap, uint64_t size);
 void drv_add_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			 uint64_t usage);
 void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t num_formats,
@@ -44,6 +90,9 @@ int drv_modify_linear_combinations(struct driver *drv);
 uint64_t drv_pick_modifier(const uint64_t *modifiers, uint32_t count,
 			   const uint64_t *modifier_order, uint32_t order_count);
 bool drv_has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier);
+bool drv_modifier_is_compressed(uint64_t modifier);
+uint64_t drv_pick_uncompressed_modifier(const uint64_t *modifiers, uint32_t count,
+					const uint64_t *modifier_order, uint32_t order_count);
 void drv_resolve_format_and_use_flags_helper(struct driver *drv, uint32_t format,
 					     uint64_t use_flags, uint32_t *out_format,
 					     uint64_t *out_use_flags);
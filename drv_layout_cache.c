@@ -0,0 +1,167 @@
+/*
+ * Copyright 2022 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "drv_layout_cache.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DRV_LAYOUT_CACHE_ENTRIES 32
+/* Requests listing more modifiers than this are not cached. */
+#define DRV_LAYOUT_CACHE_MAX_MODIFIERS 16
+
+struct drv_layout_cache_entry {
+	bool valid;
+	uint64_t hash;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t use_flags;
+	uint32_t count;
+	uint64_t modifiers[DRV_LAYOUT_CACHE_MAX_MODIFIERS];
+	struct bo_metadata meta;
+};
+
+struct drv_layout_cache {
+	pthread_mutex_t lock;
+	/* Next entry to replace; entries are recycled round robin. */
+	uint32_t next;
+	uint64_t hits;
+	uint64_t misses;
+	struct drv_layout_cache_entry entries[DRV_LAYOUT_CACHE_ENTRIES];
+};
+
+struct drv_layout_cache *drv_layout_cache_create(void)
+{
+	struct drv_layout_cache *cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	if (pthread_mutex_init(&cache->lock, NULL)) {
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+void drv_layout_cache_destroy(struct drv_layout_cache *cache)
+{
+	if (!cache)
+		return;
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+static uint64_t drv_layout_cache_mix(uint64_t hash, uint64_t value)
+{
+	/* FNV-1a, a word at a time. */
+	return (hash ^ value) * 0x100000001b3ull;
+}
+
+static uint64_t drv_layout_cache_hash(uint32_t width, uint32_t height, uint32_t format,
+				      uint64_t use_flags, const uint64_t *modifiers,
+				      uint32_t count)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	hash = drv_layout_cache_mix(hash, ((uint64_t)width << 32) | height);
+	hash = drv_layout_cache_mix(hash, format);
+	hash = drv_layout_cache_mix(hash, use_flags);
+	hash = drv_layout_cache_mix(hash, count);
+	for (uint32_t i = 0; i < count; i++)
+		hash = drv_layout_cache_mix(hash, modifiers[i]);
+
+	return hash;
+}
+
+static bool drv_layout_cache_entry_matches(const struct drv_layout_cache_entry *entry,
+					   uint64_t hash, uint32_t width, uint32_t height,
+					   uint32_t format, uint64_t use_flags,
+					   const uint64_t *modifiers, uint32_t count)
+{
+	return entry->valid && entry->hash == hash && entry->width == width &&
+	       entry->height == height && entry->format == format &&
+	       entry->use_flags == use_flags && entry->count == count &&
+	       (!count || !memcmp(entry->modifiers, modifiers, count * sizeof(*modifiers)));
+}
+
+bool drv_layout_cache_lookup(struct drv_layout_cache *cache, uint32_t width, uint32_t height,
+			     uint32_t format, uint64_t use_flags, const uint64_t *modifiers,
+			     uint32_t count, struct bo_metadata *meta)
+{
+	uint64_t hash;
+	bool found = false;
+
+	if (!cache)
+		return false;
+
+	if (count > DRV_LAYOUT_CACHE_MAX_MODIFIERS) {
+		pthread_mutex_lock(&cache->lock);
+		cache->misses++;
+		pthread_mutex_unlock(&cache->lock);
+		return false;
+	}
+
+	hash = drv_layout_cache_hash(width, height, format, use_flags, modifiers, count);
+
+	pthread_mutex_lock(&cache->lock);
+	for (uint32_t i = 0; i < DRV_LAYOUT_CACHE_ENTRIES; i++) {
+		const struct drv_layout_cache_entry *entry = &cache->entries[i];
+
+		if (drv_layout_cache_entry_matches(entry, hash, width, height, format, use_flags,
+						   modifiers, count)) {
+			*meta = entry->meta;
+			found = true;
+			break;
+		}
+	}
+
+	if (found)
+		cache->hits++;
+	else
+		cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+
+	return found;
+}
+
+void drv_layout_cache_insert(struct drv_layout_cache *cache, uint32_t width, uint32_t height,
+			     uint32_t format, uint64_t use_flags, const uint64_t *modifiers,
+			     uint32_t count, const struct bo_metadata *meta)
+{
+	struct drv_layout_cache_entry *entry;
+
+	if (!cache || count > DRV_LAYOUT_CACHE_MAX_MODIFIERS)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	entry = &cache->entries[cache->next];
+	cache->next = (cache->next + 1) % DRV_LAYOUT_CACHE_ENTRIES;
+
+	entry->valid = true;
+	entry->hash = drv_layout_cache_hash(width, height, format, use_flags, modifiers, count);
+	entry->width = width;
+	entry->height = height;
+	entry->format = format;
+	entry->use_flags = use_flags;
+	entry->count = count;
+	if (count)
+		memcpy(entry->modifiers, modifiers, count * sizeof(*modifiers));
+	entry->meta = *meta;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void drv_layout_cache_get_counters(struct drv_layout_cache *cache, uint64_t *hits,
+				   uint64_t *misses)
+{
+	pthread_mutex_lock(&cache->lock);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright 2022 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef DRV_LAYOUT_CACHE_H
+#define DRV_LAYOUT_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "drv_priv.h"
+
+/*
+ * Remembers the layouts bo_compute_metadata() picked for recent allocation requests, so that
+ * repeated requests (swapchain images, camera and codec buffer pools) skip modifier negotiation
+ * and layout math. Only valid for backends whose bo_compute_metadata() depends on nothing but
+ * its arguments and the driver. Thread safe.
+ */
+struct drv_layout_cache;
+
+struct drv_layout_cache *drv_layout_cache_create(void);
+void drv_layout_cache_destroy(struct drv_layout_cache *cache);
+
+/* On a hit, copies the layout computed for these arguments into |meta| and returns true. */
+bool drv_layout_cache_lookup(struct drv_layout_cache *cache, uint32_t width, uint32_t height,
+			     uint32_t format, uint64_t use_flags, const uint64_t *modifiers,
+			     uint32_t count, struct bo_metadata *meta);
+
+void drv_layout_cache_insert(struct drv_layout_cache *cache, uint32_t width, uint32_t height,
+			     uint32_t format, uint64_t use_flags, const uint64_t *modifiers,
+			     uint32_t count, const struct bo_metadata *meta);
+
+/* Lookups that found, and did not find, a layout. */
+void drv_layout_cache_get_counters(struct drv_layout_cache *cache, uint64_t *hits,
+				   uint64_t *misses);
+
+#endif
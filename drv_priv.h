@@ -45,9 +45,50 @@ struct bo {
 	struct bo_metadata meta;
 	bool is_test_buffer;
 	union bo_handle handles[DRV_MAX_PLANES];
+	/* Fake mmap offsets of |handles|, cached by drv_bo_get_mmap_offset(); 0 until queried. */
+	uint64_t mmap_offsets[DRV_MAX_PLANES];
+	/*
+	 * dma-bufs exported by drv_bo_get_plane_fd(), which hands out duplicates of them; -1 until
+	 * exported. Planes sharing a GEM handle only fill the slot of the first of them. Each one
+	 * costs the process an fd for as long as the bo lives, so at most DRV_MAX_CACHED_PLANE_FDS
+	 * are kept per driver and later exports are handed out without being cached.
+	 */
+	int plane_fds[DRV_MAX_PLANES];
+	/* An enum drv_heap, set by backends that know where they put the bo. */
+	uint32_t heap;
+	/* How the bo is counted in drv->heaps; see drv_bo_account(). */
+	bool accounted;
+	bool imported;
+	/*
+	 * Set once drv_bo_get_plane_fd() has handed out a dma-buf of the bo, and cleared again by
+	 * drv_bo_set_exports_released().
+	 */
+	bool exported;
+	/* Whether the allocation was counted by drv_stats_record_alloc(). */
+	bool stats_recorded;
 	void *priv;
 };
 
+/*
+ * One entry of a compression policy, see drv_set_compression_policy(). Zero fields match
+ * anything; |use_flags| matches if any of its bits is requested.
+ */
+struct drv_compression_rule {
+	bool allow;
+	uint32_t format;
+	uint64_t use_flags;
+	uint64_t min_pixels;
+	uint64_t max_pixels;
+};
+
+struct drv_heap_counters {
+	uint64_t allocated_bytes;
+	uint64_t allocated_buffers;
+	uint64_t imported_bytes;
+	uint64_t imported_buffers;
+	uint64_t budget;
+};
+
 struct format_metadata {
 	uint32_t priority;
 	uint32_t tiling;
@@ -64,12 +105,56 @@ struct driver {
 	int fd;
 	const struct backend *backend;
 	void *priv;
-	pthread_mutex_t buffer_table_lock;
-	void *buffer_table;
+	/* Per GEM handle reference counts, shared by every bo that imports the handle. */
+	struct handle_table *buffer_table;
 	pthread_mutex_t mappings_lock;
-	struct drv_array *mappings;
+	/* GEM handle -> list of struct vma_entry, one per set of map flags. */
+	void *mappings;
+	/* Unreferenced BO_MAP_PERSISTENT vmas, least recently used first. Under |mappings_lock|. */
+	struct vma_entry *parked_vmas_head;
+	struct vma_entry *parked_vmas_tail;
+	size_t parked_vmas_bytes;
+	size_t parked_vmas_max_bytes;
+	/*
+	 * Set once MADV_POPULATE_* was refused on one of the backend's mappings, which all come from
+	 * the same kind of mmap. Accessed with __atomic builtins.
+	 */
+	bool prefault_unsupported;
+	/* Backing stores for bos, vma entries and mapping entries. */
+	struct drv_slab *bo_slab;
+	struct drv_slab *vma_slab;
+	struct drv_slab *mapping_slab;
+	/* Last shadow freed by drv_shadow_free(). Under |mappings_lock|. */
+	void *shadow_cache;
+	size_t shadow_cache_size;
 	struct drv_array *combos;
+	/*
+	 * Read-only lookup index over |combos|. Built by drv_create() once the backend has
+	 * initialized; the combination list must not change after that point.
+	 */
+	struct combination_index *combo_index;
+	/* Layouts recently computed by bo_compute_metadata(); NULL if the backend has none. */
+	struct drv_layout_cache *layout_cache;
+	/* Master switch, cleared by MINIGBM_DEBUG=nocompression. */
 	bool compression;
+	/* Checked in order by drv_compression_allowed(); the first match wins. */
+	struct drv_compression_rule *compression_rules;
+	uint32_t num_compression_rules;
+	/*
+	 * Use flags whose bos drv_bo_align_size() and drv_bo_mmap() target huge pages for; see
+	 * drv_set_huge_page_policy(). Zero, the default, disables the policy.
+	 */
+	uint64_t huge_page_use_flags;
+	/* Set by drv_create_mapper_only(); backends may skip allocation-side setup. */
+	bool mapper_only;
+	/* Set once a prime export has been refused DRM_RDWR, so later ones don't ask for it. */
+	bool prime_no_rdwr;
+	/* Filled bo->plane_fds slots across the driver's bos, updated with __atomic builtins. */
+	uint32_t num_cached_plane_fds;
+	/* Live bos per enum drv_heap, updated with __atomic builtins. */
+	struct drv_heap_counters heaps[DRV_NUM_HEAPS];
+	/* Set at most once, by drv_stats_enable(); NULL while stats are disabled. */
+	struct drv_stats *stats;
 };
 
 struct backend {
@@ -85,6 +170,11 @@ struct backend {
 	int (*bo_compute_metadata)(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 				   uint64_t use_flags, const uint64_t *modifiers, uint32_t count);
 	int (*bo_create_from_metadata)(struct bo *bo);
+	/*
+	 * Fills out |bo->meta| as bo_create() would, without allocating. Only for backends without
+	 * bo_compute_metadata(), which already answers this.
+	 */
+	int (*bo_query_layout)(struct bo *bo);
 	/* Called for every non-test-buffer BO on free */
 	int (*bo_release)(struct bo *bo);
 	/* Called on free if this bo is the last object referencing the contained GEM BOs */
@@ -93,7 +183,10 @@ struct backend {
 	void *(*bo_map)(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
 	int (*bo_unmap)(struct bo *bo, struct vma *vma);
 	int (*bo_invalidate)(struct bo *bo, struct mapping *mapping);
-	int (*bo_flush)(struct bo *bo, struct mapping *mapping);
+	/* |out_fence| is NULL if the caller can't take a fence, see drv_bo_flush(). */
+	int (*bo_flush)(struct bo *bo, struct mapping *mapping, int *out_fence);
+	/* Copies |rect| without mapping either bo, or returns -ENOTSUP to copy on the CPU. */
+	int (*bo_copy)(struct bo *dst, struct bo *src, const struct rectangle *rect);
 	int (*bo_get_plane_fd)(struct bo *bo, size_t plane);
 	uint32_t (*bo_get_map_stride)(struct bo *bo);
 	void (*resolve_format_and_use_flags)(struct driver *drv, uint32_t format,
@@ -128,6 +221,9 @@ struct backend {
 
 #define LINEAR_METADATA (struct format_metadata) { 1, 0, DRM_FORMAT_MOD_LINEAR }
 
+/* Bounds the per-process fds drv_bo_get_plane_fd() keeps open for reuse. */
+#define DRV_MAX_CACHED_PLANE_FDS 64
+
 #define MESA_LLVMPIPE_MAX_TEXTURE_2D_LEVELS 15
 #define MESA_LLVMPIPE_MAX_TEXTURE_2D_SIZE (1 << (MESA_LLVMPIPE_MAX_TEXTURE_2D_LEVELS - 1))
 #define MESA_LLVMPIPE_TILE_ORDER 6
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2022 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "drv_slab.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/* Objects per chunk. Chunks are small enough that a rarely used slab wastes little. */
+#define DRV_SLAB_CHUNK_OBJECTS 32
+
+struct drv_slab_free_obj {
+	struct drv_slab_free_obj *next;
+};
+
+struct drv_slab_chunk {
+	struct drv_slab_chunk *next;
+	/* Keeps the objects that follow aligned for any type. */
+	long double data[];
+};
+
+struct drv_slab {
+	pthread_mutex_t lock;
+	size_t obj_size;
+	struct drv_slab_chunk *chunks;
+	struct drv_slab_free_obj *free_objs;
+};
+
+struct drv_slab *drv_slab_create(size_t obj_size)
+{
+	struct drv_slab *slab = calloc(1, sizeof(*slab));
+	if (!slab)
+		return NULL;
+
+	if (pthread_mutex_init(&slab->lock, NULL)) {
+		free(slab);
+		return NULL;
+	}
+
+	slab->obj_size = ALIGN(MAX(obj_size, sizeof(struct drv_slab_free_obj)),
+			       sizeof(long double));
+	return slab;
+}
+
+static int drv_slab_grow_locked(struct drv_slab *slab)
+{
+	struct drv_slab_chunk *chunk;
+	uint8_t *obj;
+
+	chunk = malloc(sizeof(*chunk) + slab->obj_size * DRV_SLAB_CHUNK_OBJECTS);
+	if (!chunk)
+		return -1;
+
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+
+	obj = (uint8_t *)chunk->data;
+	for (size_t i = 0; i < DRV_SLAB_CHUNK_OBJECTS; i++, obj += slab->obj_size) {
+		struct drv_slab_free_obj *free_obj = (struct drv_slab_free_obj *)obj;
+
+		free_obj->next = slab->free_objs;
+		slab->free_objs = free_obj;
+	}
+
+	return 0;
+}
+
+void *drv_slab_alloc(struct drv_slab *slab)
+{
+	struct drv_slab_free_obj *obj;
+
+	pthread_mutex_lock(&slab->lock);
+	if (!slab->free_objs && drv_slab_grow_locked(slab)) {
+		pthread_mutex_unlock(&slab->lock);
+		return NULL;
+	}
+
+	obj = slab->free_objs;
+	slab->free_objs = obj->next;
+	pthread_mutex_unlock(&slab->lock);
+
+	memset(obj, 0, slab->obj_size);
+	return obj;
+}
+
+void drv_slab_free(struct drv_slab *slab, void *obj)
+{
+	struct drv_slab_free_obj *free_obj = obj;
+
+	if (!obj)
+		return;
+
+	pthread_mutex_lock(&slab->lock);
+	free_obj->next = slab->free_objs;
+	slab->free_objs = free_obj;
+	pthread_mutex_unlock(&slab->lock);
+}
+
+void drv_slab_destroy(struct drv_slab *slab)
+{
+	struct drv_slab_chunk *chunk, *next;
+
+	if (!slab)
+		return;
+
+	for (chunk = slab->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	pthread_mutex_destroy(&slab->lock);
+	free(slab);
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright 2022 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef DRV_SLAB_H
+#define DRV_SLAB_H
+
+#include <stddef.h>
+
+/*
+ * Fixed size object allocator. Objects are carved out of chunks that are only returned to the
+ * system by drv_slab_destroy(), so once a slab has grown to its peak population, allocating and
+ * freeing objects never calls into malloc. Objects never move. Thread safe.
+ */
+struct drv_slab;
+
+struct drv_slab *drv_slab_create(size_t obj_size);
+
+/* Returns a zeroed object, or NULL when out of memory. */
+void *drv_slab_alloc(struct drv_slab *slab);
+
+void drv_slab_free(struct drv_slab *slab, void *obj);
+
+/* Frees every chunk, including objects that are still allocated. */
+void drv_slab_destroy(struct drv_slab *slab);
+
+#endif
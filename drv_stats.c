@@ -0,0 +1,383 @@
+/*
+ * Copyright 2022 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef __ANDROID__
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#include <cutils/trace.h>
+#endif
+
+#include "drv_layout_cache.h"
+#include "drv_priv.h"
+#include "drv_stats.h"
+#include "util.h"
+
+/*
+ * Latencies are bucketed by powers of two of microseconds: bucket 0 holds calls under 1us,
+ * bucket i holds [2^(i - 1), 2^i) us and the last bucket everything slower.
+ */
+#define DRV_STATS_NUM_BUCKETS 20
+/* Allocations in formats beyond the first DRV_STATS_NUM_FORMATS seen share the last slot. */
+#define DRV_STATS_NUM_FORMATS 32
+
+struct drv_stat_counters {
+	atomic_uint_fast64_t calls;
+	atomic_uint_fast64_t total_ns;
+	atomic_uint_fast64_t max_ns;
+	atomic_uint_fast64_t buckets[DRV_STATS_NUM_BUCKETS];
+};
+
+struct drv_format_counters {
+	atomic_uint_fast32_t format;
+	atomic_uint_fast64_t allocs;
+	atomic_uint_fast64_t bytes;
+	/* Bytes of the allocations counted above that haven't been freed yet. */
+	atomic_uint_fast64_t live_bytes;
+};
+
+struct drv_stats {
+	struct drv_stat_counters stats[DRV_NUM_STATS];
+	struct drv_format_counters formats[DRV_STATS_NUM_FORMATS];
+};
+
+static const char *drv_stat_names[DRV_NUM_STATS] = {
+	[DRV_STAT_BO_CREATE] = "bo_create",	    [DRV_STAT_BO_IMPORT] = "bo_import",
+	[DRV_STAT_BO_MAP] = "bo_map",		    [DRV_STAT_BO_UNMAP] = "bo_unmap",
+	[DRV_STAT_BO_INVALIDATE] = "bo_invalidate", [DRV_STAT_BO_FLUSH] = "bo_flush",
+	[DRV_STAT_FENCE_WAIT] = "fence_wait",
+};
+
+#ifdef __ANDROID__
+static const char *drv_stat_trace_names[DRV_NUM_STATS] = {
+	[DRV_STAT_BO_CREATE] = "minigbm::bo_create",
+	[DRV_STAT_BO_IMPORT] = "minigbm::bo_import",
+	[DRV_STAT_BO_MAP] = "minigbm::bo_map",
+	[DRV_STAT_BO_UNMAP] = "minigbm::bo_unmap",
+	[DRV_STAT_BO_INVALIDATE] = "minigbm::bo_invalidate",
+	[DRV_STAT_BO_FLUSH] = "minigbm::bo_flush",
+	[DRV_STAT_FENCE_WAIT] = "minigbm::fence_wait",
+};
+#endif
+
+struct drv_stats *drv_stats_create(void)
+{
+	struct drv_stats *stats = calloc(1, sizeof(*stats));
+	if (!stats)
+		return NULL;
+
+	for (size_t i = 0; i < DRV_NUM_STATS; i++) {
+		atomic_init(&stats->stats[i].calls, 0);
+		atomic_init(&stats->stats[i].total_ns, 0);
+		atomic_init(&stats->stats[i].max_ns, 0);
+		for (size_t b = 0; b < DRV_STATS_NUM_BUCKETS; b++)
+			atomic_init(&stats->stats[i].buckets[b], 0);
+	}
+
+	for (size_t i = 0; i < DRV_STATS_NUM_FORMATS; i++) {
+		atomic_init(&stats->formats[i].format, 0);
+		atomic_init(&stats->formats[i].allocs, 0);
+		atomic_init(&stats->formats[i].bytes, 0);
+		atomic_init(&stats->formats[i].live_bytes, 0);
+	}
+
+	return stats;
+}
+
+void drv_stats_destroy(struct drv_stats *stats)
+{
+	free(stats);
+}
+
+static struct drv_stats *drv_get_stats(struct driver *drv)
+{
+	/* Published once by drv_stats_enable() and never cleared before drv_destroy(). */
+	return __atomic_load_n(&drv->stats, __ATOMIC_ACQUIRE);
+}
+
+int drv_stats_enable(struct driver *drv)
+{
+	struct drv_stats *expected = NULL;
+	struct drv_stats *stats;
+
+	if (drv_get_stats(drv))
+		return 0;
+
+	stats = drv_stats_create();
+	if (!stats)
+		return -ENOMEM;
+
+	if (!__atomic_compare_exchange_n(&drv->stats, &expected, stats, false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE))
+		drv_stats_destroy(stats);
+
+	return 0;
+}
+
+static uint64_t drv_stats_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void drv_stat_begin(struct driver *drv, enum drv_stat stat, struct drv_stat_scope *scope)
+{
+	scope->start_ns = drv_get_stats(drv) ? drv_stats_now_ns() : 0;
+	scope->traced = false;
+
+#ifdef __ANDROID__
+	if (ATRACE_ENABLED()) {
+		ATRACE_BEGIN(drv_stat_trace_names[stat]);
+		scope->traced = true;
+	}
+#endif
+}
+
+static uint32_t drv_stats_bucket(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	uint32_t bucket = 0;
+
+	while (us && bucket < DRV_STATS_NUM_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+void drv_stat_end(struct driver *drv, enum drv_stat stat, struct drv_stat_scope *scope)
+{
+	struct drv_stats *stats;
+	struct drv_stat_counters *counters;
+	uint64_t elapsed, max;
+
+#ifdef __ANDROID__
+	if (scope->traced)
+		ATRACE_END();
+#endif
+
+	stats = drv_get_stats(drv);
+	/* Calls that began before stats were enabled carry no start time. */
+	if (!stats || !scope->start_ns)
+		return;
+
+	counters = &stats->stats[stat];
+	elapsed = drv_stats_now_ns() - scope->start_ns;
+
+	atomic_fetch_add_explicit(&counters->calls, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&counters->total_ns, elapsed, memory_order_relaxed);
+	atomic_fetch_add_explicit(&counters->buckets[drv_stats_bucket(elapsed)], 1,
+				  memory_order_relaxed);
+
+	max = atomic_load_explicit(&counters->max_ns, memory_order_relaxed);
+	while (elapsed > max && !atomic_compare_exchange_weak_explicit(
+				    &counters->max_ns, &max, elapsed, memory_order_relaxed,
+				    memory_order_relaxed))
+		;
+}
+
+bool drv_stats_record_alloc(struct driver *drv, uint32_t format, uint64_t size)
+{
+	struct drv_stats *stats = drv_get_stats(drv);
+	struct drv_format_counters *counters = NULL;
+
+	if (!stats)
+		return false;
+
+	for (size_t i = 0; i < DRV_STATS_NUM_FORMATS - 1; i++) {
+		uint_fast32_t slot_format = 0;
+
+		counters = &stats->formats[i];
+		if (atomic_compare_exchange_strong_explicit(&counters->format, &slot_format, format,
+							    memory_order_relaxed,
+							    memory_order_relaxed) ||
+		    slot_format == format)
+			break;
+
+		counters = NULL;
+	}
+
+	if (!counters)
+		counters = &stats->formats[DRV_STATS_NUM_FORMATS - 1];
+
+	atomic_fetch_add_explicit(&counters->allocs, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&counters->bytes, size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&counters->live_bytes, size, memory_order_relaxed);
+	return true;
+}
+
+void drv_stats_record_free(struct driver *drv, uint32_t format, uint64_t size)
+{
+	/* Only called for allocations drv_stats_record_alloc() counted, so stats are enabled. */
+	struct drv_stats *stats = drv_get_stats(drv);
+	struct drv_format_counters *counters = &stats->formats[DRV_STATS_NUM_FORMATS - 1];
+
+	for (size_t i = 0; i < DRV_STATS_NUM_FORMATS - 1; i++) {
+		uint32_t slot_format =
+		    atomic_load_explicit(&stats->formats[i].format, memory_order_relaxed);
+
+		if (slot_format == format) {
+			counters = &stats->formats[i];
+			break;
+		}
+	}
+
+	atomic_fetch_sub_explicit(&counters->live_bytes, size, memory_order_relaxed);
+}
+
+/* Returns the upper bound, in microseconds, of the bucket holding the |permille|-th call. */
+static uint64_t drv_stats_percentile_us(const struct drv_stat_counters *counters, uint64_t calls,
+					uint32_t permille)
+{
+	uint64_t seen = 0;
+	uint64_t rank = DIV_ROUND_UP(calls * permille, 1000);
+
+	for (uint32_t b = 0; b < DRV_STATS_NUM_BUCKETS; b++) {
+		seen += atomic_load_explicit(&counters->buckets[b], memory_order_relaxed);
+		if (seen >= rank)
+			return 1ull << b;
+	}
+
+	return 1ull << (DRV_STATS_NUM_BUCKETS - 1);
+}
+
+/* Where drv_stats_print() sends its lines: the log, or |buf| for drv_stats_dump(). */
+struct drv_stats_sink {
+	bool log;
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static void drv_stats_printf(struct drv_stats_sink *sink, const char *format, ...)
+{
+	char line[256];
+	va_list args;
+	int ret;
+
+	va_start(args, format);
+	if (sink->log) {
+		vsnprintf(line, sizeof(line), format, args);
+		drv_logi("%s", line);
+	} else {
+		size_t avail = sink->len < sink->size ? sink->size - sink->len : 0;
+
+		ret = vsnprintf(avail ? sink->buf + sink->len : NULL, avail, format, args);
+		/* Keeps counting past |size| so the caller can tell the dump was truncated. */
+		if (ret > 0)
+			sink->len += ret;
+	}
+	va_end(args);
+}
+
+/* Heap usage is always counted, so it is printed with stats disabled too. */
+static void drv_stats_print_heaps(struct driver *drv, struct drv_stats_sink *sink)
+{
+	for (uint32_t heap = 0; heap < DRV_NUM_HEAPS; heap++) {
+		struct drv_heap_usage usage;
+
+		drv_get_heap_usage(drv, heap, &usage);
+		if (!usage.allocated_buffers && !usage.imported_buffers)
+			continue;
+
+		drv_stats_printf(sink,
+				 "  %s heap: allocated=%llu (%llu bytes) imported=%llu (%llu bytes) "
+				 "budget=%llu\n",
+				 drv_heap_name(heap), (unsigned long long)usage.allocated_buffers,
+				 (unsigned long long)usage.allocated_bytes,
+				 (unsigned long long)usage.imported_buffers,
+				 (unsigned long long)usage.imported_bytes,
+				 (unsigned long long)usage.budget);
+	}
+}
+
+static void drv_stats_print(struct driver *drv, struct drv_stats_sink *sink)
+{
+	struct drv_stats *stats = drv_get_stats(drv);
+
+	if (!stats) {
+		drv_stats_printf(sink, "stats are disabled\n");
+		drv_stats_print_heaps(drv, sink);
+		return;
+	}
+
+	drv_stats_printf(sink, "%s stats:\n", drv->backend->name);
+
+	for (size_t i = 0; i < DRV_NUM_STATS; i++) {
+		const struct drv_stat_counters *counters = &stats->stats[i];
+		uint64_t calls = atomic_load_explicit(&counters->calls, memory_order_relaxed);
+		uint64_t total_ns = atomic_load_explicit(&counters->total_ns, memory_order_relaxed);
+		uint64_t max_ns = atomic_load_explicit(&counters->max_ns, memory_order_relaxed);
+
+		if (!calls)
+			continue;
+
+		drv_stats_printf(sink,
+				 "  %s: calls=%llu avg=%lluus max=%lluus p50<%lluus p99<%lluus\n",
+				 drv_stat_names[i], (unsigned long long)calls,
+				 (unsigned long long)(total_ns / calls / 1000),
+				 (unsigned long long)(max_ns / 1000),
+				 (unsigned long long)drv_stats_percentile_us(counters, calls, 500),
+				 (unsigned long long)drv_stats_percentile_us(counters, calls, 990));
+	}
+
+	for (size_t i = 0; i < DRV_STATS_NUM_FORMATS; i++) {
+		const struct drv_format_counters *counters = &stats->formats[i];
+		uint32_t format = atomic_load_explicit(&counters->format, memory_order_relaxed);
+		uint64_t allocs = atomic_load_explicit(&counters->allocs, memory_order_relaxed);
+		uint64_t bytes = atomic_load_explicit(&counters->bytes, memory_order_relaxed);
+		uint64_t live = atomic_load_explicit(&counters->live_bytes, memory_order_relaxed);
+
+		if (!allocs)
+			continue;
+
+		if (i == DRV_STATS_NUM_FORMATS - 1)
+			drv_stats_printf(sink, "  other formats: allocs=%llu bytes=%llu live=%llu\n",
+					 (unsigned long long)allocs, (unsigned long long)bytes,
+					 (unsigned long long)live);
+		else
+			drv_stats_printf(sink, "  %c%c%c%c: allocs=%llu bytes=%llu live=%llu\n",
+					 format & 0xff, (format >> 8) & 0xff,
+					 (format >> 16) & 0xff, (format >> 24) & 0xff,
+					 (unsigned long long)allocs, (unsigned long long)bytes,
+					 (unsigned long long)live);
+	}
+
+	drv_stats_print_heaps(drv, sink);
+
+	if (drv->layout_cache) {
+		uint64_t hits, misses;
+
+		drv_layout_cache_get_counters(drv->layout_cache, &hits, &misses);
+		drv_stats_printf(sink, "  layout cache: hits=%llu misses=%llu\n",
+				 (unsigned long long)hits, (unsigned long long)misses);
+	}
+}
+
+void drv_stats_log(struct driver *drv)
+{
+	struct drv_stats_sink sink = { .log = true };
+
+	drv_stats_print(drv, &sink);
+}
+
+size_t drv_stats_dump(struct driver *drv, char *buf, size_t size)
+{
+	struct drv_stats_sink sink = { .buf = buf, .size = size };
+
+	if (size)
+		buf[0] = '\0';
+
+	drv_stats_print(drv, &sink);
+	return sink.len;
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright 2022 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef DRV_STATS_H
+#define DRV_STATS_H
+
+#include <stdint.h>
+
+#include "drv.h"
+
+struct drv_stats;
+
+struct drv_stats *drv_stats_create(void);
+void drv_stats_destroy(struct drv_stats *stats);
+
+/*
+ * Accounts a successful allocation of |size| bytes in |format|. Returns whether stats were
+ * enabled to count it, in which case freeing it has to be accounted with drv_stats_record_free().
+ */
+bool drv_stats_record_alloc(struct driver *drv, uint32_t format, uint64_t size);
+void drv_stats_record_free(struct driver *drv, uint32_t format, uint64_t size);
+
+#endif
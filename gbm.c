@@ -5,12 +5,15 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <xf86drm.h>
 
 #include "drv.h"
@@ -71,44 +74,97 @@ PUBLIC void gbm_device_destroy(struct gbm_device *gbm)
 	free(gbm);
 }
 
-PUBLIC struct gbm_surface *gbm_surface_create(struct gbm_device *gbm, uint32_t width,
-					      uint32_t height, uint32_t format, uint32_t usage)
+/*
+ * A surface is a fixed ring of buffers allocated up front. There is no EGL winsys behind it, so
+ * gbm_surface_lock_front_buffer() hands out the next free buffer in ring order for the client to
+ * render into and present, and the buffer returns to the ring once it is released.
+ */
+static struct gbm_surface *gbm_surface_new(struct gbm_device *gbm, uint32_t width,
+					   uint32_t height, uint32_t format, uint32_t usage,
+					   const uint64_t *modifiers, uint32_t count)
 {
-	struct gbm_surface *surface = (struct gbm_surface *)malloc(sizeof(*surface));
+	struct gbm_surface *surface = (struct gbm_surface *)calloc(1, sizeof(*surface));
 
 	if (!surface)
 		return NULL;
 
+	surface->gbm = gbm;
+	for (uint32_t i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		if (count)
+			surface->bos[i] = gbm_bo_create_with_modifiers(gbm, width, height, format,
+								       modifiers, count);
+		else
+			surface->bos[i] = gbm_bo_create(gbm, width, height, format, usage);
+
+		if (!surface->bos[i]) {
+			gbm_surface_destroy(surface);
+			return NULL;
+		}
+	}
+
 	return surface;
 }
 
+PUBLIC struct gbm_surface *gbm_surface_create(struct gbm_device *gbm, uint32_t width,
+					      uint32_t height, uint32_t format, uint32_t usage)
+{
+	return gbm_surface_new(gbm, width, height, format, usage, NULL, 0);
+}
+
 PUBLIC struct gbm_surface *gbm_surface_create_with_modifiers(struct gbm_device *gbm, uint32_t width,
 							     uint32_t height, uint32_t format,
 							     const uint64_t *modifiers,
 							     const unsigned int count)
 {
-	if (count != 0 || modifiers != NULL)
+	if (count && !modifiers)
 		return NULL;
 
-	return gbm_surface_create(gbm, width, height, format, 0);
+	return gbm_surface_new(gbm, width, height, format, 0, modifiers, count);
 }
 
 PUBLIC struct gbm_bo *gbm_surface_lock_front_buffer(struct gbm_surface *surface)
 {
+	for (uint32_t i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		uint32_t slot = (surface->next + i) % GBM_SURFACE_NUM_BUFFERS;
+
+		if (surface->locked[slot])
+			continue;
+
+		surface->locked[slot] = true;
+		surface->next = (slot + 1) % GBM_SURFACE_NUM_BUFFERS;
+		return surface->bos[slot];
+	}
+
 	return NULL;
 }
 
 PUBLIC void gbm_surface_release_buffer(struct gbm_surface *surface, struct gbm_bo *bo)
 {
+	for (uint32_t i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		if (surface->bos[i] == bo) {
+			surface->locked[i] = false;
+			return;
+		}
+	}
 }
 
 PUBLIC int gbm_surface_has_free_buffers(struct gbm_surface *surface)
 {
-	return 0;
+	int num_free = 0;
+
+	for (uint32_t i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++)
+		num_free += !surface->locked[i];
+
+	return num_free;
 }
 
 PUBLIC void gbm_surface_destroy(struct gbm_surface *surface)
 {
+	for (uint32_t i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		if (surface->bos[i])
+			gbm_bo_destroy(surface->bos[i]);
+	}
+
 	free(surface);
 }
 
@@ -190,6 +246,38 @@ PUBLIC void gbm_bo_destroy(struct gbm_bo *bo)
 	free(bo);
 }
 
+static bool gbm_import_fd_modifier_to_drv(struct gbm_device *gbm,
+					  const struct gbm_import_fd_modifier_data *data,
+					  struct drv_import_fd_data *drv_data)
+{
+	size_t num_planes, i, num_fds;
+
+	drv_data->width = data->width;
+	drv_data->height = data->height;
+	drv_data->format = data->format;
+	num_planes = drv_num_planes_from_modifier(gbm->drv, drv_data->format, data->modifier);
+	assert(num_planes);
+
+	num_fds = data->num_fds;
+	if (!num_fds || num_fds > num_planes)
+		return false;
+
+	drv_data->format_modifier = data->modifier;
+	for (i = 0; i < num_planes; i++) {
+		if (num_fds != num_planes)
+			drv_data->fds[i] = data->fds[0];
+		else
+			drv_data->fds[i] = data->fds[i];
+		drv_data->offsets[i] = data->offsets[i];
+		drv_data->strides[i] = data->strides[i];
+	}
+
+	for (i = num_planes; i < GBM_MAX_PLANES; i++)
+		drv_data->fds[i] = -1;
+
+	return true;
+}
+
 PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void *buffer,
 				    uint32_t usage)
 {
@@ -198,7 +286,6 @@ PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void
 	struct gbm_import_fd_data *fd_data = buffer;
 	struct gbm_import_fd_modifier_data *fd_modifier_data = buffer;
 	uint32_t gbm_format;
-	size_t num_planes, i, num_fds;
 
 	drv_data.use_flags = gbm_convert_usage(usage);
 	switch (type) {
@@ -214,30 +301,9 @@ PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void
 		break;
 	case GBM_BO_IMPORT_FD_MODIFIER:
 		gbm_format = fd_modifier_data->format;
-		drv_data.width = fd_modifier_data->width;
-		drv_data.height = fd_modifier_data->height;
-		drv_data.format = fd_modifier_data->format;
-		num_planes = drv_num_planes_from_modifier(gbm->drv, drv_data.format,
-							  fd_modifier_data->modifier);
-		assert(num_planes);
-
-		num_fds = fd_modifier_data->num_fds;
-		if (!num_fds || num_fds > num_planes)
+		if (!gbm_import_fd_modifier_to_drv(gbm, fd_modifier_data, &drv_data))
 			return NULL;
 
-		drv_data.format_modifier = fd_modifier_data->modifier;
-		for (i = 0; i < num_planes; i++) {
-			if (num_fds != num_planes)
-				drv_data.fds[i] = fd_modifier_data->fds[0];
-			else
-				drv_data.fds[i] = fd_modifier_data->fds[i];
-			drv_data.offsets[i] = fd_modifier_data->offsets[i];
-			drv_data.strides[i] = fd_modifier_data->strides[i];
-		}
-
-		for (i = num_planes; i < GBM_MAX_PLANES; i++)
-			drv_data.fds[i] = -1;
-
 		break;
 	default:
 		return NULL;
@@ -261,6 +327,65 @@ PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void
 	return bo;
 }
 
+PUBLIC size_t gbm_bo_import_fd_modifier_batch(struct gbm_device *gbm,
+					      const struct gbm_import_fd_modifier_data *data,
+					      size_t count, uint32_t usage, struct gbm_bo **out_bos)
+{
+	struct drv_import_fd_data *drv_data;
+	struct bo **bos;
+	size_t i, n = 0, num_imported = 0;
+	size_t *index;
+
+	for (i = 0; i < count; i++)
+		out_bos[i] = NULL;
+
+	drv_data = calloc(count, sizeof(*drv_data));
+	bos = calloc(count, sizeof(*bos));
+	index = calloc(count, sizeof(*index));
+	if (!drv_data || !bos || !index)
+		goto out;
+
+	/* Entries that fail the per-buffer checks stay NULL and are left out of the batch. */
+	for (i = 0; i < count; i++) {
+		if (!gbm_device_is_format_supported(gbm, data[i].format, usage))
+			continue;
+
+		out_bos[i] = gbm_bo_new(gbm, data[i].format);
+		if (!out_bos[i])
+			continue;
+
+		drv_data[n].use_flags = gbm_convert_usage(usage);
+		if (!gbm_import_fd_modifier_to_drv(gbm, &data[i], &drv_data[n])) {
+			free(out_bos[i]);
+			out_bos[i] = NULL;
+			continue;
+		}
+
+		index[n++] = i;
+	}
+
+	drv_bo_import_batch(gbm->drv, drv_data, n, bos);
+
+	for (i = 0; i < n; i++) {
+		struct gbm_bo *bo = out_bos[index[i]];
+
+		if (!bos[i]) {
+			free(bo);
+			out_bos[index[i]] = NULL;
+			continue;
+		}
+
+		bo->bo = bos[i];
+		num_imported++;
+	}
+
+out:
+	free(index);
+	free(bos);
+	free(drv_data);
+	return num_imported;
+}
+
 PUBLIC void *gbm_bo_map(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
 			uint32_t transfer_flags, uint32_t *stride, void **map_data)
 {
@@ -270,7 +395,7 @@ PUBLIC void *gbm_bo_map(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t widt
 PUBLIC void gbm_bo_unmap(struct gbm_bo *bo, void *map_data)
 {
 	assert(bo);
-	drv_bo_flush_or_unmap(bo->bo, map_data);
+	drv_bo_flush_or_unmap(bo->bo, map_data, NULL);
 }
 
 PUBLIC uint32_t gbm_bo_get_width(struct gbm_bo *bo)
@@ -415,6 +540,8 @@ PUBLIC void *gbm_bo_map2(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t wid
 
 	map_flags = (transfer_flags & GBM_BO_TRANSFER_READ) ? BO_MAP_READ : BO_MAP_NONE;
 	map_flags |= (transfer_flags & GBM_BO_TRANSFER_WRITE) ? BO_MAP_WRITE : BO_MAP_NONE;
+	if (transfer_flags & GBM_BO_TRANSFER_PERSISTENT)
+		map_flags |= BO_MAP_PERSISTENT;
 
 	addr = drv_bo_map(bo->bo, &rect, map_flags, (struct mapping **)map_data, plane);
 	if (addr == MAP_FAILED)
@@ -426,3 +553,65 @@ PUBLIC void *gbm_bo_map2(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t wid
 	offset += rect.x * drv_bytes_per_pixel_from_format(bo->gbm_format, plane);
 	return (void *)((uint8_t *)addr + offset);
 }
+
+static int gbm_wait_fence(int fence)
+{
+	struct pollfd fds = {
+		.fd = fence,
+		.events = POLLIN,
+	};
+	int ret;
+
+	do {
+		ret = poll(&fds, 1, -1);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+	if (ret < 0)
+		return -errno;
+
+	if (fds.revents & (POLLERR | POLLNVAL))
+		return -EINVAL;
+
+	return 0;
+}
+
+PUBLIC void *gbm_bo_map_fence(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width,
+			      uint32_t height, uint32_t transfer_flags, uint32_t *stride,
+			      void **map_data, int plane, int in_fence)
+{
+	if (in_fence >= 0) {
+		int ret = gbm_wait_fence(in_fence);
+
+		close(in_fence);
+		if (ret) {
+			drv_loge("waiting for the map fence failed: %d\n", ret);
+			return MAP_FAILED;
+		}
+	}
+
+	return gbm_bo_map2(bo, x, y, width, height, transfer_flags, stride, map_data, plane);
+}
+
+PUBLIC int gbm_bo_unmap_fence(struct gbm_bo *bo, void *map_data, int *out_fence)
+{
+	assert(bo);
+	assert(out_fence);
+	return drv_bo_flush_or_unmap(bo->bo, map_data, out_fence);
+}
+
+PUBLIC int gbm_bo_flush_fence(struct gbm_bo *bo, void *map_data, int *out_fence)
+{
+	assert(bo);
+	assert(out_fence);
+	return drv_bo_flush(bo->bo, map_data, out_fence);
+}
+
+PUBLIC int gbm_bo_copy(struct gbm_bo *dst, struct gbm_bo *src, uint32_t x, uint32_t y,
+		       uint32_t width, uint32_t height)
+{
+	struct rectangle rect = { .x = x, .y = y, .width = width, .height = height };
+
+	assert(dst);
+	assert(src);
+	return drv_bo_copy(dst->bo, src->bo, &rect);
+}
@@ -371,6 +371,16 @@ struct gbm_bo *
 gbm_bo_import(struct gbm_device *gbm, uint32_t type,
               void *buffer, uint32_t usage);
 
+/*
+ * Imports |count| GBM_BO_IMPORT_FD_MODIFIER buffers at once, storing each bo (or NULL if that
+ * import failed) in |out_bos|. Fds that refer to the same dma-buf are only probed once. Returns
+ * the number of buffers imported. This is a minigbm extension.
+ */
+size_t
+gbm_bo_import_fd_modifier_batch(struct gbm_device *gbm,
+				const struct gbm_import_fd_modifier_data *data,
+				size_t count, uint32_t usage, struct gbm_bo **out_bos);
+
 /**
  * Flags to indicate the type of mapping for the buffer - these are
  * passed into gbm_bo_map(). The caller must set the union of all the
@@ -396,6 +406,14 @@ enum gbm_bo_transfer_flags {
     * Read/modify/write
     */
    GBM_BO_TRANSFER_READ_WRITE = (GBM_BO_TRANSFER_READ | GBM_BO_TRANSFER_WRITE),
+   /**
+    * Keep the CPU mapping alive after gbm_bo_unmap(), so that mapping the
+    * buffer again every frame only flushes and invalidates caches. Idle
+    * mappings are released once they exceed an address space budget
+    * (MINIGBM_MAP_CACHE_BYTES, 64 MiB by default) and when the bo is
+    * destroyed. This is a minigbm extension.
+    */
+   GBM_BO_TRANSFER_PERSISTENT = (1 << 2),
 };
 
 void *
@@ -508,6 +526,39 @@ gbm_bo_map2(struct gbm_bo *bo,
 	   uint32_t x, uint32_t y, uint32_t width, uint32_t height,
 	   uint32_t flags, uint32_t *stride, void **map_data, int plane);
 
+/*
+ * Explicit-sync variants of gbm_bo_map2() and gbm_bo_unmap().
+ *
+ * gbm_bo_map_fence() waits for |in_fence| (a sync file, or -1) to signal before the buffer
+ * contents are read back for CPU access. The fence is always closed.
+ *
+ * gbm_bo_unmap_fence() and gbm_bo_flush_fence() make CPU writes available to the device. When
+ * the backend would otherwise have to wait for that hand-off, they return a sync file that
+ * signals once it is done in |out_fence| instead, which the caller owns and passes on to the
+ * consumer. |out_fence| is -1 when the writes are already visible or ordered before any later
+ * device work. gbm_bo_flush_fence() keeps the mapping. Both return 0 or a negative errno.
+ */
+void *
+gbm_bo_map_fence(struct gbm_bo *bo,
+		 uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+		 uint32_t flags, uint32_t *stride, void **map_data, int plane,
+		 int in_fence);
+
+int
+gbm_bo_unmap_fence(struct gbm_bo *bo, void *map_data, int *out_fence);
+
+int
+gbm_bo_flush_fence(struct gbm_bo *bo, void *map_data, int *out_fence);
+
+/*
+ * Copies the rectangle at |x|, |y| of |src| into the same rectangle of |dst|, on the GPU where the
+ * backend supports it, without the caller mapping either buffer. Both buffers must come from the
+ * same device and have the same format. Returns 0 or a negative errno.
+ */
+int
+gbm_bo_copy(struct gbm_bo *dst, struct gbm_bo *src,
+	    uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
 #ifdef __cplusplus
 }
 #endif
@@ -32,6 +32,7 @@ struct backend gbm_mesa_backend = {
 	.bo_import = gbm_mesa_bo_import,
 	.bo_map = gbm_mesa_bo_map,
 	.bo_unmap = gbm_mesa_bo_unmap,
+	.bo_invalidate = gbm_mesa_bo_invalidate,
 	.bo_get_map_stride = gbm_mesa_bo_get_map_stride,
 	.resolve_format_and_use_flags = gbm_mesa_resolve_format_and_use_flags,
 	.bo_get_plane_fd = gbm_mesa_bo_get_plane_fd,
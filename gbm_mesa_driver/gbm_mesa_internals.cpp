@@ -22,6 +22,7 @@ extern "C" {
 
 #include "gbm_mesa_wrapper.h"
 
+#include "../dmabuf_driver/dmabuf_heap_pool.h"
 #include "UniqueFd.h"
 #include "drv_priv.h"
 #include "util.h"
@@ -33,9 +34,13 @@ extern "C" {
 #include <fcntl.h>
 #include <gbm.h>
 #include <glob.h>
+#include <inttypes.h>
 #include <iterator>
 #include <linux/dma-buf.h>
 #include <log/log.h>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
@@ -43,6 +48,7 @@ extern "C" {
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <tuple>
 #include <unistd.h>
 #include <vector>
 #include <xf86drm.h>
@@ -51,6 +57,10 @@ extern "C" {
 #define GBM_WRAPPER_NAME "libgbm_mesa_wrapper.so"
 #define GBM_GET_OPS_SYMBOL "get_gbm_ops"
 
+/* While scanout allocations of a kind keep failing, only every this many still try scanout. */
+#define GBM_MESA_SCANOUT_RETRY_INTERVAL 32
+#define GBM_MESA_PLACEMENT_MAX_KINDS 64
+
 void gbm_mesa_resolve_format_and_use_flags(struct driver *drv, uint32_t format, uint64_t use_flags,
 					   uint32_t *out_format, uint64_t *out_use_flags)
 {
@@ -121,6 +131,69 @@ int gbm_mesa_driver_init(struct driver *drv)
 	return drv_modify_linear_combinations(drv);
 }
 
+/*
+ * Remembers which kinds of buffers (format, size and usage) recently failed to allocate for
+ * scanout, which on split display/GPU SoCs means the display's CMA pool ran out. Those go to
+ * GPU memory on the first attempt instead of failing on CMA first, with a periodic retry to
+ * notice when the pool has room again. Buffers that wanted scanout but didn't get it are the
+ * misses HWC has to compose on the GPU; they are counted and logged to help size CMA.
+ */
+class GbmMesaPlacement
+{
+      public:
+	using Kind = std::tuple<uint32_t, uint32_t, uint32_t, uint64_t>;
+
+	bool should_try_scanout(const Kind &kind)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		auto it = failing_.find(kind);
+		if (it == failing_.end())
+			return true;
+
+		if (++it->second < GBM_MESA_SCANOUT_RETRY_INTERVAL)
+			return false;
+
+		it->second = 0;
+		return true;
+	}
+
+	void record(const Kind &kind, bool tried_scanout, bool got_scanout, uint64_t size)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (got_scanout) {
+			failing_.erase(kind);
+			return;
+		}
+
+		if (tried_scanout) {
+			if (failing_.size() >= GBM_MESA_PLACEMENT_MAX_KINDS &&
+			    !failing_.count(kind))
+				failing_.erase(failing_.begin());
+			failing_[kind] = 0;
+		}
+
+		misses_++;
+		miss_bytes_ += size;
+
+		/* Skipped scanout attempts are misses too, but only log when CMA actually failed. */
+		if (tried_scanout)
+			drv_logi("Placement miss: %ux%u format 0x%08x use_flags 0x%" PRIx64
+				 " not allocated for scanout, %" PRIu64 " misses (%" PRIu64
+				 " KiB) so far",
+				 std::get<1>(kind), std::get<2>(kind), std::get<0>(kind),
+				 std::get<3>(kind), misses_, miss_bytes_ / 1024);
+	}
+
+      private:
+	std::mutex mutex_;
+	/* Kinds whose last scanout attempt failed, with allocations since that attempt. */
+	std::map<Kind, uint32_t> failing_;
+	uint64_t misses_ = 0;
+	uint64_t miss_bytes_ = 0;
+};
+
 struct GbmMesaDriver {
 	~GbmMesaDriver()
 	{
@@ -137,6 +210,16 @@ struct GbmMesaDriver {
 
 	UniqueFd gbm_node_fd;
 	UniqueFd gpu_node_fd;
+
+	GbmMesaPlacement placement;
+
+	/* Exact-size backing for buffers Mesa would allocate as padded textures. */
+	UniqueFd system_heap_fd;
+	UniqueFd cma_heap_fd;
+	/* Declared after the heap fds they borrow, so they are destroyed first. */
+	std::unique_ptr<DmabufHeapPool> system_pool;
+	std::unique_ptr<DmabufHeapPool> cma_pool;
+	bool gpu_needs_contiguous = false;
 };
 
 struct GbmMesaDriverPriv {
@@ -208,7 +291,7 @@ int open_drm_dev(bool card_node, std::function<bool(int, bool, std::string)> fou
 static std::array<std::string, 6> separate_dc_gpu_list = { "v3d",      "vc4",  "etnaviv",
 							   "panfrost", "lima", "freedreno" };
 
-static bool is_separate_dc_gpu(UniqueFd *out_gpu_fd)
+static bool is_separate_dc_gpu(UniqueFd *out_gpu_fd, std::string *out_gpu_name)
 {
 	UniqueFd gpu_fd;
 	bool separate_dc = false;
@@ -229,6 +312,7 @@ static bool is_separate_dc_gpu(UniqueFd *out_gpu_fd)
 	});
 
 	*out_gpu_fd = std::move(gpu_fd);
+	*out_gpu_name = gpu_name;
 
 	drv_logi("Found GPU %s\n", gpu_name.c_str());
 
@@ -238,12 +322,17 @@ static bool is_separate_dc_gpu(UniqueFd *out_gpu_fd)
 static std::shared_ptr<GbmMesaDriver> gbm_mesa_get_or_init_driver(struct driver *drv,
 								  bool mapper_sphal)
 {
+	static std::mutex init_lock;
 	std::shared_ptr<GbmMesaDriver> gbm_mesa_drv;
 
+	std::lock_guard<std::mutex> lock(init_lock);
 	if (!drv->priv) {
 		gbm_mesa_drv = std::make_unique<GbmMesaDriver>();
 
-		bool look_for_kms = is_separate_dc_gpu(&gbm_mesa_drv->gpu_node_fd);
+		std::string gpu_name;
+		bool look_for_kms = is_separate_dc_gpu(&gbm_mesa_drv->gpu_node_fd, &gpu_name);
+		/* vc4 has no MMU, so everything it touches has to be contiguous. */
+		gbm_mesa_drv->gpu_needs_contiguous = gpu_name == "vc4";
 
 		if (look_for_kms && !mapper_sphal) {
 			drv_logi("GPU require KMSRO entry, searching for separate KMS driver...\n");
@@ -298,6 +387,21 @@ static std::shared_ptr<GbmMesaDriver> gbm_mesa_get_or_init_driver(struct driver
 			return nullptr;
 		}
 
+		/* Optional: without the heaps, every allocation goes through Mesa. */
+		if (!mapper_sphal) {
+			gbm_mesa_drv->system_heap_fd =
+			    UniqueFd(open("/dev/dma_heap/system", O_RDONLY | O_CLOEXEC));
+			if (gbm_mesa_drv->system_heap_fd)
+				gbm_mesa_drv->system_pool = std::make_unique<DmabufHeapPool>(
+				    "system", gbm_mesa_drv->system_heap_fd.Get());
+
+			gbm_mesa_drv->cma_heap_fd =
+			    UniqueFd(open("/dev/dma_heap/linux,cma", O_RDONLY | O_CLOEXEC));
+			if (gbm_mesa_drv->cma_heap_fd)
+				gbm_mesa_drv->cma_pool = std::make_unique<DmabufHeapPool>(
+				    "cma", gbm_mesa_drv->cma_heap_fd.Get());
+		}
+
 		auto priv = new GbmMesaDriverPriv();
 		priv->gbm_mesa_drv = gbm_mesa_drv;
 		drv->priv = priv;
@@ -331,17 +435,72 @@ struct GbmMesaBoPriv {
 	struct gbm_bo *gbm_bo = nullptr;
 };
 
-static void gbm_mesa_inode_to_handle(struct bo *bo)
+/* Takes ownership of |fd|, which backs every plane of |bo|. */
+static int gbm_mesa_bo_set_fd(struct bo *bo, std::shared_ptr<GbmMesaDriver> drv, int fd,
+			      uint32_t map_stride, uint64_t modifier)
 {
 	// DRM handles are used as unique buffer keys
-	// Since we are not relying on DRM, provide fstat->inode instead
-	auto priv = (GbmMesaBoPriv *)bo->priv;
+	// Since we are not relying on DRM, provide the dma-buf inode instead
+	int fds[DRV_MAX_PLANES];
+	std::fill(std::begin(fds), std::end(fds), fd);
+	int err = drv_bo_inode_handles(bo, fds);
+	if (err) {
+		close(fd);
+		return err;
+	}
 
-	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
-		struct stat sb;
-		fstat(priv->fds[plane].Get(), &sb);
-		bo->handles[plane].u64 = sb.st_ino;
+	auto priv = new GbmMesaBoPriv();
+	/* Each plane owns its fd, so the planes of one allocation must not share one. */
+	priv->fds[0] = UniqueFd(fd);
+	for (size_t plane = 1; plane < bo->meta.num_planes; plane++) {
+		priv->fds[plane] = UniqueFd(dup(fd));
 	}
+
+	priv->map_stride = map_stride;
+	bo->meta.format_modifier = modifier;
+
+	bo->priv = priv;
+	priv->drv = drv;
+
+	return 0;
+}
+
+/*
+ * Mesa allocates buffers it has no format for, and 1D BLOBs, as 4096 wide R8 textures, which
+ * adds row padding and tiling alignment on top of the page rounding a dma-heap needs. These
+ * buffers are always linear, so they come from a dma-heap instead when one is available:
+ * CMA for devices that need contiguous memory, the system heap otherwise.
+ */
+static int gbm_mesa_bo_create_from_heap(struct bo *bo, std::shared_ptr<GbmMesaDriver> drv,
+					uint32_t stride, uint32_t height, uint32_t format,
+					uint64_t use_flags, uint32_t size_align)
+{
+	uint64_t contiguous_flags = BO_USE_SCANOUT | BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE |
+				    BO_USE_HW_VIDEO_DECODER | BO_USE_HW_VIDEO_ENCODER;
+	/*
+	 * Every buffer is imported into Mesa, which rejects non-contiguous memory on GPUs that
+	 * need it, whatever the buffer's use.
+	 */
+	bool contiguous = drv->gpu_needs_contiguous || (use_flags & contiguous_flags);
+
+	DmabufHeapPool *pool = contiguous ? drv->cma_pool.get() : drv->system_pool.get();
+
+	if (!pool)
+		return -ENOTSUP;
+
+	drv_bo_from_format(bo, stride, height, format);
+	bo->meta.total_size = ALIGN(bo->meta.total_size, size_align);
+
+	auto buf_fd = pool->alloc(bo->meta.total_size);
+	if (!buf_fd)
+		return -errno;
+
+	drv_logv("Allocated %ux%u 0x%08x from a dma-heap: %" PRIu64 " bytes, overhead %" PRIu64,
+		 bo->meta.width, bo->meta.height, format, bo->meta.total_size,
+		 ALIGN(bo->meta.total_size, (uint64_t)getpagesize()) - bo->meta.total_size);
+
+	return gbm_mesa_bo_set_fd(bo, drv, buf_fd.Release(), bo->meta.strides[0],
+				  DRM_FORMAT_MOD_LINEAR);
 }
 
 int gbm_mesa_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
@@ -382,6 +541,17 @@ int gbm_mesa_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t
 		size_align = 4096;
 	}
 
+	if (alloc_args.drm_format == 0 ||
+	    (alloc_args.drm_format == DRM_FORMAT_R8 && alloc_args.height == 1)) {
+		err = gbm_mesa_bo_create_from_heap(bo, drv, alloc_args.width, alloc_args.height,
+						   format, use_flags, size_align);
+		if (err != -ENOTSUP) {
+			if (!err)
+				return 0;
+			drv_logi("dma-heap allocation failed, errno: %i, falling back to Mesa", err);
+		}
+	}
+
 	if (alloc_args.drm_format == 0) {
 		/* Always use linear for spoofed format allocations. */
 		drv_bo_from_format(bo, alloc_args.width, alloc_args.height, format);
@@ -405,10 +575,16 @@ int gbm_mesa_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t
 			 alloc_args.height);
 	}
 
+	GbmMesaPlacement::Kind kind(format, width, height, use_flags);
+	bool wants_scanout = alloc_args.use_scanout && !scanout_strong;
+	if (wants_scanout && !drv->placement.should_try_scanout(kind))
+		alloc_args.use_scanout = false;
+
+	bool tried_scanout = alloc_args.use_scanout;
 	err = wr->alloc(&alloc_args);
 
-	if (err && !scanout_strong) {
-		drv_loge("Failed to allocate for scanout, trying non-scanout");
+	if (err && tried_scanout && !scanout_strong) {
+		drv_logv("Failed to allocate for scanout, trying non-scanout");
 		alloc_args.use_scanout = false;
 		err = wr->alloc(&alloc_args);
 	}
@@ -421,23 +597,20 @@ int gbm_mesa_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t
 	if (!bo_layout_ready)
 		drv_bo_from_format(bo, alloc_args.out_stride, alloc_args.height, format);
 
-	drv_logv("Allocated: %dx%d, stride: %d, map_stride: %d", width, height,
-		 alloc_args.out_stride, alloc_args.out_map_stride);
-
-	auto priv = new GbmMesaBoPriv();
-	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
-		priv->fds[plane] = UniqueFd(alloc_args.out_fd);
-	}
-
-	priv->map_stride = alloc_args.out_map_stride;
-	bo->meta.format_modifier = alloc_args.out_modifier;
-
-	bo->priv = priv;
-	priv->drv = drv;
+	if (wants_scanout)
+		drv->placement.record(kind, tried_scanout, alloc_args.use_scanout,
+				      bo->meta.total_size);
 
-	gbm_mesa_inode_to_handle(bo);
+	/* The dma-buf size includes whatever padding and alignment Mesa added. */
+	off_t allocated = lseek(alloc_args.out_fd, 0, SEEK_END);
+	drv_logv("Allocated: %dx%d, stride: %d, map_stride: %d, size: %" PRIu64
+		 ", overhead: %" PRId64,
+		 width, height, alloc_args.out_stride, alloc_args.out_map_stride,
+		 bo->meta.total_size,
+		 allocated < 0 ? 0 : (int64_t)allocated - (int64_t)bo->meta.total_size);
 
-	return 0;
+	return gbm_mesa_bo_set_fd(bo, drv, alloc_args.out_fd, alloc_args.out_map_stride,
+				  alloc_args.out_modifier);
 }
 
 int gbm_mesa_bo_import(struct bo *bo, struct drv_import_fd_data *data)
@@ -446,6 +619,11 @@ int gbm_mesa_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 		drv_loge("%s bo isn't empty", __func__);
 		return -EINVAL;
 	}
+
+	int ret = drv_bo_inode_handles(bo, data->fds);
+	if (ret)
+		return ret;
+
 	auto priv = new GbmMesaBoPriv();
 	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
 		priv->fds[plane] = UniqueFd(dup(data->fds[plane]));
@@ -472,8 +650,6 @@ int gbm_mesa_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 
 	bo->priv = priv;
 
-	gbm_mesa_inode_to_handle(bo);
-
 	return 0;
 }
 
@@ -516,6 +692,21 @@ void *gbm_mesa_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map
 	return buf;
 }
 
+/*
+ * Mesa's map waits for the GPU but leaves CPU caches to the exporter, which matters for buffers
+ * from cached heaps on non-coherent SoCs.
+ */
+static int gbm_mesa_bo_sync(struct bo *bo, const struct vma *vma, bool end)
+{
+	auto priv = (GbmMesaBoPriv *)bo->priv;
+	int fds[DRV_MAX_PLANES];
+
+	for (size_t plane = 0; plane < bo->meta.num_planes; plane++)
+		fds[plane] = priv->fds[plane].Get();
+
+	return drv_bo_dmabuf_sync(bo, vma, fds, end);
+}
+
 int gbm_mesa_bo_unmap(struct bo *bo, struct vma *vma)
 {
 	auto drv = gbm_mesa_get_or_init_driver(bo->drv, true);
@@ -524,11 +715,21 @@ int gbm_mesa_bo_unmap(struct bo *bo, struct vma *vma)
 	auto priv = (GbmMesaBoPriv *)bo->priv;
 	assert(priv->gbm_bo != nullptr);
 	assert(vma->priv != nullptr);
+	/*
+	 * Mesa's unmap is what writes a staging copy back, so there is no bo_flush: every unlock
+	 * unmaps, and CPU access ends here, before that write back.
+	 */
+	gbm_mesa_bo_sync(bo, vma, true);
 	wr->unmap(priv->gbm_bo, vma->priv);
 	vma->priv = nullptr;
 	return 0;
 }
 
+int gbm_mesa_bo_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	return gbm_mesa_bo_sync(bo, mapping->vma, false);
+}
+
 uint32_t gbm_mesa_bo_get_map_stride(struct bo *bo)
 {
 	auto priv = (GbmMesaBoPriv *)bo->priv;
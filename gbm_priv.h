@@ -7,6 +7,7 @@
 #ifndef GBM_PRIV_H
 #define GBM_PRIV_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -18,7 +19,14 @@ struct gbm_device {
 	struct driver *drv;
 };
 
+#define GBM_SURFACE_NUM_BUFFERS 3
+
 struct gbm_surface {
+	struct gbm_device *gbm;
+	struct gbm_bo *bos[GBM_SURFACE_NUM_BUFFERS];
+	bool locked[GBM_SURFACE_NUM_BUFFERS];
+	/* Slot to try first on the next lock, so that buffers are handed out round robin. */
+	uint32_t next;
 };
 
 struct gbm_bo {
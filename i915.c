@@ -7,6 +7,7 @@
 #ifdef DRV_I915
 
 #include <assert.h>
+#include <cpuid.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -23,6 +24,11 @@
 #define I915_CACHELINE_SIZE 64
 #define I915_CACHELINE_MASK (I915_CACHELINE_SIZE - 1)
 
+// TODO: remove this definition once i915_drm.h contains it.
+#ifndef I915_MMAP_OFFSET_FIXED
+#define I915_MMAP_OFFSET_FIXED 4
+#endif
+
 static const uint32_t scanout_render_formats[] = { DRM_FORMAT_ABGR2101010, DRM_FORMAT_ABGR8888,
 						   DRM_FORMAT_ARGB2101010, DRM_FORMAT_ARGB8888,
 						   DRM_FORMAT_RGB565,	   DRM_FORMAT_XBGR2101010,
@@ -62,6 +68,14 @@ struct i915_device {
 	/*TODO : cleanup is_mtl to avoid adding variables for every new platforms */
 	bool is_mtl;
 	int32_t num_fences_avail;
+	bool has_clflushopt;
+	bool has_mmap_offset;
+	/* Set on discrete GPUs, which can place buffers in local or in system memory. */
+	bool has_lmem;
+	/* Whether the kernel can be told to keep local memory buffers CPU visible (small BAR). */
+	bool has_lmem_cpu_access_flag;
+	struct drm_i915_gem_memory_class_instance lmem_region;
+	struct drm_i915_gem_memory_class_instance smem_region;
 };
 
 static void i915_info_from_device_id(struct i915_device *i915)
@@ -404,18 +418,128 @@ static int i915_align_dimensions(struct bo *bo, uint32_t format, uint32_t tiling
 	return 0;
 }
 
-static void i915_clflush(void *start, size_t size)
+static bool i915_cpu_has_clflushopt(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return ebx & bit_CLFLUSHOPT;
+}
+
+/*
+ * Both clflush and clflushopt are ordered after earlier writes to the line they flush, so only
+ * the completion of the flushes needs a fence, once all ranges have been issued.
+ */
+static void i915_clflush(const struct i915_device *i915, void *start, size_t size)
 {
 	void *p = (void *)(((uintptr_t)start) & ~I915_CACHELINE_MASK);
 	void *end = (void *)((uintptr_t)start + size);
 
-	__builtin_ia32_mfence();
-	while (p < end) {
-		__builtin_ia32_clflush(p);
-		p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
+	if (i915->has_clflushopt) {
+		while (p < end) {
+			/* clflushopt is clflush with a 0x66 prefix; avoids needing -mclflushopt. */
+			__asm__ volatile(".byte 0x66; clflush %0" : "+m"(*(volatile char *)p));
+			p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
+		}
+	} else {
+		while (p < end) {
+			__builtin_ia32_clflush(p);
+			p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
+		}
 	}
 }
 
+static void i915_query_memory_regions(struct driver *drv, struct i915_device *i915)
+{
+	struct drm_i915_query_item item = { .query_id = DRM_I915_QUERY_MEMORY_REGIONS };
+	struct drm_i915_query query = { .num_items = 1, .items_ptr = (uintptr_t)&item };
+	struct drm_i915_query_memory_regions *info;
+	bool has_smem = false;
+
+	/* The first query only returns the size of the result; older kernels fail it. */
+	if (drmIoctl(drv->fd, DRM_IOCTL_I915_QUERY, &query) || item.length <= 0)
+		return;
+
+	info = calloc(1, item.length);
+	if (!info)
+		return;
+
+	item.data_ptr = (uintptr_t)info;
+	if (drmIoctl(drv->fd, DRM_IOCTL_I915_QUERY, &query) || item.length <= 0) {
+		free(info);
+		return;
+	}
+
+	for (uint32_t i = 0; i < info->num_regions; i++) {
+		const struct drm_i915_memory_region_info *region = &info->regions[i];
+
+		if (region->region.memory_class == I915_MEMORY_CLASS_SYSTEM && !has_smem) {
+			i915->smem_region = region->region;
+			has_smem = true;
+		} else if (region->region.memory_class == I915_MEMORY_CLASS_DEVICE &&
+			   !i915->has_lmem) {
+			i915->lmem_region = region->region;
+			i915->has_lmem = true;
+			/* Kernels that don't report this reject the flag. */
+			i915->has_lmem_cpu_access_flag = region->probed_cpu_visible_size != 0;
+			drv_logi("Local memory: %llu MiB, %llu MiB CPU visible\n",
+				 region->probed_size >> 20, region->probed_cpu_visible_size >> 20);
+		}
+	}
+
+	/* Mixed placements need system memory to migrate to. */
+	if (!has_smem)
+		i915->has_lmem = false;
+
+	free(info);
+}
+
+/* Usages served by the GPU and display alone, so that no other device imports the buffer. */
+#define I915_LMEM_ONLY_USE_MASK                                                                  \
+	(BO_USE_SCANOUT | BO_USE_CURSOR | BO_USE_RENDERING | BO_USE_TEXTURE |                    \
+	 BO_USE_FRONT_RENDERING | BO_USE_LINEAR)
+
+/*
+ * On discrete GPUs, buffers that only the GPU and display touch go to local memory, and
+ * buffers the CPU reads often, or that nothing but the CPU uses, to system memory, so that CPU
+ * access doesn't cross PCIe. Everything else starts in local memory but also lists system
+ * memory, so that importers without peer-to-peer access (camera, video, ...) can still attach
+ * it. Scanout buffers always list local memory, which display needs. Returns the number of
+ * regions stored in |regions|.
+ */
+static uint32_t i915_bo_regions(const struct i915_device *i915, uint64_t use_flags,
+				struct drm_i915_gem_memory_class_instance regions[2],
+				uint32_t *out_flags)
+{
+	bool cpu_only = !(use_flags & ~(BO_USE_SW_MASK | BO_USE_LINEAR));
+
+	*out_flags = 0;
+
+	if (!(use_flags & ~I915_LMEM_ONLY_USE_MASK)) {
+		regions[0] = i915->lmem_region;
+		return 1;
+	}
+
+	if (!(use_flags & BO_USE_SW_MASK)) {
+		regions[0] = i915->lmem_region;
+		regions[1] = i915->smem_region;
+		return 2;
+	}
+
+	if (!(use_flags & BO_USE_SCANOUT) && ((use_flags & BO_USE_SW_READ_OFTEN) || cpu_only)) {
+		regions[0] = i915->smem_region;
+		return 1;
+	}
+
+	regions[0] = i915->lmem_region;
+	regions[1] = i915->smem_region;
+	if (i915->has_lmem_cpu_access_flag)
+		*out_flags = I915_GEM_CREATE_EXT_FLAG_NEEDS_CPU_ACCESS;
+	return 2;
+}
+
 static int i915_init(struct driver *drv)
 {
 	int ret;
@@ -461,6 +585,18 @@ static int i915_init(struct driver *drv)
 	if (i915->graphics_version >= 12)
 		i915->has_hw_protection = 1;
 
+	i915->has_clflushopt = i915_cpu_has_clflushopt();
+
+	/* Version 4 of the GTT mmap interface introduced DRM_IOCTL_I915_GEM_MMAP_OFFSET. */
+	int32_t mmap_gtt_version = 0;
+	memset(&get_param, 0, sizeof(get_param));
+	get_param.param = I915_PARAM_MMAP_GTT_VERSION;
+	get_param.value = &mmap_gtt_version;
+	ret = drmIoctl(drv->fd, DRM_IOCTL_I915_GETPARAM, &get_param);
+	i915->has_mmap_offset = !ret && mmap_gtt_version >= 4;
+
+	i915_query_memory_regions(drv, i915);
+
 	drv->priv = i915;
 	return i915_add_combinations(drv);
 }
@@ -518,7 +654,7 @@ static int i915_bo_from_format(struct bo *bo, uint32_t width, uint32_t height, u
 		offset += bo->meta.sizes[plane];
 	}
 
-	bo->meta.total_size = ALIGN(offset, pagesize);
+	bo->meta.total_size = drv_bo_align_size(bo, ALIGN(offset, pagesize));
 
 	return 0;
 }
@@ -546,7 +682,8 @@ static int i915_bo_compute_metadata(struct bo *bo, uint32_t width, uint32_t heig
 		modifier =
 		    drv_pick_modifier(modifiers, count, i915->modifier.order, i915->modifier.count);
 	} else {
-		struct combination *combo = drv_get_combination(bo->drv, format, use_flags);
+		struct combination *combo =
+		    drv_get_combination_with_policy(bo->drv, format, use_flags, width, height);
 		if (!combo)
 			return -EINVAL;
 		modifier = combo->metadata.modifier;
@@ -570,19 +707,16 @@ static int i915_bo_compute_metadata(struct bo *bo, uint32_t width, uint32_t heig
 	}
 
 	/*
-	 * Skip I915_FORMAT_MOD_Y_TILED_CCS modifier if compression is disabled
-	 * Pick y tiled modifier if it has been passed in, otherwise use linear
+	 * Skip CCS modifiers if the compression policy denies them to this buffer. Pick the next
+	 * uncompressed modifier that has been passed in, otherwise use linear.
 	 */
-	if (!bo->drv->compression && modifier == I915_FORMAT_MOD_Y_TILED_CCS) {
-		uint32_t i;
-		for (i = 0; modifiers && i < count; i++) {
-			if (modifiers[i] == I915_FORMAT_MOD_Y_TILED)
-				break;
-		}
-		if (i == count)
-			modifier = DRM_FORMAT_MOD_LINEAR;
+	if (drv_modifier_is_compressed(modifier) &&
+	    !drv_compression_allowed(bo->drv, format, use_flags, width, height)) {
+		if (modifiers)
+			modifier = drv_pick_uncompressed_modifier(
+			    modifiers, count, i915->modifier.order, i915->modifier.count);
 		else
-			modifier = I915_FORMAT_MOD_Y_TILED;
+			modifier = DRM_FORMAT_MOD_LINEAR;
 	}
 
 	/* Prevent gen 8 and earlier from trying to use a tiling modifier */
@@ -712,18 +846,32 @@ static int i915_bo_create_from_metadata(struct bo *bo)
 	uint32_t gem_handle;
 	struct drm_i915_gem_set_tiling gem_set_tiling = { 0 };
 	struct i915_device *i915 = bo->drv->priv;
+	struct drm_i915_gem_create_ext_protected_content protected_content = {
+		.base = { .name = I915_GEM_CREATE_EXT_PROTECTED_CONTENT },
+		.flags = 0,
+	};
+	struct drm_i915_gem_memory_class_instance regions[2];
+	struct drm_i915_gem_create_ext_memory_regions memory_regions = {
+		.base = { .name = I915_GEM_CREATE_EXT_MEMORY_REGIONS },
+		.regions = (uintptr_t)regions,
+	};
+	struct drm_i915_gem_create_ext create_ext = {
+		.size = bo->meta.total_size,
+	};
 
-	if (i915->has_hw_protection && (bo->meta.use_flags & BO_USE_PROTECTED)) {
-		struct drm_i915_gem_create_ext_protected_content protected_content = {
-			.base = { .name = I915_GEM_CREATE_EXT_PROTECTED_CONTENT },
-			.flags = 0,
-		};
+	if (i915->has_hw_protection && (bo->meta.use_flags & BO_USE_PROTECTED))
+		create_ext.extensions = (uintptr_t)&protected_content;
 
-		struct drm_i915_gem_create_ext create_ext = {
-			.size = bo->meta.total_size,
-			.extensions = (uintptr_t)&protected_content,
-		};
+	if (i915->has_lmem) {
+		memory_regions.num_regions =
+		    i915_bo_regions(i915, bo->meta.use_flags, regions, &create_ext.flags);
+		memory_regions.base.next_extension = create_ext.extensions;
+		create_ext.extensions = (uintptr_t)&memory_regions;
+		if (regions[0].memory_class == I915_MEMORY_CLASS_DEVICE)
+			bo->heap = DRV_HEAP_VRAM;
+	}
 
+	if (create_ext.extensions) {
 		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_CREATE_EXT, &create_ext);
 		if (ret) {
 			drv_loge("DRM_IOCTL_I915_GEM_CREATE_EXT failed (size=%llu) (ret=%d) \n",
@@ -805,17 +953,200 @@ static int i915_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	return 0;
 }
 
+/*
+ * Picks the CPU caching of a linear mapping: WB by default, and WC for scanout buffers that the
+ * CPU only writes, since reads through WC are uncached.
+ */
+static uint64_t i915_mmap_offset_type(struct bo *bo)
+{
+	if (bo->meta.use_flags & (BO_USE_SW_READ_OFTEN | BO_USE_SW_READ_RARELY | BO_USE_RENDERSCRIPT |
+				  BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE))
+		return I915_MMAP_OFFSET_WB;
+
+	if (bo->meta.use_flags & BO_USE_SCANOUT)
+		return I915_MMAP_OFFSET_WC;
+
+	return I915_MMAP_OFFSET_WB;
+}
+
+static void *i915_bo_mmap_offset(struct bo *bo, uint32_t map_flags)
+{
+	int ret;
+	struct drm_i915_gem_mmap_offset gem_map = { 0 };
+
+	gem_map.handle = bo->handles[0].u32;
+	gem_map.flags = i915_mmap_offset_type(bo);
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP_OFFSET, &gem_map);
+	/* Objects in local memory only accept the caching the kernel fixed at creation. */
+	if (ret && errno == ENODEV) {
+		gem_map.flags = I915_MMAP_OFFSET_FIXED;
+		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP_OFFSET, &gem_map);
+	}
+
+	if (ret)
+		return MAP_FAILED;
+
+	return drv_bo_mmap(bo, bo->meta.total_size, drv_get_prot(map_flags), bo->drv->fd,
+			   gem_map.offset);
+}
+
+/*
+ * CPU access to tiled buffers the GTT can't detile (Tile4, and X/Y tiling on platforms without a
+ * mappable aperture) goes through a linear shadow of the buffer with the same strides and plane
+ * offsets. The vma hands out the shadow and keeps the real mapping in |vma->priv|; the tile rows
+ * a mapping covers are detiled into the shadow on invalidate and tiled back on flush.
+ *
+ * Compressed (CCS) buffers are still refused: their compression is only known to the hardware.
+ */
+#define I915_TILE_SIZE 4096
+/* Every tiling keeps runs of at least 16 bytes contiguous, so rows are copied in such spans. */
+#define I915_TILE_SPAN 16
+
+static bool i915_tile_dimensions(uint32_t tiling, uint32_t *width, uint32_t *height)
+{
+	switch (tiling) {
+	case I915_TILING_X:
+		*width = 512;
+		*height = 8;
+		return true;
+	case I915_TILING_Y:
+	case I915_TILING_4:
+		*width = 128;
+		*height = 32;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Offset of byte |x| in row |y| within a tile. */
+static uint32_t i915_tile_offset(uint32_t tiling, uint32_t x, uint32_t y)
+{
+	switch (tiling) {
+	case I915_TILING_X:
+		/* 8 rows of 512 bytes. */
+		return y * 512 + x;
+	case I915_TILING_Y:
+		/* 8 columns of 16 bytes by 32 rows. */
+		return (x / 16) * 512 + y * 16 + x % 16;
+	default:
+		/*
+		 * Tile4: 2x4 blocks of 512 bytes, each 2x4 cells of 64 bytes holding 4 rows of 16
+		 * bytes.
+		 */
+		return ((y / 8) * 2 + x / 64) * 512 + (((y / 4) % 2) * 4 + (x / 16) % 4) * 64 +
+		       (y % 4) * 16 + x % 16;
+	}
+}
+
+static bool i915_bo_needs_shadow(struct bo *bo)
+{
+	struct i915_device *i915 = bo->drv->priv;
+	uint32_t tile_width, tile_height;
+	size_t plane;
+
+	/* Bit 6 swizzling, which older platforms may apply, isn't handled. */
+	if (i915->graphics_version < 12 || !i915->has_mmap_offset ||
+	    !i915_tile_dimensions(bo->meta.tiling, &tile_width, &tile_height))
+		return false;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		if (bo->meta.strides[plane] % tile_width ||
+		    bo->meta.sizes[plane] % ((size_t)bo->meta.strides[plane] * tile_height) ||
+		    bo->meta.offsets[plane] % I915_TILE_SIZE)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Copies the tile rows of each plane that |rect| touches between the linear |shadow| and the
+ * |tiled| mapping, in the direction given by |to_tiled|. Returns the range of bytes of the
+ * buffer that were copied.
+ */
+static void i915_shadow_copy(struct bo *bo, uint8_t *shadow, uint8_t *tiled,
+			     const struct rectangle *rect, bool to_tiled, size_t plane,
+			     size_t *out_start, size_t *out_end)
+{
+	uint32_t tile_width, tile_height;
+	uint32_t stride = bo->meta.strides[plane];
+	uint32_t tiles_per_row, subsample, rows, y, y_end;
+
+	i915_tile_dimensions(bo->meta.tiling, &tile_width, &tile_height);
+	tiles_per_row = stride / tile_width;
+	subsample = drv_vertical_subsampling_from_format(bo->meta.format, plane);
+	rows = bo->meta.sizes[plane] / stride;
+
+	y = rect->y / subsample / tile_height * tile_height;
+	y_end = ALIGN(DIV_ROUND_UP(rect->y + rect->height, subsample), tile_height);
+	if (y_end > rows)
+		y_end = rows;
+
+	shadow += bo->meta.offsets[plane];
+	tiled += bo->meta.offsets[plane];
+	*out_start = bo->meta.offsets[plane] + (size_t)y * stride;
+	*out_end = bo->meta.offsets[plane] + (size_t)y_end * stride;
+
+	for (; y < y_end; y++) {
+		uint8_t *linear = shadow + (size_t)y * stride;
+		uint8_t *tile_row =
+		    tiled + (size_t)(y / tile_height) * tiles_per_row * I915_TILE_SIZE;
+
+		for (uint32_t x = 0; x < stride; x += I915_TILE_SPAN) {
+			uint8_t *tile = tile_row + (size_t)(x / tile_width) * I915_TILE_SIZE +
+					i915_tile_offset(bo->meta.tiling, x % tile_width,
+							 y % tile_height);
+
+			/* A constant size lets the compiler emit single vector moves. */
+			if (to_tiled)
+				memcpy(tile, linear + x, I915_TILE_SPAN);
+			else
+				memcpy(linear + x, tile, I915_TILE_SPAN);
+		}
+	}
+}
+
+static void *i915_bo_map_shadow(struct bo *bo, struct vma *vma, uint32_t map_flags)
+{
+	void *tiled, *shadow;
+
+	tiled = i915_bo_mmap_offset(bo, map_flags);
+	if (tiled == MAP_FAILED)
+		return MAP_FAILED;
+
+	shadow = mmap(0, bo->meta.total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		      -1, 0);
+	if (shadow == MAP_FAILED) {
+		munmap(tiled, bo->meta.total_size);
+		return MAP_FAILED;
+	}
+
+	vma->priv = tiled;
+	vma->length = bo->meta.total_size;
+	return shadow;
+}
+
 static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
 	void *addr = MAP_FAILED;
+	struct i915_device *i915 = bo->drv->priv;
 
 	if ((bo->meta.format_modifier == I915_FORMAT_MOD_Y_TILED_CCS) ||
-	    (bo->meta.format_modifier == I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS) ||
-	    (bo->meta.format_modifier == I915_FORMAT_MOD_4_TILED))
+	    (bo->meta.format_modifier == I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS))
 		return MAP_FAILED;
 
-	if (bo->meta.tiling == I915_TILING_NONE) {
+	/* Tile4 can't be detiled by a GTT fence. */
+	if (bo->meta.tiling == I915_TILING_4)
+		return i915_bo_needs_shadow(bo) ? i915_bo_map_shadow(bo, vma, map_flags)
+						: MAP_FAILED;
+
+	if (bo->meta.tiling == I915_TILING_NONE && i915->has_mmap_offset)
+		addr = i915_bo_mmap_offset(bo, map_flags);
+
+	if (addr == MAP_FAILED && bo->meta.tiling == I915_TILING_NONE) {
 		struct drm_i915_gem_mmap gem_map = { 0 };
 		/* TODO(b/118799155): We don't seem to have a good way to
 		 * detect the use cases for which WC mapping is really needed.
@@ -851,17 +1182,21 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 
 		gem_map.handle = bo->handles[0].u32;
 		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP_GTT, &gem_map);
+		/* Platforms without a mappable aperture have no GTT mmaps. */
+		if (ret && bo->meta.tiling != I915_TILING_NONE && i915_bo_needs_shadow(bo))
+			return i915_bo_map_shadow(bo, vma, map_flags);
+
 		if (ret) {
-			drv_loge("DRM_IOCTL_I915_GEM_MMAP_GTT failed\n");
+			drv_loge_ratelimited("DRM_IOCTL_I915_GEM_MMAP_GTT failed\n");
 			return MAP_FAILED;
 		}
 
-		addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED,
-			    bo->drv->fd, gem_map.offset);
+		addr = drv_bo_mmap(bo, bo->meta.total_size, drv_get_prot(map_flags), bo->drv->fd,
+				   gem_map.offset);
 	}
 
 	if (addr == MAP_FAILED) {
-		drv_loge("i915 GEM mmap failed\n");
+		drv_loge_ratelimited("i915 GEM mmap failed\n");
 		return addr;
 	}
 
@@ -869,13 +1204,52 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 	return addr;
 }
 
+/*
+ * The domains last set on a bo whose use flags say that only the CPU ever accesses it. Nothing
+ * else can move such a bo out of the domains it was put in, so setting them again (and waiting
+ * on its fences) would be a no-op.
+ */
+struct i915_bo_domain {
+	uint32_t read_domains;
+	uint32_t write_domain;
+};
+
+static int i915_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	if (vma->priv) {
+		munmap(vma->priv, vma->length);
+		vma->priv = NULL;
+	}
+
+	return drv_bo_munmap(bo, vma);
+}
+
+static int i915_bo_release(struct bo *bo)
+{
+	free(bo->priv);
+	bo->priv = NULL;
+	return 0;
+}
+
 static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
 	struct drm_i915_gem_set_domain set_domain = { 0 };
+	struct i915_bo_domain *domain = bo->priv;
+	bool cpu_only = (bo->meta.use_flags & BO_USE_SW_MASK) &&
+			!(bo->meta.use_flags & BO_USE_HW_MASK);
 
 	set_domain.handle = bo->handles[0].u32;
-	if (bo->meta.tiling == I915_TILING_NONE) {
+	if (mapping->vma->priv) {
+		/* The shadow is filled through a CPU mapping of the tiled buffer. */
+		uint32_t domain = i915_mmap_offset_type(bo) == I915_MMAP_OFFSET_WC
+				      ? I915_GEM_DOMAIN_WC
+				      : I915_GEM_DOMAIN_CPU;
+
+		set_domain.read_domains = domain;
+		if (mapping->vma->map_flags & BO_MAP_WRITE)
+			set_domain.write_domain = domain;
+	} else if (bo->meta.tiling == I915_TILING_NONE) {
 		set_domain.read_domains = I915_GEM_DOMAIN_CPU;
 		if (mapping->vma->map_flags & BO_MAP_WRITE)
 			set_domain.write_domain = I915_GEM_DOMAIN_CPU;
@@ -885,20 +1259,90 @@ static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 			set_domain.write_domain = I915_GEM_DOMAIN_GTT;
 	}
 
+	if (cpu_only && domain && (set_domain.read_domains & ~domain->read_domains) == 0 &&
+	    (!set_domain.write_domain || set_domain.write_domain == domain->write_domain))
+		goto detile;
+
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
 	if (ret) {
 		drv_loge("DRM_IOCTL_I915_GEM_SET_DOMAIN with %d\n", ret);
 		return ret;
 	}
 
+	if (cpu_only) {
+		if (!domain)
+			domain = bo->priv = calloc(1, sizeof(*domain));
+
+		/* Without tracking, the next invalidate simply issues the ioctl again. */
+		if (domain) {
+			/* Setting a write domain makes it the only read domain too. */
+			domain->read_domains = set_domain.write_domain ? set_domain.write_domain
+								       : set_domain.read_domains;
+			domain->write_domain = set_domain.write_domain;
+		}
+	}
+
+detile:
+	if (mapping->vma->priv) {
+		for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
+			size_t start, end;
+
+			i915_shadow_copy(bo, mapping->vma->addr, mapping->vma->priv,
+					 &mapping->rect, false, plane, &start, &end);
+		}
+	}
+
 	return 0;
 }
 
-static int i915_bo_flush(struct bo *bo, struct mapping *mapping)
+static int i915_bo_flush(struct bo *bo, struct mapping *mapping, int *out_fence)
 {
 	struct i915_device *i915 = bo->drv->priv;
-	if (!i915->has_llc && bo->meta.tiling == I915_TILING_NONE)
-		i915_clflush(mapping->vma->addr, mapping->vma->length);
+	const struct rectangle *rect = &mapping->rect;
+	uint8_t *addr = mapping->vma->addr;
+	size_t plane;
+
+	if (mapping->vma->priv) {
+		if (!(mapping->vma->map_flags & BO_MAP_WRITE))
+			return 0;
+
+		for (plane = 0; plane < bo->meta.num_planes; plane++) {
+			size_t start, end;
+
+			i915_shadow_copy(bo, addr, mapping->vma->priv, rect, true, plane, &start,
+					 &end);
+			if (!i915->has_llc && start < end)
+				i915_clflush(i915, (uint8_t *)mapping->vma->priv + start,
+					     end - start);
+		}
+
+		if (!i915->has_llc)
+			__builtin_ia32_mfence();
+
+		return 0;
+	}
+
+	if (i915->has_llc || bo->meta.tiling != I915_TILING_NONE)
+		return 0;
+
+	/*
+	 * Only the rows of each plane covered by the mapped rectangle can have been written.
+	 * Whole rows are flushed, since partial-width accesses are rare and the rows of a linear
+	 * plane are contiguous.
+	 */
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		uint32_t subsample = drv_vertical_subsampling_from_format(bo->meta.format, plane);
+		uint32_t stride = bo->meta.strides[plane];
+		size_t start = (size_t)(rect->y / subsample) * stride;
+		size_t end = (size_t)DIV_ROUND_UP(rect->y + rect->height, subsample) * stride;
+
+		if (end > bo->meta.sizes[plane])
+			end = bo->meta.sizes[plane];
+		if (start < end)
+			i915_clflush(i915, addr + bo->meta.offsets[plane] + start, end - start);
+	}
+
+	__builtin_ia32_mfence();
 
 	return 0;
 }
@@ -909,10 +1353,11 @@ const struct backend backend_i915 = {
 	.close = i915_close,
 	.bo_compute_metadata = i915_bo_compute_metadata,
 	.bo_create_from_metadata = i915_bo_create_from_metadata,
+	.bo_release = i915_bo_release,
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_import = i915_bo_import,
 	.bo_map = i915_bo_map,
-	.bo_unmap = drv_bo_munmap,
+	.bo_unmap = i915_bo_unmap,
 	.bo_invalidate = i915_bo_invalidate,
 	.bo_flush = i915_bo_flush,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
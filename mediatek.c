@@ -266,29 +266,40 @@ static int mediatek_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 						 ARRAY_SIZE(modifiers));
 }
 
-static void *mediatek_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+static int mediatek_bo_query_mmap_offset(struct bo *bo, uint32_t handle, uint64_t *offset)
 {
-	int ret, prime_fd;
+	int ret;
 	struct drm_mtk_gem_map_off gem_map = { 0 };
-	struct mediatek_private_map_data *priv;
-	void *addr = NULL;
 
-	gem_map.handle = bo->handles[0].u32;
+	gem_map.handle = handle;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_MTK_GEM_MAP_OFFSET, &gem_map);
 	if (ret) {
 		drv_loge("DRM_IOCTL_MTK_GEM_MAP_OFFSET failed\n");
-		return MAP_FAILED;
+		return ret;
 	}
 
+	*offset = gem_map.offset;
+	return 0;
+}
+
+static void *mediatek_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	int prime_fd;
+	struct mediatek_private_map_data *priv;
+	uint64_t offset;
+	void *addr = NULL;
+
+	if (drv_bo_get_mmap_offset(bo, 0, mediatek_bo_query_mmap_offset, &offset))
+		return MAP_FAILED;
+
 	prime_fd = drv_bo_get_plane_fd(bo, 0);
 	if (prime_fd < 0) {
 		drv_loge("Failed to get a prime fd\n");
 		return MAP_FAILED;
 	}
 
-	addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.offset);
+	addr = drv_bo_mmap(bo, bo->meta.total_size, drv_get_prot(map_flags), bo->drv->fd, offset);
 	if (addr == MAP_FAILED)
 		goto out_close_prime_fd;
 
@@ -299,7 +310,7 @@ static void *mediatek_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 		goto out_unmap_addr;
 
 	if (bo->meta.use_flags & BO_USE_RENDERSCRIPT) {
-		priv->cached_addr = calloc(1, bo->meta.total_size);
+		priv->cached_addr = drv_shadow_alloc(bo->drv, bo->meta.total_size);
 		if (!priv->cached_addr)
 			goto out_free_priv;
 
@@ -328,7 +339,7 @@ static int mediatek_bo_unmap(struct bo *bo, struct vma *vma)
 
 		if (priv->cached_addr) {
 			vma->addr = priv->gem_addr;
-			free(priv->cached_addr);
+			drv_shadow_free(bo->drv, priv->cached_addr, vma->length);
 		}
 
 		close(priv->prime_fd);
@@ -359,17 +370,17 @@ static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
 			drv_loge("poll prime_fd failed\n");
 
 		if (priv->cached_addr)
-			memcpy(priv->cached_addr, priv->gem_addr, bo->meta.total_size);
+			drv_shadow_copy_in(bo, mapping, priv->cached_addr, priv->gem_addr);
 	}
 
 	return 0;
 }
 
-static int mediatek_bo_flush(struct bo *bo, struct mapping *mapping)
+static int mediatek_bo_flush(struct bo *bo, struct mapping *mapping, int *out_fence)
 {
 	struct mediatek_private_map_data *priv = mapping->vma->priv;
 	if (priv && priv->cached_addr && (mapping->vma->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->meta.total_size);
+		drv_shadow_copy_out(bo, mapping, priv->gem_addr, priv->cached_addr);
 
 	return 0;
 }
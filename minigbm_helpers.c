@@ -17,6 +17,7 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "drv.h"
 #include "gbm.h"
 #include "minigbm_helpers.h"
 #include "util.h"
@@ -327,7 +328,15 @@ static struct gbm_device *try_drm_devices(drmDevicePtr *devs, int dev_count, int
 
 		fd = open(dev->nodes[type], O_RDWR | O_CLOEXEC);
 		if (fd >= 0) {
-			struct gbm_device *gbm = gbm_create_device(fd);
+			struct gbm_device *gbm;
+
+			/* Skip the backend init for devices no backend handles. */
+			if (!drv_has_backend(fd)) {
+				close(fd);
+				continue;
+			}
+
+			gbm = gbm_create_device(fd);
 			if (gbm) {
 				*out_fd = fd;
 				return gbm;
@@ -346,11 +355,23 @@ PUBLIC struct gbm_device *minigbm_create_default_device(int *out_fd)
 	int dev_count;
 	int fd;
 
+	/* a node picked earlier in this boot is the one the probing below would find */
+	fd = drv_open_cached_node("gbm");
+	if (fd >= 0) {
+		gbm = gbm_create_device(fd);
+		if (gbm) {
+			*out_fd = fd;
+			return gbm;
+		}
+		close(fd);
+	}
+
 	/* try gbm_get_default_device_fd first */
 	fd = gbm_get_default_device_fd();
 	if (fd >= 0) {
 		gbm = gbm_create_device(fd);
 		if (gbm) {
+			drv_cache_node(fd, "gbm");
 			*out_fd = fd;
 			return gbm;
 		}
@@ -366,5 +387,8 @@ PUBLIC struct gbm_device *minigbm_create_default_device(int *out_fd)
 
 	drmFreeDevices(devs, dev_count);
 
+	if (gbm)
+		drv_cache_node(*out_fd, "gbm");
+
 	return gbm;
 }
@@ -332,7 +332,8 @@ static int msm_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t
 	uint64_t modifier =
 	    drv_pick_modifier(modifiers, count, modifier_order, ARRAY_SIZE(modifier_order));
 
-	if (!bo->drv->compression && modifier == DRM_FORMAT_MOD_QCOM_COMPRESSED)
+	if (modifier == DRM_FORMAT_MOD_QCOM_COMPRESSED &&
+	    !drv_compression_allowed(bo->drv, format, bo->meta.use_flags, width, height))
 		modifier = DRM_FORMAT_MOD_LINEAR;
 
 	return msm_bo_create_for_modifier(bo, width, height, format, modifier);
@@ -342,34 +343,52 @@ static int msm_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t
 static int msm_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			 uint64_t flags)
 {
-	struct combination *combo = drv_get_combination(bo->drv, format, flags);
+	struct combination *combo =
+	    drv_get_combination_with_policy(bo->drv, format, flags, width, height);
 
 	if (!combo) {
 		drv_loge("invalid format = %d, flags = %" PRIx64 " combination\n", format, flags);
 		return -EINVAL;
 	}
 
+	/* NV12 only has a UBWC combination, which the policy may still deny. */
+	if (combo->metadata.modifier == DRM_FORMAT_MOD_QCOM_COMPRESSED &&
+	    !drv_compression_allowed(bo->drv, format, flags, width, height))
+		return msm_bo_create_for_modifier(bo, width, height, format,
+						  DRM_FORMAT_MOD_LINEAR);
+
 	return msm_bo_create_for_modifier(bo, width, height, format, combo->metadata.modifier);
 }
 
-static void *msm_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+static int msm_bo_query_mmap_offset(struct bo *bo, uint32_t handle, uint64_t *offset)
 {
 	int ret;
 	struct drm_msm_gem_info req = { 0 };
 
-	if (bo->meta.format_modifier)
-		return MAP_FAILED;
-
-	req.handle = bo->handles[0].u32;
+	req.handle = handle;
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_MSM_GEM_INFO, &req);
 	if (ret) {
 		drv_loge("DRM_IOCLT_MSM_GEM_INFO failed with %s\n", strerror(errno));
-		return MAP_FAILED;
+		return ret;
 	}
+
+	*offset = req.offset;
+	return 0;
+}
+
+static void *msm_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	uint64_t offset;
+
+	if (bo->meta.format_modifier)
+		return MAP_FAILED;
+
+	if (drv_bo_get_mmap_offset(bo, 0, msm_bo_query_mmap_offset, &offset))
+		return MAP_FAILED;
+
 	vma->length = bo->meta.total_size;
 
-	return mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    req.offset);
+	return drv_bo_mmap(bo, bo->meta.total_size, drv_get_prot(map_flags), bo->drv->fd, offset);
 }
 
 const struct backend backend_msm = {
@@ -142,7 +142,8 @@ static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint
 		 * driver to store motion vectors.
 		 */
 		bo->meta.total_size += w_mbs * h_mbs * 128;
-	} else if (width <= 2560 && afbc_modifier && bo->drv->compression) {
+	} else if (width <= 2560 && afbc_modifier &&
+		   drv_compression_allowed(bo->drv, format, bo->meta.use_flags, width, height)) {
 		/* If the caller has decided they can use AFBC, always
 		 * pick that */
 		afbc_bo_from_format(bo, width, height, format, afbc_modifier);
@@ -192,11 +193,26 @@ static int rockchip_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 						 ARRAY_SIZE(modifiers));
 }
 
-static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+static int rockchip_bo_query_mmap_offset(struct bo *bo, uint32_t handle, uint64_t *offset)
 {
 	int ret;
-	struct rockchip_private_map_data *priv;
 	struct drm_rockchip_gem_map_off gem_map = { 0 };
+
+	gem_map.handle = handle;
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_ROCKCHIP_GEM_MAP_OFFSET, &gem_map);
+	if (ret) {
+		drv_loge("DRM_IOCTL_ROCKCHIP_GEM_MAP_OFFSET failed\n");
+		return ret;
+	}
+
+	*offset = gem_map.offset;
+	return 0;
+}
+
+static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	struct rockchip_private_map_data *priv;
+	uint64_t offset;
 	void *addr = NULL;
 
 	/* We can only map buffers created with SW access flags, which should
@@ -205,15 +221,10 @@ static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 	    bo->meta.format_modifier == DRM_FORMAT_MOD_ROCKCHIP_AFBC)
 		return MAP_FAILED;
 
-	gem_map.handle = bo->handles[0].u32;
-	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_ROCKCHIP_GEM_MAP_OFFSET, &gem_map);
-	if (ret) {
-		drv_loge("DRM_IOCTL_ROCKCHIP_GEM_MAP_OFFSET failed\n");
+	if (drv_bo_get_mmap_offset(bo, 0, rockchip_bo_query_mmap_offset, &offset))
 		return MAP_FAILED;
-	}
 
-	addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.offset);
+	addr = drv_bo_mmap(bo, bo->meta.total_size, drv_get_prot(map_flags), bo->drv->fd, offset);
 	if (addr == MAP_FAILED)
 		return MAP_FAILED;
 
@@ -224,7 +235,7 @@ static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 		if (!priv)
 			goto out_unmap_addr;
 
-		priv->cached_addr = calloc(1, bo->meta.total_size);
+		priv->cached_addr = drv_shadow_alloc(bo->drv, bo->meta.total_size);
 		if (!priv->cached_addr)
 			goto out_free_priv;
 
@@ -247,7 +258,7 @@ static int rockchip_bo_unmap(struct bo *bo, struct vma *vma)
 	if (vma->priv) {
 		struct rockchip_private_map_data *priv = vma->priv;
 		vma->addr = priv->gem_addr;
-		free(priv->cached_addr);
+		drv_shadow_free(bo->drv, priv->cached_addr, vma->length);
 		free(priv);
 		vma->priv = NULL;
 	}
@@ -259,17 +270,17 @@ static int rockchip_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	if (mapping->vma->priv) {
 		struct rockchip_private_map_data *priv = mapping->vma->priv;
-		memcpy(priv->cached_addr, priv->gem_addr, bo->meta.total_size);
+		drv_shadow_copy_in(bo, mapping, priv->cached_addr, priv->gem_addr);
 	}
 
 	return 0;
 }
 
-static int rockchip_bo_flush(struct bo *bo, struct mapping *mapping)
+static int rockchip_bo_flush(struct bo *bo, struct mapping *mapping, int *out_fence)
 {
 	struct rockchip_private_map_data *priv = mapping->vma->priv;
 	if (priv && (mapping->vma->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->meta.total_size);
+		drv_shadow_copy_out(bo, mapping, priv->gem_addr, priv->cached_addr);
 
 	return 0;
 }
@@ -22,8 +22,35 @@ static const uint32_t render_target_formats[] = { DRM_FORMAT_ARGB8888, DRM_FORMA
 
 static const uint32_t texture_only_formats[] = { DRM_FORMAT_NV12, DRM_FORMAT_YVU420 };
 
+/*
+ * T-tiled images are made of 4 KiB tiles of 32 rows, each made of 2x2 1 KiB subtiles of 4x4
+ * 64-byte utiles. A utile is 4 rows of 16 bytes.
+ */
+#define VC4_UTILE_ROW_BYTES 16
+#define VC4_UTILE_HEIGHT 4
+#define VC4_T_TILE_ROW_BYTES 128
+#define VC4_T_TILE_HEIGHT 32
+
+/*
+ * Buffers the GPU renders to or samples from stay T-tiled unless software touches them often,
+ * as CPU access has to go through a linear copy.
+ */
+#define VC4_T_TILED_USE_FLAGS (BO_USE_RENDERING | BO_USE_TEXTURE | BO_USE_SCANOUT | \
+			       BO_USE_SW_READ_RARELY | BO_USE_SW_WRITE_RARELY)
+
+static bool vc4_format_can_t_tile(uint32_t format)
+{
+	uint32_t cpp = drv_bytes_per_pixel_from_format(format, 0);
+
+	return drv_num_planes_from_format(format) == 1 && (cpp == 2 || cpp == 4);
+}
+
 static int vc4_init(struct driver *drv)
 {
+	struct format_metadata metadata = { .tiling = 0,
+					    .priority = 2,
+					    .modifier = DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED };
+
 	drv_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
 			     &LINEAR_METADATA, BO_USE_RENDER_MASK);
 
@@ -37,6 +64,9 @@ static int vc4_init(struct driver *drv)
 	drv_modify_combination(drv, DRM_FORMAT_NV12, &LINEAR_METADATA,
 			       BO_USE_HW_VIDEO_DECODER | BO_USE_SCANOUT | BO_USE_HW_VIDEO_ENCODER);
 
+	drv_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
+			     &metadata, VC4_T_TILED_USE_FLAGS);
+
 	return drv_modify_linear_combinations(drv);
 }
 
@@ -47,25 +77,29 @@ static int vc4_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t he
 	size_t plane;
 	uint32_t stride;
 	struct drm_vc4_create_bo bo_create = { 0 };
+	struct drm_vc4_set_tiling set_tiling = { 0 };
 
 	switch (modifier) {
 	case DRM_FORMAT_MOD_LINEAR:
+		/*
+		 * Since the ARM L1 cache line size is 64 bytes, align to that as a
+		 * performance optimization.
+		 */
+		stride = drv_stride_from_format(format, width, 0);
+		stride = ALIGN(stride, 64);
+		drv_bo_from_format(bo, stride, height, format);
 		break;
 	case DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED:
-		drv_loge("DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED not supported yet\n");
-		return -EINVAL;
+		if (!vc4_format_can_t_tile(format))
+			return -EINVAL;
+
+		stride = ALIGN(drv_stride_from_format(format, width, 0), VC4_T_TILE_ROW_BYTES);
+		drv_bo_from_format(bo, stride, ALIGN(height, VC4_T_TILE_HEIGHT), format);
+		break;
 	default:
 		return -EINVAL;
 	}
 
-	/*
-	 * Since the ARM L1 cache line size is 64 bytes, align to that as a
-	 * performance optimization.
-	 */
-	stride = drv_stride_from_format(format, width, 0);
-	stride = ALIGN(stride, 64);
-	drv_bo_from_format(bo, stride, height, format);
-
 	bo_create.size = bo->meta.total_size;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VC4_CREATE_BO, &bo_create);
@@ -77,6 +111,20 @@ static int vc4_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t he
 	for (plane = 0; plane < bo->meta.num_planes; plane++)
 		bo->handles[plane].u32 = bo_create.handle;
 
+	bo->meta.format_modifier = modifier;
+	if (modifier == DRM_FORMAT_MOD_LINEAR)
+		return 0;
+
+	/* Importers that don't pass modifiers, such as KMS without them, ask the bo. */
+	set_tiling.handle = bo_create.handle;
+	set_tiling.modifier = modifier;
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VC4_SET_TILING, &set_tiling);
+	if (ret) {
+		drv_loge("DRM_IOCTL_VC4_SET_TILING failed\n");
+		drv_gem_bo_destroy(bo);
+		return -errno;
+	}
+
 	return 0;
 }
 
@@ -96,30 +144,155 @@ static int vc4_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t
 					uint32_t format, const uint64_t *modifiers, uint32_t count)
 {
 	static const uint64_t modifier_order[] = {
+		DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED,
 		DRM_FORMAT_MOD_LINEAR,
 	};
 	uint64_t modifier;
 
 	modifier = drv_pick_modifier(modifiers, count, modifier_order, ARRAY_SIZE(modifier_order));
+	if (modifier == DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED && !vc4_format_can_t_tile(format))
+		modifier = drv_has_modifier(modifiers, count, DRM_FORMAT_MOD_LINEAR)
+			       ? DRM_FORMAT_MOD_LINEAR
+			       : DRM_FORMAT_MOD_INVALID;
 
 	return vc4_bo_create_for_modifier(bo, width, height, format, modifier);
 }
 
-static void *vc4_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+static int vc4_bo_query_mmap_offset(struct bo *bo, uint32_t handle, uint64_t *offset)
 {
 	int ret;
 	struct drm_vc4_mmap_bo bo_map = { 0 };
 
-	bo_map.handle = bo->handles[0].u32;
+	bo_map.handle = handle;
 	ret = drmCommandWriteRead(bo->drv->fd, DRM_VC4_MMAP_BO, &bo_map, sizeof(bo_map));
 	if (ret) {
 		drv_loge("DRM_VC4_MMAP_BO failed\n");
-		return MAP_FAILED;
+		return ret;
 	}
 
+	*offset = bo_map.offset;
+	return 0;
+}
+
+/* Byte offset of utile (|utile_x|, |utile_y|) in a T-tiled image |tile_stride| tiles wide. */
+static uint32_t vc4_t_utile_address(uint32_t utile_x, uint32_t utile_y, uint32_t tile_stride)
+{
+	static const uint32_t even_stile_map[4] = { 0, 3, 1, 2 };
+	static const uint32_t odd_stile_map[4] = { 2, 1, 3, 0 };
+	uint32_t tile_x = utile_x / 8;
+	uint32_t tile_y = utile_y / 8;
+	bool odd_tile_y = tile_y & 1;
+	uint32_t stile_index = (((utile_y / 4) & 1) << 1) | ((utile_x / 4) & 1);
+	uint32_t stile;
+
+	/* Odd rows of tiles go right to left, and order their subtiles differently. */
+	if (odd_tile_y)
+		tile_x = tile_stride - tile_x - 1;
+
+	stile = odd_tile_y ? odd_stile_map[stile_index] : even_stile_map[stile_index];
+	return 4096 * (tile_y * tile_stride + tile_x) + 1024 * stile +
+	       64 * ((utile_y & 3) * 4 + (utile_x & 3));
+}
+
+/*
+ * Copies the utiles |rect| touches between the T-tiled buffer and a linear copy with the same
+ * stride. Utile rows are 16 bytes, which the compiler turns into single NEON loads and stores.
+ */
+static void vc4_t_tiled_copy(struct bo *bo, uint8_t *tiled, uint8_t *linear,
+			     const struct rectangle *rect, bool to_tiled)
+{
+	uint32_t cpp = drv_bytes_per_pixel_from_format(bo->meta.format, 0);
+	uint32_t stride = bo->meta.strides[0];
+	uint32_t tile_stride = stride / VC4_T_TILE_ROW_BYTES;
+	uint32_t utiles_w = stride / VC4_UTILE_ROW_BYTES;
+	uint32_t utiles_h = bo->meta.sizes[0] / stride / VC4_UTILE_HEIGHT;
+	uint32_t ux0 = rect->x * cpp / VC4_UTILE_ROW_BYTES;
+	uint32_t ux1 = DIV_ROUND_UP((rect->x + rect->width) * cpp, VC4_UTILE_ROW_BYTES);
+	uint32_t uy0 = rect->y / VC4_UTILE_HEIGHT;
+	uint32_t uy1 = DIV_ROUND_UP(rect->y + rect->height, VC4_UTILE_HEIGHT);
+
+	if (ux1 > utiles_w)
+		ux1 = utiles_w;
+	if (uy1 > utiles_h)
+		uy1 = utiles_h;
+
+	for (uint32_t uy = uy0; uy < uy1; uy++) {
+		uint8_t *row = linear + (size_t)uy * VC4_UTILE_HEIGHT * stride;
+
+		for (uint32_t ux = ux0; ux < ux1; ux++) {
+			uint8_t *utile = tiled + vc4_t_utile_address(ux, uy, tile_stride);
+			uint8_t *l = row + ux * VC4_UTILE_ROW_BYTES;
+
+			for (uint32_t r = 0; r < VC4_UTILE_HEIGHT; r++) {
+				if (to_tiled)
+					memcpy(utile + r * VC4_UTILE_ROW_BYTES, l + r * stride,
+					       VC4_UTILE_ROW_BYTES);
+				else
+					memcpy(l + r * stride, utile + r * VC4_UTILE_ROW_BYTES,
+					       VC4_UTILE_ROW_BYTES);
+			}
+		}
+	}
+}
+
+static void *vc4_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	uint64_t offset;
+	void *addr, *shadow;
+
+	if (drv_bo_get_mmap_offset(bo, 0, vc4_bo_query_mmap_offset, &offset))
+		return MAP_FAILED;
+
 	vma->length = bo->meta.total_size;
-	return mmap(NULL, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    bo_map.offset);
+	addr = drv_bo_mmap(bo, bo->meta.total_size, drv_get_prot(map_flags), bo->drv->fd, offset);
+	if (addr == MAP_FAILED || bo->meta.format_modifier != DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED)
+		return addr;
+
+	/* Software sees a linear copy, (de)tiled on invalidate and flush. */
+	shadow = drv_shadow_alloc(bo->drv, bo->meta.total_size);
+	if (!shadow) {
+		munmap(addr, bo->meta.total_size);
+		return MAP_FAILED;
+	}
+
+	vma->priv = addr;
+	return shadow;
+}
+
+static int vc4_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	if (vma->priv) {
+		drv_shadow_free(bo->drv, vma->addr, vma->length);
+		vma->addr = vma->priv;
+		vma->priv = NULL;
+	}
+
+	return drv_bo_munmap(bo, vma);
+}
+
+static int vc4_bo_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	if (mapping->vma->priv)
+		vc4_t_tiled_copy(bo, mapping->vma->priv, mapping->vma->addr, &mapping->rect, false);
+
+	return 0;
+}
+
+static int vc4_bo_flush(struct bo *bo, struct mapping *mapping, int *out_fence)
+{
+	if (!mapping->vma->priv || !(mapping->vma->map_flags & BO_MAP_WRITE))
+		return 0;
+
+	if (!mapping->num_dirty_rects) {
+		vc4_t_tiled_copy(bo, mapping->vma->priv, mapping->vma->addr, &mapping->rect, true);
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < mapping->num_dirty_rects; i++)
+		vc4_t_tiled_copy(bo, mapping->vma->priv, mapping->vma->addr,
+				 &mapping->dirty_rects[i], true);
+
+	return 0;
 }
 
 const struct backend backend_vc4 = {
@@ -130,7 +303,9 @@ const struct backend backend_vc4 = {
 	.bo_import = drv_prime_bo_import,
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_map = vc4_bo_map,
-	.bo_unmap = drv_bo_munmap,
+	.bo_unmap = vc4_bo_unmap,
+	.bo_invalidate = vc4_bo_invalidate,
+	.bo_flush = vc4_bo_flush,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
 };
 
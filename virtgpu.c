@@ -5,12 +5,18 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
+#include "drv_helpers.h"
 #include "drv_priv.h"
 #include "external/virtgpu_drm.h"
 #include "util.h"
@@ -33,14 +39,138 @@ struct virtgpu_param params[] = {
 extern const struct backend virtgpu_virgl;
 extern const struct backend virtgpu_cross_domain;
 
-static int virtgpu_init(struct driver *drv)
+/*
+ * Probe results can be shared between processes through a file named by MINIGBM_VIRTGPU_CACHE.
+ * They only depend on the host, so the file is trusted only for the boot and device node it was
+ * written for, and everything is probed again on any mismatch.
+ */
+#define VIRTGPU_CACHE_MAGIC 0x76677063 /* "cpgv" */
+#define VIRTGPU_CACHE_VERSION 1
+#define VIRTGPU_CACHE_MAX_CAPSETS 4
+#define VIRTGPU_CACHE_MAX_CAPSET_SIZE 2048
+#define VIRTGPU_BOOT_ID_SIZE 40
+
+struct virtgpu_cached_capset {
+	uint32_t id;
+	uint32_t version;
+	uint32_t size;
+	uint8_t data[VIRTGPU_CACHE_MAX_CAPSET_SIZE];
+};
+
+struct virtgpu_cache {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t rdev;
+	char boot_id[VIRTGPU_BOOT_ID_SIZE];
+	uint32_t params[param_max];
+	uint32_t num_capsets;
+	struct virtgpu_cached_capset capsets[VIRTGPU_CACHE_MAX_CAPSETS];
+};
+
+/* virtgpu_init() is serialized so that backends can reach the cache of the current probe. */
+static pthread_mutex_t virtgpu_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct virtgpu_cache *virtgpu_cache_mapped;
+static struct virtgpu_cache virtgpu_cache_probed;
+static bool virtgpu_cache_dirty;
+
+static int virtgpu_cache_key(int fd, struct virtgpu_cache *cache)
 {
-	int ret = 0;
-	const struct backend *virtgpu_backends[2] = {
-		&virtgpu_cross_domain,
-		&virtgpu_virgl,
-	};
+	int boot_id_fd;
+	ssize_t len;
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -errno;
+
+	boot_id_fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if (boot_id_fd < 0)
+		return -errno;
+
+	len = read(boot_id_fd, cache->boot_id, sizeof(cache->boot_id) - 1);
+	close(boot_id_fd);
+	if (len <= 0)
+		return -EINVAL;
+
+	cache->magic = VIRTGPU_CACHE_MAGIC;
+	cache->version = VIRTGPU_CACHE_VERSION;
+	cache->rdev = st.st_rdev;
+	return 0;
+}
+
+static struct virtgpu_cache *virtgpu_cache_map(const char *path,
+					       const struct virtgpu_cache *key)
+{
+	int fd;
+	struct stat st;
+	struct virtgpu_cache *cache;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size != sizeof(*cache)) {
+		close(fd);
+		return NULL;
+	}
+
+	cache = mmap(NULL, sizeof(*cache), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache == MAP_FAILED)
+		return NULL;
+
+	if (cache->magic != key->magic || cache->version != key->version ||
+	    cache->rdev != key->rdev ||
+	    memcmp(cache->boot_id, key->boot_id, sizeof(key->boot_id)) ||
+	    cache->num_capsets > VIRTGPU_CACHE_MAX_CAPSETS) {
+		munmap(cache, sizeof(*cache));
+		return NULL;
+	}
+
+	return cache;
+}
 
+int virtgpu_get_caps(struct driver *drv, uint32_t cap_set_id, uint32_t cap_set_ver, void *caps,
+		     uint32_t size)
+{
+	int ret;
+	struct virtgpu_cached_capset *capset;
+	struct drm_virtgpu_get_caps cap_args = { 0 };
+
+	if (virtgpu_cache_mapped) {
+		for (uint32_t i = 0; i < virtgpu_cache_mapped->num_capsets; i++) {
+			const struct virtgpu_cached_capset *cached =
+			    &virtgpu_cache_mapped->capsets[i];
+			if (cached->id == cap_set_id && cached->version == cap_set_ver &&
+			    cached->size == size) {
+				memcpy(caps, cached->data, size);
+				return 0;
+			}
+		}
+	}
+
+	cap_args.cap_set_id = cap_set_id;
+	cap_args.cap_set_ver = cap_set_ver;
+	cap_args.addr = (unsigned long long)caps;
+	cap_args.size = size;
+	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GET_CAPS, &cap_args);
+	if (ret)
+		return ret;
+
+	if (size <= VIRTGPU_CACHE_MAX_CAPSET_SIZE &&
+	    virtgpu_cache_probed.num_capsets < VIRTGPU_CACHE_MAX_CAPSETS) {
+		capset = &virtgpu_cache_probed.capsets[virtgpu_cache_probed.num_capsets++];
+		capset->id = cap_set_id;
+		capset->version = cap_set_ver;
+		capset->size = size;
+		memcpy(capset->data, caps, size);
+		virtgpu_cache_dirty = true;
+	}
+
+	return 0;
+}
+
+static void virtgpu_get_params(struct driver *drv)
+{
 	for (uint32_t i = 0; i < ARRAY_SIZE(params); i++) {
 		struct drm_virtgpu_getparam get_param = { 0 };
 
@@ -50,6 +180,35 @@ static int virtgpu_init(struct driver *drv)
 		if (ret)
 			drv_logi("virtgpu backend not enabling %s\n", params[i].name);
 	}
+}
+
+static int virtgpu_init(struct driver *drv)
+{
+	int ret = 0;
+	const struct backend *virtgpu_backends[2] = {
+		&virtgpu_cross_domain,
+		&virtgpu_virgl,
+	};
+	const char *cache_path = getenv("MINIGBM_VIRTGPU_CACHE");
+
+	pthread_mutex_lock(&virtgpu_cache_lock);
+	memset(&virtgpu_cache_probed, 0, sizeof(virtgpu_cache_probed));
+	virtgpu_cache_dirty = false;
+
+	if (cache_path && virtgpu_cache_key(drv->fd, &virtgpu_cache_probed))
+		cache_path = NULL;
+
+	if (cache_path)
+		virtgpu_cache_mapped = virtgpu_cache_map(cache_path, &virtgpu_cache_probed);
+
+	if (virtgpu_cache_mapped) {
+		memcpy(&virtgpu_cache_probed, virtgpu_cache_mapped, sizeof(virtgpu_cache_probed));
+		for (uint32_t i = 0; i < ARRAY_SIZE(params); i++)
+			params[i].value = virtgpu_cache_mapped->params[i];
+	} else {
+		virtgpu_get_params(drv);
+		virtgpu_cache_dirty = true;
+	}
 
 	for (uint32_t i = 0; i < ARRAY_SIZE(virtgpu_backends); i++) {
 		const struct backend *backend = virtgpu_backends[i];
@@ -58,9 +217,24 @@ static int virtgpu_init(struct driver *drv)
 			continue;
 
 		drv->backend = backend;
-		return 0;
+		break;
+	}
+
+	if (virtgpu_cache_mapped) {
+		munmap(virtgpu_cache_mapped, sizeof(*virtgpu_cache_mapped));
+		virtgpu_cache_mapped = NULL;
+	}
+
+	if (!ret && cache_path && virtgpu_cache_dirty) {
+		for (uint32_t i = 0; i < ARRAY_SIZE(params); i++)
+			virtgpu_cache_probed.params[i] = params[i].value;
+
+		if (drv_write_cache_file(cache_path, &virtgpu_cache_probed,
+					 sizeof(virtgpu_cache_probed)))
+			drv_logi("Failed to write virtgpu cache %s\n", cache_path);
 	}
 
+	pthread_mutex_unlock(&virtgpu_cache_lock);
 	return ret;
 }
 
@@ -23,3 +23,10 @@ enum virtgpu_param_id {
 	param_guest_vram,
 	param_max,
 };
+
+/*
+ * DRM_IOCTL_VIRTGPU_GET_CAPS, answered from the MINIGBM_VIRTGPU_CACHE file when it is valid.
+ * Only usable from a virtgpu backend's init().
+ */
+int virtgpu_get_caps(struct driver *drv, uint32_t cap_set_id, uint32_t cap_set_ver, void *caps,
+		     uint32_t size);
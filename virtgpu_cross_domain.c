@@ -5,8 +5,12 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <xf86drm.h>
 
 #include "drv_helpers.h"
@@ -32,19 +36,108 @@ static const uint32_t texture_only_formats[] = {
 
 extern struct virtgpu_param params[];
 
+#define METADATA_CACHE_MAX_ENTRIES 64
+#define METADATA_CACHE_NUM_BUCKETS 128
+
+/*
+ * A host answer for one (width, height, format, use_flags). Completed entries are kept on an LRU
+ * list; entries still waiting for their query are only reachable through the hash buckets, so
+ * they can't be evicted from under the thread doing the query.
+ */
+struct metadata_cache_entry {
+	struct bo_metadata metadata;
+	bool pending;
+	struct metadata_cache_entry *bucket_next;
+	struct metadata_cache_entry *lru_prev;
+	struct metadata_cache_entry *lru_next;
+};
+
+/*
+ * A blob resource whose last guest bo was destroyed, kept so an allocation of the same shape can
+ * reuse the host memory behind it. Only blobs that were never exported, or whose exports were
+ * released with drv_bo_set_exports_released(), are kept: no other process can still be using
+ * them.
+ */
+struct recycled_blob {
+	uint32_t handle;
+	uint64_t size;
+	uint32_t blob_id;
+	uint32_t blob_mem;
+	uint32_t blob_flags;
+	int32_t memory_idx;
+	struct recycled_blob *next;
+};
+
 struct cross_domain_private {
 	uint32_t ring_handle;
 	void *ring_addr;
-	struct drv_array *metadata_cache;
+	/* Serializes commands whose reply is read back from the ring. */
+	pthread_mutex_t ring_lock;
 	pthread_mutex_t metadata_cache_lock;
+	/* Signalled whenever a pending entry completes or is dropped. */
+	pthread_cond_t metadata_cache_cond;
+	struct metadata_cache_entry *metadata_cache[METADATA_CACHE_NUM_BUCKETS];
+	/* Most recently used first. */
+	struct metadata_cache_entry *metadata_lru_head;
+	struct metadata_cache_entry *metadata_lru_tail;
+	uint32_t metadata_cache_size;
+	pthread_t prefetch_thread;
+	bool prefetch_started;
+	atomic_bool prefetch_stop;
+	pthread_mutex_t recycle_lock;
+	/* Oldest first. Under |recycle_lock|. */
+	struct recycled_blob *recycled_head;
+	size_t recycled_bytes;
+	/* MINIGBM_CROSS_DOMAIN_RECYCLE_BYTES; zero disables recycling. */
+	size_t recycle_max_bytes;
+};
+
+/*
+ * Allocations most Android guests make right after boot: composer and app buffers at common
+ * display sizes, and decoder output at common video sizes. Querying them in the background
+ * takes their host round trips off the first bo_create() calls.
+ */
+struct metadata_prefetch {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t use_flags;
+};
+
+#define PREFETCH_DISPLAY_USE_FLAGS (BO_USE_SCANOUT | BO_USE_RENDERING | BO_USE_TEXTURE)
+#define PREFETCH_VIDEO_USE_FLAGS (BO_USE_HW_VIDEO_DECODER | BO_USE_TEXTURE)
+
+static const struct metadata_prefetch metadata_prefetches[] = {
+	{ 1920, 1080, DRM_FORMAT_ABGR8888, PREFETCH_DISPLAY_USE_FLAGS },
+	{ 1080, 1920, DRM_FORMAT_ABGR8888, PREFETCH_DISPLAY_USE_FLAGS },
+	{ 2560, 1600, DRM_FORMAT_ABGR8888, PREFETCH_DISPLAY_USE_FLAGS },
+	{ 1280, 720, DRM_FORMAT_NV12, PREFETCH_VIDEO_USE_FLAGS },
+	{ 1920, 1080, DRM_FORMAT_NV12, PREFETCH_VIDEO_USE_FLAGS },
+	{ 3840, 2160, DRM_FORMAT_NV12, PREFETCH_VIDEO_USE_FLAGS },
 };
 
+static void recycled_blob_free(struct driver *drv, struct recycled_blob *blob)
+{
+	struct drm_gem_close gem_close = { 0 };
+
+	gem_close.handle = blob->handle;
+	if (drmIoctl(drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close))
+		drv_loge("DRM_IOCTL_GEM_CLOSE failed (handle=%x) error %d\n", blob->handle, -errno);
+
+	free(blob);
+}
+
 static void cross_domain_release_private(struct driver *drv)
 {
 	int ret;
 	struct cross_domain_private *priv = drv->priv;
 	struct drm_gem_close gem_close = { 0 };
 
+	if (priv->prefetch_started) {
+		atomic_store(&priv->prefetch_stop, true);
+		pthread_join(priv->prefetch_thread, NULL);
+	}
+
 	if (priv->ring_addr != MAP_FAILED)
 		munmap(priv->ring_addr, PAGE_SIZE);
 
@@ -58,10 +151,24 @@ static void cross_domain_release_private(struct driver *drv)
 		}
 	}
 
-	if (priv->metadata_cache)
-		drv_array_destroy(priv->metadata_cache);
+	while (priv->recycled_head) {
+		struct recycled_blob *blob = priv->recycled_head;
+		priv->recycled_head = blob->next;
+		recycled_blob_free(drv, blob);
+	}
+
+	for (uint32_t i = 0; i < METADATA_CACHE_NUM_BUCKETS; i++) {
+		while (priv->metadata_cache[i]) {
+			struct metadata_cache_entry *entry = priv->metadata_cache[i];
+			priv->metadata_cache[i] = entry->bucket_next;
+			free(entry);
+		}
+	}
 
+	pthread_mutex_destroy(&priv->recycle_lock);
+	pthread_cond_destroy(&priv->metadata_cache_cond);
 	pthread_mutex_destroy(&priv->metadata_cache_lock);
+	pthread_mutex_destroy(&priv->ring_lock);
 
 	free(priv);
 }
@@ -145,26 +252,83 @@ static bool metadata_equal(struct bo_metadata *current, struct bo_metadata *cach
 	return false;
 }
 
-static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *metadata)
+static uint32_t metadata_cache_bucket(const struct bo_metadata *metadata)
 {
-	int ret = 0;
-	struct bo_metadata *cached_data = NULL;
+	uint64_t hash = metadata->format * 0x9e3779b97f4a7c15ull;
+
+	hash ^= metadata->use_flags * 0xc2b2ae3d27d4eb4full;
+	hash ^= ((uint64_t)metadata->width << 32 | metadata->height) * 0x165667b19e3779f9ull;
+	return (hash >> 32) % METADATA_CACHE_NUM_BUCKETS;
+}
+
+static struct metadata_cache_entry *metadata_cache_find(struct cross_domain_private *priv,
+							struct bo_metadata *metadata)
+{
+	struct metadata_cache_entry *entry = priv->metadata_cache[metadata_cache_bucket(metadata)];
+
+	while (entry && !metadata_equal(metadata, &entry->metadata))
+		entry = entry->bucket_next;
+
+	return entry;
+}
+
+static void metadata_lru_unlink(struct cross_domain_private *priv,
+				struct metadata_cache_entry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		priv->metadata_lru_head = entry->lru_next;
+
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		priv->metadata_lru_tail = entry->lru_prev;
+
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void metadata_lru_push_front(struct cross_domain_private *priv,
+				    struct metadata_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = priv->metadata_lru_head;
+	if (priv->metadata_lru_head)
+		priv->metadata_lru_head->lru_prev = entry;
+	else
+		priv->metadata_lru_tail = entry;
+
+	priv->metadata_lru_head = entry;
+}
+
+static void metadata_cache_remove(struct cross_domain_private *priv,
+				  struct metadata_cache_entry *entry)
+{
+	struct metadata_cache_entry **link =
+	    &priv->metadata_cache[metadata_cache_bucket(&entry->metadata)];
+
+	while (*link != entry)
+		link = &(*link)->bucket_next;
+
+	*link = entry->bucket_next;
+	if (!entry->pending)
+		metadata_lru_unlink(priv, entry);
+
+	priv->metadata_cache_size--;
+	free(entry);
+}
+
+/* Must be called with |ring_lock| held; fills the layout of |metadata| from the host. */
+static int cross_domain_get_image_requirements(struct driver *drv, struct bo_metadata *metadata)
+{
+	int ret;
 	struct cross_domain_private *priv = drv->priv;
 	struct CrossDomainGetImageRequirements cmd_get_reqs;
 	uint32_t *addr = (uint32_t *)priv->ring_addr;
 	uint32_t plane, remaining_size;
 
 	memset(&cmd_get_reqs, 0, sizeof(cmd_get_reqs));
-	pthread_mutex_lock(&priv->metadata_cache_lock);
-	for (uint32_t i = 0; i < drv_array_size(priv->metadata_cache); i++) {
-		cached_data = (struct bo_metadata *)drv_array_at_idx(priv->metadata_cache, i);
-		if (!metadata_equal(metadata, cached_data))
-			continue;
-
-		memcpy(metadata, cached_data, sizeof(*cached_data));
-		goto out_unlock;
-	}
-
 	cmd_get_reqs.hdr.cmd = CROSS_DOMAIN_CMD_GET_IMAGE_REQUIREMENTS;
 	cmd_get_reqs.hdr.cmd_size = sizeof(struct CrossDomainGetImageRequirements);
 
@@ -174,17 +338,10 @@ static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *m
 	    (metadata->format == DRM_FORMAT_YVU420_ANDROID) ? DRM_FORMAT_YVU420 : metadata->format;
 	cmd_get_reqs.flags = metadata->use_flags;
 
-	/*
-	 * It is possible to avoid blocking other bo_create() calls by unlocking before
-	 * cross_domain_submit_cmd() and re-locking afterwards.  However, that would require
-	 * another scan of the metadata cache before drv_array_append in case two bo_create() calls
-	 * do the same metadata query.  Until cross_domain functionality is more widely tested,
-	 * leave this optimization out for now.
-	 */
 	ret = cross_domain_submit_cmd(drv, (uint32_t *)&cmd_get_reqs, cmd_get_reqs.hdr.cmd_size,
 				      true);
 	if (ret < 0)
-		goto out_unlock;
+		return ret;
 
 	memcpy(&metadata->strides, &addr[0], 4 * sizeof(uint32_t));
 	memcpy(&metadata->offsets, &addr[4], 4 * sizeof(uint32_t));
@@ -205,13 +362,95 @@ static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *m
 	}
 
 	metadata->sizes[plane - 1] = remaining_size;
-	drv_array_append(priv->metadata_cache, metadata);
+	return 0;
+}
+
+static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *metadata)
+{
+	int ret = 0;
+	struct metadata_cache_entry *entry;
+	struct cross_domain_private *priv = drv->priv;
+
+	pthread_mutex_lock(&priv->metadata_cache_lock);
+	for (;;) {
+		entry = metadata_cache_find(priv, metadata);
+		if (!entry || !entry->pending)
+			break;
+
+		/* Another thread is already asking the host the same question. */
+		pthread_cond_wait(&priv->metadata_cache_cond, &priv->metadata_cache_lock);
+	}
+
+	if (entry) {
+		memcpy(metadata, &entry->metadata, sizeof(entry->metadata));
+		metadata_lru_unlink(priv, entry);
+		metadata_lru_push_front(priv, entry);
+		goto out_unlock;
+	}
+
+	if (priv->metadata_cache_size >= METADATA_CACHE_MAX_ENTRIES && priv->metadata_lru_tail)
+		metadata_cache_remove(priv, priv->metadata_lru_tail);
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+
+	memcpy(&entry->metadata, metadata, sizeof(*metadata));
+	entry->pending = true;
+	entry->bucket_next = priv->metadata_cache[metadata_cache_bucket(metadata)];
+	priv->metadata_cache[metadata_cache_bucket(metadata)] = entry;
+	priv->metadata_cache_size++;
+
+	/* Other bo_create() calls may hit the cache while the host answers this one. */
+	pthread_mutex_unlock(&priv->metadata_cache_lock);
+
+	pthread_mutex_lock(&priv->ring_lock);
+	ret = cross_domain_get_image_requirements(drv, metadata);
+	pthread_mutex_unlock(&priv->ring_lock);
+
+	pthread_mutex_lock(&priv->metadata_cache_lock);
+	if (ret < 0) {
+		/* Waiters find no entry and retry the query themselves. */
+		metadata_cache_remove(priv, entry);
+	} else {
+		memcpy(&entry->metadata, metadata, sizeof(*metadata));
+		entry->pending = false;
+		metadata_lru_push_front(priv, entry);
+	}
+
+	pthread_cond_broadcast(&priv->metadata_cache_cond);
 
 out_unlock:
 	pthread_mutex_unlock(&priv->metadata_cache_lock);
 	return ret;
 }
 
+static void *cross_domain_prefetch_metadata(void *arg)
+{
+	struct driver *drv = arg;
+	struct cross_domain_private *priv = drv->priv;
+
+	for (size_t i = 0; i < ARRAY_SIZE(metadata_prefetches); i++) {
+		struct bo_metadata metadata = { 0 };
+
+		if (atomic_load(&priv->prefetch_stop))
+			break;
+
+		metadata.width = metadata_prefetches[i].width;
+		metadata.height = metadata_prefetches[i].height;
+		metadata.format = metadata_prefetches[i].format;
+		metadata.use_flags = metadata_prefetches[i].use_flags;
+		metadata.num_planes = drv_num_planes_from_format(metadata.format);
+
+		/* Best effort: a failed query is simply retried by the first real allocation. */
+		cross_domain_metadata_query(drv, &metadata);
+	}
+
+	return NULL;
+}
+
 /* Fill out metadata for guest buffers, used only for CPU access: */
 void cross_domain_get_emulated_metadata(struct bo_metadata *metadata)
 {
@@ -233,7 +472,6 @@ static int cross_domain_init(struct driver *drv)
 	int ret;
 	struct cross_domain_private *priv;
 	struct drm_virtgpu_map map = { 0 };
-	struct drm_virtgpu_get_caps args = { 0 };
 	struct drm_virtgpu_context_init init = { 0 };
 	struct drm_virtgpu_resource_create_blob drm_rc_blob = { 0 };
 	struct drm_virtgpu_context_set_param ctx_set_params[2] = { { 0 } };
@@ -259,26 +497,45 @@ static int cross_domain_init(struct driver *drv)
 	if (!priv)
 		return -ENOMEM;
 
+	ret = pthread_mutex_init(&priv->ring_lock, NULL);
+	if (ret) {
+		free(priv);
+		return -ret;
+	}
+
 	ret = pthread_mutex_init(&priv->metadata_cache_lock, NULL);
 	if (ret) {
+		pthread_mutex_destroy(&priv->ring_lock);
 		free(priv);
-		return ret;
+		return -ret;
 	}
 
-	priv->metadata_cache = drv_array_init(sizeof(struct bo_metadata));
-	if (!priv->metadata_cache) {
-		ret = -ENOMEM;
-		goto free_private;
+	ret = pthread_cond_init(&priv->metadata_cache_cond, NULL);
+	if (ret) {
+		pthread_mutex_destroy(&priv->metadata_cache_lock);
+		pthread_mutex_destroy(&priv->ring_lock);
+		free(priv);
+		return -ret;
 	}
 
+	ret = pthread_mutex_init(&priv->recycle_lock, NULL);
+	if (ret) {
+		pthread_cond_destroy(&priv->metadata_cache_cond);
+		pthread_mutex_destroy(&priv->metadata_cache_lock);
+		pthread_mutex_destroy(&priv->ring_lock);
+		free(priv);
+		return -ret;
+	}
+
+	if (getenv("MINIGBM_CROSS_DOMAIN_RECYCLE_BYTES"))
+		priv->recycle_max_bytes =
+		    strtoull(getenv("MINIGBM_CROSS_DOMAIN_RECYCLE_BYTES"), NULL, 0);
+
 	priv->ring_addr = MAP_FAILED;
 	drv->priv = priv;
 
-	args.cap_set_id = CAPSET_CROSS_DOMAIN;
-	args.size = sizeof(struct CrossDomainCapabilities);
-	args.addr = (unsigned long long)&cross_domain_caps;
-
-	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GET_CAPS, &args);
+	ret = virtgpu_get_caps(drv, CAPSET_CROSS_DOMAIN, 0, &cross_domain_caps,
+			       sizeof(struct CrossDomainCapabilities));
 	if (ret) {
 		drv_loge("DRM_IOCTL_VIRTGPU_GET_CAPS failed with %s\n", strerror(errno));
 		goto free_private;
@@ -324,7 +581,7 @@ static int cross_domain_init(struct driver *drv)
 	map.handle = priv->ring_handle;
 	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_MAP, &map);
 	if (ret < 0) {
-		drv_loge("DRM_IOCTL_VIRTGPU_MAP failed with %s\n", strerror(errno));
+		drv_loge_ratelimited("DRM_IOCTL_VIRTGPU_MAP failed with %s\n", strerror(errno));
 		goto free_private;
 	}
 
@@ -332,7 +589,7 @@ static int cross_domain_init(struct driver *drv)
 	    mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, drv->fd, map.offset);
 
 	if (priv->ring_addr == MAP_FAILED) {
-		drv_loge("mmap failed with %s\n", strerror(errno));
+		drv_loge_ratelimited("mmap failed with %s\n", strerror(errno));
 		goto free_private;
 	}
 
@@ -346,6 +603,11 @@ static int cross_domain_init(struct driver *drv)
 
 	// minigbm bookkeeping
 	add_combinations(drv);
+
+	atomic_init(&priv->prefetch_stop, false);
+	if (!pthread_create(&priv->prefetch_thread, NULL, cross_domain_prefetch_metadata, drv))
+		priv->prefetch_started = true;
+
 	return 0;
 
 free_private:
@@ -358,45 +620,91 @@ static void cross_domain_close(struct driver *drv)
 	cross_domain_release_private(drv);
 }
 
+/* Fills out the blob parameters of |bo|, whose metadata must already be known. */
+static void cross_domain_fill_blob(struct bo *bo, struct drm_virtgpu_resource_create_blob *blob)
+{
+	blob->blob_flags = VIRTGPU_BLOB_FLAG_USE_SHAREABLE;
+	if (bo->meta.use_flags & (BO_USE_SW_MASK | BO_USE_GPU_DATA_BUFFER))
+		blob->blob_flags |= VIRTGPU_BLOB_FLAG_USE_MAPPABLE;
+
+	if (!(bo->meta.use_flags & BO_USE_HW_MASK)) {
+		blob->blob_mem = VIRTGPU_BLOB_MEM_GUEST;
+	} else {
+		if (params[param_cross_device].value)
+			blob->blob_flags |= VIRTGPU_BLOB_FLAG_USE_CROSS_DEVICE;
+
+		/// It may be possible to have host3d blobs and handles from guest memory at the
+		/// same time. But for the immediate use cases, we will either have one or the
+		/// other.  For now, just prefer guest memory since adding that feature is more
+		/// involved (requires --udmabuf flag to crosvm), so developers would likely test
+		/// that.
+		if (params[param_create_guest_handle].value) {
+			blob->blob_mem = VIRTGPU_BLOB_MEM_GUEST;
+			blob->blob_flags |= VIRTGPU_BLOB_FLAG_CREATE_GUEST_HANDLE;
+		} else if (params[param_host_visible].value) {
+			blob->blob_mem = VIRTGPU_BLOB_MEM_HOST3D;
+		}
+		blob->blob_id = (uint64_t)bo->meta.blob_id;
+	}
+
+	blob->size = bo->meta.total_size;
+}
+
+/* Takes a recycled blob that matches |blob| for |bo|, if one is parked. */
+static bool cross_domain_reuse_blob(struct bo *bo,
+				    const struct drm_virtgpu_resource_create_blob *blob)
+{
+	struct cross_domain_private *priv = bo->drv->priv;
+	struct recycled_blob **link, *found = NULL;
+
+	if (!priv->recycle_max_bytes)
+		return false;
+
+	pthread_mutex_lock(&priv->recycle_lock);
+	for (link = &priv->recycled_head; *link; link = &(*link)->next) {
+		struct recycled_blob *curr = *link;
+
+		if (curr->size != blob->size || curr->blob_id != blob->blob_id ||
+		    curr->blob_mem != blob->blob_mem || curr->blob_flags != blob->blob_flags ||
+		    curr->memory_idx != bo->meta.memory_idx)
+			continue;
+
+		*link = curr->next;
+		priv->recycled_bytes -= curr->size;
+		found = curr;
+		break;
+	}
+	pthread_mutex_unlock(&priv->recycle_lock);
+
+	if (!found)
+		return false;
+
+	for (uint32_t plane = 0; plane < bo->meta.num_planes; plane++)
+		bo->handles[plane].u32 = found->handle;
+
+	free(found);
+	return true;
+}
+
 static int cross_domain_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 				  uint64_t use_flags)
 {
 	int ret;
-	uint32_t blob_flags = VIRTGPU_BLOB_FLAG_USE_SHAREABLE;
 	struct drm_virtgpu_resource_create_blob drm_rc_blob = { 0 };
 
-	if (use_flags & (BO_USE_SW_MASK | BO_USE_GPU_DATA_BUFFER))
-		blob_flags |= VIRTGPU_BLOB_FLAG_USE_MAPPABLE;
-
 	if (!(use_flags & BO_USE_HW_MASK)) {
 		cross_domain_get_emulated_metadata(&bo->meta);
-		drm_rc_blob.blob_mem = VIRTGPU_BLOB_MEM_GUEST;
 	} else {
 		ret = cross_domain_metadata_query(bo->drv, &bo->meta);
 		if (ret < 0) {
 			drv_loge("Metadata query failed");
 			return ret;
 		}
-
-		if (params[param_cross_device].value)
-			blob_flags |= VIRTGPU_BLOB_FLAG_USE_CROSS_DEVICE;
-
-		/// It may be possible to have host3d blobs and handles from guest memory at the
-		/// same time. But for the immediate use cases, we will either have one or the
-		/// other.  For now, just prefer guest memory since adding that feature is more
-		/// involved (requires --udmabuf flag to crosvm), so developers would likely test
-		/// that.
-		if (params[param_create_guest_handle].value) {
-			drm_rc_blob.blob_mem = VIRTGPU_BLOB_MEM_GUEST;
-			blob_flags |= VIRTGPU_BLOB_FLAG_CREATE_GUEST_HANDLE;
-		} else if (params[param_host_visible].value) {
-			drm_rc_blob.blob_mem = VIRTGPU_BLOB_MEM_HOST3D;
-		}
-		drm_rc_blob.blob_id = (uint64_t)bo->meta.blob_id;
 	}
 
-	drm_rc_blob.size = bo->meta.total_size;
-	drm_rc_blob.blob_flags = blob_flags;
+	cross_domain_fill_blob(bo, &drm_rc_blob);
+	if (cross_domain_reuse_blob(bo, &drm_rc_blob))
+		return 0;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB, &drm_rc_blob);
 	if (ret < 0) {
@@ -410,6 +718,74 @@ static int cross_domain_bo_create(struct bo *bo, uint32_t width, uint32_t height
 	return 0;
 }
 
+/*
+ * Parks the blobs of allocated bos for cross_domain_bo_create() to reuse, up to
+ * MINIGBM_CROSS_DOMAIN_RECYCLE_BYTES, instead of having the host free and reallocate the memory
+ * behind them. A reused blob keeps whatever its last user left in it.
+ *
+ * Exported blobs are freed unless the caller vouched for them with drv_bo_set_exports_released():
+ * other processes, or a bo imported from the dma-buf in this one, may still hold them, and the
+ * driver has no reliable way to tell when they stop.
+ */
+static int cross_domain_bo_destroy(struct bo *bo)
+{
+	struct cross_domain_private *priv = bo->drv->priv;
+	struct drm_virtgpu_resource_create_blob blob = { 0 };
+	struct recycled_blob *recycled, **tail, *evicted = NULL;
+
+	if (!priv->recycle_max_bytes || bo->imported ||
+	    __atomic_load_n(&bo->exported, __ATOMIC_RELAXED) ||
+	    bo->meta.total_size > priv->recycle_max_bytes)
+		return drv_gem_bo_destroy(bo);
+
+	recycled = calloc(1, sizeof(*recycled));
+	if (!recycled)
+		return drv_gem_bo_destroy(bo);
+
+	cross_domain_fill_blob(bo, &blob);
+	recycled->handle = bo->handles[0].u32;
+	recycled->size = blob.size;
+	recycled->blob_id = blob.blob_id;
+	recycled->blob_mem = blob.blob_mem;
+	recycled->blob_flags = blob.blob_flags;
+	recycled->memory_idx = bo->meta.memory_idx;
+
+	pthread_mutex_lock(&priv->recycle_lock);
+	for (tail = &priv->recycled_head; *tail; tail = &(*tail)->next)
+		;
+	*tail = recycled;
+	priv->recycled_bytes += recycled->size;
+
+	while (priv->recycled_bytes > priv->recycle_max_bytes) {
+		struct recycled_blob *oldest = priv->recycled_head;
+
+		priv->recycled_head = oldest->next;
+		priv->recycled_bytes -= oldest->size;
+		oldest->next = evicted;
+		evicted = oldest;
+	}
+	pthread_mutex_unlock(&priv->recycle_lock);
+
+	while (evicted) {
+		struct recycled_blob *next = evicted->next;
+		recycled_blob_free(bo->drv, evicted);
+		evicted = next;
+	}
+
+	return 0;
+}
+
+static int cross_domain_bo_query_layout(struct bo *bo)
+{
+	if (!(bo->meta.use_flags & BO_USE_HW_MASK)) {
+		cross_domain_get_emulated_metadata(&bo->meta);
+		return 0;
+	}
+
+	/* Answered from the metadata cache after the first time, without a host round trip. */
+	return cross_domain_metadata_query(bo->drv, &bo->meta);
+}
+
 static void *cross_domain_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
@@ -418,13 +794,13 @@ static void *cross_domain_bo_map(struct bo *bo, struct vma *vma, size_t plane, u
 	gem_map.handle = bo->handles[0].u32;
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_MAP, &gem_map);
 	if (ret) {
-		drv_loge("DRM_IOCTL_VIRTGPU_MAP failed with %s\n", strerror(errno));
+		drv_loge_ratelimited("DRM_IOCTL_VIRTGPU_MAP failed with %s\n", strerror(errno));
 		return MAP_FAILED;
 	}
 
 	vma->length = bo->meta.total_size;
-	return mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.offset);
+	return drv_bo_mmap(bo, bo->meta.total_size, drv_get_prot(map_flags), bo->drv->fd,
+			   gem_map.offset);
 }
 
 const struct backend virtgpu_cross_domain = {
@@ -432,8 +808,9 @@ const struct backend virtgpu_cross_domain = {
 	.init = cross_domain_init,
 	.close = cross_domain_close,
 	.bo_create = cross_domain_bo_create,
+	.bo_query_layout = cross_domain_bo_query_layout,
 	.bo_import = drv_prime_bo_import,
-	.bo_destroy = drv_gem_bo_destroy,
+	.bo_destroy = cross_domain_bo_destroy,
 	.bo_map = cross_domain_bo_map,
 	.bo_unmap = drv_bo_munmap,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
@@ -10,6 +10,7 @@
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -58,6 +59,8 @@ struct virgl_priv {
 	union virgl_caps caps;
 	int host_gbm_enabled;
 	atomic_int next_blob_id;
+	/* Whether SW-written, host-read buffers are mapped through a guest staging copy. */
+	bool staging;
 };
 
 static uint32_t translate_format(uint32_t drm_fourcc)
@@ -224,6 +227,9 @@ struct virtio_transfers_params {
 	struct rectangle xfer_boxes[DRV_MAX_PLANES];
 };
 
+/* Transfers covering up to DRV_MAX_DIRTY_RECTS rectangles of a mapping. */
+#define VIRGL_MAX_TRANSFERS (DRV_MAX_DIRTY_RECTS * DRV_MAX_PLANES)
+
 static void virgl_get_emulated_transfers_params(const struct bo *bo,
 						const struct rectangle *transfer_box,
 						struct virtio_transfers_params *xfer_params)
@@ -513,13 +519,13 @@ static void *virgl_3d_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 	gem_map.handle = bo->handles[0].u32;
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_MAP, &gem_map);
 	if (ret) {
-		drv_loge("DRM_IOCTL_VIRTGPU_MAP failed with %s\n", strerror(errno));
+		drv_loge_ratelimited("DRM_IOCTL_VIRTGPU_MAP failed with %s\n", strerror(errno));
 		return MAP_FAILED;
 	}
 
 	vma->length = bo->meta.total_size;
-	return mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.offset);
+	return drv_bo_mmap(bo, bo->meta.total_size, drv_get_prot(map_flags), bo->drv->fd,
+			   gem_map.offset);
 }
 
 static uint32_t virgl_3d_get_max_texture_2d_size(struct driver *drv)
@@ -535,29 +541,21 @@ static uint32_t virgl_3d_get_max_texture_2d_size(struct driver *drv)
 static int virgl_get_caps(struct driver *drv, union virgl_caps *caps, int *caps_is_v2)
 {
 	int ret;
-	struct drm_virtgpu_get_caps cap_args = { 0 };
 
 	*caps_is_v2 = 0;
-	cap_args.addr = (unsigned long long)caps;
 	if (params[param_capset_fix].value) {
 		*caps_is_v2 = 1;
-		cap_args.cap_set_id = 2;
-		cap_args.size = sizeof(union virgl_caps);
+		ret = virtgpu_get_caps(drv, 2, 0, caps, sizeof(union virgl_caps));
 	} else {
-		cap_args.cap_set_id = 1;
-		cap_args.size = sizeof(struct virgl_caps_v1);
+		ret = virtgpu_get_caps(drv, 1, 0, caps, sizeof(struct virgl_caps_v1));
 	}
 
-	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GET_CAPS, &cap_args);
 	if (ret) {
 		drv_loge("DRM_IOCTL_VIRTGPU_GET_CAPS failed with %s\n", strerror(errno));
 		*caps_is_v2 = 0;
 
 		// Fallback to v1
-		cap_args.cap_set_id = 1;
-		cap_args.size = sizeof(struct virgl_caps_v1);
-
-		ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GET_CAPS, &cap_args);
+		ret = virtgpu_get_caps(drv, 1, 0, caps, sizeof(struct virgl_caps_v1));
 		if (ret)
 			drv_loge("DRM_IOCTL_VIRTGPU_GET_CAPS failed with %s\n", strerror(errno));
 	}
@@ -593,6 +591,7 @@ static int virgl_init(struct driver *drv)
 		return -ENOMEM;
 
 	drv->priv = priv;
+	priv->staging = getenv("MINIGBM_VIRGL_STAGING") != NULL;
 
 	virgl_init_params_and_caps(drv);
 
@@ -677,6 +676,45 @@ static void virgl_close(struct driver *drv)
 	drv->priv = NULL;
 }
 
+/*
+ * The host allocates the storage behind a blob, so its layout is authoritative when the guest maps
+ * it. Replace the guest-computed layout with the one the host reports, provided it fits in the
+ * blob.
+ */
+static int virgl_blob_use_host_layout(struct bo *bo)
+{
+	int ret;
+	struct drm_virtgpu_resource_info_cros res_info = { 0 };
+
+	res_info.bo_handle = bo->handles[0].u32;
+	res_info.type = VIRTGPU_RESOURCE_INFO_TYPE_EXTENDED;
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO_CROS, &res_info);
+	if (ret) {
+		drv_loge("DRM_IOCTL_VIRTGPU_RESOURCE_INFO failed with %s\n", strerror(errno));
+		return -EINVAL;
+	}
+
+	for (uint32_t plane = 0; plane < bo->meta.num_planes; plane++) {
+		uint32_t size;
+
+		// Without the extended resource info the layout can't be known.
+		if (!res_info.strides[plane])
+			return -EINVAL;
+
+		size = drv_size_from_format(bo->meta.format, res_info.strides[plane],
+					    bo->meta.height, plane);
+		if ((uint64_t)res_info.offsets[plane] + size > bo->meta.total_size)
+			return -EINVAL;
+
+		bo->meta.strides[plane] = res_info.strides[plane];
+		bo->meta.offsets[plane] = res_info.offsets[plane];
+		bo->meta.sizes[plane] = size;
+	}
+
+	bo->meta.format_modifier = res_info.format_modifier;
+	return 0;
+}
+
 static int virgl_bo_create_blob(struct driver *drv, struct bo *bo)
 {
 	int ret;
@@ -698,7 +736,12 @@ static int virgl_bo_create_blob(struct driver *drv, struct bo *bo)
 	stride = drv_stride_from_format(bo->meta.format, bo->meta.width, 0);
 	drv_bo_from_format(bo, stride, bo->meta.height, bo->meta.format);
 	bo->meta.total_size = ALIGN(bo->meta.total_size, PAGE_SIZE);
+
+	if (!drv_heap_has_room(drv, DRV_HEAP_BLOB, bo->meta.total_size))
+		return -ENOSPC;
+
 	bo->meta.tiling = blob_flags;
+	bo->heap = DRV_HEAP_BLOB;
 
 	cmd[0] = VIRGL_CMD0(VIRGL_CCMD_PIPE_RESOURCE_CREATE, 0, VIRGL_PIPE_RES_CREATE_SIZE);
 	cmd[VIRGL_PIPE_RES_CREATE_TARGET] = PIPE_TEXTURE_2D;
@@ -725,6 +768,14 @@ static int virgl_bo_create_blob(struct driver *drv, struct bo *bo)
 	for (uint32_t plane = 0; plane < bo->meta.num_planes; plane++)
 		bo->handles[plane].u32 = drm_rc_blob.bo_handle;
 
+	if (bo->meta.num_planes > 1 && (bo->meta.use_flags & BO_USE_SW_MASK)) {
+		ret = virgl_blob_use_host_layout(bo);
+		if (ret) {
+			drv_gem_bo_destroy(bo);
+			return ret;
+		}
+	}
+
 	return 0;
 }
 
@@ -753,9 +804,8 @@ static bool should_use_blob(struct driver *drv, uint32_t format, uint64_t use_fl
 		return true;
 	case DRM_FORMAT_YVU420_ANDROID:
 	case DRM_FORMAT_NV12:
-		// Knowing buffer metadata at buffer creation isn't yet supported, so buffers
-		// can't be properly mapped into the guest.
-		return (use_flags & BO_USE_SW_MASK) == 0;
+		// Mappable blobs take their layout from the host, see virgl_blob_use_host_layout.
+		return true;
 	default:
 		return false;
 	}
@@ -765,8 +815,17 @@ static int virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint3
 			   uint64_t use_flags)
 {
 	if (params[param_resource_blob].value && params[param_host_visible].value &&
-	    should_use_blob(bo->drv, format, use_flags))
-		return virgl_bo_create_blob(bo->drv, bo);
+	    should_use_blob(bo->drv, format, use_flags)) {
+		int ret = virgl_bo_create_blob(bo->drv, bo);
+
+		// Fall back to a transfer-backed resource when blobs are over budget, or the host
+		// can't describe the layout of a mappable blob.
+		if (ret != -ENOSPC && (ret != -EINVAL || !(use_flags & BO_USE_SW_MASK)))
+			return ret;
+
+		bo->meta.tiling = 0;
+		bo->heap = DRV_HEAP_SYSTEM;
+	}
 
 	if (params[param_3d].value)
 		return virgl_3d_bo_create(bo, width, height, format, use_flags);
@@ -797,14 +856,6 @@ static int virgl_bo_destroy(struct bo *bo)
 		return drv_dumb_bo_destroy(bo);
 }
 
-static void *virgl_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
-{
-	if (params[param_3d].value)
-		return virgl_3d_bo_map(bo, vma, plane, map_flags);
-	else
-		return drv_dumb_bo_map(bo, vma, plane, map_flags);
-}
-
 static bool is_arc_screen_capture_bo(struct bo *bo)
 {
 	struct drm_prime_handle prime_handle = {};
@@ -835,185 +886,454 @@ static bool is_arc_screen_capture_bo(struct bo *bo)
 	return strstr(tmp, "ARC-SCREEN-CAP");
 }
 
-static int virgl_bo_invalidate(struct bo *bo, struct mapping *mapping)
+/* One box of a transfer, with the offset virglrenderer expects for it. */
+struct virgl_transfer {
+	struct rectangle box;
+	uint32_t offset;
+};
+
+/* Per-bo transfer state, allocated on the first transfer that needs it. */
+struct virgl_bo_priv {
+	/* Host resource id, needed to encode transfers in the command stream. */
+	uint32_t res_handle;
+	/*
+	 * The last flush handed its fence to the caller, or queued a staged upload, so the next
+	 * invalidate or staged flush has to wait.
+	 */
+	bool flush_pending;
+};
+
+static struct virgl_bo_priv *virgl_bo_get_priv(struct bo *bo)
 {
-	int ret;
-	size_t i;
-	struct drm_virtgpu_3d_transfer_from_host xfer = { 0 };
-	struct drm_virtgpu_3d_wait waitcmd = { 0 };
-	struct virtio_transfers_params xfer_params;
-	struct virgl_priv *priv = (struct virgl_priv *)bo->drv->priv;
-	uint64_t host_write_flags;
+	if (!bo->priv)
+		bo->priv = calloc(1, sizeof(struct virgl_bo_priv));
 
-	if (!params[param_3d].value)
-		return 0;
+	return bo->priv;
+}
+
+static int virgl_bo_release(struct bo *bo)
+{
+	free(bo->priv);
+	bo->priv = NULL;
+	return 0;
+}
+
+// The encoder and decoder flags don't differentiate between input and output buffers, but we can
+// use the format to determine whether this buffer could be encoder/decoder output.
+static uint64_t virgl_host_write_flags(struct bo *bo)
+{
+	uint64_t host_write_flags = BO_USE_RENDERING | BO_USE_CAMERA_WRITE | BO_USE_GPU_DATA_BUFFER;
 
-	// Invalidate is only necessary if the host writes to the buffer. The encoder and
-	// decoder flags don't differentiate between input and output buffers, but we can
-	// use the format to determine whether this buffer could be encoder/decoder output.
-	host_write_flags = BO_USE_RENDERING | BO_USE_CAMERA_WRITE | BO_USE_GPU_DATA_BUFFER;
 	if (bo->meta.format == DRM_FORMAT_R8)
 		host_write_flags |= BO_USE_HW_VIDEO_ENCODER;
 	else
 		host_write_flags |= BO_USE_HW_VIDEO_DECODER;
 
-	// TODO(b/267892346): Revert this workaround after migrating to virtgpu_cross_domain
-	// backend since it's a special arc only behavior.
+	return host_write_flags;
+}
+
+// TODO(b/267892346): Revert this workaround after migrating to virtgpu_cross_domain
+// backend since it's a special arc only behavior.
+static void virgl_probe_screen_capture(struct bo *bo)
+{
 	if (!(bo->meta.use_flags & (BO_USE_ARC_SCREEN_CAP_PROBED | BO_USE_RENDERING))) {
 		bo->meta.use_flags |= BO_USE_ARC_SCREEN_CAP_PROBED;
 		if (is_arc_screen_capture_bo(bo)) {
 			bo->meta.use_flags |= BO_USE_RENDERING;
 		}
 	}
+}
 
-	if ((bo->meta.use_flags & host_write_flags) == 0)
-		return 0;
+/*
+ * Buffers that the guest CPU writes and the host only reads can be mapped through a staging copy:
+ * the caller writes the copy, each flush copies the dirty rows into the bo's pages and queues
+ * their upload without waiting for it, and only the flush after that has to wait, if the upload
+ * is still in flight. Producers then aren't paced by host round trips.
+ */
+static bool virgl_bo_use_staging(struct bo *bo, uint32_t map_flags)
+{
+	struct virgl_priv *priv = (struct virgl_priv *)bo->drv->priv;
+
+	if (!priv->staging || !(map_flags & BO_MAP_WRITE) ||
+	    !(bo->meta.use_flags & BO_USE_SW_WRITE_OFTEN))
+		return false;
 
 	if (params[param_resource_blob].value && (bo->meta.tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE))
-		return 0;
+		return false;
+
+	virgl_probe_screen_capture(bo);
+	return (bo->meta.use_flags & virgl_host_write_flags(bo)) == 0;
+}
 
-	xfer.bo_handle = mapping->vma->handle;
+static void *virgl_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	void *addr, *staging;
 
-	if (mapping->rect.x || mapping->rect.y) {
-		/*
-		 * virglrenderer uses the box parameters and assumes that offset == 0 for planar
-		 * images
-		 */
-		if (bo->meta.num_planes == 1) {
-			xfer.offset =
-			    (bo->meta.strides[0] * mapping->rect.y) +
-			    drv_bytes_per_pixel_from_format(bo->meta.format, 0) * mapping->rect.x;
-		}
+	if (!params[param_3d].value)
+		return drv_dumb_bo_map(bo, vma, plane, map_flags);
+
+	addr = virgl_3d_bo_map(bo, vma, plane, map_flags);
+	if (addr == MAP_FAILED || !virgl_bo_use_staging(bo, map_flags) || !virgl_bo_get_priv(bo))
+		return addr;
+
+	staging = mmap(0, vma->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (staging == MAP_FAILED)
+		return addr;
+
+	// Nothing but guest writers changes the pages, so seeding the copy once is enough.
+	memcpy(staging, addr, vma->length);
+	vma->priv = addr;
+	return staging;
+}
+
+static int virgl_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	if (vma->priv) {
+		munmap(vma->priv, vma->length);
+		vma->priv = NULL;
 	}
 
-	if ((bo->meta.use_flags & BO_USE_RENDERING) == 0) {
-		// Unfortunately, the kernel doesn't actually pass the guest layer_stride
-		// and guest stride to the host (compare virgl.h and virtgpu_drm.h).
-		// For gbm based resources, we can work around this by using the level field
-		// to pass the stride to virglrenderer's gbm transfer code. However, we need
-		// to avoid doing this for resources which don't rely on that transfer code,
-		// which is resources with the BO_USE_RENDERING flag set.
-		// TODO(b/145993887): Send also stride when the patches are landed
-		if (priv->host_gbm_enabled)
-			xfer.level = bo->meta.strides[0];
+	return munmap(vma->addr, vma->length);
+}
+
+static int virgl_bo_wait(struct bo *bo, struct mapping *mapping)
+{
+	int ret;
+	struct drm_virtgpu_3d_wait waitcmd = { 0 };
+	struct virgl_bo_priv *bo_priv = bo->priv;
+
+	waitcmd.handle = mapping->vma->handle;
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
+	if (ret) {
+		drv_loge("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
+		return -errno;
 	}
 
-	if (virgl_supports_combination_natively(bo->drv, bo->meta.format, bo->meta.use_flags)) {
-		xfer_params.xfers_needed = 1;
-		xfer_params.xfer_boxes[0] = mapping->rect;
-	} else {
-		assert(virgl_supports_combination_through_emulation(bo->drv, bo->meta.format,
-								    bo->meta.use_flags));
+	if (bo_priv)
+		bo_priv->flush_pending = false;
+
+	return 0;
+}
+
+static int virgl_execbuffer(struct bo *bo, uint32_t handle, uint32_t *cmd, uint32_t size,
+			    int *out_fence)
+{
+	int ret;
+	struct drm_virtgpu_execbuffer exec = { 0 };
 
-		virgl_get_emulated_transfers_params(bo, &mapping->rect, &xfer_params);
+	exec.command = (uint64_t)(uintptr_t)cmd;
+	exec.size = size;
+	exec.bo_handles = (uint64_t)(uintptr_t)&handle;
+	exec.num_bo_handles = 1;
+	exec.fence_fd = -1;
+	if (out_fence)
+		exec.flags = VIRTGPU_EXECBUF_FENCE_FD_OUT;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_EXECBUFFER, &exec);
+	if (ret) {
+		drv_loge("DRM_IOCTL_VIRTGPU_EXECBUFFER failed with %s\n", strerror(errno));
+		return -errno;
 	}
 
-	for (i = 0; i < xfer_params.xfers_needed; i++) {
-		xfer.box.x = xfer_params.xfer_boxes[i].x;
-		xfer.box.y = xfer_params.xfer_boxes[i].y;
-		xfer.box.w = xfer_params.xfer_boxes[i].width;
-		xfer.box.h = xfer_params.xfer_boxes[i].height;
-		xfer.box.d = 1;
+	if (out_fence)
+		*out_fence = exec.fence_fd;
+
+	return 0;
+}
+
+/* Encodes every box as a VIRGL_CCMD_TRANSFER3D so that all of them take a single round trip. */
+static int virgl_submit_transfer_cmds(struct bo *bo, uint32_t handle, uint32_t direction,
+				      uint32_t level, const struct virgl_transfer *xfers,
+				      size_t num_xfers, int *out_fence)
+{
+	int ret;
+	uint32_t cmd[VIRGL_MAX_TRANSFERS * (VIRGL_TRANSFER3D_SIZE + 1)];
+	uint32_t *dw = cmd;
+	struct drm_virtgpu_resource_info res_info = { 0 };
+	struct virgl_bo_priv *bo_priv = virgl_bo_get_priv(bo);
+
+	if (!bo_priv)
+		return -ENOMEM;
 
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &xfer);
+	if (!bo_priv->res_handle) {
+		res_info.bo_handle = handle;
+		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &res_info);
 		if (ret) {
-			drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST failed with %s\n",
+			drv_loge("DRM_IOCTL_VIRTGPU_RESOURCE_INFO failed with %s\n",
 				 strerror(errno));
 			return -errno;
 		}
+
+		bo_priv->res_handle = res_info.res_handle;
 	}
 
-	// The transfer needs to complete before invalidate returns so that any host changes
-	// are visible and to ensure the host doesn't overwrite subsequent guest changes.
-	// TODO(b/136733358): Support returning fences from transfers
-	waitcmd.handle = mapping->vma->handle;
-	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
-	if (ret) {
-		drv_loge("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
-		return -errno;
+	for (size_t i = 0; i < num_xfers; i++) {
+		const struct rectangle *box = &xfers[i].box;
+
+		*dw++ = VIRGL_CMD0(VIRGL_CCMD_TRANSFER3D, 0, VIRGL_TRANSFER3D_SIZE);
+		*dw++ = bo_priv->res_handle;
+		*dw++ = level;
+		*dw++ = 0; /* usage */
+		/* Zero strides let the host infer them, as it does for the transfer ioctls. */
+		*dw++ = 0;
+		*dw++ = 0;
+		*dw++ = box->x;
+		*dw++ = box->y;
+		*dw++ = 0;
+		*dw++ = box->width;
+		*dw++ = box->height;
+		*dw++ = 1;
+		*dw++ = xfers[i].offset;
+		*dw++ = direction;
 	}
 
-	return 0;
+	return virgl_execbuffer(bo, handle, cmd, (dw - cmd) * sizeof(*cmd), out_fence);
 }
 
-static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
+static int virgl_submit_transfer_ioctls(struct bo *bo, uint32_t handle, uint32_t direction,
+					uint32_t level, const struct virgl_transfer *xfers,
+					size_t num_xfers, int *out_fence)
 {
 	int ret;
-	size_t i;
-	struct drm_virtgpu_3d_transfer_to_host xfer = { 0 };
-	struct drm_virtgpu_3d_wait waitcmd = { 0 };
+	struct drm_virtgpu_3d_transfer_to_host to_host = { 0 };
+	struct drm_virtgpu_3d_transfer_from_host from_host = { 0 };
+
+	for (size_t i = 0; i < num_xfers; i++) {
+		struct drm_virtgpu_3d_box box = { 0 };
+
+		box.x = xfers[i].box.x;
+		box.y = xfers[i].box.y;
+		box.w = xfers[i].box.width;
+		box.h = xfers[i].box.height;
+		box.d = 1;
+
+		if (direction == VIRGL_TRANSFER_TO_HOST) {
+			to_host.bo_handle = handle;
+			to_host.box = box;
+			to_host.level = level;
+			to_host.offset = xfers[i].offset;
+
+			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &to_host);
+			if (ret) {
+				drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n",
+					 strerror(errno));
+				return -errno;
+			}
+		} else {
+			from_host.bo_handle = handle;
+			from_host.box = box;
+			from_host.level = level;
+			from_host.offset = xfers[i].offset;
+
+			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST,
+				       &from_host);
+			if (ret) {
+				drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST failed with %s\n",
+					 strerror(errno));
+				return -errno;
+			}
+		}
+	}
+
+	if (!out_fence)
+		return 0;
+
+	// The transfer ioctls don't return fences (b/136733358), but an empty submission that
+	// references the bo is retired by the host only after the transfers queued before it.
+	ret = virgl_execbuffer(bo, handle, NULL, 0, out_fence);
+	if (ret)
+		*out_fence = -1;
+
+	return 0;
+}
+
+/*
+ * Submits the transfers covering |rects| of |mapping| for all planes back to back, without
+ * waiting for any of them. If |out_fence| is non-NULL, it is set to a fence that signals once the
+ * host is done with them, or to -1 if none could be created and the caller has to wait on the bo
+ * instead.
+ */
+static int virgl_submit_transfers(struct bo *bo, struct mapping *mapping, uint32_t direction,
+				  uint32_t level, const struct rectangle *rects, size_t num_rects,
+				  int *out_fence)
+{
+	size_t num_xfers = 0;
+	struct virgl_transfer xfers[VIRGL_MAX_TRANSFERS];
 	struct virtio_transfers_params xfer_params;
 	struct virgl_priv *priv = (struct virgl_priv *)bo->drv->priv;
 
+	assert(num_rects <= DRV_MAX_DIRTY_RECTS);
+
+	for (size_t r = 0; r < num_rects; r++) {
+		uint32_t offset = 0;
+
+		if (rects[r].x || rects[r].y) {
+			/*
+			 * virglrenderer uses the box parameters and assumes that offset == 0 for
+			 * planar images
+			 */
+			if (bo->meta.num_planes == 1) {
+				offset = (bo->meta.strides[0] * rects[r].y) +
+					 drv_bytes_per_pixel_from_format(bo->meta.format, 0) *
+					     rects[r].x;
+			}
+		}
+
+		if (virgl_supports_combination_natively(bo->drv, bo->meta.format,
+							bo->meta.use_flags)) {
+			xfer_params.xfers_needed = 1;
+			xfer_params.xfer_boxes[0] = rects[r];
+		} else {
+			assert(virgl_supports_combination_through_emulation(
+			    bo->drv, bo->meta.format, bo->meta.use_flags));
+
+			virgl_get_emulated_transfers_params(bo, &rects[r], &xfer_params);
+		}
+
+		for (size_t i = 0; i < xfer_params.xfers_needed; i++) {
+			xfers[num_xfers].box = xfer_params.xfer_boxes[i];
+			xfers[num_xfers].offset = offset;
+			num_xfers++;
+		}
+	}
+
+	if (priv->caps_is_v2 && (priv->caps.v2.capability_bits & VIRGL_CAP_TRANSFER))
+		return virgl_submit_transfer_cmds(bo, mapping->vma->handle, direction, level,
+						  xfers, num_xfers, out_fence);
+
+	return virgl_submit_transfer_ioctls(bo, mapping->vma->handle, direction, level, xfers,
+					    num_xfers, out_fence);
+}
+
+static int virgl_bo_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	int ret;
+	struct virgl_priv *priv = (struct virgl_priv *)bo->drv->priv;
+	struct virgl_bo_priv *bo_priv = bo->priv;
+	uint32_t level = 0;
+
 	if (!params[param_3d].value)
 		return 0;
 
-	if (!(mapping->vma->map_flags & BO_MAP_WRITE))
+	// Writes land in the staging copy, which no upload reads from.
+	if (mapping->vma->priv)
 		return 0;
 
-	if (params[param_resource_blob].value && (bo->meta.tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE))
+	// Invalidate is only necessary if the host writes to the buffer.
+	virgl_probe_screen_capture(bo);
+	if ((bo->meta.use_flags & virgl_host_write_flags(bo)) == 0 ||
+	    (params[param_resource_blob].value &&
+	     (bo->meta.tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE))) {
+		// Nothing to read back, but a transfer from the last flush may still be reading
+		// the guest pages that are about to be written again.
+		if (bo_priv && bo_priv->flush_pending)
+			return virgl_bo_wait(bo, mapping);
+
 		return 0;
+	}
+
+	if ((bo->meta.use_flags & BO_USE_RENDERING) == 0) {
+		// Unfortunately, the kernel doesn't actually pass the guest layer_stride
+		// and guest stride to the host (compare virgl.h and virtgpu_drm.h).
+		// For gbm based resources, we can work around this by using the level field
+		// to pass the stride to virglrenderer's gbm transfer code. However, we need
+		// to avoid doing this for resources which don't rely on that transfer code,
+		// which is resources with the BO_USE_RENDERING flag set.
+		// TODO(b/145993887): Send also stride when the patches are landed
+		if (priv->host_gbm_enabled)
+			level = bo->meta.strides[0];
+	}
 
-	xfer.bo_handle = mapping->vma->handle;
+	ret = virgl_submit_transfers(bo, mapping, VIRGL_TRANSFER_FROM_HOST, level, &mapping->rect,
+				     1, NULL);
+	if (ret)
+		return ret;
 
-	if (mapping->rect.x || mapping->rect.y) {
-		/*
-		 * virglrenderer uses the box parameters and assumes that offset == 0 for planar
-		 * images
-		 */
-		if (bo->meta.num_planes == 1) {
-			xfer.offset =
-			    (bo->meta.strides[0] * mapping->rect.y) +
-			    drv_bytes_per_pixel_from_format(bo->meta.format, 0) * mapping->rect.x;
-		}
+	// The transfer needs to complete before invalidate returns so that any host changes
+	// are visible and to ensure the host doesn't overwrite subsequent guest changes. This
+	// also covers a fenced flush still in flight.
+	return virgl_bo_wait(bo, mapping);
+}
+
+static int virgl_bo_flush(struct bo *bo, struct mapping *mapping, int *out_fence)
+{
+	int ret;
+	struct virgl_priv *priv = (struct virgl_priv *)bo->drv->priv;
+	struct virgl_bo_priv *bo_priv = NULL;
+	uint32_t level = 0;
+	bool host_hw;
+	const struct rectangle *rects = &mapping->rect;
+	size_t num_rects = 1;
+
+	if (!params[param_3d].value)
+		return 0;
+
+	if (!(mapping->vma->map_flags & BO_MAP_WRITE))
+		return 0;
+
+	// Only send back what the caller said it wrote, if it said anything.
+	if (mapping->num_dirty_rects) {
+		rects = mapping->dirty_rects;
+		num_rects = mapping->num_dirty_rects;
 	}
 
+	if (params[param_resource_blob].value && (bo->meta.tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE))
+		return 0;
+
 	// Unfortunately, the kernel doesn't actually pass the guest layer_stride and
 	// guest stride to the host (compare virgl.h and virtgpu_drm.h). We can use
 	// the level to work around this.
 	if (priv->host_gbm_enabled)
-		xfer.level = bo->meta.strides[0];
+		level = bo->meta.strides[0];
 
-	if (virgl_supports_combination_natively(bo->drv, bo->meta.format, bo->meta.use_flags)) {
-		xfer_params.xfers_needed = 1;
-		xfer_params.xfer_boxes[0] = mapping->rect;
-	} else {
-		assert(virgl_supports_combination_through_emulation(bo->drv, bo->meta.format,
-								    bo->meta.use_flags));
+	if (mapping->vma->priv) {
+		bo_priv = bo->priv;
 
-		virgl_get_emulated_transfers_params(bo, &mapping->rect, &xfer_params);
-	}
+		// The previous upload may still be reading the pages about to be overwritten.
+		if (bo_priv->flush_pending) {
+			ret = virgl_bo_wait(bo, mapping);
+			if (ret)
+				return ret;
+		}
 
-	for (i = 0; i < xfer_params.xfers_needed; i++) {
-		xfer.box.x = xfer_params.xfer_boxes[i].x;
-		xfer.box.y = xfer_params.xfer_boxes[i].y;
-		xfer.box.w = xfer_params.xfer_boxes[i].width;
-		xfer.box.h = xfer_params.xfer_boxes[i].height;
-		xfer.box.d = 1;
+		drv_shadow_copy_out(bo, mapping, mapping->vma->priv, mapping->vma->addr);
+		host_hw = bo->meta.use_flags & BO_USE_NON_GPU_HW;
 
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
-		if (ret) {
-			drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n",
-				 strerror(errno));
-			return -errno;
-		}
+		ret = virgl_submit_transfers(bo, mapping, VIRGL_TRANSFER_TO_HOST, level, rects,
+					     num_rects, host_hw ? out_fence : NULL);
+		if (ret)
+			return ret;
+
+		// As below, other host hardware must not see the buffer before the upload is done.
+		if (host_hw && (!out_fence || *out_fence < 0))
+			return virgl_bo_wait(bo, mapping);
+
+		bo_priv->flush_pending = true;
+		return 0;
 	}
 
 	// If the buffer is only accessed by the host GPU, then the flush is ordered
 	// with subsequent commands. However, if other host hardware can access the
-	// buffer, we need to wait for the transfer to complete for consistency.
-	// TODO(b/136733358): Support returning fences from transfers
-	if (bo->meta.use_flags & BO_USE_NON_GPU_HW) {
-		waitcmd.handle = mapping->vma->handle;
+	// buffer, it must not touch it before the transfer completes. Callers that can
+	// pass a fence on get one; everyone else waits here.
+	if (!(bo->meta.use_flags & BO_USE_NON_GPU_HW))
+		return virgl_submit_transfers(bo, mapping, VIRGL_TRANSFER_TO_HOST, level, rects,
+					      num_rects, NULL);
+
+	if (out_fence)
+		bo_priv = virgl_bo_get_priv(bo);
+
+	ret = virgl_submit_transfers(bo, mapping, VIRGL_TRANSFER_TO_HOST, level, rects, num_rects,
+				     bo_priv ? out_fence : NULL);
+	if (ret)
+		return ret;
 
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
-		if (ret) {
-			drv_loge("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
-			return -errno;
-		}
+	if (bo_priv && *out_fence >= 0) {
+		bo_priv->flush_pending = true;
+		return 0;
 	}
 
-	return 0;
+	return virgl_bo_wait(bo, mapping);
 }
 
 static void virgl_3d_resolve_format_and_use_flags(struct driver *drv, uint32_t format,
@@ -1162,10 +1482,11 @@ const struct backend virtgpu_virgl = { .name = "virtgpu_virgl",
 				       .close = virgl_close,
 				       .bo_create = virgl_bo_create,
 				       .bo_create_with_modifiers = virgl_bo_create_with_modifiers,
+				       .bo_release = virgl_bo_release,
 				       .bo_destroy = virgl_bo_destroy,
 				       .bo_import = drv_prime_bo_import,
 				       .bo_map = virgl_bo_map,
-				       .bo_unmap = drv_bo_munmap,
+				       .bo_unmap = virgl_bo_unmap,
 				       .bo_invalidate = virgl_bo_invalidate,
 				       .bo_flush = virgl_bo_flush,
 				       .resolve_format_and_use_flags =